@@ -0,0 +1,263 @@
+#include "backend_pool.h"
+
+#include <asio/connect.hpp>
+#include <asio/post.hpp>
+
+#include <algorithm>
+#include <format>
+#include <memory>
+
+namespace
+{
+    namespace net = asio;
+    using tcp = asio::ip::tcp;
+
+    // Virtual nodes per backend on the consistent hash ring
+    constexpr std::size_t kHashRingReplicas = 160;
+    // Consecutive failed connects (active or passive) before a backend is ejected
+    constexpr int kEjectThreshold = 2;
+    constexpr std::chrono::seconds kHealthCheckTimeout{3};
+
+    // FNV-1a, stable across restarts and instances so that affinity survives them
+    std::uint64_t hash_key(std::string_view key)
+    {
+        std::uint64_t hash = 0xcbf29ce484222325ull;
+        for (const auto ch : key) {
+            hash ^= static_cast<std::uint8_t>(ch);
+            hash *= 0x100000001b3ull;
+        }
+
+        return hash;
+    }
+}
+
+namespace mtls_mproxy
+{
+    std::optional<BalancePolicy> parse_balance_policy(std::string_view name)
+    {
+        if (name == "round-robin")
+            return BalancePolicy::kRoundRobin;
+        if (name == "least-sessions")
+            return BalancePolicy::kLeastSessions;
+        if (name == "p2c")
+            return BalancePolicy::kPowerOfTwoChoices;
+        if (name == "hash-address")
+            return BalancePolicy::kHashAddress;
+        if (name == "hash-identity")
+            return BalancePolicy::kHashIdentity;
+
+        return std::nullopt;
+    }
+
+    BackendPool::BackendPool(Options options, const asynclog::LoggerFactory& log_factory)
+        : work_guard_{net::make_work_guard(ctx_)}
+        , health_timer_{ctx_}
+        , policy_{options.policy}
+        , health_check_interval_{options.health_check_interval}
+        , fast_open_{options.fast_open}
+        , random_{std::random_device{}()}
+        , logger_{log_factory.create("backend_pool")}
+    {
+        for (const auto& target : options.targets) {
+            auto backend = std::make_unique<Backend>(ctx_.get_executor(), target, options.resolve_interval, log_factory);
+            backend->resolver.start();
+            backends_.emplace_back(std::move(backend));
+        }
+
+        if (policy_ == BalancePolicy::kHashAddress || policy_ == BalancePolicy::kHashIdentity)
+            build_hash_ring();
+
+        if (health_check_interval_.count() > 0)
+            schedule_health_check();
+
+        worker_ = std::thread([this]() { ctx_.run(); });
+    }
+
+    BackendPool::~BackendPool()
+    {
+        work_guard_.reset();
+        ctx_.stop();
+        if (worker_.joinable())
+            worker_.join();
+    }
+
+    std::size_t BackendPool::select(const ServerStreamPtr& stream)
+    {
+        if (backends_.size() == 1)
+            return 0;
+
+        switch (policy_) {
+        case BalancePolicy::kHashAddress:
+            return select_by_hash(stream->remote_address());
+        case BalancePolicy::kHashIdentity: {
+            const auto identity = stream->client_identity();
+            return select_by_hash(identity.empty() ? stream->remote_address() : identity);
+        }
+        default:
+            break;
+        }
+
+        auto candidates = healthy_backends();
+        if (candidates.empty()) {
+            // Everything is ejected, fail open rather than refuse all tunnels
+            candidates.resize(backends_.size());
+            for (std::size_t idx = 0; idx < candidates.size(); ++idx)
+                candidates[idx] = idx;
+        }
+
+        switch (policy_) {
+        case BalancePolicy::kLeastSessions:
+            return select_least_sessions(candidates);
+        case BalancePolicy::kPowerOfTwoChoices: {
+            if (candidates.size() == 1)
+                return candidates.front();
+            std::uniform_int_distribution<std::size_t> dist{0, candidates.size() - 1};
+            const auto first = dist(random_);
+            auto second = dist(random_);
+            if (second == first)
+                second = (first + 1) % candidates.size();
+            return select_least_sessions({candidates[first], candidates[second]});
+        }
+        default:
+            return candidates[next_backend_++ % candidates.size()];
+        }
+    }
+
+    void BackendPool::on_session_opened(std::size_t idx)
+    {
+        ++backends_[idx]->active_sessions;
+    }
+
+    void BackendPool::on_session_closed(std::size_t idx)
+    {
+        if (backends_[idx]->active_sessions > 0)
+            --backends_[idx]->active_sessions;
+    }
+
+    void BackendPool::report_connect_success(std::size_t idx)
+    {
+        backends_[idx]->failures.store(0, std::memory_order_relaxed);
+    }
+
+    void BackendPool::report_connect_failure(std::size_t idx, const net::error_code& ec)
+    {
+        // Without active checks nobody would bring the backend back, so passive failures are not counted
+        if (health_check_interval_.count() == 0)
+            return;
+
+        net::post(ctx_, [this, idx, reason{ec.message()}]() { mark_down(idx, reason); });
+    }
+
+    void BackendPool::build_hash_ring()
+    {
+        hash_ring_.reserve(backends_.size() * kHashRingReplicas);
+        for (std::size_t idx = 0; idx < backends_.size(); ++idx) {
+            const auto& resolver = backends_[idx]->resolver;
+            for (std::size_t replica = 0; replica < kHashRingReplicas; ++replica) {
+                const auto node = std::format("{}:{}#{}", resolver.host(), resolver.port(), replica);
+                hash_ring_.emplace_back(hash_key(node), idx);
+            }
+        }
+        std::ranges::sort(hash_ring_);
+    }
+
+    std::size_t BackendPool::select_by_hash(std::string_view key) const
+    {
+        const auto hash = hash_key(key);
+        const auto start = std::ranges::lower_bound(hash_ring_, std::make_pair(hash, std::size_t{0}));
+        const auto start_pos = static_cast<std::size_t>(start - hash_ring_.begin());
+
+        // Walk clockwise to the first healthy backend, so only the keys of an ejected backend move
+        for (std::size_t step = 0; step < hash_ring_.size(); ++step) {
+            const auto idx = hash_ring_[(start_pos + step) % hash_ring_.size()].second;
+            if (backends_[idx]->healthy.load(std::memory_order_relaxed))
+                return idx;
+        }
+
+        return hash_ring_[start_pos % hash_ring_.size()].second;
+    }
+
+    std::size_t BackendPool::select_least_sessions(const std::vector<std::size_t>& candidates) const
+    {
+        return *std::ranges::min_element(candidates, {}, [this](std::size_t idx) {
+            return backends_[idx]->active_sessions;
+        });
+    }
+
+    std::vector<std::size_t> BackendPool::healthy_backends() const
+    {
+        std::vector<std::size_t> healthy;
+        healthy.reserve(backends_.size());
+        for (std::size_t idx = 0; idx < backends_.size(); ++idx)
+            if (backends_[idx]->healthy.load(std::memory_order_relaxed))
+                healthy.push_back(idx);
+
+        return healthy;
+    }
+
+    void BackendPool::schedule_health_check()
+    {
+        health_timer_.expires_after(health_check_interval_);
+        health_timer_.async_wait([this](const net::error_code& ec) {
+            if (ec)
+                return;
+
+            for (std::size_t idx = 0; idx < backends_.size(); ++idx)
+                check_health(idx);
+
+            schedule_health_check();
+        });
+    }
+
+    void BackendPool::check_health(std::size_t idx)
+    {
+        const auto endpoints = backends_[idx]->resolver.endpoints();
+        if (!endpoints) {
+            mark_down(idx, "not resolved");
+            return;
+        }
+
+        auto socket = std::make_shared<tcp::socket>(ctx_);
+        auto timer = std::make_shared<net::steady_timer>(ctx_);
+
+        timer->expires_after(std::min(kHealthCheckTimeout, health_check_interval_));
+        timer->async_wait([socket](const net::error_code& ec) {
+            if (!ec) {
+                net::error_code ignored_ec;
+                socket->close(ignored_ec);
+            }
+        });
+
+        net::async_connect(
+            *socket, *endpoints,
+            [this, idx, socket, timer](const net::error_code& ec, const tcp::endpoint&) {
+                timer->cancel();
+                if (!ec) {
+                    net::error_code ignored_ec;
+                    socket->close(ignored_ec);
+                    mark_up(idx);
+                } else {
+                    mark_down(idx, ec == net::error::operation_aborted ? "health check timed out" : ec.message());
+                }
+            });
+    }
+
+    void BackendPool::mark_up(std::size_t idx)
+    {
+        auto& backend = *backends_[idx];
+        backend.failures.store(0, std::memory_order_relaxed);
+        if (!backend.healthy.exchange(true, std::memory_order_relaxed))
+            logger_.info(std::format("backend [{}:{}] restored", backend.resolver.host(), backend.resolver.port()));
+    }
+
+    void BackendPool::mark_down(std::size_t idx, std::string_view reason)
+    {
+        auto& backend = *backends_[idx];
+        if (backend.failures.fetch_add(1, std::memory_order_relaxed) + 1 < kEjectThreshold)
+            return;
+
+        if (backend.healthy.exchange(false, std::memory_order_relaxed))
+            logger_.warn(std::format("backend [{}:{}] ejected: {}",
+                                     backend.resolver.host(), backend.resolver.port(), reason));
+    }
+}
@@ -0,0 +1,119 @@
+#ifndef MTLS_MPROXY_FWD_BACKEND_POOL_H
+#define MTLS_MPROXY_FWD_BACKEND_POOL_H
+
+#include "target_resolver.h"
+#include "transport/server_stream.h"
+
+#include <asynclog/logger_factory.h>
+
+#include <asio/io_context.hpp>
+#include <asio/executor_work_guard.hpp>
+#include <asio/steady_timer.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace mtls_mproxy
+{
+    enum class BalancePolicy
+    {
+        kRoundRobin,
+        kLeastSessions,
+        kPowerOfTwoChoices,
+        kHashAddress,
+        kHashIdentity
+    };
+
+    std::optional<BalancePolicy> parse_balance_policy(std::string_view name);
+
+    // Set of tunnel backends. Endpoint resolution and active health checks run on a background thread,
+    // backend selection and session accounting are done on the proxy event loop.
+    class BackendPool
+    {
+    public:
+        struct Target {
+            std::string host;
+            std::string port;
+        };
+
+        struct Options {
+            std::vector<Target> targets;
+            BalancePolicy policy{BalancePolicy::kRoundRobin};
+            std::chrono::seconds resolve_interval{30};
+            // 0 disables active checks, backends are never ejected then
+            std::chrono::seconds health_check_interval{5};
+            // Connects with TCP Fast Open when the client has sent data already, it goes in the SYN
+            bool fast_open{false};
+        };
+
+        BackendPool(Options options, const asynclog::LoggerFactory& log_factory);
+        ~BackendPool();
+
+        BackendPool(const BackendPool& other) = delete;
+        BackendPool& operator=(const BackendPool& other) = delete;
+
+        // Picks a backend for the session served by the stream, returns its index
+        std::size_t select(const ServerStreamPtr& stream);
+
+        const std::string& host(std::size_t idx) const { return backends_[idx]->resolver.host(); }
+        const std::string& port(std::size_t idx) const { return backends_[idx]->resolver.port(); }
+        TargetResolver::EndpointsPtr endpoints(std::size_t idx) const { return backends_[idx]->resolver.endpoints(); }
+        bool fast_open() const { return fast_open_; }
+
+        void on_session_opened(std::size_t idx);
+        void on_session_closed(std::size_t idx);
+
+        // Passive health reporting from the relay path
+        void report_connect_success(std::size_t idx);
+        void report_connect_failure(std::size_t idx, const net::error_code& ec);
+
+    private:
+        struct Backend {
+            Backend(net::any_io_executor executor,
+                    const Target& target,
+                    std::chrono::seconds resolve_interval,
+                    const asynclog::LoggerFactory& log_factory)
+                : resolver{std::move(executor), target.host, target.port, resolve_interval, log_factory}
+            {}
+
+            TargetResolver resolver;
+            std::atomic<bool> healthy{true};
+            std::atomic<int> failures{0};
+            std::size_t active_sessions{0};
+        };
+
+        void build_hash_ring();
+        std::size_t select_by_hash(std::string_view key) const;
+        std::size_t select_least_sessions(const std::vector<std::size_t>& candidates) const;
+        std::vector<std::size_t> healthy_backends() const;
+
+        void schedule_health_check();
+        void check_health(std::size_t idx);
+        void mark_up(std::size_t idx);
+        void mark_down(std::size_t idx, std::string_view reason);
+
+        net::io_context ctx_;
+        net::executor_work_guard<net::io_context::executor_type> work_guard_;
+        net::steady_timer health_timer_;
+        std::vector<std::unique_ptr<Backend>> backends_;
+        std::vector<std::pair<std::uint64_t, std::size_t>> hash_ring_;
+
+        BalancePolicy policy_;
+        std::chrono::seconds health_check_interval_;
+        bool fast_open_;
+        std::size_t next_backend_{0};
+        std::minstd_rand random_;
+
+        asynclog::ScopedLogger logger_;
+        std::thread worker_;
+    };
+}
+
+#endif // MTLS_MPROXY_FWD_BACKEND_POOL_H
@@ -0,0 +1,182 @@
+#include "entry_stream_manager.h"
+#include "transport/tls/tls_client_stream.h"
+
+namespace mtls_mproxy
+{
+    EntryStreamManager::EntryStreamManager(const asynclog::LoggerFactory& log_factory,
+                                           TlsConnectorPtr connector,
+                                           FlowControl flow_control,
+                                           TrafficShaperPtr shaper)
+        : logger_factory_{log_factory}
+        , logger_{logger_factory_.create("entry_session_manager")}
+        , connector_{std::move(connector)}
+        , flow_control_{flow_control}
+        , shaper_{std::move(shaper)}
+    {
+    }
+
+    void EntryStreamManager::stop(int id)
+    {
+        if (const auto it = sessions_.find(id); it != sessions_.end()) {
+            auto& [_, found] = *it;
+            if (found.shaping)
+                found.shaping->close();
+            if (found.client)
+                found.client->stop();
+            if (found.server)
+                found.server->stop();
+
+            const auto& ses = it->second.session;
+
+            logger_.info(
+                std::format("[{}] session closed: [{}:{}] rx_bytes: {}, tx_bytes: {}, live sessions {}",
+                            id,
+                            ses.host(),
+                            ses.service(),
+                            ses.transferred_bytes_to_local(),
+                            ses.transferred_bytes_to_remote(),
+                            sessions_.size()));
+            sessions_.erase(it);
+        }
+    }
+
+    void EntryStreamManager::on_error(net::error_code ec, ServerStreamPtr stream)
+    {
+        if (const auto it = sessions_.find(stream->id()); it != sessions_.end())
+            it->second.session.handle_server_error(ec);
+    }
+
+    void EntryStreamManager::on_error(net::error_code ec, ClientStreamPtr stream)
+    {
+        if (const auto it = sessions_.find(stream->id()); it != sessions_.end())
+            it->second.session.handle_client_error(ec);
+    }
+
+    void EntryStreamManager::on_accept(ServerStreamPtr upstream)
+    {
+        const auto id{upstream->id()};
+        logger_.debug(std::format("[{}] session created", id));
+
+        FwdSession session{id, shared_from_this(), logger_factory_};
+        EntryPair pair{id, upstream, nullptr, std::move(session)};
+        sessions_.insert({id, std::move(pair)});
+
+        upstream->start();
+    }
+
+    void EntryStreamManager::on_read(IoBuffer buffer, ServerStreamPtr stream)
+    {
+        if (const auto it = sessions_.find(stream->id()); it != sessions_.end()) {
+            if (it->second.shaping)
+                it->second.shaping->consume(buffer.size());
+            it->second.session.handle_server_read(buffer);
+        }
+    }
+
+    void EntryStreamManager::on_write(ServerStreamPtr stream)
+    {
+        if (const auto it = sessions_.find(stream->id()); it != sessions_.end())
+            it->second.session.handle_server_write();
+    }
+
+    void EntryStreamManager::read_server(int id)
+    {
+        if (const auto it = sessions_.find(id); it != sessions_.end()) {
+            if (it->second.shaping)
+                it->second.shaping->read([server{it->second.server}]() { server->read(); });
+            else
+                it->second.server->read();
+        }
+    }
+
+    void EntryStreamManager::write_server(int id, IoBuffer buffer)
+    {
+        if (const auto it = sessions_.find(id); it != sessions_.end())
+            it->second.server->write(std::move(buffer));
+    }
+
+    void EntryStreamManager::on_server_ready(ServerStreamPtr stream)
+    {
+        const auto sid = stream->id();
+        if (const auto it = sessions_.find(sid); it != sessions_.end()) {
+            it->second.client = TlsClientStream::create(shared_from_this(), sid, connector_, logger_factory_);
+            it->second.session.set_endpoint_info(connector_->host(), connector_->port());
+            // The client identity is known once the handshake is done
+            if (shaper_)
+                it->second.shaping = shaper_->open(stream->executor(), "client", stream->client_identity());
+            it->second.session.handle_on_accept();
+        }
+    }
+
+    void EntryStreamManager::on_read(IoBuffer buffer, ClientStreamPtr stream)
+    {
+        if (const auto it = sessions_.find(stream->id()); it != sessions_.end()) {
+            if (it->second.shaping)
+                it->second.shaping->consume(buffer.size());
+            it->second.session.handle_client_read(buffer);
+        }
+    }
+
+    void EntryStreamManager::on_write(ClientStreamPtr stream)
+    {
+        if (const auto it = sessions_.find(stream->id()); it != sessions_.end())
+            it->second.session.handle_client_write();
+    }
+
+    void EntryStreamManager::on_connect(IoBuffer buffer, ClientStreamPtr stream)
+    {
+        if (const auto it = sessions_.find(stream->id()); it != sessions_.end())
+            it->second.session.handle_client_connect(buffer);
+    }
+
+    void EntryStreamManager::read_client(int id)
+    {
+        if (const auto it = sessions_.find(id); it != sessions_.end()) {
+            if (it->second.shaping)
+                it->second.shaping->read([client{it->second.client}]() { client->read(); });
+            else
+                it->second.client->read();
+        }
+    }
+
+    void EntryStreamManager::write_client(int id, IoBuffer buffer)
+    {
+        if (const auto it = sessions_.find(id); it != sessions_.end())
+            it->second.client->write(std::move(buffer));
+    }
+
+    void EntryStreamManager::connect(int id, std::string host, std::string service)
+    {
+        if (const auto it = sessions_.find(id); it != sessions_.end()) {
+            auto& client = it->second.client;
+            client->set_host(std::move(host));
+            client->set_service(std::move(service));
+            client->start();
+        }
+    }
+
+    std::vector<std::uint8_t> EntryStreamManager::udp_associate(int id)
+    {
+        return {};
+    }
+
+    FlowControl EntryStreamManager::flow_control() const
+    {
+        return flow_control_;
+    }
+
+    const SocketOptions& EntryStreamManager::upstream_socket_options() const
+    {
+        return connector_->socket_options();
+    }
+
+    std::size_t EntryStreamManager::live_sessions() const
+    {
+        return sessions_.size();
+    }
+
+    std::vector<std::uint8_t> EntryStreamManager::overload_reply() const
+    {
+        return {};
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef MTLS_MPROXY_ENTRY_STREAM_MANAGER_H
+#define MTLS_MPROXY_ENTRY_STREAM_MANAGER_H
+
+#include "transport/stream_manager.h"
+#include "transport/traffic_shaper.h"
+#include "transport/tls/tls_connector.h"
+#include "fwd_session.h"
+
+#include <asynclog/logger_factory.h>
+
+namespace mtls_mproxy
+{
+    class TlsClientStream;
+
+    // Client side entry point: every local connection is relayed as it is through its own mTLS tunnel
+    // to a remote mproxy, which runs the SOCKS5, HTTP or TCP protocol with the local client
+    class EntryStreamManager final
+        : public StreamManager
+        , public std::enable_shared_from_this<EntryStreamManager>
+    {
+    public:
+        EntryStreamManager(const asynclog::LoggerFactory& log_factory,
+                           TlsConnectorPtr connector,
+                           FlowControl flow_control = {},
+                           TrafficShaperPtr shaper = nullptr);
+        ~EntryStreamManager() override = default;
+
+        EntryStreamManager(const EntryStreamManager& other) = delete;
+        EntryStreamManager& operator=(const EntryStreamManager& other) = delete;
+
+        void stop(int id) override;
+
+        void on_accept(ServerStreamPtr stream) override;
+        void on_read(IoBuffer event, ServerStreamPtr stream) override;
+        void on_write(ServerStreamPtr stream) override;
+        void on_error(net::error_code ec, ServerStreamPtr stream) override;
+        void read_server(int id) override;
+        void write_server(int id, IoBuffer event) override;
+        void on_server_ready(ServerStreamPtr stream) override;
+
+        void on_connect(IoBuffer event, ClientStreamPtr stream) override;
+        void on_read(IoBuffer event, ClientStreamPtr stream) override;
+        void on_write(ClientStreamPtr stream) override;
+        void on_error(net::error_code ec, ClientStreamPtr stream) override;
+        void read_client(int id) override;
+        void write_client(int id, IoBuffer event) override;
+        void connect(int id, std::string host, std::string service) override;
+
+        std::vector<std::uint8_t> udp_associate(int id) override;
+        FlowControl flow_control() const override;
+        const SocketOptions& upstream_socket_options() const override;
+        std::size_t live_sessions() const override;
+        std::vector<std::uint8_t> overload_reply() const override;
+
+    private:
+        struct EntryPair {
+            int id;
+            ServerStreamPtr server;
+            std::shared_ptr<TlsClientStream> client;
+            FwdSession session;
+            // nullptr if traffic shaping is disabled
+            ShapingGatePtr shaping;
+        };
+
+        std::unordered_map<int, EntryPair> sessions_;
+        asynclog::LoggerFactory logger_factory_;
+        asynclog::ScopedLogger logger_;
+        TlsConnectorPtr connector_;
+        FlowControl flow_control_;
+        TrafficShaperPtr shaper_;
+    };
+}
+
+#endif // MTLS_MPROXY_ENTRY_STREAM_MANAGER_H
@@ -3,11 +3,17 @@
 
 namespace mtls_mproxy
 {
-    FwdStreamManager::FwdStreamManager(const asynclog::LoggerFactory& log_factory, std::string host, std::string port)
+    FwdStreamManager::FwdStreamManager(const asynclog::LoggerFactory& log_factory,
+                                       BackendPool::Options backends,
+                                       FlowControl flow_control,
+                                       TrafficShaperPtr shaper,
+                                       SocketOptions upstream_sockets)
         : logger_factory_{log_factory}
         , logger_{logger_factory_.create("fwd_session_manager")}
-        , host_{std::move(host)}
-        , port_{std::move(port)}
+        , backends_{std::move(backends), logger_factory_}
+        , flow_control_{flow_control}
+        , shaper_{std::move(shaper)}
+        , upstream_sockets_{std::move(upstream_sockets)}
     {
     }
 
@@ -15,10 +21,14 @@ namespace mtls_mproxy
     {
         if (const auto it = sessions_.find(id); it != sessions_.end()) {
             auto& [_, found] = *it;
+            if (found.shaping)
+                found.shaping->close();
             if (found.client)
                 found.client->stop();
             if (found.server)
                 found.server->stop();
+            if (found.backend.has_value())
+                backends_.on_session_closed(*found.backend);
 
             const auto& ses = it->second.session;
 
@@ -42,8 +52,12 @@ namespace mtls_mproxy
 
     void FwdStreamManager::on_error(net::error_code ec, ClientStreamPtr stream)
     {
-        if (const auto it = sessions_.find(stream->id()); it != sessions_.end())
-            it->second.session.handle_client_error(ec);
+        if (const auto it = sessions_.find(stream->id()); it != sessions_.end()) {
+            auto& pair = it->second;
+            if (!pair.connected && pair.backend.has_value() && ec && ec != net::error::operation_aborted)
+                backends_.report_connect_failure(*pair.backend, ec);
+            pair.session.handle_client_error(ec);
+        }
     }
 
     void FwdStreamManager::on_accept(ServerStreamPtr upstream)
@@ -52,7 +66,6 @@ namespace mtls_mproxy
         logger_.debug(std::format("[{}] session created", id));
 
         FwdSession session{id, shared_from_this(), logger_factory_};
-        session.set_endpoint_info(host_, port_);
         FwdPair pair{id, upstream, nullptr, std::move(session)};
         sessions_.insert({id, std::move(pair)});
 
@@ -61,8 +74,11 @@ namespace mtls_mproxy
 
     void FwdStreamManager::on_read(IoBuffer buffer, ServerStreamPtr stream)
     {
-        if (const auto it = sessions_.find(stream->id()); it != sessions_.end())
+        if (const auto it = sessions_.find(stream->id()); it != sessions_.end()) {
+            if (it->second.shaping)
+                it->second.shaping->consume(buffer.size());
             it->second.session.handle_server_read(buffer);
+        }
     }
 
     void FwdStreamManager::on_write(ServerStreamPtr stream)
@@ -73,8 +89,12 @@ namespace mtls_mproxy
 
     void FwdStreamManager::read_server(int id)
     {
-        if (const auto it = sessions_.find(id); it != sessions_.end())
-            it->second.server->read();
+        if (const auto it = sessions_.find(id); it != sessions_.end()) {
+            if (it->second.shaping)
+                it->second.shaping->read([server{it->second.server}]() { server->read(); });
+            else
+                it->second.server->read();
+        }
     }
 
     void FwdStreamManager::write_server(int id, IoBuffer buffer)
@@ -92,14 +112,26 @@ namespace mtls_mproxy
                                                                 stream->executor(),
                                                                 logger_factory_);
             it->second.client = std::move(downstream);
+
+            const auto backend = backends_.select(stream);
+            backends_.on_session_opened(backend);
+            it->second.backend = backend;
+            it->second.session.set_endpoint_info(backends_.host(backend), backends_.port(backend));
+
+            // The client identity is known once the handshake is done
+            if (shaper_)
+                it->second.shaping = shaper_->open(stream->executor(), "tun", stream->client_identity());
             it->second.session.handle_on_accept();
         }
     }
 
     void FwdStreamManager::on_read(IoBuffer buffer, ClientStreamPtr stream)
     {
-        if (const auto it = sessions_.find(stream->id()); it != sessions_.end())
+        if (const auto it = sessions_.find(stream->id()); it != sessions_.end()) {
+            if (it->second.shaping)
+                it->second.shaping->consume(buffer.size());
             it->second.session.handle_client_read(buffer);
+        }
     }
 
     void FwdStreamManager::on_write(ClientStreamPtr stream)
@@ -110,14 +142,23 @@ namespace mtls_mproxy
 
     void FwdStreamManager::on_connect(IoBuffer buffer, ClientStreamPtr stream)
     {
-        if (const auto it = sessions_.find(stream->id()); it != sessions_.end())
-            it->second.session.handle_client_connect(buffer);
+        if (const auto it = sessions_.find(stream->id()); it != sessions_.end()) {
+            auto& pair = it->second;
+            pair.connected = true;
+            if (pair.backend.has_value())
+                backends_.report_connect_success(*pair.backend);
+            pair.session.handle_client_connect(buffer);
+        }
     }
 
     void FwdStreamManager::read_client(int id)
     {
-        if (const auto it = sessions_.find(id); it != sessions_.end())
-            it->second.client->read();
+        if (const auto it = sessions_.find(id); it != sessions_.end()) {
+            if (it->second.shaping)
+                it->second.shaping->read([client{it->second.client}]() { client->read(); });
+            else
+                it->second.client->read();
+        }
     }
 
     void FwdStreamManager::write_client(int id, IoBuffer buffer)
@@ -129,9 +170,21 @@ namespace mtls_mproxy
     void FwdStreamManager::connect(int id, std::string host, std::string service)
     {
         if (const auto it = sessions_.find(id); it != sessions_.end()) {
-            it->second.client->set_host(std::move(host));
-            it->second.client->set_service(std::move(service));
-            it->second.client->start();
+            auto& client = it->second.client;
+            client->set_host(std::move(host));
+            client->set_service(std::move(service));
+
+            // Only with client data at hand, a server speaking first would wait for the connect otherwise
+            if (backends_.fast_open() && it->second.server->has_data_ready())
+                client->enable_fast_open();
+
+            // Go straight to connect on the cached endpoints, per connection resolve is only a fallback
+            // for a backend that has never been resolved
+            const auto& backend = it->second.backend;
+            if (const auto endpoints = backend.has_value() ? backends_.endpoints(*backend) : nullptr)
+                client->connect(TargetResolver::Endpoints{*endpoints});
+            else
+                client->start();
         }
     }
 
@@ -139,4 +192,24 @@ namespace mtls_mproxy
     {
         return {};
     }
-}
\ No newline at end of file
+
+    FlowControl FwdStreamManager::flow_control() const
+    {
+        return flow_control_;
+    }
+
+    const SocketOptions& FwdStreamManager::upstream_socket_options() const
+    {
+        return upstream_sockets_;
+    }
+
+    std::size_t FwdStreamManager::live_sessions() const
+    {
+        return sessions_.size();
+    }
+
+    std::vector<std::uint8_t> FwdStreamManager::overload_reply() const
+    {
+        return {};
+    }
+}
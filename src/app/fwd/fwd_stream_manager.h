@@ -2,20 +2,28 @@
 #define MTLS_MPROXY_FWD_STREAM_MANAGER_H
 
 #include "transport/stream_manager.h"
+#include "transport/traffic_shaper.h"
 #include "fwd_session.h"
+#include "backend_pool.h"
 
 #include <asynclog/logger_factory.h>
 
-#include <string>
+#include <optional>
 
 namespace mtls_mproxy
 {
+    class TcpClientStream;
+
     class FwdStreamManager final
         : public StreamManager
         , public std::enable_shared_from_this<FwdStreamManager>
     {
     public:
-        explicit FwdStreamManager(const asynclog::LoggerFactory& log_factory, std::string host, std::string port);
+        explicit FwdStreamManager(const asynclog::LoggerFactory& log_factory,
+                                  BackendPool::Options backends,
+                                  FlowControl flow_control = {},
+                                  TrafficShaperPtr shaper = nullptr,
+                                  SocketOptions upstream_sockets = {});
         ~FwdStreamManager() override = default;
 
         FwdStreamManager(const FwdStreamManager& other) = delete;
@@ -40,20 +48,30 @@ namespace mtls_mproxy
         void connect(int id, std::string host, std::string service) override;
 
         std::vector<std::uint8_t> udp_associate(int id) override;
+        FlowControl flow_control() const override;
+        const SocketOptions& upstream_socket_options() const override;
+        std::size_t live_sessions() const override;
+        std::vector<std::uint8_t> overload_reply() const override;
 
     private:
         struct FwdPair {
             int id;
             ServerStreamPtr server;
-            ClientStreamPtr client;
+            std::shared_ptr<TcpClientStream> client;
             FwdSession session;
+            std::optional<std::size_t> backend;
+            bool connected{false};
+            // nullptr if traffic shaping is disabled
+            ShapingGatePtr shaping;
         };
 
         std::unordered_map<int, FwdPair> sessions_;
         asynclog::LoggerFactory logger_factory_;
         asynclog::ScopedLogger logger_;
-        std::string host_;
-        std::string port_;
+        BackendPool backends_;
+        FlowControl flow_control_;
+        TrafficShaperPtr shaper_;
+        SocketOptions upstream_sockets_;
     };
 }
 
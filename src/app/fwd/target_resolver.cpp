@@ -0,0 +1,103 @@
+#include "target_resolver.h"
+
+#include "auxiliary/helpers.h"
+
+#include <format>
+
+namespace
+{
+    std::string endpoints_to_str(const mtls_mproxy::TargetResolver::Endpoints& results)
+    {
+        std::string str;
+        for (const auto& entry : results) {
+            if (!str.empty())
+                str += ", ";
+            str += aux::to_string(entry.endpoint());
+        }
+
+        return str;
+    }
+}
+
+namespace mtls_mproxy
+{
+    TargetResolver::TargetResolver(net::any_io_executor executor,
+                                   std::string host,
+                                   std::string port,
+                                   std::chrono::seconds refresh_interval,
+                                   const asynclog::LoggerFactory& log_factory)
+        : host_{std::move(host)}
+        , port_{std::move(port)}
+        , refresh_interval_{refresh_interval}
+        , resolver_{executor}
+        , refresh_timer_{executor}
+        , logger_{log_factory.create("target_resolver")}
+    {
+    }
+
+    void TargetResolver::start()
+    {
+        resolve();
+
+        if (refresh_interval_.count() > 0)
+            schedule_refresh();
+    }
+
+    void TargetResolver::stop()
+    {
+        refresh_timer_.cancel();
+        resolver_.cancel();
+    }
+
+    void TargetResolver::resolve()
+    {
+        net::error_code ec;
+        auto results = resolver_.resolve(host_, port_, ec);
+        if (ec) {
+            logger_.warn(std::format("target [{}:{}] resolve failed: {}, will resolve per connection",
+                                     host_, port_, ec.message()));
+            return;
+        }
+
+        publish(std::move(results));
+    }
+
+    void TargetResolver::schedule_refresh()
+    {
+        refresh_timer_.expires_after(refresh_interval_);
+        refresh_timer_.async_wait([this](const net::error_code& ec) {
+            if (!ec)
+                refresh();
+        });
+    }
+
+    void TargetResolver::refresh()
+    {
+        resolver_.async_resolve(
+            host_, port_,
+            [this](const net::error_code& ec, Endpoints results) {
+                if (!ec) {
+                    publish(std::move(results));
+                } else if (ec == net::error::operation_aborted) {
+                    return;
+                } else {
+                    logger_.warn(std::format("target [{}:{}] re-resolve failed: {}, keeping previous endpoints",
+                                             host_, port_, ec.message()));
+                }
+                schedule_refresh();
+            });
+    }
+
+    void TargetResolver::publish(Endpoints results)
+    {
+        if (results.empty())
+            return;
+
+        auto resolved = endpoints_to_str(results);
+        const auto previous = endpoints();
+        if (!previous || endpoints_to_str(*previous) != resolved)
+            logger_.info(std::format("target [{}:{}] resolved to [{}]", host_, port_, resolved));
+
+        endpoints_.store(std::make_shared<const Endpoints>(std::move(results)), std::memory_order_release);
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef MTLS_MPROXY_FWD_TARGET_RESOLVER_H
+#define MTLS_MPROXY_FWD_TARGET_RESOLVER_H
+
+#include <asynclog/logger_factory.h>
+
+#include <asio/any_io_executor.hpp>
+#include <asio/ip/tcp.hpp>
+#include <asio/steady_timer.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+
+namespace mtls_mproxy
+{
+    namespace net = asio;
+    using tcp = asio::ip::tcp;
+
+    // Keeps the resolved endpoint set of a tunnel target. The target is resolved once by start(), then
+    // re-resolved on the given (background) executor every refresh interval. A failed refresh keeps the
+    // previous set, so a resolver hiccup never stalls new tunnels.
+    class TargetResolver
+    {
+    public:
+        using Endpoints = tcp::resolver::results_type;
+        using EndpointsPtr = std::shared_ptr<const Endpoints>;
+
+        TargetResolver(net::any_io_executor executor,
+                       std::string host,
+                       std::string port,
+                       std::chrono::seconds refresh_interval,
+                       const asynclog::LoggerFactory& log_factory);
+
+        TargetResolver(const TargetResolver& other) = delete;
+        TargetResolver& operator=(const TargetResolver& other) = delete;
+
+        void start();
+        void stop();
+
+        // Latest resolved endpoint set, nullptr if the target has never been resolved successfully
+        [[nodiscard]] EndpointsPtr endpoints() const { return endpoints_.load(std::memory_order_acquire); }
+
+        [[nodiscard]] const std::string& host() const { return host_; }
+        [[nodiscard]] const std::string& port() const { return port_; }
+
+    private:
+        void resolve();
+        void schedule_refresh();
+        void refresh();
+        void publish(Endpoints results);
+
+        std::string host_;
+        std::string port_;
+        std::chrono::seconds refresh_interval_;
+
+        tcp::resolver resolver_;
+        net::steady_timer refresh_timer_;
+
+        std::atomic<EndpointsPtr> endpoints_;
+        asynclog::ScopedLogger logger_;
+    };
+}
+
+#endif // MTLS_MPROXY_FWD_TARGET_RESOLVER_H
@@ -0,0 +1,240 @@
+#include "cache_policy.h"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <limits>
+
+namespace
+{
+    using namespace std::chrono_literals;
+
+    constexpr std::string_view kSchemeSeparator = "://";
+    constexpr std::string_view kDefaultService = "http";
+    constexpr std::string_view kDefaultPort = "80";
+
+    // RFC 9111 section 1.2.2, larger values are clamped
+    constexpr std::int64_t kMaxDeltaSeconds = 2147483648;
+
+    // A tenth of the time since the last modification, up to a day (RFC 9111 section 4.2.2)
+    constexpr std::int64_t kHeuristicFraction = 10;
+    constexpr auto kMaxHeuristicLifetime = std::chrono::seconds{24h};
+
+    // Status codes a shared cache may store without explicit freshness (RFC 9110 section 15.1)
+    constexpr std::array kHeuristicallyCacheable = {200, 203, 204, 300, 301, 308, 404, 405, 410, 414, 501};
+
+    constexpr std::array<std::string_view, 12> kMonths = {
+        "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+    std::optional<std::chrono::seconds> parse_delta_seconds(std::string_view value)
+    {
+        std::int64_t seconds{0};
+        const auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), seconds);
+        if (value.empty() || ptr != value.data() + value.size())
+            return std::nullopt;
+        if (ec == std::errc::result_out_of_range || seconds > kMaxDeltaSeconds)
+            return std::chrono::seconds{kMaxDeltaSeconds};
+        if (ec != std::errc{} || seconds < 0)
+            return std::nullopt;
+
+        return std::chrono::seconds{seconds};
+    }
+
+    int parse_number(std::string_view digits)
+    {
+        int value{0};
+        const auto [ptr, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), value);
+        return (ec != std::errc{} || ptr != digits.data() + digits.size()) ? -1 : value;
+    }
+
+    // Calls fn(name, value) for every directive of the fields with the name, quoted values are unquoted
+    template <typename Fn>
+    void for_each_directive(const http::head_parser& head, std::string_view field, Fn&& fn)
+    {
+        for (std::size_t idx = 0; idx < head.header_count(); ++idx) {
+            const auto [name, value] = head.header(idx);
+            if (!http::iequals(name, field))
+                continue;
+
+            auto list = value;
+            while (!list.empty()) {
+                const auto comma = list.find(',');
+                const auto item = http::trim(list.substr(0, comma));
+                list = (comma == std::string_view::npos) ? std::string_view{} : list.substr(comma + 1);
+
+                const auto equals = item.find('=');
+                auto argument = (equals == std::string_view::npos) ? std::string_view{} : http::trim(item.substr(equals + 1));
+                if (argument.size() >= 2 && argument.front() == '"' && argument.back() == '"')
+                    argument = argument.substr(1, argument.size() - 2);
+
+                fn(http::trim(item.substr(0, equals)), argument);
+            }
+        }
+    }
+}
+
+namespace http
+{
+    request_directives parse_request_directives(const request_parser& request)
+    {
+        request_directives directives;
+        for_each_directive(request, "Cache-Control", [&](std::string_view name, std::string_view value) {
+            if (iequals(name, "no-store"))
+                directives.no_store = true;
+            else if (iequals(name, "no-cache"))
+                directives.no_cache = true;
+            else if (iequals(name, "max-age"))
+                directives.max_age = parse_delta_seconds(value);
+        });
+
+        if (request.header("Cache-Control").empty() && request.has_token("Pragma", "no-cache"))
+            directives.no_cache = true;
+
+        return directives;
+    }
+
+    bool is_cacheable_request(const request_parser& request)
+    {
+        if (request.method() != kGet)
+            return false;
+
+        const auto length = request.header("Content-Length");
+        if (!request.header("Transfer-Encoding").empty() || !(length.empty() || length == "0"))
+            return false;
+
+        // Responses to authenticated requests are private unless the origin says otherwise, such requests
+        // simply bypass the cache. So do protocol upgrades, the connection isn't HTTP after the response.
+        if (!request.header("Authorization").empty() || !request.header("Upgrade").empty())
+            return false;
+
+        return !parse_request_directives(request).no_store;
+    }
+
+    bool is_unsafe_request(const request_parser& request)
+    {
+        switch (request.method()) {
+        case kGet:
+        case kHead:
+        case kOptions:
+        case kTrace:
+        case kConnect:
+            return false;
+        default:
+            return true;
+        }
+    }
+
+    bool is_storable_status(int status)
+    {
+        return std::ranges::find(kHeuristicallyCacheable, status) != kHeuristicallyCacheable.end();
+    }
+
+    response_freshness evaluate_response(const response_parser& response, cache_clock::time_point response_time)
+    {
+        // A 304 carries the updated freshness of the response it validates, is_storable_status() keeps
+        // it from being stored itself
+        response_freshness freshness;
+        if (response.status() != 304 && !is_storable_status(response.status()))
+            return freshness;
+
+        bool no_store{false};
+        std::optional<std::chrono::seconds> max_age;
+        std::optional<std::chrono::seconds> shared_max_age;
+        for_each_directive(response, "Cache-Control", [&](std::string_view name, std::string_view value) {
+            if (iequals(name, "no-store") || iequals(name, "private"))
+                no_store = true;
+            else if (iequals(name, "no-cache"))
+                freshness.no_cache = true;
+            else if (iequals(name, "max-age"))
+                max_age = parse_delta_seconds(value).value_or(0s);
+            else if (iequals(name, "s-maxage"))
+                shared_max_age = parse_delta_seconds(value).value_or(0s);
+        });
+
+        // Cookies are per user, a shared cache shouldn't hand them out to everybody
+        if (no_store || response.has_token("Vary", "*") || !response.header("Set-Cookie").empty())
+            return freshness;
+
+        const auto date = parse_http_date(response.header("Date")).value_or(response_time);
+        const auto last_modified = parse_http_date(response.header("Last-Modified"));
+
+        std::chrono::seconds lifetime{0};
+        if (shared_max_age.has_value()) {
+            lifetime = *shared_max_age;
+        } else if (max_age.has_value()) {
+            lifetime = *max_age;
+        } else if (const auto expires_field = response.header("Expires"); !expires_field.empty()) {
+            // An invalid date means already expired
+            const auto expires = parse_http_date(expires_field);
+            if (expires.has_value() && *expires > date)
+                lifetime = std::chrono::duration_cast<std::chrono::seconds>(*expires - date);
+        } else if (last_modified.has_value() && *last_modified < date) {
+            const auto modified_ago = std::chrono::duration_cast<std::chrono::seconds>(date - *last_modified);
+            lifetime = std::min(modified_ago / kHeuristicFraction, kMaxHeuristicLifetime);
+        }
+
+        const auto has_validators = !response.header("ETag").empty() || last_modified.has_value();
+        if (freshness.no_cache)
+            lifetime = 0s;
+        if (lifetime == 0s && !has_validators)
+            return freshness;
+
+        const auto age = parse_delta_seconds(response.header("Age")).value_or(0s);
+        const auto apparent_age = std::max(std::chrono::duration_cast<std::chrono::seconds>(response_time - date), 0s);
+
+        freshness.storable = true;
+        freshness.lifetime = lifetime;
+        freshness.initial_age = std::max(age, apparent_age);
+        return freshness;
+    }
+
+    std::optional<cache_clock::time_point> parse_http_date(std::string_view date)
+    {
+        // Sun, 06 Nov 1994 08:49:37 GMT
+        constexpr std::size_t kFixdateSize = 29;
+        if (date.size() != kFixdateSize || date.substr(3, 2) != ", " || date[7] != ' ' || date[11] != ' ' ||
+            date[16] != ' ' || date[19] != ':' || date[22] != ':' || date.substr(25) != " GMT")
+            return std::nullopt;
+
+        const auto month = std::ranges::find(kMonths, date.substr(8, 3));
+        const auto day = parse_number(date.substr(5, 2));
+        const auto year = parse_number(date.substr(12, 4));
+        const auto hours = parse_number(date.substr(17, 2));
+        const auto minutes = parse_number(date.substr(20, 2));
+        const auto seconds = parse_number(date.substr(23, 2));
+        if (month == kMonths.end() || day < 0 || year < 0 || hours < 0 || hours > 23 ||
+            minutes < 0 || minutes > 59 || seconds < 0 || seconds > 60)
+            return std::nullopt;
+
+        const std::chrono::year_month_day ymd{
+            std::chrono::year{year},
+            std::chrono::month{static_cast<unsigned>(month - kMonths.begin() + 1)},
+            std::chrono::day{static_cast<unsigned>(day)}};
+        if (!ymd.ok())
+            return std::nullopt;
+
+        return std::chrono::sys_days{ymd} + std::chrono::hours{hours} + std::chrono::minutes{minutes} +
+               std::chrono::seconds{seconds};
+    }
+
+    std::string cache_key(const request_parser& request)
+    {
+        auto path = request.target();
+        if (const auto pos = path.find(kSchemeSeparator); pos != std::string_view::npos) {
+            path = path.substr(pos + kSchemeSeparator.size());
+            const auto path_begin = path.find_first_of("/?");
+            path = (path_begin == std::string_view::npos) ? std::string_view{} : path.substr(path_begin);
+        }
+        path = path.substr(0, path.find('#'));
+
+        std::string key{request.host()};
+        std::ranges::transform(key, key.begin(), [](char ch) {
+            return (ch >= 'A' && ch <= 'Z') ? static_cast<char>(ch - 'A' + 'a') : ch;
+        });
+
+        const auto service = request.service();
+        key.append(":").append(service == kDefaultService ? kDefaultPort : service);
+        key.append(path.empty() ? std::string_view{"/"} : path);
+        return key;
+    }
+}
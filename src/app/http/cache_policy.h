@@ -0,0 +1,57 @@
+#ifndef MTLS_MPROXY_HTTP_CACHE_POLICY_H
+#define MTLS_MPROXY_HTTP_CACHE_POLICY_H
+
+#include "http.h"
+
+#include <chrono>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace http
+{
+    using cache_clock = std::chrono::system_clock;
+
+    // Request side Cache-Control directives that matter to a shared cache (RFC 9111 section 5.2.1)
+    struct request_directives
+    {
+        bool no_store{false};
+        // 'no-cache' or 'Pragma: no-cache', a stored response has to be revalidated
+        bool no_cache{false};
+        std::optional<std::chrono::seconds> max_age;
+    };
+
+    // Storability and freshness of a response as seen by a shared cache (RFC 9111 sections 3 and 4.2)
+    struct response_freshness
+    {
+        bool storable{false};
+        // Stored, but revalidated before every use
+        bool no_cache{false};
+        std::chrono::seconds lifetime{0};
+        std::chrono::seconds initial_age{0};
+    };
+
+    request_directives parse_request_directives(const request_parser& request);
+
+    // GET requests without credentials whose client doesn't forbid storing the response
+    bool is_cacheable_request(const request_parser& request);
+
+    // Requests that invalidate stored responses for their target (RFC 9111 section 4.4)
+    bool is_unsafe_request(const request_parser& request);
+
+    // Statuses a response is stored with. A 206 is only a part of the response and a 304 only refreshes
+    // the stored response it validates, neither ever becomes an entry of its own.
+    bool is_storable_status(int status);
+
+    // Evaluates the response to a cacheable request received at the time. A 304 is evaluated too, for
+    // the freshness it gives the stored response.
+    response_freshness evaluate_response(const response_parser& response, cache_clock::time_point response_time);
+
+    // IMF-fixdate ('Sun, 06 Nov 1994 08:49:37 GMT'), nullopt for anything else
+    std::optional<cache_clock::time_point> parse_http_date(std::string_view date);
+
+    // Authority and path of the request target, the same for absolute-form and origin-form targets
+    std::string cache_key(const request_parser& request);
+}
+
+#endif // MTLS_MPROXY_HTTP_CACHE_POLICY_H
@@ -1,139 +1,669 @@
 #include "http.h"
 
-#include <vector>
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <limits>
+#include <utility>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MTLS_MPROXY_HTTP_SSE2
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#define MTLS_MPROXY_HTTP_AVX2
+#include <immintrin.h>
+#elif defined(__GNUC__) || defined(__clang__)
+// Built without -mavx2, the AVX2 scanner is compiled for that target and selected at runtime
+#define MTLS_MPROXY_HTTP_AVX2
+#define MTLS_MPROXY_HTTP_AVX2_DISPATCH
+#include <immintrin.h>
+#endif
+#endif
 
 namespace
 {
-    const std::string kHost = "Host:";
-    const std::string kConnection = "Connection:";
+    constexpr std::string_view kHttpVersionPrefix = "HTTP/1.";
+    constexpr std::string_view kSchemeSeparator = "://";
+    constexpr std::string_view kDefaultService = "http";
+    constexpr std::string_view kHttpVersion10 = "HTTP/1.0";
+
+    // 2^60 bytes, enough for any chunk and no overflow while accumulating the size
+    constexpr std::size_t kMaxChunkSizeDigits = 15;
+    constexpr auto kNoContentLength = std::numeric_limits<std::uint64_t>::max();
 
-    std::vector<std::string_view> split(std::string_view str, std::string_view delimeter)
+    std::size_t find_line_feed_scalar(const std::uint8_t* data, std::size_t size)
     {
-        std::string_view::size_type cur_pos{};
-        std::string_view::size_type next_pos{};
+        for (std::size_t pos = 0; pos < size; ++pos)
+            if (data[pos] == '\n')
+                return pos;
 
-        std::vector<std::string_view> items;
+        return size;
+    }
 
-        while ((next_pos = str.find_first_of(delimeter, cur_pos)) != std::string_view::npos) {
-            if ((next_pos - cur_pos) > 0)
-                items.emplace_back(str.data() + cur_pos, next_pos - cur_pos);
-            cur_pos = next_pos + 1;
-        }
+#ifdef MTLS_MPROXY_HTTP_SSE2
+    std::size_t find_line_feed_sse2(const std::uint8_t* data, std::size_t size)
+    {
+        const auto line_feed = _mm_set1_epi8('\n');
 
-        if (cur_pos < str.size())
-            items.emplace_back(str.data() + cur_pos, str.size() - cur_pos);
+        std::size_t pos = 0;
+        for (; pos + 16 <= size; pos += 16) {
+            const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+            const auto mask = static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, line_feed)));
+            if (mask != 0)
+                return pos + static_cast<std::size_t>(std::countr_zero(mask));
+        }
 
-        return items;
+        return pos + find_line_feed_scalar(data + pos, size - pos);
     }
+#endif
 
-    std::string_view rtrim_copy(std::string_view str, std::string_view pattern)
+#ifdef MTLS_MPROXY_HTTP_AVX2
+#ifdef MTLS_MPROXY_HTTP_AVX2_DISPATCH
+    __attribute__((target("avx2")))
+#endif
+    std::size_t find_line_feed_avx2(const std::uint8_t* data, std::size_t size)
     {
-        if (const auto pos = str.rfind(pattern.data()); pos != std::string_view::npos)
-            return std::string_view{str.data(), pos};
+        const auto line_feed = _mm256_set1_epi8('\n');
 
-        return str;
+        std::size_t pos = 0;
+        for (; pos + 32 <= size; pos += 32) {
+            const auto chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+            const auto mask = static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, line_feed)));
+            if (mask != 0)
+                return pos + static_cast<std::size_t>(std::countr_zero(mask));
+        }
+
+        return pos + find_line_feed_sse2(data + pos, size - pos);
     }
+#endif
+
+    using find_line_feed_fn = std::size_t (*)(const std::uint8_t*, std::size_t);
 
-    bool get_request_fields(std::string_view header, http::request_headers& req)
+    find_line_feed_fn select_find_line_feed()
     {
-        const auto fields = split(header, " ");
-        if (fields.size() != 3)
-            return false;
+#if defined(MTLS_MPROXY_HTTP_AVX2_DISPATCH)
+        return __builtin_cpu_supports("avx2") ? find_line_feed_avx2 : find_line_feed_sse2;
+#elif defined(MTLS_MPROXY_HTTP_AVX2)
+        return find_line_feed_avx2;
+#elif defined(MTLS_MPROXY_HTTP_SSE2)
+        return find_line_feed_sse2;
+#else
+        return find_line_feed_scalar;
+#endif
+    }
 
-        if (fields[0].empty() || fields[1].empty() || fields[2].empty())
-            return false;
+    bool is_space(char ch)
+    {
+        return ch == ' ' || ch == '\t';
+    }
 
-        if (fields[0] == "GET")
-            req.method = http::request_method::kGet;
-        else if (fields[0] == "POST")
-            req.method = http::request_method::kPost;
-        else if (fields[0] == "DELETE")
-            req.method = http::request_method::kDelete;
-        else if (fields[0] == "UPDATE")
-            req.method = http::request_method::kUpdate;
-        else if (fields[0] == "HEAD")
-            req.method = http::request_method::kHead;
-        else if (fields[0] == "CONNECT") {
-            req.method = http::request_method::kConnect;
-            req.host = fields[1];
-        } else {
-            req.method = http::request_method::kNone;
-            return false;
-        }
+    bool is_control(char ch)
+    {
+        const auto uch = static_cast<unsigned char>(ch);
+        return uch < 0x20 || uch == 0x7f;
+    }
 
-        req.uri = fields[1];
-        req.version = fields[2];
+    using http::iequals;
+    using http::trim;
 
-        return true;
+    int hex_digit(char ch)
+    {
+        if (ch >= '0' && ch <= '9')
+            return ch - '0';
+        if (ch >= 'a' && ch <= 'f')
+            return ch - 'a' + 10;
+        if (ch >= 'A' && ch <= 'F')
+            return ch - 'A' + 10;
+        return -1;
     }
 
-    std::string_view get_http_header_value(std::string_view name, std::string_view str)
+    http::request_method to_method(std::string_view name)
     {
-        if (const auto pos = str.find(name); pos != std::string_view::npos)
-            return std::string_view{str.data() + name.size() + pos + 1, str.size() - name.size() - pos - 1};
+        using namespace std::string_view_literals;
 
-        return {};
+        constexpr std::pair<std::string_view, http::request_method> kMethods[] = {
+            {"GET"sv, http::kGet},
+            {"POST"sv, http::kPost},
+            {"DELETE"sv, http::kDelete},
+            {"UPDATE"sv, http::kUpdate},
+            {"HEAD"sv, http::kHead},
+            {"CONNECT"sv, http::kConnect},
+            {"PUT"sv, http::kPut},
+            {"PATCH"sv, http::kPatch},
+            {"OPTIONS"sv, http::kOptions},
+            {"TRACE"sv, http::kTrace},
+        };
+
+        for (const auto& [method_name, method] : kMethods)
+            if (method_name == name)
+                return method;
+
+        return http::kNone;
     }
 
-    bool get_remaining_required_fields(const std::vector<std::string_view>& http_headers, std::size_t start_idx, http::request_headers& req)
+    // Content-Length value, kNoContentLength if the field is absent and nullopt if it is malformed.
+    // Repeated fields or list values are accepted only when they all carry the same length.
+    std::optional<std::uint64_t> content_length(const http::head_parser& head)
     {
-        for (auto idx = start_idx; idx < http_headers.size(); ++idx) {
-            if (req.host.empty()) {
-                if (const auto pos = http_headers[idx].find(kHost); pos != std::string_view::npos)
-                    req.host = get_http_header_value(kHost, http_headers[idx]);
-            } else if (const auto pos = http_headers[idx].find(kConnection); pos != std::string_view::npos) {
-                req.connection = get_http_header_value(kConnection, http_headers[idx]);
+        auto length = kNoContentLength;
+        for (std::size_t idx = 0; idx < head.header_count(); ++idx) {
+            const auto [name, value] = head.header(idx);
+            if (!iequals(name, "Content-Length"))
+                continue;
+
+            auto list = value;
+            while (true) {
+                const auto comma = list.find(',');
+                const auto item = trim(list.substr(0, comma));
+
+                std::uint64_t item_length{0};
+                const auto [ptr, ec] = std::from_chars(item.data(), item.data() + item.size(), item_length);
+                if (item.empty() || ec != std::errc{} || ptr != item.data() + item.size() || item_length == kNoContentLength)
+                    return std::nullopt;
+                if (length != kNoContentLength && length != item_length)
+                    return std::nullopt;
+                length = item_length;
+
+                if (comma == std::string_view::npos)
+                    break;
+                list = list.substr(comma + 1);
             }
         }
 
-        return !req.host.empty();
+        return length;
+    }
+
+    // Transfer codings are applied in order, the body is self delimiting only if chunked is the last one
+    bool is_chunked(const http::head_parser& head)
+    {
+        std::string_view last;
+        for (std::size_t idx = 0; idx < head.header_count(); ++idx) {
+            const auto [name, value] = head.header(idx);
+            if (iequals(name, "Transfer-Encoding") && !value.empty())
+                last = value;
+        }
+
+        const auto comma = last.rfind(',');
+        return iequals(trim(comma == std::string_view::npos ? last : last.substr(comma + 1)), "chunked");
+    }
+
+    // Splits 'host[:port]' or '[ipv6][:port]'
+    std::pair<std::string_view, std::string_view> split_authority(std::string_view authority)
+    {
+        if (!authority.empty() && authority.front() == '[') {
+            const auto close = authority.find(']');
+            if (close == std::string_view::npos)
+                return {};
+
+            const auto host = authority.substr(1, close - 1);
+            if (close + 1 < authority.size() && authority[close + 1] == ':')
+                return {host, authority.substr(close + 2)};
+            return {host, {}};
+        }
+
+        const auto colon = authority.rfind(':');
+        if (colon == std::string_view::npos)
+            return {authority, {}};
+
+        return {authority.substr(0, colon), authority.substr(colon + 1)};
     }
 }
 
 namespace http
 {
-    std::string request_headers::get_service() const
+    bool iequals(std::string_view lhs, std::string_view rhs)
     {
-        if (method != kConnect) {
-            const auto parts = split(uri, ":");
-            if (parts.size() == 2)
-                return std::string{parts[0]};
-            return {};
+        return std::ranges::equal(lhs, rhs, [](char l, char r) {
+            const auto lower = [](char ch) { return (ch >= 'A' && ch <= 'Z') ? static_cast<char>(ch - 'A' + 'a') : ch; };
+            return lower(l) == lower(r);
+        });
+    }
+
+    std::string_view trim(std::string_view str)
+    {
+        while (!str.empty() && is_space(str.front()))
+            str.remove_prefix(1);
+        while (!str.empty() && is_space(str.back()))
+            str.remove_suffix(1);
+        return str;
+    }
+
+    std::size_t find_line_feed(const std::uint8_t* data, std::size_t size)
+    {
+        static const auto impl = select_find_line_feed();
+        return impl(data, size);
+    }
+
+    head_parser::head_parser(parser_limits limits)
+        : limits_{limits}
+    {
+        headers_.reserve(limits_.max_header_count);
+    }
+
+    void head_parser::reset()
+    {
+        buffer_.clear();
+        headers_.clear();
+        stage_ = stage::kStartLine;
+        line_begin_ = 0;
+        scan_pos_ = 0;
+        head_size_ = 0;
+        version_ = {};
+        reset_start_line();
+    }
+
+    parse_result head_parser::parse(std::span<const std::uint8_t> data)
+    {
+        buffer_.insert(buffer_.end(), data.begin(), data.end());
+        if (stage_ == stage::kDone)
+            return parse_result::kComplete;
+
+        while (true) {
+            const auto line_feed = scan_pos_ + find_line_feed(buffer_.data() + scan_pos_, buffer_.size() - scan_pos_);
+            if (line_feed == buffer_.size()) {
+                scan_pos_ = buffer_.size();
+                return buffer_.size() >= limits_.max_head_size ? parse_result::kHeadTooLarge : parse_result::kIncomplete;
+            }
+
+            if (line_feed >= limits_.max_head_size)
+                return parse_result::kHeadTooLarge;
+
+            auto line_end = line_feed;
+            if (line_end > line_begin_ && buffer_[line_end - 1] == '\r')
+                --line_end;
+
+            const auto result = parse_line(line_begin_, line_end);
+            line_begin_ = line_feed + 1;
+            scan_pos_ = line_begin_;
+
+            if (result == parse_result::kComplete)
+                head_size_ = line_begin_;
+            if (result != parse_result::kIncomplete)
+                return result;
         }
+    }
 
-        const auto parts = split(host, ":");
-        if (parts.size() == 2)
-            return std::string{parts[1]};
+    header_field head_parser::header(std::size_t idx) const
+    {
+        return {view(headers_[idx].name), view(headers_[idx].value)};
+    }
+
+    std::string_view head_parser::header(std::string_view name) const
+    {
+        for (const auto& field : headers_)
+            if (iequals(view(field.name), name))
+                return view(field.value);
 
         return {};
     }
 
-    std::string request_headers::get_host() const
+    bool head_parser::has_token(std::string_view name, std::string_view token) const
     {
-        if (method != kConnect)
-            return std::string{host};
+        for (const auto& field : headers_) {
+            if (!iequals(view(field.name), name))
+                continue;
 
-        const auto parts = split(host, ":");
-        if (parts.size() == 2)
-            return std::string{parts[0]};
+            auto value = view(field.value);
+            while (!value.empty()) {
+                const auto comma = value.find(',');
+                if (iequals(trim(value.substr(0, comma)), token))
+                    return true;
+                value = (comma == std::string_view::npos) ? std::string_view{} : value.substr(comma + 1);
+            }
+        }
 
-        return {};
+        return false;
     }
 
-    request_headers get_headers(std::string_view header)
+    bool head_parser::keep_alive() const
     {
-        const auto http_req_hdrs = split(header, "\r\n");
-        if (http_req_hdrs.size() < 2)
-            return {};
+        if (has_token("Connection", "close"))
+            return false;
 
-        request_headers req;
+        if (version() == kHttpVersion10)
+            return has_token("Connection", "keep-alive") || has_token("Proxy-Connection", "keep-alive");
 
-        if (!get_request_fields(http_req_hdrs[0], req))
-            return {};
+        return true;
+    }
+
+    std::string_view head_parser::view(token tok) const
+    {
+        return {reinterpret_cast<const char*>(buffer_.data()) + tok.offset, tok.size};
+    }
+
+    std::string_view head_parser::line(std::size_t begin, std::size_t end) const
+    {
+        return {reinterpret_cast<const char*>(buffer_.data()) + begin, end - begin};
+    }
+
+    head_parser::token head_parser::make_token(std::size_t offset, std::size_t size) const
+    {
+        return {static_cast<std::uint32_t>(offset), static_cast<std::uint32_t>(size)};
+    }
+
+    parse_result head_parser::parse_line(std::size_t begin, std::size_t end)
+    {
+        if (stage_ == stage::kStartLine) {
+            // Empty lines in front of the start line are ignored
+            if (begin == end)
+                return parse_result::kIncomplete;
+
+            if (!parse_start_line(begin, end))
+                return parse_result::kBadRequest;
+
+            stage_ = stage::kHeaders;
+            return parse_result::kIncomplete;
+        }
+
+        if (begin == end) {
+            stage_ = stage::kDone;
+            return parse_result::kComplete;
+        }
+
+        if (headers_.size() >= limits_.max_header_count)
+            return parse_result::kTooManyHeaders;
+
+        return parse_header_field(begin, end) ? parse_result::kIncomplete : parse_result::kBadRequest;
+    }
+
+    bool head_parser::parse_header_field(std::size_t begin, std::size_t end)
+    {
+        const auto line = this->line(begin, end);
+
+        // Obsolete line folding is rejected, as is whitespace between the name and the colon
+        const auto colon = line.find(':');
+        if (colon == std::string_view::npos || colon == 0)
+            return false;
+
+        const auto name = line.substr(0, colon);
+        if (std::ranges::any_of(name, [](char ch) { return is_space(ch) || is_control(ch); }))
+            return false;
 
-        if (!get_remaining_required_fields(http_req_hdrs, 1, req))
+        std::size_t value_begin = colon + 1;
+        std::size_t value_end = line.size();
+        while (value_begin < value_end && is_space(line[value_begin]))
+            ++value_begin;
+        while (value_end > value_begin && is_space(line[value_end - 1]))
+            --value_end;
+
+        headers_.push_back({make_token(begin, colon), make_token(begin + value_begin, value_end - value_begin)});
+        return true;
+    }
+
+    request_parser::request_parser()
+        : request_parser{parser_limits{}}
+    {
+    }
+
+    request_parser::request_parser(parser_limits limits)
+        : head_parser{limits}
+    {
+    }
+
+    std::string_view request_parser::host() const
+    {
+        return split_authority(authority()).first;
+    }
+
+    std::string_view request_parser::service() const
+    {
+        if (const auto port = split_authority(authority()).second; !port.empty())
+            return port;
+
+        if (method_ == kConnect)
             return {};
 
-        return req;
+        const auto target = this->target();
+        if (const auto pos = target.find(kSchemeSeparator); pos != std::string_view::npos)
+            return target.substr(0, pos);
+
+        return kDefaultService;
+    }
+
+    std::string_view request_parser::authority() const
+    {
+        const auto target = this->target();
+        if (method_ == kConnect)
+            return target;
+
+        if (const auto pos = target.find(kSchemeSeparator); pos != std::string_view::npos) {
+            auto authority = target.substr(pos + kSchemeSeparator.size());
+            authority = authority.substr(0, authority.find_first_of("/?#"));
+            if (const auto at = authority.rfind('@'); at != std::string_view::npos)
+                authority = authority.substr(at + 1);
+            return authority;
+        }
+
+        return header("Host");
+    }
+
+    bool request_parser::parse_start_line(std::size_t begin, std::size_t end)
+    {
+        const auto line = this->line(begin, end);
+
+        const auto first_space = line.find(' ');
+        if (first_space == std::string_view::npos || first_space == 0)
+            return false;
+
+        const auto second_space = line.find(' ', first_space + 1);
+        if (second_space == std::string_view::npos || second_space == first_space + 1)
+            return false;
+
+        const auto version = line.substr(second_space + 1);
+        if (!version.starts_with(kHttpVersionPrefix) || version.find(' ') != std::string_view::npos)
+            return false;
+
+        if (std::ranges::any_of(line, is_control))
+            return false;
+
+        method_name_ = make_token(begin, first_space);
+        target_ = make_token(begin + first_space + 1, second_space - first_space - 1);
+        set_version(make_token(begin + second_space + 1, version.size()));
+        method_ = to_method(method_name());
+
+        return true;
+    }
+
+    void request_parser::reset_start_line()
+    {
+        method_ = kNone;
+        method_name_ = {};
+        target_ = {};
+    }
+
+    response_parser::response_parser()
+        : response_parser{parser_limits{}}
+    {
+    }
+
+    response_parser::response_parser(parser_limits limits)
+        : head_parser{limits}
+    {
+    }
+
+    bool response_parser::parse_start_line(std::size_t begin, std::size_t end)
+    {
+        const auto line = this->line(begin, end);
+
+        // HTTP-version SP 3DIGIT SP [ reason-phrase ], the space after the code is often omitted
+        const auto space = line.find(' ');
+        if (space == std::string_view::npos || !line.substr(0, space).starts_with(kHttpVersionPrefix))
+            return false;
+
+        const auto code = line.substr(space + 1, 3);
+        if (code.size() != 3 || !std::ranges::all_of(code, [](char ch) { return ch >= '0' && ch <= '9'; }))
+            return false;
+
+        const auto reason_begin = std::min(line.size(), space + 5);
+        if (space + 4 < line.size() && line[space + 4] != ' ')
+            return false;
+
+        if (std::ranges::any_of(line, [](char ch) { return is_control(ch) && ch != '\t'; }))
+            return false;
+
+        status_ = (code[0] - '0') * 100 + (code[1] - '0') * 10 + (code[2] - '0');
+        reason_ = make_token(begin + reason_begin, line.size() - reason_begin);
+        set_version(make_token(begin, space));
+
+        return true;
+    }
+
+    void response_parser::reset_start_line()
+    {
+        status_ = 0;
+        reason_ = {};
+    }
+
+    body_framer::body_framer(kind type, state initial, std::uint64_t remaining)
+        : kind_{type}, state_{initial}, remaining_{remaining}
+    {
+    }
+
+    body_framer body_framer::length(std::uint64_t size)
+    {
+        return {kind::kLength, size == 0 ? state::kDone : state::kData, size};
+    }
+
+    body_framer body_framer::chunked()
+    {
+        return {kind::kChunked, state::kSize, 0};
+    }
+
+    body_framer body_framer::until_close()
+    {
+        return {kind::kUntilClose, state::kData, 0};
+    }
+
+    std::size_t body_framer::consume(std::span<const std::uint8_t> data)
+    {
+        switch (kind_) {
+        case kind::kNone:
+            return 0;
+        case kind::kUntilClose:
+            return data.size();
+        case kind::kLength: {
+            if (state_ == state::kDone)
+                return 0;
+            const auto count = static_cast<std::size_t>(std::min<std::uint64_t>(remaining_, data.size()));
+            remaining_ -= count;
+            if (remaining_ == 0)
+                state_ = state::kDone;
+            return count;
+        }
+        case kind::kChunked:
+            return consume_chunked(data);
+        }
+
+        return 0;
+    }
+
+    std::size_t body_framer::consume_chunked(std::span<const std::uint8_t> data)
+    {
+        std::size_t pos = 0;
+        while (pos < data.size() && state_ != state::kDone && state_ != state::kFailed) {
+            if (state_ == state::kData) {
+                const auto count = static_cast<std::size_t>(std::min<std::uint64_t>(remaining_, data.size() - pos));
+                remaining_ -= count;
+                pos += count;
+                if (remaining_ == 0)
+                    state_ = state::kDataCarriageReturn;
+                continue;
+            }
+
+            const auto ch = static_cast<char>(data[pos++]);
+            switch (state_) {
+            case state::kSize:
+                if (const auto digit = hex_digit(ch); digit >= 0) {
+                    if (++size_digits_ > kMaxChunkSizeDigits) {
+                        state_ = state::kFailed;
+                        break;
+                    }
+                    remaining_ = remaining_ * 16 + static_cast<std::uint64_t>(digit);
+                } else if (size_digits_ == 0) {
+                    state_ = state::kFailed;
+                } else if (ch == ';' || is_space(ch)) {
+                    state_ = state::kExtension;
+                } else if (ch == '\r') {
+                    state_ = state::kSizeLineFeed;
+                } else if (ch == '\n') {
+                    state_ = remaining_ == 0 ? state::kTrailer : state::kData;
+                } else {
+                    state_ = state::kFailed;
+                }
+                break;
+            case state::kExtension:
+                if (ch == '\n')
+                    state_ = remaining_ == 0 ? state::kTrailer : state::kData;
+                break;
+            case state::kSizeLineFeed:
+                state_ = (ch != '\n') ? state::kFailed : (remaining_ == 0 ? state::kTrailer : state::kData);
+                break;
+            case state::kDataCarriageReturn:
+                if (ch == '\r') {
+                    state_ = state::kDataLineFeed;
+                    break;
+                }
+                [[fallthrough]];
+            case state::kDataLineFeed:
+                if (ch == '\n') {
+                    state_ = state::kSize;
+                    size_digits_ = 0;
+                } else {
+                    state_ = state::kFailed;
+                }
+                break;
+            case state::kTrailer:
+                // Trailer fields end with an empty line
+                if (ch == '\r')
+                    state_ = state::kTrailerLineFeed;
+                else
+                    state_ = (ch == '\n') ? state::kDone : state::kTrailerLine;
+                break;
+            case state::kTrailerLine:
+                if (ch == '\n')
+                    state_ = state::kTrailer;
+                break;
+            case state::kTrailerLineFeed:
+                state_ = (ch == '\n') ? state::kDone : state::kFailed;
+                break;
+            default:
+                break;
+            }
+        }
+
+        return pos;
+    }
+
+    std::optional<body_framer> request_body(const request_parser& request)
+    {
+        const auto length = content_length(request);
+        if (!length.has_value())
+            return std::nullopt;
+
+        if (!request.header("Transfer-Encoding").empty()) {
+            // Both framings or a coding other than a final chunked make the length unknown to one of the
+            // parties and open the door to request smuggling
+            if (*length != kNoContentLength || !is_chunked(request))
+                return std::nullopt;
+            return body_framer::chunked();
+        }
+
+        return *length == kNoContentLength ? body_framer{} : body_framer::length(*length);
+    }
+
+    std::optional<body_framer> response_body(const response_parser& response, request_method method)
+    {
+        const auto status = response.status();
+        if (method == kHead || (status >= 100 && status < 200) || status == 204 || status == 304)
+            return body_framer{};
+
+        if (!response.header("Transfer-Encoding").empty())
+            return is_chunked(response) ? body_framer::chunked() : body_framer::until_close();
+
+        const auto length = content_length(response);
+        if (!length.has_value())
+            return std::nullopt;
+
+        return *length == kNoContentLength ? body_framer::until_close() : body_framer::length(*length);
     }
 }
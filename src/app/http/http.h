@@ -1,7 +1,12 @@
 #ifndef MTLS_MPROXY_HTTP_HPP
 #define MTLS_MPROXY_HTTP_HPP
 
-#include <iostream>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
 
 namespace http
 {
@@ -13,23 +18,200 @@ namespace http
         kDelete,
         kUpdate,
         kHead,
-        kConnect
+        kConnect,
+        kPut,
+        kPatch,
+        kOptions,
+        kTrace
     };
 
-    struct request_headers
+    enum class parse_result
     {
-        request_method method{kNone};
+        kIncomplete,
+        kComplete,
+        kBadRequest,
+        kHeadTooLarge,
+        kTooManyHeaders
+    };
 
-        std::string uri;
-        std::string version;
-        std::string host;
-        std::string connection;
+    struct parser_limits
+    {
+        // Request line and header fields including the terminating empty line
+        std::size_t max_head_size{64 * 1024};
+        std::size_t max_header_count{100};
+    };
 
-        std::string get_host() const;
-        std::string get_service() const;
+    struct header_field
+    {
+        std::string_view name;
+        std::string_view value;
     };
 
-    request_headers get_headers(std::string_view header);
+    // Streaming HTTP/1.x message head parser. Bytes are fed as they are read, scanning resumes where the
+    // previous read stopped, so a head split across any number of reads is parsed in a single pass.
+    // Fields are kept as offsets into the receive buffer, nothing is allocated per field. The buffer
+    // holds everything fed so far, including bytes read past the end of the head.
+    class head_parser
+    {
+    public:
+        virtual ~head_parser() = default;
+
+        parse_result parse(std::span<const std::uint8_t> data);
+        void reset();
+
+        std::string_view version() const { return view(version_); }
+
+        std::size_t header_count() const { return headers_.size(); }
+        header_field header(std::size_t idx) const;
+        // Value of the first field with the name (case insensitive), empty if there is none
+        std::string_view header(std::string_view name) const;
+        // True if any field with the name lists the token, e.g. 'Connection: keep-alive, Upgrade'
+        bool has_token(std::string_view name, std::string_view token) const;
+
+        // Persistence of the connection the message was received on (RFC 9112 section 9.3)
+        bool keep_alive() const;
+
+        std::size_t head_size() const { return head_size_; }
+        std::span<const std::uint8_t> data() const { return buffer_; }
+
+    protected:
+        struct token {
+            std::uint32_t offset{0};
+            std::uint32_t size{0};
+        };
+
+        explicit head_parser(parser_limits limits);
+
+        std::string_view view(token tok) const;
+        std::string_view line(std::size_t begin, std::size_t end) const;
+        token make_token(std::size_t offset, std::size_t size) const;
+        void set_version(token version) { version_ = version; }
+
+    private:
+        struct field {
+            token name;
+            token value;
+        };
+
+        enum class stage { kStartLine, kHeaders, kDone };
+
+        virtual bool parse_start_line(std::size_t begin, std::size_t end) = 0;
+        virtual void reset_start_line() = 0;
+
+        parse_result parse_line(std::size_t begin, std::size_t end);
+        bool parse_header_field(std::size_t begin, std::size_t end);
+
+        parser_limits limits_;
+        std::vector<std::uint8_t> buffer_;
+        std::vector<field> headers_;
+        stage stage_{stage::kStartLine};
+        std::size_t line_begin_{0};
+        std::size_t scan_pos_{0};
+        std::size_t head_size_{0};
+        token version_;
+    };
+
+    class request_parser final : public head_parser
+    {
+    public:
+        request_parser();
+        explicit request_parser(parser_limits limits);
+
+        request_method method() const { return method_; }
+        std::string_view method_name() const { return view(method_name_); }
+        std::string_view target() const { return view(target_); }
+
+        // Destination of the request: the CONNECT authority, the authority of an absolute-form
+        // target or the Host field. The service is the port if present, the scheme name otherwise.
+        std::string_view host() const;
+        std::string_view service() const;
+
+    private:
+        std::string_view authority() const;
+        bool parse_start_line(std::size_t begin, std::size_t end) override;
+        void reset_start_line() override;
+
+        request_method method_{kNone};
+        token method_name_;
+        token target_;
+    };
+
+    class response_parser final : public head_parser
+    {
+    public:
+        response_parser();
+        explicit response_parser(parser_limits limits);
+
+        int status() const { return status_; }
+        std::string_view reason() const { return view(reason_); }
+
+    private:
+        bool parse_start_line(std::size_t begin, std::size_t end) override;
+        void reset_start_line() override;
+
+        int status_{0};
+        token reason_;
+    };
+
+    // Finds where a message body ends in the byte stream. The body itself is neither copied nor
+    // decoded, chunked bodies are relayed as they are and only the chunk framing is tracked.
+    class body_framer
+    {
+    public:
+        enum class kind { kNone, kLength, kChunked, kUntilClose };
+
+        // A message without body
+        body_framer() = default;
+
+        static body_framer length(std::uint64_t size);
+        static body_framer chunked();
+        // The body ends when the connection is closed
+        static body_framer until_close();
+
+        // Number of leading bytes of the data that belong to the body, the rest belongs to the next message
+        std::size_t consume(std::span<const std::uint8_t> data);
+
+        kind type() const { return kind_; }
+        bool done() const { return state_ == state::kDone; }
+        bool failed() const { return state_ == state::kFailed; }
+
+    private:
+        enum class state
+        {
+            kData,
+            kSize,
+            kExtension,
+            kSizeLineFeed,
+            kDataCarriageReturn,
+            kDataLineFeed,
+            kTrailer,
+            kTrailerLine,
+            kTrailerLineFeed,
+            kDone,
+            kFailed
+        };
+
+        body_framer(kind type, state initial, std::uint64_t remaining);
+        std::size_t consume_chunked(std::span<const std::uint8_t> data);
+
+        kind kind_{kind::kNone};
+        state state_{state::kDone};
+        std::uint64_t remaining_{0};
+        std::size_t size_digits_{0};
+    };
+
+    // Body framing of a request (RFC 9112 section 6.3), nullopt if the head frames it ambiguously
+    std::optional<body_framer> request_body(const request_parser& request);
+    // Body framing of the response to a request with the method, nullopt for an invalid Content-Length
+    std::optional<body_framer> response_body(const response_parser& response, request_method method);
+
+    // Case insensitive ASCII comparison, field names and most tokens are case insensitive
+    bool iequals(std::string_view lhs, std::string_view rhs);
+    // Strips spaces and tabs around a field value or list item
+    std::string_view trim(std::string_view str);
+
+    // Position of the first '\n' in the range, size if there is none. Uses AVX2 or SSE2 when available.
+    std::size_t find_line_feed(const std::uint8_t* data, std::size_t size);
 };
 
 
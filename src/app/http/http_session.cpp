@@ -1,6 +1,7 @@
 #include "http_session.h"
 #include "http_stream_manager.h"
 
+#include <format>
 #include <utility>
 
 namespace mtls_mproxy
@@ -57,6 +58,11 @@ namespace mtls_mproxy
         state_->handle_client_error(*this, ec);
     }
 
+    void HttpSession::handle_cache_ready(CachedResponsePtr entry)
+    {
+        state_->handle_cache_ready(*this, std::move(entry));
+    }
+
     void HttpSession::update_bytes_sent_to_remote(std::size_t count)
     {
         context().transferred_bytes_to_remote += count;
@@ -72,6 +78,241 @@ namespace mtls_mproxy
         return manager_;
     }
 
+    std::shared_ptr<HttpStreamManager> HttpSession::http_manager()
+    {
+        return std::static_pointer_cast<HttpStreamManager>(manager_);
+    }
+
+    bool HttpSession::start_exchange()
+    {
+        auto& ctx = context();
+        const auto framing = http::request_body(ctx.request);
+        if (!framing.has_value())
+            return false;
+
+        ctx.request_body = *framing;
+        ctx.response_head.reset();
+        ctx.response_body = {};
+        ctx.response_rest.clear();
+        ctx.upstream_reusable = true;
+        ctx.response_started = false;
+
+        const auto data = ctx.request.data();
+        const auto head_size = ctx.request.head_size();
+        const auto body_size = ctx.request_body.consume(data.subspan(head_size));
+        if (ctx.request_body.failed())
+            return false;
+
+        ctx.response.assign(data.begin(), data.begin() + static_cast<std::ptrdiff_t>(head_size + body_size));
+        ctx.pipelined.assign(data.begin() + static_cast<std::ptrdiff_t>(head_size + body_size), data.end());
+        // A request sent in one write is kept until the response starts, so that it can be replayed
+        ctx.replayable = ctx.request_body.done();
+        return true;
+    }
+
+    void HttpSession::finish_exchange()
+    {
+        auto& ctx = context();
+        if (ctx.capturing) {
+            ctx.capturing = false;
+            complete_cache_fetch(make_cached_response(ctx.request, ctx.response_head, std::move(ctx.captured), ctx.response_time));
+            ctx.captured = {};
+        }
+        complete_cache_fetch(nullptr);
+        release_upstream();
+
+        // The response fields are relayed as they are, so the client connection persists only if both
+        // messages allow it. Responses served from the cache have their hop-by-hop fields removed.
+        // A request body cut short by an early response leaves the connection out of sync.
+        const auto keep_alive = ctx.request_body.done() && ctx.request.keep_alive() &&
+            (ctx.from_cache || ctx.response_head.keep_alive());
+        if (!keep_alive) {
+            stop();
+            return;
+        }
+
+        // The next request may be routed to another host
+        ctx.request.reset();
+        change_state(HttpWaitRequest::instance());
+        if (ctx.pipelined.empty()) {
+            read_from_server();
+            return;
+        }
+
+        IoBuffer pipelined;
+        pipelined.swap(ctx.pipelined);
+        handle_server_read(pipelined);
+    }
+
+    bool HttpSession::retry_request()
+    {
+        auto& ctx = context();
+        if (ctx.tunnel || !ctx.upstream_reused || !ctx.replayable || ctx.response_started)
+            return false;
+
+        logger().debug(std::format("[{}] idle connection to [{}:{}] was closed, retrying", id(), host(), service()));
+        ctx.upstream_reused = false;
+        change_state(HttpConnectionEstablished::instance());
+        http_manager()->reconnect(id());
+        return true;
+    }
+
+    bool HttpSession::try_cache()
+    {
+        auto& ctx = context();
+        ctx.cached = nullptr;
+        ctx.captured.clear();
+        ctx.cache_fetch = false;
+        ctx.cache_validating = false;
+        ctx.capturing = false;
+        ctx.from_cache = false;
+
+        auto* const cache = http_manager()->cache();
+        if (cache == nullptr)
+            return false;
+
+        if (http::is_unsafe_request(ctx.request)) {
+            cache->invalidate(http::cache_key(ctx.request));
+            return false;
+        }
+
+        if (!http::is_cacheable_request(ctx.request))
+            return false;
+
+        ctx.cache_key = http::cache_key(ctx.request);
+        auto [status, entry] = cache->lookup(ctx.cache_key, ctx.request, id());
+        switch (status) {
+        case ResponseCache::Status::kFresh:
+            logger().debug(std::format("[{}] cache hit [{}]", id(), ctx.cache_key));
+            serve_cached(std::move(entry));
+            return true;
+        case ResponseCache::Status::kPending:
+            logger().debug(std::format("[{}] waiting for the fetch of [{}]", id(), ctx.cache_key));
+            change_state(HttpWaitCache::instance());
+            return true;
+        case ResponseCache::Status::kStale:
+            logger().debug(std::format("[{}] cache revalidate [{}]", id(), ctx.cache_key));
+            ctx.cached = std::move(entry);
+            add_validators();
+            break;
+        case ResponseCache::Status::kMiss:
+            logger().debug(std::format("[{}] cache miss [{}]", id(), ctx.cache_key));
+            break;
+        }
+
+        ctx.cache_fetch = true;
+        return false;
+    }
+
+    void HttpSession::serve_cached(CachedResponsePtr entry)
+    {
+        context().from_cache = true;
+
+        auto response = entry->response(http::cache_clock::now());
+        update_bytes_sent_to_local(response.size());
+        change_state(HttpServeCached::instance());
+        write_to_server(std::move(response));
+    }
+
+    void HttpSession::serve_revalidated()
+    {
+        auto& ctx = context();
+        const auto& head = ctx.response_head;
+
+        // A 304 has no body, anything after its head makes the connection unusable
+        if (head.data().size() > head.head_size())
+            ctx.upstream_reusable = false;
+        release_upstream();
+
+        auto entry = make_revalidated_response(*ctx.cached, head, ctx.response_time);
+        complete_cache_fetch(entry);
+        serve_cached(std::move(entry));
+    }
+
+    void HttpSession::start_capture()
+    {
+        auto& ctx = context();
+        if (!ctx.cache_fetch)
+            return;
+
+        // Sessions waiting for a response that won't be stored don't wait for its body
+        if (ctx.response_body.type() == http::body_framer::kind::kUntilClose ||
+            !http::is_storable_status(ctx.response_head.status()) ||
+            !http::evaluate_response(ctx.response_head, ctx.response_time).storable) {
+            complete_cache_fetch(nullptr);
+            return;
+        }
+
+        ctx.capturing = true;
+    }
+
+    void HttpSession::capture(std::span<const std::uint8_t> data)
+    {
+        auto& ctx = context();
+        if (!ctx.capturing)
+            return;
+
+        if (ctx.captured.size() + data.size() > http_manager()->cache()->max_object_size()) {
+            ctx.capturing = false;
+            ctx.captured = {};
+            complete_cache_fetch(nullptr);
+            return;
+        }
+
+        ctx.captured.insert(ctx.captured.end(), data.begin(), data.end());
+    }
+
+    void HttpSession::complete_cache_fetch(CachedResponsePtr entry)
+    {
+        auto& ctx = context();
+        if (!ctx.cache_fetch)
+            return;
+
+        ctx.cache_fetch = false;
+        const auto waiters = http_manager()->cache()->complete(ctx.cache_key, entry);
+        http_manager()->wake_cache_waiters(waiters, std::move(entry));
+    }
+
+    void HttpSession::release_upstream()
+    {
+        const auto& ctx = context();
+        const auto& request = ctx.request;
+
+        // A HTTP/1.0 request keeps the origin connection open only when it says so itself,
+        // a 'Proxy-Connection' field is meant for the proxy
+        const auto keep_alive = request.keep_alive() && ctx.response_head.keep_alive() && ctx.upstream_reusable &&
+            (request.version() != "HTTP/1.0" || request.has_token("Connection", "keep-alive"));
+
+        http_manager()->release_client(id(), keep_alive);
+    }
+
+    void HttpSession::add_validators()
+    {
+        auto& ctx = context();
+        const auto& stored = *ctx.cached;
+
+        // Conditional requests of the client itself are forwarded as they are, the 304 is theirs then
+        if (!ctx.request.header("If-None-Match").empty() || !ctx.request.header("If-Modified-Since").empty())
+            return;
+
+        std::string fields;
+        if (!stored.etag.empty())
+            fields.append("If-None-Match: ").append(stored.etag).append("\r\n");
+        if (!stored.last_modified.empty())
+            fields.append("If-Modified-Since: ").append(stored.last_modified).append("\r\n");
+
+        // Cacheable requests have no body, the head ends the buffer
+        auto& head = ctx.response;
+        const auto line_end = (head.size() >= 2 && head[head.size() - 2] == '\r') ? 2 : 1;
+        head.insert(head.end() - line_end, fields.begin(), fields.end());
+        ctx.cache_validating = true;
+    }
+
+    void HttpSession::keep_pipelined(std::span<const std::uint8_t> data)
+    {
+        context().pipelined.insert(context().pipelined.end(), data.begin(), data.end());
+    }
+
     void HttpSession::connect()
     {
         manager()->connect(id(), std::string{host()}, std::string{service()});
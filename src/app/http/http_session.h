@@ -1,10 +1,13 @@
 #ifndef MTLS_MPROXY_HTTP_SESSION_H
 #define MTLS_MPROXY_HTTP_SESSION_H
 
+#include "http.h"
 #include "http_state.h"
+#include "response_cache.h"
 
 #include <asynclog/scoped_logger.h>
 
+#include <span>
 #include <string>
 #include <string_view>
 
@@ -16,6 +19,7 @@ namespace mtls_mproxy
 {
     class StreamManager;
     using StreamManagerPtr = std::shared_ptr<StreamManager>;
+    class HttpStreamManager;
 
     class HttpSession
     {
@@ -26,6 +30,31 @@ namespace mtls_mproxy
             std::string service;
             std::size_t transferred_bytes_to_remote;
             std::size_t transferred_bytes_to_local;
+            http::request_parser request;
+            http::response_parser response_head;
+            http::body_framer request_body;
+            http::body_framer response_body;
+            // Bytes of the following requests read together with the current one
+            IoBuffer pipelined;
+            // Bytes of the final response read together with an interim (1xx) one
+            IoBuffer response_rest;
+            bool tunnel;
+            bool upstream_reused;
+            bool upstream_reusable;
+            bool response_started;
+            bool replayable;
+            // Response cache state of the current request
+            std::string cache_key;
+            // Stored response being revalidated
+            CachedResponsePtr cached;
+            // Body bytes recorded for the cache
+            std::vector<std::uint8_t> captured;
+            http::cache_clock::time_point response_time;
+            // The session fetches the response other sessions may be waiting for
+            bool cache_fetch;
+            bool cache_validating;
+            bool capturing;
+            bool from_cache;
         };
 
     public:
@@ -39,6 +68,7 @@ namespace mtls_mproxy
         void handle_on_accept();
         void handle_server_error(net::error_code ec);
         void handle_client_error(net::error_code ec);
+        void handle_cache_ready(CachedResponsePtr entry);
 
         auto& context() { return context_; }
         const auto& context() const { return context_; }
@@ -53,6 +83,10 @@ namespace mtls_mproxy
         std::uint64_t transferred_bytes_to_remote() const { return context().transferred_bytes_to_remote; }
 
         const std::vector<uint8_t>& get_response() const { return context().response; }
+        http::request_parser& request() { return context().request; }
+        http::response_parser& response_head() { return context().response_head; }
+        http::body_framer& request_body() { return context().request_body; }
+        http::body_framer& response_body() { return context().response_body; }
 
         void set_endpoint_info(std::string_view host, std::string_view service) {
             context().host = host;
@@ -60,6 +94,29 @@ namespace mtls_mproxy
         }
 
         void set_response(IoBuffer buffer) { context().response = std::move(buffer); }
+        void set_upstream_reused(bool reused) { context().upstream_reused = reused; }
+
+        // Plain (non-CONNECT) request forwarding. The head and the body bytes read with it become the
+        // response buffer written upstream, false if the body framing of the request is ambiguous.
+        bool start_exchange();
+        // Called once the response is relayed: parks or closes the upstream connection and either
+        // waits for the next request on the client connection or closes the session
+        void finish_exchange();
+        // Replays the request on a new connection if a pooled one was closed before answering
+        bool retry_request();
+        void keep_pipelined(std::span<const std::uint8_t> data);
+
+        // Looks the request up in the response cache. Fresh responses are written to the client and
+        // requests for a URL another session is fetching wait for it, false if the request goes upstream.
+        bool try_cache();
+        void serve_cached(CachedResponsePtr entry);
+        // Serves the stored response after the origin answered its revalidation with 304
+        void serve_revalidated();
+        // Called with the final response head, records the body if the response can be stored
+        void start_capture();
+        void capture(std::span<const std::uint8_t> data);
+        // Ends the fetch for the cache, the waiting sessions get the entry or go upstream on their own
+        void complete_cache_fetch(CachedResponsePtr entry);
 
         void connect();
         void stop();
@@ -70,9 +127,13 @@ namespace mtls_mproxy
         void write_to_server(IoBuffer buffer);
 
         StreamManagerPtr manager();
+        std::shared_ptr<HttpStreamManager> http_manager();
         asynclog::ScopedLogger& logger() { return logger_; }
 
     private:
+        void release_upstream();
+        void add_validators();
+
         HttpCtx context_;
         std::unique_ptr<HttpState> state_;
         StreamManagerPtr manager_;
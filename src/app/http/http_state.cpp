@@ -15,6 +15,21 @@ namespace
         "Connection : Closed\r\n"
         "\r\n";
 
+    constexpr std::string_view kHttpError400 =
+        "HTTP/1.1 400 Bad Request\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+
+    constexpr std::string_view kHttpError431 =
+        "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+
+    constexpr std::string_view kHttpError502 =
+        "HTTP/1.1 502 Bad Gateway\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+
     constexpr std::string_view kHttpDone =
         "HTTP/1.1 200 OK\r\n"
         "\r\n";
@@ -49,6 +64,7 @@ namespace mtls_mproxy
     void HttpState::handle_client_connect(HttpSession& session, IoBuffer buffer) {}
     void HttpState::handle_server_write(HttpSession& session) {}
     void HttpState::handle_client_write(HttpSession& session) {}
+    void HttpState::handle_cache_ready(HttpSession& session, CachedResponsePtr entry) {}
 
     void HttpState::handle_server_error(HttpSession& session, net::error_code ec)
     {
@@ -74,15 +90,33 @@ namespace mtls_mproxy
     void HttpWaitRequest::handle_server_read(HttpSession& session, IoBuffer buffer)
     {
         const auto sid = session.id();
-        const auto* req_str = reinterpret_cast<const char*>(buffer.data());
+        auto& request = session.request();
+
+        switch (request.parse(buffer)) {
+        case http::parse_result::kIncomplete:
+            session.read_from_server();
+            return;
+        case http::parse_result::kHeadTooLarge:
+        case http::parse_result::kTooManyHeaders:
+            session.logger().warn(std::format("[{}] http protocol: request head exceeds limits", sid));
+            session.write_to_server(IoBuffer(kHttpError431.begin(), kHttpError431.end()));
+            session.stop();
+            return;
+        case http::parse_result::kBadRequest:
+            session.logger().warn(std::format("[{}] http protocol: bad request packet", sid));
+            session.write_to_server(IoBuffer(kHttpError400.begin(), kHttpError400.end()));
+            session.stop();
+            return;
+        case http::parse_result::kComplete:
+            break;
+        }
 
-        auto http_req = http::get_headers(std::string_view{req_str, buffer.size()});
-        const auto host = http_req.get_host();
-        const auto service = http_req.get_service();
+        const auto host = request.host();
+        const auto service = request.service();
 
         if (host.empty()) {
-            session.logger().warn(std::format("[{}] http protocol: bad request packet", sid));
-            session.write_to_server(IoBuffer(kHttpError500.begin(), kHttpError500.end()));
+            session.logger().warn(std::format("[{}] http protocol: request without host", sid));
+            session.write_to_server(IoBuffer(kHttpError400.begin(), kHttpError400.end()));
             session.stop();
             return;
         }
@@ -94,27 +128,212 @@ namespace mtls_mproxy
             return;
         }
 
-        if (http_req.method == http::kConnect)
+        session.set_endpoint_info(host, service);
+        session.logger().info(std::format("[{}] requested [{}:{}]", sid, host, service));
+
+        if (request.method() == http::kConnect) {
+            session.context().tunnel = true;
             session.set_response(IoBuffer(kHttpDone.begin(), kHttpDone.end()));
-        else
-            session.set_response(std::move(buffer));
+        } else {
+            if (!session.start_exchange()) {
+                session.logger().warn(std::format("[{}] http protocol: bad request body framing", sid));
+                session.write_to_server(IoBuffer(kHttpError400.begin(), kHttpError400.end()));
+                session.stop();
+                return;
+            }
 
-        session.set_endpoint_info(host, service);
+            if (session.try_cache())
+                return;
+        }
 
-        session.logger().info(std::format("[{}] requested [{}:{}]", sid, host, service));
         session.connect();
         session.change_state(HttpConnectionEstablished::instance());
     }
 
+    void HttpWaitCache::handle_cache_ready(HttpSession& session, CachedResponsePtr entry)
+    {
+        if (entry && entry->matches(session.request())) {
+            session.serve_cached(std::move(entry));
+            return;
+        }
+
+        // The fetched response wasn't stored, the request goes to the origin on its own
+        session.connect();
+        session.change_state(HttpConnectionEstablished::instance());
+    }
+
+    void HttpServeCached::handle_server_write(HttpSession& session)
+    {
+        session.finish_exchange();
+    }
+
     void HttpConnectionEstablished::handle_client_connect(HttpSession& session, IoBuffer buffer)
     {
-        // TODO
-        const std::string resp{session.get_response().begin(), session.get_response().end()};
-        if (resp == kHttpDone)
+        if (session.context().tunnel) {
             session.write_to_server(session.get_response());
+            session.change_state(HttpReadyTransferData::instance());
+            return;
+        }
+
+        session.update_bytes_sent_to_remote(session.get_response().size());
+        session.write_to_client(session.get_response());
+        session.change_state(HttpSendRequest::instance());
+        // The origin may answer before the body is sent, with 100 Continue or with a final response
+        session.read_from_client();
+    }
+
+    void HttpConnectionEstablished::handle_client_error(HttpSession& session, net::error_code ec)
+    {
+        if (!session.retry_request())
+            HttpState::handle_client_error(session, ec);
+    }
+
+    void HttpSendRequest::handle_server_read(HttpSession& session, IoBuffer buffer)
+    {
+        auto& body = session.request_body();
+        const auto body_size = body.consume(buffer);
+        if (body.failed()) {
+            session.logger().warn(std::format("[{}] http protocol: bad chunked request body", session.id()));
+            session.stop();
+            return;
+        }
+
+        session.keep_pipelined(std::span{buffer}.subspan(body_size));
+        buffer.resize(body_size);
+
+        session.update_bytes_sent_to_remote(buffer.size());
+        session.write_to_client(std::move(buffer));
+    }
+
+    void HttpSendRequest::handle_client_write(HttpSession& session)
+    {
+        // The response is read meanwhile, the state ends with its head
+        if (!session.request_body().done())
+            session.read_from_server();
+    }
+
+    void HttpSendRequest::handle_client_error(HttpSession& session, net::error_code ec)
+    {
+        if (!session.retry_request())
+            HttpState::handle_client_error(session, ec);
+    }
+
+    void HttpSendRequest::handle_client_read(HttpSession& session, IoBuffer buffer)
+    {
+        const auto sid = session.id();
+        auto& head = session.response_head();
+        session.context().response_started = true;
+
+        switch (head.parse(buffer)) {
+        case http::parse_result::kIncomplete:
+            session.read_from_client();
+            return;
+        case http::parse_result::kComplete:
+            break;
+        default:
+            session.logger().warn(std::format("[{}] http protocol: bad response from [{}:{}]", sid, session.host(), session.service()));
+            session.write_to_server(IoBuffer(kHttpError502.begin(), kHttpError502.end()));
+            session.stop();
+            return;
+        }
+
+        const auto data = head.data();
+        const auto head_end = data.begin() + static_cast<std::ptrdiff_t>(head.head_size());
+        session.context().response_time = http::cache_clock::now();
+
+        // Upgraded connections are relayed as they are until either side closes
+        if (head.status() == 101) {
+            session.context().tunnel = true;
+            session.update_bytes_sent_to_local(data.size());
+            session.write_to_server(IoBuffer(data.begin(), data.end()));
+            session.change_state(HttpReadyTransferData::instance());
+            return;
+        }
+
+        // Interim responses are passed on, the final one follows on the same connection
+        if (head.status() < 200) {
+            IoBuffer interim(data.begin(), head_end);
+            session.context().response_rest.assign(head_end, data.end());
+            head.reset();
+            session.update_bytes_sent_to_local(interim.size());
+            session.write_to_server(std::move(interim));
+            return;
+        }
+
+        if (head.status() == 304 && session.context().cache_validating) {
+            session.serve_revalidated();
+            return;
+        }
+
+        // The rest of the request body isn't forwarded, neither connection can carry another request
+        if (!session.request_body().done()) {
+            session.logger().debug(std::format("[{}] response from [{}:{}] before the end of the request body",
+                                               sid, session.host(), session.service()));
+            session.context().upstream_reusable = false;
+        }
+
+        const auto framing = http::response_body(head, session.request().method());
+        if (!framing.has_value()) {
+            session.logger().warn(std::format("[{}] http protocol: bad response framing from [{}:{}]", sid, session.host(), session.service()));
+            session.write_to_server(IoBuffer(kHttpError502.begin(), kHttpError502.end()));
+            session.stop();
+            return;
+        }
+
+        auto& body = session.response_body();
+        body = *framing;
+        const auto extra = data.subspan(head.head_size());
+        const auto body_size = body.consume(extra);
+        // Anything past the end of the response makes the connection unusable for the next request
+        if (body_size < extra.size())
+            session.context().upstream_reusable = false;
+
+        session.start_capture();
+        session.capture(extra.first(body_size));
+
+        IoBuffer response(data.begin(), head_end + static_cast<std::ptrdiff_t>(body_size));
+        session.update_bytes_sent_to_local(response.size());
+        session.change_state(HttpRelayResponse::instance());
+        session.write_to_server(std::move(response));
+    }
+
+    void HttpSendRequest::handle_server_write(HttpSession& session)
+    {
+        IoBuffer rest;
+        rest.swap(session.context().response_rest);
+        if (rest.empty())
+            session.read_from_client();
+        else
+            handle_client_read(session, std::move(rest));
+    }
+
+    void HttpRelayResponse::handle_client_read(HttpSession& session, IoBuffer buffer)
+    {
+        auto& body = session.response_body();
+        const auto body_size = body.consume(buffer);
+        if (body.failed()) {
+            session.logger().warn(std::format("[{}] http protocol: bad chunked response body from [{}:{}]",
+                                              session.id(), session.host(), session.service()));
+            session.stop();
+            return;
+        }
+
+        if (body_size < buffer.size()) {
+            session.context().upstream_reusable = false;
+            buffer.resize(body_size);
+        }
+        session.capture(buffer);
+
+        session.update_bytes_sent_to_local(buffer.size());
+        session.write_to_server(std::move(buffer));
+    }
+
+    void HttpRelayResponse::handle_server_write(HttpSession& session)
+    {
+        if (session.response_body().done())
+            session.finish_exchange();
         else
-            session.write_to_client(session.get_response());
-        session.change_state(HttpReadyTransferData::instance());
+            session.read_from_client();
     }
 
     void HttpReadyTransferData::handle_client_write(HttpSession& session)
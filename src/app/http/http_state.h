@@ -1,6 +1,7 @@
 #ifndef MTLS_MPROXY_HTTP_STATE_H
 #define MTLS_MPROXY_HTTP_STATE_H
 
+#include "response_cache.h"
 #include "transport/io_buffer.h"
 
 #include <asio/error_code.hpp>
@@ -25,6 +26,7 @@ namespace mtls_mproxy
         virtual void handle_client_write(HttpSession& session);
         virtual void handle_server_error(HttpSession& session, net::error_code ec);
         virtual void handle_client_error(HttpSession& session, net::error_code ec);
+        virtual void handle_cache_ready(HttpSession& session, CachedResponsePtr entry);
     };
 
     class HttpWaitRequest final : public HttpState
@@ -35,11 +37,45 @@ namespace mtls_mproxy
         void handle_server_read(HttpSession& session, IoBuffer event) override;
     };
 
+    class HttpWaitCache final : public HttpState
+    {
+    public:
+        static auto instance() { return std::make_unique<HttpWaitCache>(); }
+        void handle_cache_ready(HttpSession& session, CachedResponsePtr entry) override;
+    };
+
+    class HttpServeCached final : public HttpState
+    {
+    public:
+        static auto instance() { return std::make_unique<HttpServeCached>(); }
+        void handle_server_write(HttpSession& session) override;
+    };
+
     class HttpConnectionEstablished final : public HttpState
     {
     public:
         static auto instance() { return std::make_unique<HttpConnectionEstablished>(); }
         void handle_client_connect(HttpSession& session, IoBuffer event) override;
+        void handle_client_error(HttpSession& session, net::error_code ec) override;
+    };
+
+    class HttpSendRequest final : public HttpState
+    {
+    public:
+        static auto instance() { return std::make_unique<HttpSendRequest>(); }
+        void handle_server_read(HttpSession& session, IoBuffer event) override;
+        void handle_client_read(HttpSession& session, IoBuffer event) override;
+        void handle_server_write(HttpSession& session) override;
+        void handle_client_write(HttpSession& session) override;
+        void handle_client_error(HttpSession& session, net::error_code ec) override;
+    };
+
+    class HttpRelayResponse final : public HttpState
+    {
+    public:
+        static auto instance() { return std::make_unique<HttpRelayResponse>(); }
+        void handle_client_read(HttpSession& session, IoBuffer event) override;
+        void handle_server_write(HttpSession& session) override;
     };
 
     class HttpReadyTransferData final : public HttpState
@@ -1,18 +1,47 @@
 #include "http_stream_manager.h"
 #include "transport/tcp_client_stream.h"
 
+#include <asio/post.hpp>
+
+#include <string_view>
+
+namespace
+{
+    constexpr std::string_view kHttpError503 =
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Retry-After: 1\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+}
+
 namespace mtls_mproxy
 {
-    HttpStreamManager::HttpStreamManager(const asynclog::LoggerFactory& log_factory)
-        : logger_factory_{log_factory}
+    HttpStreamManager::HttpStreamManager(const asynclog::LoggerFactory& log_factory,
+                                         UpstreamPool::Options pool_options,
+                                         ResponseCache::Options cache_options,
+                                         FlowControl flow_control,
+                                         TrafficShaperPtr shaper,
+                                         SocketOptions upstream_sockets)
+        : upstreams_{pool_options}
+        , logger_factory_{log_factory}
         , logger_{logger_factory_.create("http_session_manager")}
+        , flow_control_{flow_control}
+        , shaper_{std::move(shaper)}
+        , upstream_sockets_{std::move(upstream_sockets)}
     {
+        if (cache_options.memory_size > 0 || cache_options.disk_size > 0)
+            cache_ = std::make_unique<ResponseCache>(std::move(cache_options));
     }
 
     void HttpStreamManager::stop(int id)
     {
         if (const auto it = sessions_.find(id); it != sessions_.end()) {
-            it->second.client->stop();
+            // Requests waiting for a fetch this session didn't finish go upstream themselves
+            it->second.session.complete_cache_fetch(nullptr);
+            if (it->second.shaping)
+                it->second.shaping->close();
+            if (it->second.client)
+                it->second.client->stop();
             it->second.server->stop();
 
             const auto& ses = it->second.session;
@@ -26,6 +55,10 @@ namespace mtls_mproxy
                             ses.transferred_bytes_to_remote(),
                             sessions_.size()));
             sessions_.erase(it);
+
+            if (cache_)
+                logger_.debug(std::format("response cache: hits {}, misses {}, memory {} bytes, disk {} bytes",
+                                          cache_->hits(), cache_->misses(), cache_->memory_used(), cache_->disk_used()));
         }
     }
 
@@ -37,8 +70,10 @@ namespace mtls_mproxy
 
     void HttpStreamManager::on_error(net::error_code ec, ClientStreamPtr stream)
     {
-        if (const auto it = sessions_.find(stream->id()); it != sessions_.end())
-            it->second.session.handle_client_error(ec);
+        if (const auto pair = owner(stream))
+            pair->session.handle_client_error(ec);
+        else
+            upstreams_.remove(stream);
     }
 
     void HttpStreamManager::on_accept(ServerStreamPtr upstream)
@@ -55,8 +90,11 @@ namespace mtls_mproxy
 
     void HttpStreamManager::on_read(IoBuffer buffer, ServerStreamPtr stream)
     {
-        if (const auto it = sessions_.find(stream->id()); it != sessions_.end())
+        if (const auto it = sessions_.find(stream->id()); it != sessions_.end()) {
+            if (it->second.shaping)
+                it->second.shaping->consume(buffer.size());
             it->second.session.handle_server_read(buffer);
+        }
     }
 
     void HttpStreamManager::on_write(ServerStreamPtr stream)
@@ -67,8 +105,12 @@ namespace mtls_mproxy
 
     void HttpStreamManager::read_server(int id)
     {
-        if (const auto it = sessions_.find(id); it != sessions_.end())
-            it->second.server->read();
+        if (const auto it = sessions_.find(id); it != sessions_.end()) {
+            if (it->second.shaping)
+                it->second.shaping->read([server{it->second.server}]() { server->read(); });
+            else
+                it->second.server->read();
+        }
     }
 
     void HttpStreamManager::write_server(int id, IoBuffer buffer)
@@ -81,52 +123,166 @@ namespace mtls_mproxy
     {
         const auto sid = stream->id();
         if (const auto it = sessions_.find(sid); it != sessions_.end()) {
-            it->second.client = TcpClientStream::create(shared_from_this(), stream->id(), stream->executor(), logger_factory_);
+            // The client identity is known once the handshake is done
+            if (shaper_)
+                it->second.shaping = shaper_->open(stream->executor(), "http", stream->client_identity());
             it->second.session.handle_on_accept();
         }
     }
 
     void HttpStreamManager::on_read(IoBuffer buffer, ClientStreamPtr stream)
     {
-        if (const auto it = sessions_.find(stream->id()); it != sessions_.end())
-            it->second.session.handle_client_read(buffer);
+        // An idle connection isn't expected to send anything, it is dropped if it does
+        if (const auto pair = owner(stream)) {
+            if (pair->shaping)
+                pair->shaping->consume(buffer.size());
+            pair->session.handle_client_read(buffer);
+        } else
+            upstreams_.remove(stream);
     }
 
     void HttpStreamManager::on_write(ClientStreamPtr stream)
     {
-        if (const auto it = sessions_.find(stream->id()); it != sessions_.end())
-            it->second.session.handle_client_write();
+        if (const auto pair = owner(stream))
+            pair->session.handle_client_write();
     }
 
     void HttpStreamManager::on_connect(IoBuffer buffer, ClientStreamPtr stream)
     {
-        if (const auto it = sessions_.find(stream->id()); it != sessions_.end())
-            it->second.session.handle_client_connect(buffer);
+        if (const auto pair = owner(stream))
+            pair->session.handle_client_connect(buffer);
     }
 
     void HttpStreamManager::read_client(int id)
     {
-        if (const auto it = sessions_.find(id); it != sessions_.end())
+        const auto it = sessions_.find(id);
+        if (it == sessions_.end() || !it->second.client)
+            return;
+
+        if (!it->second.shaping) {
             it->second.client->read();
+            return;
+        }
+
+        // The upstream connection may be released to the pool while the read is delayed
+        it->second.shaping->read([this, self{shared_from_this()}, id]() {
+            if (const auto it = sessions_.find(id); it != sessions_.end() && it->second.client)
+                it->second.client->read();
+        });
     }
 
     void HttpStreamManager::write_client(int id, IoBuffer buffer)
     {
-        if (const auto it = sessions_.find(id); it != sessions_.end())
+        if (const auto it = sessions_.find(id); it != sessions_.end() && it->second.client)
             it->second.client->write(std::move(buffer));
     }
 
     void HttpStreamManager::connect(int id, std::string host, std::string service)
+    {
+        const auto it = sessions_.find(id);
+        if (it == sessions_.end())
+            return;
+
+        auto& pair = it->second;
+        if (auto client = upstreams_.acquire(host, service)) {
+            logger_.debug(std::format("[{}] reusing idle connection to [{}:{}], idle connections {}",
+                                      id, host, service, upstreams_.size()));
+            client->set_id(id);
+            pair.client = client;
+            pair.session.set_upstream_reused(true);
+            net::post(pair.server->executor(), [self{shared_from_this()}, client] {
+                self->on_connect(IoBuffer{}, client);
+            });
+            return;
+        }
+
+        pair.session.set_upstream_reused(false);
+        open_client(pair, std::move(host), std::move(service));
+    }
+
+    void HttpStreamManager::release_client(int id, bool reusable)
+    {
+        const auto it = sessions_.find(id);
+        if (it == sessions_.end() || !it->second.client)
+            return;
+
+        auto& pair = it->second;
+        auto client = std::move(pair.client);
+        pair.client = nullptr;
+
+        if (reusable)
+            upstreams_.release(std::string{pair.session.host()}, std::string{pair.session.service()},
+                               std::move(client), pair.server->executor());
+        else
+            client->stop();
+    }
+
+    void HttpStreamManager::reconnect(int id)
     {
         if (const auto it = sessions_.find(id); it != sessions_.end()) {
-            it->second.client->set_host(std::move(host));
-            it->second.client->set_service(std::move(service));
-            it->second.client->start();
+            auto& pair = it->second;
+            if (pair.client)
+                pair.client->stop();
+            open_client(pair, std::string{pair.session.host()}, std::string{pair.session.service()});
+        }
+    }
+
+    void HttpStreamManager::wake_cache_waiters(const std::vector<int>& ids, CachedResponsePtr entry)
+    {
+        // Posted, the waiting sessions shouldn't run inside the handler of the one that fetched
+        for (const auto id : ids) {
+            if (const auto it = sessions_.find(id); it != sessions_.end()) {
+                net::post(it->second.server->executor(), [self{shared_from_this()}, id, entry] {
+                    if (const auto waiter = self->sessions_.find(id); waiter != self->sessions_.end())
+                        waiter->second.session.handle_cache_ready(entry);
+                });
+            }
         }
     }
 
+    HttpStreamManager::HttpPair* HttpStreamManager::owner(const ClientStreamPtr& stream)
+    {
+        if (const auto it = sessions_.find(stream->id()); it != sessions_.end() && it->second.client == stream)
+            return &it->second;
+
+        return nullptr;
+    }
+
+    void HttpStreamManager::open_client(HttpPair& pair, std::string host, std::string service)
+    {
+        auto client = TcpClientStream::create(shared_from_this(), pair.id, pair.server->executor(), logger_factory_);
+        // The request is buffered already and goes out first, a tunnel waits for the client instead
+        if (upstreams_.fast_open() && !pair.session.context().tunnel)
+            client->enable_fast_open();
+
+        pair.client = client;
+        pair.client->set_host(std::move(host));
+        pair.client->set_service(std::move(service));
+        pair.client->start();
+    }
+
     std::vector<std::uint8_t> HttpStreamManager::udp_associate(int id)
     {
         return {};
     }
-}
\ No newline at end of file
+
+    FlowControl HttpStreamManager::flow_control() const
+    {
+        return flow_control_;
+    }
+
+    const SocketOptions& HttpStreamManager::upstream_socket_options() const
+    {
+        return upstream_sockets_;
+    }
+
+    std::size_t HttpStreamManager::live_sessions() const
+    {
+        return sessions_.size();
+    }
+
+    std::vector<std::uint8_t> HttpStreamManager::overload_reply() const
+    {
+        return {kHttpError503.begin(), kHttpError503.end()};
+    }
+}
@@ -2,7 +2,10 @@
 #define MTLS_MPROXY_HTTP_STREAM_MANAGER_H
 
 #include "transport/stream_manager.h"
+#include "transport/traffic_shaper.h"
 #include "http_session.h"
+#include "response_cache.h"
+#include "upstream_pool.h"
 
 #include <asynclog/logger_factory.h>
 
@@ -13,7 +16,13 @@ namespace mtls_mproxy
         , public std::enable_shared_from_this<HttpStreamManager>
     {
     public:
-        explicit HttpStreamManager(const asynclog::LoggerFactory& log_factory);
+        // Throws std::runtime_error if the disk tier of the response cache can't be set up
+        explicit HttpStreamManager(const asynclog::LoggerFactory& log_factory,
+                                   UpstreamPool::Options pool_options = {},
+                                   ResponseCache::Options cache_options = {},
+                                   FlowControl flow_control = {},
+                                   TrafficShaperPtr shaper = nullptr,
+                                   SocketOptions upstream_sockets = {});
         ~HttpStreamManager() override = default;
 
         HttpStreamManager(const HttpStreamManager& other) = delete;
@@ -38,6 +47,20 @@ namespace mtls_mproxy
         void connect(int id, std::string host, std::string service) override;
 
         std::vector<std::uint8_t> udp_associate(int id) override;
+        FlowControl flow_control() const override;
+        const SocketOptions& upstream_socket_options() const override;
+        std::size_t live_sessions() const override;
+        std::vector<std::uint8_t> overload_reply() const override;
+
+        // Detaches the upstream connection of the session, parking it in the pool if it can be reused
+        void release_client(int id, bool reusable);
+        // Replaces the upstream connection of the session with a new one to the same host
+        void reconnect(int id);
+
+        // nullptr if caching is disabled
+        ResponseCache* cache() { return cache_.get(); }
+        // Hands the fetched entry (nullptr if it wasn't stored) to the sessions that waited for it
+        void wake_cache_waiters(const std::vector<int>& ids, CachedResponsePtr entry);
 
     private:
         struct HttpPair {
@@ -45,11 +68,22 @@ namespace mtls_mproxy
             ServerStreamPtr server;
             ClientStreamPtr client;
             HttpSession session;
+            // nullptr if traffic shaping is disabled
+            ShapingGatePtr shaping;
         };
 
+        // The session the upstream stream currently belongs to, nullptr for idle or replaced streams
+        HttpPair* owner(const ClientStreamPtr& stream);
+        void open_client(HttpPair& pair, std::string host, std::string service);
+
         std::unordered_map<int, HttpPair> sessions_;
+        UpstreamPool upstreams_;
+        std::unique_ptr<ResponseCache> cache_;
         asynclog::LoggerFactory logger_factory_;
         asynclog::ScopedLogger logger_;
+        FlowControl flow_control_;
+        TrafficShaperPtr shaper_;
+        SocketOptions upstream_sockets_;
     };
 }
 
@@ -0,0 +1,103 @@
+#include "mapped_ring.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace mtls_mproxy
+{
+    MappedRing::MappedRing(const std::string& path, std::size_t size)
+        : size_{size}
+    {
+#ifdef _WIN32
+        throw std::runtime_error{"memory mapped disk cache is not supported on this platform"};
+#else
+        const auto fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0)
+            throw std::runtime_error{"failed to open cache file " + path + ": " + std::strerror(errno)};
+
+        if (::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            const auto error = errno;
+            ::close(fd);
+            throw std::runtime_error{"failed to size cache file " + path + ": " + std::strerror(error)};
+        }
+
+        // The mapping keeps the file referenced, the descriptor isn't needed afterwards
+        auto* const mapping = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        const auto error = errno;
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+            throw std::runtime_error{"failed to map cache file " + path + ": " + std::strerror(error)};
+
+        data_ = static_cast<std::uint8_t*>(mapping);
+#endif
+    }
+
+    MappedRing::~MappedRing()
+    {
+#ifndef _WIN32
+        if (data_ != nullptr)
+            ::munmap(data_, size_);
+#endif
+    }
+
+    bool MappedRing::put(const std::string& key, std::span<const std::uint8_t> record)
+    {
+        if (record.empty() || record.size() > size_)
+            return false;
+
+        erase(key);
+
+        // Records are contiguous, a record that doesn't fit in front of the end starts over at offset 0.
+        // Whatever is left of the previous lap behind the write position goes then.
+        if (write_pos_ + record.size() > size_) {
+            while (!slots_.empty() && slots_.front().record.offset >= write_pos_)
+                evict_front();
+            write_pos_ = 0;
+        }
+
+        const auto end = write_pos_ + record.size();
+        while (!slots_.empty() && slots_.front().record.offset >= write_pos_ && slots_.front().record.offset < end)
+            evict_front();
+
+        std::memcpy(data_ + write_pos_, record.data(), record.size());
+        index_[key] = {write_pos_, record.size()};
+        slots_.push_back({key, {write_pos_, record.size()}});
+        used_ += record.size();
+        write_pos_ = end;
+        return true;
+    }
+
+    std::optional<std::span<const std::uint8_t>> MappedRing::get(const std::string& key) const
+    {
+        const auto it = index_.find(key);
+        if (it == index_.end())
+            return std::nullopt;
+
+        return std::span<const std::uint8_t>{data_ + it->second.offset, it->second.size};
+    }
+
+    void MappedRing::erase(const std::string& key)
+    {
+        if (const auto it = index_.find(key); it != index_.end()) {
+            used_ -= it->second.size;
+            index_.erase(it);
+        }
+    }
+
+    void MappedRing::evict_front()
+    {
+        const auto& slot = slots_.front();
+        if (const auto it = index_.find(slot.key); it != index_.end() && it->second.offset == slot.record.offset) {
+            used_ -= it->second.size;
+            index_.erase(it);
+        }
+        slots_.pop_front();
+    }
+}
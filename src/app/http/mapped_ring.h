@@ -0,0 +1,61 @@
+#ifndef MTLS_MPROXY_HTTP_MAPPED_RING_H
+#define MTLS_MPROXY_HTTP_MAPPED_RING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+
+namespace mtls_mproxy
+{
+    // Fixed size file mapped into memory and filled like a ring buffer. Records are copied in at the
+    // write position, which wraps around to the start of the file, and the records it runs over are
+    // dropped, so the oldest records are evicted first. Writing back to disk is left to the kernel,
+    // no system call is made per record. The index lives in memory only, the file is recreated on start.
+    class MappedRing
+    {
+    public:
+        // Throws std::runtime_error if the file can't be created or mapped
+        MappedRing(const std::string& path, std::size_t size);
+        ~MappedRing();
+
+        MappedRing(const MappedRing& other) = delete;
+        MappedRing& operator=(const MappedRing& other) = delete;
+
+        // Stores the record under the key replacing the previous one, false if it is larger than the file
+        bool put(const std::string& key, std::span<const std::uint8_t> record);
+        // The record points into the mapping and stays valid until the next put
+        std::optional<std::span<const std::uint8_t>> get(const std::string& key) const;
+        void erase(const std::string& key);
+        bool contains(const std::string& key) const { return index_.contains(key); }
+
+        std::size_t capacity() const { return size_; }
+        std::size_t used() const { return used_; }
+
+    private:
+        struct Record {
+            std::size_t offset;
+            std::size_t size;
+        };
+
+        struct Slot {
+            std::string key;
+            Record record;
+        };
+
+        void evict_front();
+
+        std::uint8_t* data_{nullptr};
+        std::size_t size_{0};
+        std::size_t write_pos_{0};
+        std::size_t used_{0};
+        std::unordered_map<std::string, Record> index_;
+        // Records in write order, erased or replaced ones stay until the write position reaches them
+        std::deque<Slot> slots_;
+    };
+}
+
+#endif // MTLS_MPROXY_HTTP_MAPPED_RING_H
@@ -0,0 +1,378 @@
+#include "response_cache.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <format>
+
+namespace
+{
+    using namespace std::chrono_literals;
+
+    constexpr std::string_view kLineEnd = "\r\n";
+
+    // Not forwarded by proxies (RFC 9110 section 7.6.1), Age is recomputed for every hit
+    constexpr std::array<std::string_view, 10> kNotStoredFields = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Upgrade",
+        "Proxy-Authenticate", "Proxy-Authorization", "Proxy-Authentication-Info", "Age"};
+
+    constexpr std::uint32_t kRecordMagic = 0x3143504d; // "MPC1"
+
+    bool is_stored_field(std::string_view name)
+    {
+        return std::ranges::none_of(kNotStoredFields, [name](std::string_view field) { return http::iequals(name, field); });
+    }
+
+    void append(std::vector<std::uint8_t>& out, std::string_view str)
+    {
+        out.insert(out.end(), str.begin(), str.end());
+    }
+
+    // Disk records are only read back by the process that wrote them, integers are in host order
+    class RecordWriter
+    {
+    public:
+        template <typename T>
+        void put(T value)
+        {
+            const auto offset = data_.size();
+            data_.resize(offset + sizeof(T));
+            std::memcpy(data_.data() + offset, &value, sizeof(T));
+        }
+
+        void put(std::span<const std::uint8_t> bytes)
+        {
+            put(static_cast<std::uint64_t>(bytes.size()));
+            data_.insert(data_.end(), bytes.begin(), bytes.end());
+        }
+
+        void put(std::string_view str)
+        {
+            put(std::span{reinterpret_cast<const std::uint8_t*>(str.data()), str.size()});
+        }
+
+        std::vector<std::uint8_t> release() { return std::move(data_); }
+
+    private:
+        std::vector<std::uint8_t> data_;
+    };
+
+    class RecordReader
+    {
+    public:
+        explicit RecordReader(std::span<const std::uint8_t> data)
+            : data_{data}
+        {}
+
+        template <typename T>
+        bool get(T& value)
+        {
+            if (data_.size() < sizeof(T))
+                return false;
+            std::memcpy(&value, data_.data(), sizeof(T));
+            data_ = data_.subspan(sizeof(T));
+            return true;
+        }
+
+        bool get(std::span<const std::uint8_t>& bytes)
+        {
+            std::uint64_t size{0};
+            if (!get(size) || data_.size() < size)
+                return false;
+            bytes = data_.first(static_cast<std::size_t>(size));
+            data_ = data_.subspan(static_cast<std::size_t>(size));
+            return true;
+        }
+
+        bool get(std::string& str)
+        {
+            std::span<const std::uint8_t> bytes;
+            if (!get(bytes))
+                return false;
+            str.assign(bytes.begin(), bytes.end());
+            return true;
+        }
+
+    private:
+        std::span<const std::uint8_t> data_;
+    };
+
+    std::vector<std::uint8_t> serialize(const mtls_mproxy::CachedResponse& response)
+    {
+        RecordWriter writer;
+        writer.put(kRecordMagic);
+        writer.put(static_cast<std::int64_t>(std::chrono::duration_cast<std::chrono::seconds>(
+            response.response_time.time_since_epoch()).count()));
+        writer.put(static_cast<std::int64_t>(response.initial_age.count()));
+        writer.put(static_cast<std::int64_t>(response.lifetime.count()));
+        writer.put(std::string_view{response.etag});
+        writer.put(std::string_view{response.last_modified});
+        writer.put(static_cast<std::uint32_t>(response.vary.size()));
+        for (const auto& [name, value] : response.vary) {
+            writer.put(std::string_view{name});
+            writer.put(std::string_view{value});
+        }
+        writer.put(std::span<const std::uint8_t>{response.head});
+        writer.put(std::span<const std::uint8_t>{*response.body});
+        return writer.release();
+    }
+
+    mtls_mproxy::CachedResponsePtr deserialize(std::span<const std::uint8_t> record)
+    {
+        RecordReader reader{record};
+        auto response = std::make_shared<mtls_mproxy::CachedResponse>();
+
+        std::uint32_t magic{0};
+        std::int64_t response_time{0};
+        std::int64_t initial_age{0};
+        std::int64_t lifetime{0};
+        std::uint32_t vary_count{0};
+        if (!reader.get(magic) || magic != kRecordMagic || !reader.get(response_time) || !reader.get(initial_age) ||
+            !reader.get(lifetime) || !reader.get(response->etag) || !reader.get(response->last_modified) ||
+            !reader.get(vary_count))
+            return nullptr;
+
+        for (std::uint32_t idx = 0; idx < vary_count; ++idx) {
+            auto& [name, value] = response->vary.emplace_back();
+            if (!reader.get(name) || !reader.get(value))
+                return nullptr;
+        }
+
+        std::span<const std::uint8_t> head;
+        std::span<const std::uint8_t> body;
+        if (!reader.get(head) || !reader.get(body))
+            return nullptr;
+
+        response->head.assign(head.begin(), head.end());
+        response->body = std::make_shared<const std::vector<std::uint8_t>>(body.begin(), body.end());
+        response->response_time = http::cache_clock::time_point{std::chrono::seconds{response_time}};
+        response->initial_age = std::chrono::seconds{initial_age};
+        response->lifetime = std::chrono::seconds{lifetime};
+        return response;
+    }
+}
+
+namespace mtls_mproxy
+{
+    std::chrono::seconds CachedResponse::age(http::cache_clock::time_point now) const
+    {
+        const auto resident = std::chrono::duration_cast<std::chrono::seconds>(now - response_time);
+        return initial_age + std::max(resident, 0s);
+    }
+
+    bool CachedResponse::fresh(http::cache_clock::time_point now, const http::request_directives& directives) const
+    {
+        if (directives.no_cache)
+            return false;
+
+        const auto current_age = age(now);
+        if (directives.max_age.has_value() && current_age > *directives.max_age)
+            return false;
+
+        return current_age < lifetime;
+    }
+
+    bool CachedResponse::matches(const http::request_parser& request) const
+    {
+        return std::ranges::all_of(vary, [&request](const auto& field) {
+            return request.header(field.first) == field.second;
+        });
+    }
+
+    std::size_t CachedResponse::size() const
+    {
+        std::size_t size = sizeof(CachedResponse) + head.size() + body->size() + etag.size() + last_modified.size();
+        for (const auto& [name, value] : vary)
+            size += name.size() + value.size();
+        return size;
+    }
+
+    IoBuffer CachedResponse::response(http::cache_clock::time_point now) const
+    {
+        const auto age_field = std::format("Age: {}\r\n\r\n", age(now).count());
+
+        // The stored head ends with an empty line, the field goes in front of it
+        IoBuffer response;
+        response.reserve(head.size() + age_field.size() + body->size());
+        response.insert(response.end(), head.begin(), head.end() - static_cast<std::ptrdiff_t>(kLineEnd.size()));
+        append(response, age_field);
+        response.insert(response.end(), body->begin(), body->end());
+        return response;
+    }
+
+    CachedResponsePtr make_cached_response(const http::request_parser& request,
+                                           const http::response_parser& response,
+                                           std::vector<std::uint8_t> body,
+                                           http::cache_clock::time_point response_time)
+    {
+        // A 304 to a conditional request of the client would turn into an empty entry for everybody
+        if (!http::is_storable_status(response.status()))
+            return nullptr;
+
+        const auto freshness = http::evaluate_response(response, response_time);
+        if (!freshness.storable)
+            return nullptr;
+
+        auto entry = std::make_shared<CachedResponse>();
+        append(entry->head, std::format("{} {} {}\r\n", response.version(), response.status(), response.reason()));
+        for (std::size_t idx = 0; idx < response.header_count(); ++idx) {
+            const auto [name, value] = response.header(idx);
+            if (!is_stored_field(name))
+                continue;
+
+            append(entry->head, name);
+            append(entry->head, ": ");
+            append(entry->head, value);
+            append(entry->head, kLineEnd);
+
+            if (!http::iequals(name, "Vary"))
+                continue;
+
+            auto list = value;
+            while (!list.empty()) {
+                const auto comma = list.find(',');
+                if (const auto field = http::trim(list.substr(0, comma)); !field.empty())
+                    entry->vary.emplace_back(field, request.header(field));
+                list = (comma == std::string_view::npos) ? std::string_view{} : list.substr(comma + 1);
+            }
+        }
+        append(entry->head, kLineEnd);
+
+        entry->body = std::make_shared<const std::vector<std::uint8_t>>(std::move(body));
+        entry->response_time = response_time;
+        entry->initial_age = freshness.initial_age;
+        entry->lifetime = freshness.lifetime;
+        entry->etag = response.header("ETag");
+        entry->last_modified = response.header("Last-Modified");
+        return entry;
+    }
+
+    CachedResponsePtr make_revalidated_response(const CachedResponse& stored,
+                                                const http::response_parser& not_modified,
+                                                http::cache_clock::time_point response_time)
+    {
+        auto entry = std::make_shared<CachedResponse>(stored);
+        const auto freshness = http::evaluate_response(not_modified, response_time);
+
+        // Without freshness information of its own the 304 extends the stored response by its lifetime
+        if (!not_modified.header("Cache-Control").empty() || !not_modified.header("Expires").empty())
+            entry->lifetime = freshness.lifetime;
+        entry->response_time = response_time;
+        entry->initial_age = freshness.initial_age;
+
+        if (const auto etag = not_modified.header("ETag"); !etag.empty())
+            entry->etag = etag;
+        if (const auto last_modified = not_modified.header("Last-Modified"); !last_modified.empty())
+            entry->last_modified = last_modified;
+        return entry;
+    }
+
+    ResponseCache::ResponseCache(Options options)
+        : options_{std::move(options)}
+        , max_object_size_{std::max(options_.memory_size, options_.disk_size) / 8}
+    {
+        if (options_.disk_size > 0)
+            disk_ = std::make_unique<MappedRing>(options_.disk_file, options_.disk_size);
+    }
+
+    ResponseCache::Lookup ResponseCache::lookup(const std::string& key, const http::request_parser& request, int session_id)
+    {
+        if (const auto fetch = fetches_.find(key); fetch != fetches_.end() && fetch->second.session_id != session_id) {
+            fetch->second.waiters.push_back(session_id);
+            return {Status::kPending, nullptr};
+        }
+
+        auto entry = find(key);
+        if (entry && !entry->matches(request))
+            entry = nullptr;
+
+        if (entry && entry->fresh(http::cache_clock::now(), http::parse_request_directives(request))) {
+            ++hits_;
+            return {Status::kFresh, std::move(entry)};
+        }
+
+        ++misses_;
+        fetches_[key].session_id = session_id;
+        if (entry && entry->has_validators())
+            return {Status::kStale, std::move(entry)};
+        return {Status::kMiss, nullptr};
+    }
+
+    std::vector<int> ResponseCache::complete(const std::string& key, CachedResponsePtr entry)
+    {
+        if (entry) {
+            invalidate(key);
+            insert(key, std::move(entry));
+        }
+
+        auto fetch = fetches_.extract(key);
+        return fetch.empty() ? std::vector<int>{} : std::move(fetch.mapped().waiters);
+    }
+
+    void ResponseCache::invalidate(const std::string& key)
+    {
+        if (const auto it = memory_.find(key); it != memory_.end()) {
+            memory_used_ -= it->second.response->size();
+            lru_.erase(it->second.position);
+            memory_.erase(it);
+        }
+
+        if (disk_)
+            disk_->erase(key);
+    }
+
+    CachedResponsePtr ResponseCache::find(const std::string& key)
+    {
+        if (const auto it = memory_.find(key); it != memory_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second.position);
+            return it->second.response;
+        }
+
+        if (!disk_)
+            return nullptr;
+
+        const auto record = disk_->get(key);
+        if (!record.has_value())
+            return nullptr;
+
+        auto response = deserialize(*record);
+        if (!response) {
+            disk_->erase(key);
+            return nullptr;
+        }
+
+        // The record stays on disk, the entry isn't written again when it leaves memory
+        insert(key, response);
+        return response;
+    }
+
+    void ResponseCache::insert(const std::string& key, CachedResponsePtr response)
+    {
+        if (response->size() > max_object_size_)
+            return;
+
+        if (options_.memory_size == 0) {
+            demote(key, *response);
+            return;
+        }
+
+        const auto size = response->size();
+        lru_.push_front(key);
+        memory_.insert_or_assign(key, MemoryEntry{std::move(response), lru_.begin()});
+        memory_used_ += size;
+
+        while (memory_used_ > options_.memory_size) {
+            const auto oldest = memory_.find(lru_.back());
+            demote(oldest->first, *oldest->second.response);
+            memory_used_ -= oldest->second.response->size();
+            memory_.erase(oldest);
+            lru_.pop_back();
+        }
+    }
+
+    void ResponseCache::demote(const std::string& key, const CachedResponse& response)
+    {
+        if (disk_ && !disk_->contains(key))
+            disk_->put(key, serialize(response));
+    }
+}
@@ -0,0 +1,140 @@
+#ifndef MTLS_MPROXY_HTTP_RESPONSE_CACHE_H
+#define MTLS_MPROXY_HTTP_RESPONSE_CACHE_H
+
+#include "cache_policy.h"
+#include "mapped_ring.h"
+#include "transport/io_buffer.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace mtls_mproxy
+{
+    struct CachedResponse
+    {
+        // Status line and fields without hop-by-hop ones and without Age, ends with the empty line
+        std::vector<std::uint8_t> head;
+        // As received from the origin, a chunked body keeps its framing. Shared with revalidated copies.
+        std::shared_ptr<const std::vector<std::uint8_t>> body;
+        http::cache_clock::time_point response_time;
+        std::chrono::seconds initial_age{0};
+        std::chrono::seconds lifetime{0};
+        std::string etag;
+        std::string last_modified;
+        // Request fields named by Vary and their values in the request the response was selected for
+        std::vector<std::pair<std::string, std::string>> vary;
+
+        std::chrono::seconds age(http::cache_clock::time_point now) const;
+        bool fresh(http::cache_clock::time_point now, const http::request_directives& directives) const;
+        bool has_validators() const { return !etag.empty() || !last_modified.empty(); }
+        bool matches(const http::request_parser& request) const;
+        std::size_t size() const;
+
+        // Response bytes for the client with the Age field added
+        IoBuffer response(http::cache_clock::time_point now) const;
+    };
+
+    using CachedResponsePtr = std::shared_ptr<const CachedResponse>;
+
+    // Entry for a complete response to the request, nullptr if the response must not be stored
+    CachedResponsePtr make_cached_response(const http::request_parser& request,
+                                           const http::response_parser& response,
+                                           std::vector<std::uint8_t> body,
+                                           http::cache_clock::time_point response_time);
+
+    // Copy of a stored entry updated with the fields of a 304 response to its revalidation
+    CachedResponsePtr make_revalidated_response(const CachedResponse& stored,
+                                                const http::response_parser& not_modified,
+                                                http::cache_clock::time_point response_time);
+
+    // Shared HTTP response cache with a memory LRU tier in front of a memory mapped file. Entries
+    // evicted from memory are moved to the file, file hits are moved back to memory. Lookups that miss
+    // while another session fetches the same URL wait for that fetch instead of going to the origin.
+    // Owned by the stream manager and used from its event loop only.
+    class ResponseCache
+    {
+    public:
+        struct Options {
+            // Bytes, 0 disables the tier
+            std::size_t memory_size{0};
+            std::size_t disk_size{0};
+            std::string disk_file;
+        };
+
+        enum class Status
+        {
+            // Not stored, the session fetches the response for the cache
+            kMiss,
+            // Stored but has to be revalidated by the session
+            kStale,
+            kFresh,
+            // Another session is fetching it, the session is told when that completes
+            kPending
+        };
+
+        struct Lookup {
+            Status status;
+            CachedResponsePtr entry;
+        };
+
+        // Throws std::runtime_error if the disk tier can't be set up
+        explicit ResponseCache(Options options);
+
+        ResponseCache(const ResponseCache& other) = delete;
+        ResponseCache& operator=(const ResponseCache& other) = delete;
+
+        Lookup lookup(const std::string& key, const http::request_parser& request, int session_id);
+
+        // Ends the fetch started by a kMiss or kStale lookup, stores the entry unless it is nullptr and
+        // returns the sessions waiting for the fetch
+        std::vector<int> complete(const std::string& key, CachedResponsePtr entry);
+
+        void invalidate(const std::string& key);
+
+        // Responses larger than this are relayed without being stored
+        std::size_t max_object_size() const { return max_object_size_; }
+
+        std::size_t memory_used() const { return memory_used_; }
+        std::size_t disk_used() const { return disk_ ? disk_->used() : 0; }
+        std::uint64_t hits() const { return hits_; }
+        std::uint64_t misses() const { return misses_; }
+
+    private:
+        struct MemoryEntry {
+            CachedResponsePtr response;
+            std::list<std::string>::iterator position;
+        };
+
+        struct Fetch {
+            int session_id;
+            std::vector<int> waiters;
+        };
+
+        CachedResponsePtr find(const std::string& key);
+        void insert(const std::string& key, CachedResponsePtr response);
+        void demote(const std::string& key, const CachedResponse& response);
+
+        Options options_;
+        std::size_t max_object_size_;
+
+        // Most recently used first
+        std::list<std::string> lru_;
+        std::unordered_map<std::string, MemoryEntry> memory_;
+        std::size_t memory_used_{0};
+
+        std::unique_ptr<MappedRing> disk_;
+        std::unordered_map<std::string, Fetch> fetches_;
+
+        std::uint64_t hits_{0};
+        std::uint64_t misses_{0};
+    };
+}
+
+#endif // MTLS_MPROXY_HTTP_RESPONSE_CACHE_H
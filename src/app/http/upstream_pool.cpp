@@ -0,0 +1,104 @@
+#include "upstream_pool.h"
+
+#include <algorithm>
+
+namespace
+{
+    // Idle streams don't belong to any session, events reported for them go to the pool
+    constexpr int kIdleStreamId = 0;
+}
+
+namespace mtls_mproxy
+{
+    UpstreamPool::UpstreamPool(Options options)
+        : options_{options}
+    {
+    }
+
+    ClientStreamPtr UpstreamPool::acquire(const std::string& host, const std::string& service)
+    {
+        const auto it = hosts_.find(make_key(host, service));
+        if (it == hosts_.end() || it->second.empty())
+            return nullptr;
+
+        // The read started on release stays pending and delivers the response to the new owner
+        auto stream = std::move(it->second.back().stream);
+        erase(it, std::prev(it->second.end()));
+        return stream;
+    }
+
+    void UpstreamPool::release(const std::string& host,
+                               const std::string& service,
+                               ClientStreamPtr stream,
+                               const net::any_io_executor& executor)
+    {
+        if (options_.max_idle_per_host == 0 || options_.max_idle == 0) {
+            stream->stop();
+            return;
+        }
+
+        const auto key = make_key(host, service);
+        if (const auto it = hosts_.find(key); it != hosts_.end() && it->second.size() >= options_.max_idle_per_host) {
+            it->second.front().stream->stop();
+            erase(it, it->second.begin());
+        } else if (idle_count_ >= options_.max_idle) {
+            evict_oldest();
+        }
+
+        stream->set_id(kIdleStreamId);
+        // Detects the origin server closing the connection while it is parked
+        stream->read();
+
+        auto timer = std::make_unique<net::steady_timer>(executor, options_.idle_timeout);
+        timer->async_wait([this, weak = std::weak_ptr<ClientStream>{stream}](const net::error_code& ec) {
+            if (ec)
+                return;
+            if (const auto expired = weak.lock())
+                remove(expired);
+        });
+
+        hosts_[key].push_back({std::move(stream), std::chrono::steady_clock::now(), std::move(timer)});
+        ++idle_count_;
+    }
+
+    void UpstreamPool::remove(const ClientStreamPtr& stream)
+    {
+        for (auto host = hosts_.begin(); host != hosts_.end(); ++host) {
+            auto& idle = host->second;
+            const auto entry = std::ranges::find(idle, stream, &Idle::stream);
+            if (entry != idle.end()) {
+                entry->stream->stop();
+                erase(host, entry);
+                return;
+            }
+        }
+    }
+
+    std::string UpstreamPool::make_key(const std::string& host, const std::string& service)
+    {
+        return host + ":" + service;
+    }
+
+    void UpstreamPool::evict_oldest()
+    {
+        auto oldest = hosts_.end();
+        for (auto host = hosts_.begin(); host != hosts_.end(); ++host) {
+            if (!host->second.empty() &&
+                (oldest == hosts_.end() || host->second.front().since < oldest->second.front().since))
+                oldest = host;
+        }
+
+        if (oldest != hosts_.end()) {
+            oldest->second.front().stream->stop();
+            erase(oldest, oldest->second.begin());
+        }
+    }
+
+    void UpstreamPool::erase(std::unordered_map<std::string, IdleList>::iterator host, IdleList::iterator entry)
+    {
+        host->second.erase(entry);
+        --idle_count_;
+        if (host->second.empty())
+            hosts_.erase(host);
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef MTLS_MPROXY_HTTP_UPSTREAM_POOL_H
+#define MTLS_MPROXY_HTTP_UPSTREAM_POOL_H
+
+#include "transport/client_stream.h"
+
+#include <asio/any_io_executor.hpp>
+#include <asio/steady_timer.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+namespace mtls_mproxy
+{
+    namespace net = asio;
+
+    // Idle keep-alive connections to origin servers, keyed by 'host:service'. The most recently released
+    // connection of a host is handed out first, the least recently released one is evicted first.
+    // Owned by the stream manager and used from its event loop only.
+    class UpstreamPool
+    {
+    public:
+        struct Options {
+            // 0 disables connection reuse
+            std::size_t max_idle_per_host{8};
+            std::size_t max_idle{256};
+            std::chrono::seconds idle_timeout{30};
+            // New connections carry a plain request in the SYN with TCP Fast Open
+            bool fast_open{false};
+        };
+
+        explicit UpstreamPool(Options options);
+
+        UpstreamPool(const UpstreamPool& other) = delete;
+        UpstreamPool& operator=(const UpstreamPool& other) = delete;
+
+        // An idle connection to the host, nullptr if there is none
+        ClientStreamPtr acquire(const std::string& host, const std::string& service);
+
+        // Parks the connection, the stream is stopped instead if the limits don't allow keeping it.
+        // The idle timer runs on the executor.
+        void release(const std::string& host,
+                     const std::string& service,
+                     ClientStreamPtr stream,
+                     const net::any_io_executor& executor);
+
+        // Drops an idle connection, e.g. closed by the origin server
+        void remove(const ClientStreamPtr& stream);
+
+        std::size_t size() const { return idle_count_; }
+        bool fast_open() const { return options_.fast_open; }
+
+    private:
+        struct Idle {
+            ClientStreamPtr stream;
+            std::chrono::steady_clock::time_point since;
+            std::unique_ptr<net::steady_timer> timer;
+        };
+
+        using IdleList = std::deque<Idle>;
+
+        static std::string make_key(const std::string& host, const std::string& service);
+        void evict_oldest();
+        void erase(std::unordered_map<std::string, IdleList>::iterator host, IdleList::iterator entry);
+
+        Options options_;
+        std::unordered_map<std::string, IdleList> hosts_;
+        std::size_t idle_count_{0};
+    };
+}
+
+#endif // MTLS_MPROXY_HTTP_UPSTREAM_POOL_H
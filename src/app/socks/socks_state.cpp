@@ -141,6 +141,14 @@ namespace mtls_mproxy
 
             session.enable_udp_mode();
             auto bind_addr = session.udp_associate();
+            if (bind_addr.empty()) {
+                session.logger().warn(std::format("[{}] socks5 UDP associate not supported by the stream", sid));
+                session.set_response(std::move(buffer));
+                session.set_response_error_code(Socks::Responses::command_not_supported);
+                session.write_to_server(std::move(IoBuffer{session.response()}));
+                session.stop();
+                return;
+            }
 
             if (bind_addr.size() + 4 == buffer.size()) {
                 session.set_response(std::move(buffer));
@@ -4,16 +4,27 @@
 
 namespace mtls_mproxy
 {
-    SocksStreamManager::SocksStreamManager(const asynclog::LoggerFactory& log_factory, bool udp_enabled)
+    SocksStreamManager::SocksStreamManager(const asynclog::LoggerFactory& log_factory,
+                                           bool udp_enabled,
+                                           UdpSocketPool::Options udp_sockets,
+                                           FlowControl flow_control,
+                                           TrafficShaperPtr shaper,
+                                           SocketOptions upstream_sockets)
         : logger_factory_{log_factory}
         , logger_{logger_factory_.create("socks5_session_manager")}
         , is_udp_associate_mode_enabled_{udp_enabled}
+        , udp_sockets_{udp_sockets}
+        , flow_control_{flow_control}
+        , shaper_{std::move(shaper)}
+        , upstream_sockets_{std::move(upstream_sockets)}
     {
     }
 
     void SocksStreamManager::stop(int id)
     {
         if (const auto it = sessions_.find(id); it != sessions_.end()) {
+            if (it->second.shaping)
+                it->second.shaping->close();
             if (it->second.client)
                 it->second.client->stop();
             if (it->second.server)
@@ -60,8 +71,11 @@ namespace mtls_mproxy
 
     void SocksStreamManager::on_read(IoBuffer buffer, ServerStreamPtr stream)
     {
-        if (const auto it = sessions_.find(stream->id()); it != sessions_.end())
+        if (const auto it = sessions_.find(stream->id()); it != sessions_.end()) {
+            if (it->second.shaping)
+                it->second.shaping->consume(buffer.size());
             it->second.session.handle_server_read(std::move(buffer));
+        }
     }
 
     void SocksStreamManager::on_write(ServerStreamPtr stream)
@@ -72,8 +86,12 @@ namespace mtls_mproxy
 
     void SocksStreamManager::read_server(int id)
     {
-        if (const auto it = sessions_.find(id); it != sessions_.end())
-            it->second.server->read();
+        if (const auto it = sessions_.find(id); it != sessions_.end()) {
+            if (it->second.shaping)
+                it->second.shaping->read([server{it->second.server}]() { server->read(); });
+            else
+                it->second.server->read();
+        }
     }
 
     void SocksStreamManager::write_server(int id, IoBuffer buffer)
@@ -85,14 +103,21 @@ namespace mtls_mproxy
     void SocksStreamManager::on_server_ready(ServerStreamPtr stream)
     {
         const auto sid = stream->id();
-        if (const auto it = sessions_.find(sid); it != sessions_.end())
+        if (const auto it = sessions_.find(sid); it != sessions_.end()) {
+            // The client identity is known once the handshake is done
+            if (shaper_)
+                it->second.shaping = shaper_->open(stream->executor(), "socks5", stream->client_identity());
             it->second.session.handle_on_accept();
+        }
     }
 
     void SocksStreamManager::on_read(IoBuffer buffer, ClientStreamPtr stream)
     {
-        if (const auto it = sessions_.find(stream->id()); it != sessions_.end())
-            it->second.session.handle_client_read(buffer);
+        if (const auto it = sessions_.find(stream->id()); it != sessions_.end()) {
+            if (it->second.shaping)
+                it->second.shaping->consume(buffer.size());
+            it->second.session.handle_client_read(std::move(buffer));
+        }
     }
 
     void SocksStreamManager::on_write(ClientStreamPtr stream)
@@ -109,8 +134,12 @@ namespace mtls_mproxy
 
     void SocksStreamManager::read_client(int id)
     {
-        if (const auto it = sessions_.find(id); it != sessions_.end())
-            it->second.client->read();
+        if (const auto it = sessions_.find(id); it != sessions_.end()) {
+            if (it->second.shaping)
+                it->second.shaping->read([client{it->second.client}]() { client->read(); });
+            else
+                it->second.client->read();
+        }
     }
 
     void SocksStreamManager::write_client(int id, IoBuffer buffer)
@@ -124,10 +153,18 @@ namespace mtls_mproxy
         if (const auto it = sessions_.find(id); it != sessions_.end()) {
             if (!it->second.client) {
                 if (it->second.session.is_udp_mode_enabled()) {
+                    const auto executor = it->second.server->executor();
+                    auto pool = shared_udp_pool_;
+                    if (!pool) {
+                        pool = UdpSocketPool::create(executor, udp_sockets_, logger_factory_);
+                        if (pool->is_shared())
+                            shared_udp_pool_ = pool;
+                    }
                     it->second.client = std::make_shared<UdpClientStream>(shared_from_this(),
                                                                           id,
-                                                                          it->second.server->executor(),
-                                                                          logger_factory_);
+                                                                          executor,
+                                                                          logger_factory_,
+                                                                          std::move(pool));
                 } else {
                     it->second.client = TcpClientStream::create(shared_from_this(),
                                                                 id,
@@ -148,4 +185,27 @@ namespace mtls_mproxy
 
         return {};
     }
-}
\ No newline at end of file
+
+    FlowControl SocksStreamManager::flow_control() const
+    {
+        return flow_control_;
+    }
+
+    const SocketOptions& SocksStreamManager::upstream_socket_options() const
+    {
+        return upstream_sockets_;
+    }
+
+    std::size_t SocksStreamManager::live_sessions() const
+    {
+        return sessions_.size();
+    }
+
+    std::vector<std::uint8_t> SocksStreamManager::overload_reply() const
+    {
+        // Method selection and the request reply at once, the client reads them as it goes through the handshake
+        return {proto::version, proto::AuthMethod::NoAuth,
+                proto::version, Socks::general_socks_server_failure, proto::reserved, proto::ipv4,
+                0, 0, 0, 0, 0, 0};
+    }
+}
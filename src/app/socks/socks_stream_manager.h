@@ -2,6 +2,8 @@
 #define MTLS_MPROXY_SOCKS_STREAM_MANAGER_H
 
 #include "transport/stream_manager.h"
+#include "transport/traffic_shaper.h"
+#include "transport/udp_socket_pool.h"
 #include "socks_session.h"
 
 #include <asynclog/logger_factory.h>
@@ -13,7 +15,12 @@ namespace mtls_mproxy
         , public std::enable_shared_from_this<SocksStreamManager>
     {
     public:
-        explicit SocksStreamManager(const asynclog::LoggerFactory& log_factory, bool udp_enabled = false);
+        explicit SocksStreamManager(const asynclog::LoggerFactory& log_factory,
+                                    bool udp_enabled = false,
+                                    UdpSocketPool::Options udp_sockets = {},
+                                    FlowControl flow_control = {},
+                                    TrafficShaperPtr shaper = nullptr,
+                                    SocketOptions upstream_sockets = {});
         ~SocksStreamManager() override = default;
 
         SocksStreamManager(const SocksStreamManager& other) = delete;
@@ -38,6 +45,10 @@ namespace mtls_mproxy
         void connect(int id, std::string host, std::string service) override;
 
         std::vector<std::uint8_t> udp_associate(int id) override;
+        FlowControl flow_control() const override;
+        const SocketOptions& upstream_socket_options() const override;
+        std::size_t live_sessions() const override;
+        std::vector<std::uint8_t> overload_reply() const override;
 
     private:
         struct SocksPair {
@@ -45,12 +56,20 @@ namespace mtls_mproxy
             ServerStreamPtr server;
             ClientStreamPtr client;
             SocksSession session;
+            // nullptr if traffic shaping is disabled
+            ShapingGatePtr shaping;
         };
 
         std::unordered_map<int, SocksPair> sessions_;
         asynclog::LoggerFactory logger_factory_;
         asynclog::ScopedLogger logger_;
         bool is_udp_associate_mode_enabled_{false};
+        UdpSocketPool::Options udp_sockets_;
+        // Outgoing sockets of all UDP associations in shared mode, opened with the first association
+        UdpSocketPoolPtr shared_udp_pool_;
+        FlowControl flow_control_;
+        TrafficShaperPtr shaper_;
+        SocketOptions upstream_sockets_;
     };
 }
 
@@ -0,0 +1,143 @@
+#include "admission_control.h"
+
+#include <array>
+#include <filesystem>
+#include <limits>
+
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+namespace
+{
+    namespace net = asio;
+
+    // Open descriptors are counted at most this often, admitted connections are added in between
+    constexpr std::chrono::milliseconds kDescriptorSampleInterval{250};
+    // Descriptors an admitted session is assumed to take, its downstream and upstream sockets
+    constexpr std::size_t kDescriptorsPerSession{2};
+
+    std::size_t descriptor_limit()
+    {
+#if !defined(_WIN32)
+        rlimit limit{};
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+            return static_cast<std::size_t>(limit.rlim_cur);
+#endif
+        return 0;
+    }
+
+    std::size_t open_descriptors()
+    {
+        std::size_t count{0};
+#if defined(__linux__)
+        std::error_code ec;
+        for (std::filesystem::directory_iterator it{"/proc/self/fd", ec}, end; !ec && it != end; it.increment(ec))
+            ++count;
+#endif
+        return count;
+    }
+}
+
+namespace mtls_mproxy
+{
+    std::optional<OverloadAction> parse_overload_action(std::string_view str)
+    {
+        if (str == "pause")
+            return OverloadAction::pause;
+        if (str == "reset")
+            return OverloadAction::reset;
+        if (str == "reply")
+            return OverloadAction::reply;
+
+        return std::nullopt;
+    }
+
+    AdmissionControl::AdmissionControl(Options options)
+        : options_{options}
+        , descriptor_limit_{descriptor_limit()}
+    {
+        // A second worth of accepts may come at once, every accept takes a whole token
+        accept_rate_.configure({options_.max_accept_rate, options_.max_accept_rate}, Clock::now());
+    }
+
+    AdmissionControl::Clock::duration AdmissionControl::accept_delay(std::size_t live_sessions)
+    {
+        const auto now = Clock::now();
+        if (descriptors_low(now))
+            return kPauseInterval;
+
+        if (options_.action != OverloadAction::pause)
+            return Clock::duration::zero();
+
+        if (options_.max_sessions > 0 && live_sessions >= options_.max_sessions)
+            return kPauseInterval;
+
+        return accept_rate_.wait_time(now, 1);
+    }
+
+    std::size_t AdmissionControl::accept_headroom(std::size_t live_sessions) const
+    {
+        if (options_.action != OverloadAction::pause || options_.max_sessions == 0)
+            return std::numeric_limits<std::size_t>::max();
+
+        return live_sessions < options_.max_sessions ? options_.max_sessions - live_sessions : 0;
+    }
+
+    bool AdmissionControl::admit(std::size_t live_sessions)
+    {
+        const auto now = Clock::now();
+        if ((options_.max_sessions > 0 && live_sessions >= options_.max_sessions) ||
+            accept_rate_.wait_time(now, 1) > Clock::duration::zero()) {
+            // A paused listener holds the connection, it isn't rejected
+            if (options_.action != OverloadAction::pause)
+                ++rejected_;
+            return false;
+        }
+
+        accept_rate_.consume(1, now);
+        descriptors_ += kDescriptorsPerSession;
+        return true;
+    }
+
+    void AdmissionControl::on_descriptors_exhausted()
+    {
+        exhausted_until_ = Clock::now() + kPauseInterval;
+    }
+
+    void AdmissionControl::reject(tcp::socket& socket, const std::vector<std::uint8_t>& reply)
+    {
+        net::error_code ec;
+        if (options_.action == OverloadAction::reply && !reply.empty()) {
+            // The reply fits into the send buffer of a fresh connection, the loop is never blocked
+            socket.non_blocking(true, ec);
+            socket.write_some(net::buffer(reply), ec);
+            socket.shutdown(tcp::socket::shutdown_send, ec);
+
+            // Closing with unread data resets the connection, and the client may lose the reply
+            std::array<std::uint8_t, 512> discard{};
+            while (!ec && socket.available(ec) > 0)
+                socket.read_some(net::buffer(discard), ec);
+        } else {
+            socket.set_option(tcp::socket::linger(true, 0), ec);
+        }
+
+        socket.close(ec);
+    }
+
+    bool AdmissionControl::descriptors_low(Clock::time_point now)
+    {
+        if (now < exhausted_until_)
+            return true;
+
+        if (options_.fd_headroom == 0 || descriptor_limit_ == 0)
+            return false;
+
+        if (now - descriptors_sampled_ >= kDescriptorSampleInterval) {
+            descriptors_ = open_descriptors();
+            descriptors_sampled_ = now;
+        }
+
+        return descriptors_ + options_.fd_headroom >= descriptor_limit_;
+    }
+}
@@ -0,0 +1,89 @@
+#ifndef MTLS_MPROXY_TRANSPORT_ADMISSION_CONTROL_H
+#define MTLS_MPROXY_TRANSPORT_ADMISSION_CONTROL_H
+
+#include "traffic_shaper.h"
+
+#include <asio/ip/tcp.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace mtls_mproxy
+{
+    using tcp = asio::ip::tcp;
+
+    // What a listener does with connections over its limits
+    enum class OverloadAction {
+        // Stop accepting, the connections wait in the listen backlog
+        pause,
+        // Accept and reset them right away
+        reset,
+        // Accept, send the refusal of the proxy protocol (SOCKS5 failure, HTTP 503) and close them,
+        // reset where the protocol has none or the listener is behind TLS
+        reply
+    };
+
+    std::optional<OverloadAction> parse_overload_action(std::string_view str);
+
+    // Admission control of a listener. New connections are admitted up to a number of live sessions and
+    // an accept rate, and accepting pauses while the process runs short of file descriptors, so a
+    // connection storm is held in the kernel backlog (or refused) instead of slowing down the sessions
+    // already running or failing them when descriptors run out.
+    class AdmissionControl
+    {
+    public:
+        struct Options {
+            // Live sessions, 0 - unlimited
+            std::size_t max_sessions{0};
+            // Accepted connections per second, 0 - unlimited
+            std::uint64_t max_accept_rate{0};
+            // Free file descriptors below which accepting pauses, 0 - disabled
+            std::size_t fd_headroom{64};
+            OverloadAction action{OverloadAction::pause};
+        };
+
+        using Clock = std::chrono::steady_clock;
+
+        // Retry period of a paused listener
+        static constexpr std::chrono::milliseconds kPauseInterval{100};
+
+        explicit AdmissionControl(Options options);
+
+        // Time to wait before the next accept, zero if the listener may accept now. Limits covered by
+        // fast rejection don't pause, a connection over them is accepted and refused by admit().
+        [[nodiscard]] Clock::duration accept_delay(std::size_t live_sessions);
+        // Accepts the listener may keep outstanding. With the pause action these are the sessions left up
+        // to the limit, a connection accepted beyond them could only be held.
+        [[nodiscard]] std::size_t accept_headroom(std::size_t live_sessions) const;
+        // Checks an accepted connection against the limits and counts it if it is admitted. With the pause
+        // action the listener holds a connection that isn't admitted until accept_delay() is zero again,
+        // then it is admitted.
+        [[nodiscard]] bool admit(std::size_t live_sessions);
+        // The accept failed because the process or the system is out of file descriptors
+        void on_descriptors_exhausted();
+
+        // Closes a connection that was not admitted, sends the reply first if the action asks for it
+        void reject(tcp::socket& socket, const std::vector<std::uint8_t>& reply);
+
+        [[nodiscard]] const Options& options() const { return options_; }
+        [[nodiscard]] std::uint64_t rejected() const { return rejected_; }
+
+    private:
+        bool descriptors_low(Clock::time_point now);
+
+        Options options_;
+        TokenBucket accept_rate_;
+        // Open descriptors sampled from the system, admitted connections are added until the next sample
+        std::size_t descriptors_{0};
+        std::size_t descriptor_limit_{0};
+        Clock::time_point descriptors_sampled_{};
+        // Accepting pauses until then after an accept failed for lack of descriptors
+        Clock::time_point exhausted_until_{};
+        std::uint64_t rejected_{0};
+    };
+}
+
+#endif // MTLS_MPROXY_TRANSPORT_ADMISSION_CONTROL_H
@@ -30,6 +30,8 @@ namespace mtls_mproxy
         virtual void set_service(std::string service) = 0;
 
         [[nodiscard]] int id() const { return id_; }
+        // Pooled upstream connections are handed over from one session to another
+        void set_id(int id) { id_ = id; }
         StreamManagerPtr manager() { return stream_manager_; }
 
     private:
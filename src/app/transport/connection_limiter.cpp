@@ -0,0 +1,230 @@
+#include "connection_limiter.h"
+
+#include <bit>
+#include <random>
+
+namespace
+{
+    // FNV-1a prime, the offset basis is replaced by the per process seed
+    constexpr std::uint64_t kFnvPrime{0x100000001b3};
+
+    constexpr std::size_t kIpv6PrefixBytes{8};
+}
+
+namespace mtls_mproxy
+{
+    PeerTable::PeerTable(PeerLimits limits, std::size_t capacity)
+        : limits_{limits}
+    {
+        // Tables without limits are never used
+        if (!limits_.limited())
+            return;
+
+        entries_.resize(capacity);
+        buckets_.assign(std::bit_ceil(capacity), kNone);
+    }
+
+    std::optional<PeerTable::Slot> PeerTable::acquire(std::uint64_t key, TokenBucket::Clock::time_point now)
+    {
+        auto index = find(key);
+        if (index == kNone) {
+            index = allocate();
+            if (index == kNone)
+                return std::nullopt;
+
+            auto& entry = entries_[index];
+            entry.key = key;
+            entry.connections = 0;
+            // A second worth of connections may come at once
+            entry.rate = TokenBucket{};
+            entry.rate.configure({limits_.max_rate, limits_.max_rate}, now);
+
+            auto& bucket = buckets_[key & (buckets_.size() - 1)];
+            entry.chain = bucket;
+            bucket = index;
+        }
+
+        auto& entry = entries_[index];
+        if (entry.idle)
+            unlink_lru(index);
+
+        if ((limits_.max_connections > 0 && entry.connections >= limits_.max_connections) ||
+            entry.rate.wait_time(now, 1) > TokenBucket::Clock::duration::zero()) {
+            // A rejected peer without connections is still the most recently seen one
+            if (entry.connections == 0)
+                push_newest(index);
+            return std::nullopt;
+        }
+
+        entry.rate.consume(1, now);
+        ++entry.connections;
+        return Slot{index, key};
+    }
+
+    void PeerTable::release(const Slot& slot)
+    {
+        auto& entry = entries_[slot.index];
+        if (entry.key != slot.key || entry.connections == 0)
+            return;
+
+        if (--entry.connections == 0)
+            push_newest(slot.index);
+    }
+
+    std::uint32_t PeerTable::find(std::uint64_t key) const
+    {
+        auto index = buckets_[key & (buckets_.size() - 1)];
+        while (index != kNone && entries_[index].key != key)
+            index = entries_[index].chain;
+
+        return index;
+    }
+
+    std::uint32_t PeerTable::allocate()
+    {
+        if (used_ < entries_.size())
+            return used_++;
+
+        // Only peers without connections are evicted
+        const auto index = oldest_;
+        if (index == kNone)
+            return kNone;
+
+        unlink_lru(index);
+        unlink_chain(index);
+        return index;
+    }
+
+    void PeerTable::unlink_chain(std::uint32_t index)
+    {
+        auto* link = &buckets_[entries_[index].key & (buckets_.size() - 1)];
+        while (*link != index)
+            link = &entries_[*link].chain;
+
+        *link = entries_[index].chain;
+    }
+
+    void PeerTable::unlink_lru(std::uint32_t index)
+    {
+        auto& entry = entries_[index];
+        if (entry.newer != kNone)
+            entries_[entry.newer].older = entry.older;
+        else
+            newest_ = entry.older;
+
+        if (entry.older != kNone)
+            entries_[entry.older].newer = entry.newer;
+        else
+            oldest_ = entry.newer;
+
+        entry.newer = kNone;
+        entry.older = kNone;
+        entry.idle = false;
+    }
+
+    void PeerTable::push_newest(std::uint32_t index)
+    {
+        auto& entry = entries_[index];
+        entry.older = newest_;
+        entry.newer = kNone;
+        entry.idle = true;
+        if (newest_ != kNone)
+            entries_[newest_].newer = index;
+        else
+            oldest_ = index;
+
+        newest_ = index;
+    }
+
+    ConnectionLease::~ConnectionLease()
+    {
+        release();
+    }
+
+    ConnectionLease& ConnectionLease::operator=(ConnectionLease&& other) noexcept
+    {
+        if (this != &other) {
+            release();
+            limiter_ = std::move(other.limiter_);
+            source_ = other.source_;
+            identity_ = other.identity_;
+        }
+
+        return *this;
+    }
+
+    void ConnectionLease::release()
+    {
+        if (!limiter_)
+            return;
+
+        if (source_.has_value())
+            limiter_->sources_.release(*source_);
+        if (identity_.has_value())
+            limiter_->identities_.release(*identity_);
+
+        limiter_.reset();
+        source_.reset();
+        identity_.reset();
+    }
+
+    ConnectionLimiter::ConnectionLimiter(Options options)
+        : seed_{std::random_device{}() | (std::uint64_t{std::random_device{}()} << 32)}
+        , sources_{options.per_source, options.tracked_peers}
+        , identities_{options.per_identity, options.tracked_peers}
+    {
+    }
+
+    bool ConnectionLimiter::admit_source(ConnectionLease& lease, const net::ip::address& address)
+    {
+        if (!sources_.limits().limited())
+            return true;
+
+        std::uint64_t key{0};
+        if (address.is_v4()) {
+            const auto bytes = address.to_v4().to_bytes();
+            key = hash(bytes.data(), bytes.size());
+        } else {
+            const auto bytes = address.to_v6().to_bytes();
+            key = hash(bytes.data(), kIpv6PrefixBytes);
+        }
+
+        const auto slot = sources_.acquire(key, TokenBucket::Clock::now());
+        if (!slot.has_value()) {
+            ++rejected_;
+            return false;
+        }
+
+        lease.limiter_ = shared_from_this();
+        lease.source_ = slot;
+        return true;
+    }
+
+    bool ConnectionLimiter::admit_identity(ConnectionLease& lease, std::string_view identity)
+    {
+        if (!identities_.limits().limited() || identity.empty())
+            return true;
+
+        const auto slot = identities_.acquire(hash(identity.data(), identity.size()), TokenBucket::Clock::now());
+        if (!slot.has_value()) {
+            ++rejected_;
+            return false;
+        }
+
+        lease.limiter_ = shared_from_this();
+        lease.identity_ = slot;
+        return true;
+    }
+
+    std::uint64_t ConnectionLimiter::hash(const void* data, std::size_t size) const
+    {
+        auto value = seed_;
+        const auto* bytes = static_cast<const std::uint8_t*>(data);
+        for (std::size_t i = 0; i < size; ++i) {
+            value ^= bytes[i];
+            value *= kFnvPrime;
+        }
+
+        return value;
+    }
+}
@@ -0,0 +1,150 @@
+#ifndef MTLS_MPROXY_TRANSPORT_CONNECTION_LIMITER_H
+#define MTLS_MPROXY_TRANSPORT_CONNECTION_LIMITER_H
+
+#include "traffic_shaper.h"
+
+#include <asio/ip/address.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace mtls_mproxy
+{
+    namespace net = asio;
+
+    // Limits of one peer, a source address or a client identity
+    struct PeerLimits {
+        // Concurrent connections, 0 - unlimited
+        std::size_t max_connections{0};
+        // New connections per second, 0 - unlimited
+        std::uint64_t max_rate{0};
+
+        [[nodiscard]] bool limited() const { return max_connections > 0 || max_rate > 0; }
+    };
+
+    // Fixed size hash table of peers. Entries and hash buckets are allocated once, so a flood of distinct
+    // sources costs no memory. A new peer takes a free entry or evicts the least recently seen peer without
+    // connections, whose rate history is forgotten. Peers with connections are never evicted, while all
+    // entries have some new peers are rejected: spreading connections over many sources can't push the
+    // counted ones out.
+    class PeerTable
+    {
+    public:
+        struct Slot {
+            std::uint32_t index;
+            std::uint64_t key;
+        };
+
+        PeerTable(PeerLimits limits, std::size_t capacity);
+
+        // Counts a new connection of the peer, std::nullopt if the peer is over its limits or the table
+        // has no room for a new peer
+        std::optional<Slot> acquire(std::uint64_t key, TokenBucket::Clock::time_point now);
+        // Counts a closed connection
+        void release(const Slot& slot);
+
+        [[nodiscard]] const PeerLimits& limits() const { return limits_; }
+
+    private:
+        static constexpr std::uint32_t kNone = ~std::uint32_t{0};
+
+        struct Entry {
+            std::uint64_t key{0};
+            std::uint32_t connections{0};
+            // Next entry of the hash bucket
+            std::uint32_t chain{kNone};
+            // Neighbours in the LRU list of peers without connections, the eviction candidates
+            std::uint32_t newer{kNone};
+            std::uint32_t older{kNone};
+            bool idle{false};
+            TokenBucket rate;
+        };
+
+        std::uint32_t find(std::uint64_t key) const;
+        std::uint32_t allocate();
+        void unlink_chain(std::uint32_t index);
+        void unlink_lru(std::uint32_t index);
+        void push_newest(std::uint32_t index);
+
+        PeerLimits limits_;
+        std::vector<Entry> entries_;
+        // Power of two buckets with the first entry of each chain
+        std::vector<std::uint32_t> buckets_;
+        std::uint32_t used_{0};
+        // Ends of the LRU list of idle peers
+        std::uint32_t newest_{kNone};
+        std::uint32_t oldest_{kNone};
+    };
+
+    class ConnectionLimiter;
+
+    // Connection counted by the limiter, released when the lease is destroyed with the connection
+    class ConnectionLease
+    {
+    public:
+        ConnectionLease() = default;
+        ~ConnectionLease();
+
+        ConnectionLease(ConnectionLease&& other) noexcept = default;
+        ConnectionLease& operator=(ConnectionLease&& other) noexcept;
+        ConnectionLease(const ConnectionLease& other) = delete;
+        ConnectionLease& operator=(const ConnectionLease& other) = delete;
+
+    private:
+        friend class ConnectionLimiter;
+
+        void release();
+
+        std::shared_ptr<ConnectionLimiter> limiter_;
+        std::optional<PeerTable::Slot> source_;
+        std::optional<PeerTable::Slot> identity_;
+    };
+
+    // Per source address and per client identity limits of concurrent connections and connection rate,
+    // checked by the listener before a session is created. IPv6 sources are counted per /64, the
+    // prefix a single host usually controls. Both count connections, a multiplexed mTLS connection
+    // counts once however many streams it carries (those are bounded by its own stream limit).
+    // Used on the relay event loop only.
+    class ConnectionLimiter final : public std::enable_shared_from_this<ConnectionLimiter>
+    {
+    public:
+        struct Options {
+            PeerLimits per_source;
+            PeerLimits per_identity;
+            // Peers tracked per table
+            std::size_t tracked_peers{16384};
+        };
+
+        explicit ConnectionLimiter(Options options);
+
+        ConnectionLimiter(const ConnectionLimiter& other) = delete;
+        ConnectionLimiter& operator=(const ConnectionLimiter& other) = delete;
+
+        // Counts a connection from the address in the lease, false if the source is over its limits
+        bool admit_source(ConnectionLease& lease, const net::ip::address& address);
+        // Counts the authenticated connection of the lease for its identity, false if the identity is
+        // over its limits
+        bool admit_identity(ConnectionLease& lease, std::string_view identity);
+
+        [[nodiscard]] bool identity_limited() const { return identities_.limits().limited(); }
+        [[nodiscard]] std::uint64_t rejected() const { return rejected_; }
+
+    private:
+        friend class ConnectionLease;
+
+        std::uint64_t hash(const void* data, std::size_t size) const;
+
+        // Random per process, peers can't pick keys that collide in the table
+        std::uint64_t seed_;
+        PeerTable sources_;
+        PeerTable identities_;
+        std::uint64_t rejected_{0};
+    };
+
+    using ConnectionLimiterPtr = std::shared_ptr<ConnectionLimiter>;
+}
+
+#endif // MTLS_MPROXY_TRANSPORT_CONNECTION_LIMITER_H
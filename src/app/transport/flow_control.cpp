@@ -0,0 +1,31 @@
+#include "flow_control.h"
+
+#include <algorithm>
+
+namespace mtls_mproxy
+{
+    WriteBudget::WriteBudget(FlowControl limits)
+        : limits_{limits}
+    {
+        limits_.low_watermark = std::min(limits_.low_watermark, limits_.high_watermark);
+    }
+
+    bool WriteBudget::queue(std::size_t size)
+    {
+        queued_ += size;
+        if (queued_ >= limits_.high_watermark)
+            paused_ = true;
+
+        return !paused_;
+    }
+
+    bool WriteBudget::drain(std::size_t size)
+    {
+        queued_ -= std::min(size, queued_);
+        if (!paused_ || queued_ > limits_.low_watermark)
+            return false;
+
+        paused_ = false;
+        return true;
+    }
+}
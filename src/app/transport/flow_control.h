@@ -0,0 +1,45 @@
+#ifndef MTLS_MPROXY_TRANSPORT_FLOW_CONTROL_H
+#define MTLS_MPROXY_TRANSPORT_FLOW_CONTROL_H
+
+#include <chrono>
+#include <cstddef>
+
+namespace mtls_mproxy
+{
+    // Byte budget of one relay direction. The session reads the producing stream again once the consuming
+    // stream acknowledges a write with on_write, so holding the acknowledgement back pauses the producer.
+    struct FlowControl {
+        // Writes are acknowledged right away while less than this is buffered in the consuming stream
+        std::size_t high_watermark{256 * 1024};
+        // A paused producer resumes when the buffer has drained to this
+        std::size_t low_watermark{64 * 1024};
+        // A stopped stream writes out what it still buffers for up to this long, then its socket is
+        // closed, a peer that stops reading can't hold the stream open
+        std::chrono::seconds drain_timeout{5};
+    };
+
+    // Bytes a stream buffers for its socket. Every write either is acknowledged at once or leaves the
+    // producer paused until drain() reports the low watermark, so a session buffers at most the high
+    // watermark plus one read per direction.
+    class WriteBudget
+    {
+    public:
+        explicit WriteBudget(FlowControl limits = {});
+
+        // Counts bytes handed to the stream, false when the producer has to pause
+        bool queue(std::size_t size);
+        // Counts bytes written to the socket, true when a paused producer resumes
+        bool drain(std::size_t size);
+
+        [[nodiscard]] std::size_t queued() const { return queued_; }
+        [[nodiscard]] bool paused() const { return paused_; }
+        [[nodiscard]] const FlowControl& limits() const { return limits_; }
+
+    private:
+        FlowControl limits_;
+        std::size_t queued_{0};
+        bool paused_{false};
+    };
+}
+
+#endif // MTLS_MPROXY_TRANSPORT_FLOW_CONTROL_H
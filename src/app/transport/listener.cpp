@@ -0,0 +1,48 @@
+#include "listener.h"
+
+#if defined(__linux__)
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
+
+namespace mtls_mproxy
+{
+    std::vector<std::string> open_listener(tcp::acceptor& acceptor,
+                                           const tcp::endpoint& endpoint,
+                                           const ListenerOptions& options)
+    {
+        std::vector<std::string> unsupported;
+
+        acceptor.open(endpoint.protocol());
+        acceptor.set_option(tcp::acceptor::reuse_address(true));
+        acceptor.bind(endpoint);
+
+#if defined(__linux__)
+        const auto fd = acceptor.native_handle();
+        if (options.defer_accept.count() > 0) {
+            const int timeout = static_cast<int>(options.defer_accept.count());
+            if (::setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &timeout, sizeof(timeout)) != 0)
+                unsupported.emplace_back("TCP_DEFER_ACCEPT");
+        }
+
+        if (options.fast_open > 0) {
+            const int queue = options.fast_open;
+            if (::setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &queue, sizeof(queue)) != 0)
+                unsupported.emplace_back("TCP_FASTOPEN");
+        }
+#else
+        if (options.defer_accept.count() > 0)
+            unsupported.emplace_back("TCP_DEFER_ACCEPT");
+        if (options.fast_open > 0)
+            unsupported.emplace_back("TCP_FASTOPEN");
+#endif
+
+        // Set before listening, connections take the buffer sizes of the listener into their handshake
+        const auto socket_options = apply_socket_options(acceptor, options.sockets);
+        unsupported.insert(unsupported.end(), socket_options.begin(), socket_options.end());
+
+        acceptor.listen(options.backlog > 0 ? options.backlog : tcp::acceptor::max_listen_connections);
+        return unsupported;
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef MTLS_MPROXY_TRANSPORT_LISTENER_H
+#define MTLS_MPROXY_TRANSPORT_LISTENER_H
+
+#include "socket_options.h"
+
+#include <asio/ip/tcp.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace mtls_mproxy
+{
+    using tcp = asio::ip::tcp;
+
+    struct ListenerOptions {
+        // Listen backlog, 0 - the system maximum (SOMAXCONN)
+        int backlog{0};
+        // Accepts kept outstanding at once, a readable listener is drained by all of them in one go
+        std::size_t accepts{4};
+        // The kernel hands over a connection once the client has sent data or after this timeout
+        // (TCP_DEFER_ACCEPT), 0 - disabled. All proxy protocols have the client speak first, only
+        // server-first protocols relayed in client mode would be held up.
+        std::chrono::seconds defer_accept{0};
+        // Pending TCP Fast Open requests (TCP_FASTOPEN), 0 - disabled. Clients with a cookie send their
+        // first request in the SYN, the server side also needs bit 2 of net.ipv4.tcp_fastopen.
+        int fast_open{0};
+        // Downstream socket profile, set on the listening socket and on every accepted connection
+        SocketOptions sockets;
+    };
+
+    // Opens, binds and starts the listener, throws if any of that fails. Tuning options the system does
+    // not support are skipped, their names are returned for a warning.
+    std::vector<std::string> open_listener(tcp::acceptor& acceptor,
+                                           const tcp::endpoint& endpoint,
+                                           const ListenerOptions& options);
+}
+
+#endif // MTLS_MPROXY_TRANSPORT_LISTENER_H
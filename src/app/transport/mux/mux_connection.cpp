@@ -0,0 +1,449 @@
+#include "mux_connection.h"
+#include "mux_server_stream.h"
+#include "transport/tls/peer_identity.h"
+
+#include <asio/post.hpp>
+#include <asio/write.hpp>
+
+#include <algorithm>
+#include <format>
+#include <limits>
+
+namespace
+{
+    // Data a stream sends per round-robin turn, one full TLS record
+    constexpr std::size_t kQuantum = 16 * 1024;
+    // Frames gathered into one TLS write
+    constexpr std::size_t kMaxBatchSize = 64 * 1024;
+}
+
+namespace mtls_mproxy
+{
+    MuxConnection::MuxConnection(ssl_socket&& socket,
+                                 int id,
+                                 StreamManagerPtr stream_manager,
+                                 IdGenerator next_id,
+                                 Options options,
+                                 TlsSessionStatsPtr stats,
+                                 const asynclog::LoggerFactory& log_factory,
+                                 IoBuffer early_data)
+        : socket_{std::move(socket)}
+        , stream_manager_{std::move(stream_manager)}
+        , next_id_{std::move(next_id)}
+        , options_{options}
+        , stats_{std::move(stats)}
+        , logger_factory_{log_factory}
+        , logger_{logger_factory_.create("mux_connection")}
+        , id_{id}
+        , read_buffer_{}
+        , rx_{std::move(early_data)}
+    {
+        options_.stream_window = std::max(options_.stream_window, kMuxInitialWindow);
+
+        net::error_code ec;
+        if (const auto ep = socket_.lowest_layer().remote_endpoint(ec); !ec)
+            remote_address_ = ep.address().to_string();
+    }
+
+    MuxConnection::~MuxConnection()
+    {
+        logger_.debug(std::format("[{}] multiplexed connection closed", id_));
+    }
+
+    net::any_io_executor MuxConnection::executor() { return socket_.get_executor(); }
+
+    void MuxConnection::start()
+    {
+        if (SSL_session_reused(socket_.native_handle()))
+            stats_->resumed_handshakes.fetch_add(1, std::memory_order_relaxed);
+        else
+            stats_->full_handshakes.fetch_add(1, std::memory_order_relaxed);
+
+        client_identity_ = peer_certificate_subject(socket_.native_handle());
+        logger_.debug(std::format("[{}] multiplexed connection from client: [{}]", id_, remote_address_));
+
+        // 0-RTT data already holds the first frames
+        if (!rx_.empty() && !process_frames())
+            return;
+
+        do_read();
+    }
+
+    void MuxConnection::do_read()
+    {
+        socket_.async_read_some(
+            net::buffer(read_buffer_),
+            [this, self{shared_from_this()}](const net::error_code& ec, const std::size_t length) {
+                if (closed_)
+                    return;
+
+                if (ec) {
+                    const auto clean = ec == net::error::eof || ec == net::ssl::error::stream_truncated;
+                    close(clean ? net::error_code{} : ec);
+                    return;
+                }
+
+                rx_.insert(rx_.end(), read_buffer_.data(), read_buffer_.data() + length);
+                if (process_frames())
+                    do_read();
+            });
+    }
+
+    bool MuxConnection::process_frames()
+    {
+        std::size_t pos{0};
+        bool ok{true};
+        while (ok && rx_.size() - pos >= kMuxHeaderSize) {
+            const auto header = decode_mux_header({rx_.data() + pos, kMuxHeaderSize});
+            if (!header.has_value()) {
+                protocol_error("unknown frame version or type");
+                return false;
+            }
+
+            const std::size_t payload_size = header->type == MuxFrameType::kData ? header->length : 0;
+            // Checked before buffering, a frame never carries more than one receive window
+            if (payload_size > options_.stream_window) {
+                protocol_error(std::format("data frame of {} bytes exceeds the stream window", payload_size));
+                return false;
+            }
+
+            if (rx_.size() - pos - kMuxHeaderSize < payload_size)
+                break;
+
+            ok = handle_frame(*header, {rx_.data() + pos + kMuxHeaderSize, payload_size});
+            pos += kMuxHeaderSize + payload_size;
+        }
+
+        rx_.erase(rx_.begin(), rx_.begin() + static_cast<std::ptrdiff_t>(pos));
+        return ok;
+    }
+
+    bool MuxConnection::handle_frame(const MuxFrameHeader& header, std::span<const std::uint8_t> payload)
+    {
+        switch (header.type) {
+        case MuxFrameType::kPing:
+            if (header.flags & kMuxSyn)
+                send_control(MuxFrameType::kPing, kMuxAck, 0, header.length);
+            return true;
+        case MuxFrameType::kGoAway:
+            logger_.debug(std::format("[{}] client is going away, code {}", id_, header.length));
+            return true;
+        default:
+            break;
+        }
+
+        const auto mux_id = header.stream_id;
+        if (mux_id == 0) {
+            protocol_error("stream frame without stream id");
+            return false;
+        }
+
+        if (header.flags & kMuxSyn) {
+            if (channels_.contains(mux_id)) {
+                protocol_error(std::format("stream {} opened twice", mux_id));
+                return false;
+            }
+            if (!open_channel(header))
+                return true;
+        }
+
+        // Frames of a stream closed on this side are dropped, the client learns about it from the fin
+        const auto it = channels_.find(mux_id);
+        if (it == channels_.end())
+            return true;
+        auto& channel = it->second;
+
+        if (header.flags & kMuxRst) {
+            channel.reset = true;
+            channel.inbound.clear();
+            channel.outbound.clear();
+            net::post(executor(), [stream{channel.stream}]() {
+                stream->manager()->on_error(net::error::connection_reset, stream);
+            });
+            return true;
+        }
+
+        if (header.type == MuxFrameType::kWindowUpdate) {
+            if (header.length > std::numeric_limits<std::uint32_t>::max() - channel.send_window) {
+                protocol_error(std::format("stream {} send window overflow", mux_id));
+                return false;
+            }
+            channel.send_window += header.length;
+            if (!channel.outbound.empty())
+                schedule(mux_id, channel);
+        } else if (!payload.empty() && !channel.remote_closed) {
+            if (payload.size() > channel.recv_window) {
+                protocol_error(std::format("stream {} exceeded its receive window", mux_id));
+                return false;
+            }
+            channel.recv_window -= static_cast<std::uint32_t>(payload.size());
+            channel.inbound.insert(channel.inbound.end(), payload.begin(), payload.end());
+        }
+
+        if (header.flags & kMuxFin)
+            channel.remote_closed = true;
+
+        if (channel.reading && (!channel.inbound.empty() || channel.remote_closed))
+            deliver(mux_id, channel);
+
+        return true;
+    }
+
+    bool MuxConnection::open_channel(const MuxFrameHeader& header)
+    {
+        const auto mux_id = header.stream_id;
+        if (going_away_ || channels_.size() >= options_.max_streams) {
+            logger_.warn(std::format("[{}] stream {} refused, {} streams open", id_, mux_id, channels_.size()));
+            send_control(MuxFrameType::kWindowUpdate, kMuxRst, mux_id, 0);
+            return false;
+        }
+
+        auto stream = std::make_shared<MuxServerStream>(stream_manager_, next_id_(), shared_from_this(), mux_id);
+
+        Channel channel;
+        channel.stream = stream;
+        channel.recv_window = options_.stream_window;
+        channel.budget = WriteBudget{stream_manager_->flow_control()};
+        channels_.emplace(mux_id, std::move(channel));
+
+        // A receive window larger than the initial one is announced with the acknowledgement
+        send_control(MuxFrameType::kWindowUpdate, kMuxAck, mux_id, options_.stream_window - kMuxInitialWindow);
+
+        logger_.debug(std::format("[{}] stream {} opened as session {}", id_, mux_id, stream->id()));
+        stream_manager_->on_accept(std::move(stream));
+        return true;
+    }
+
+    void MuxConnection::start_stream(std::uint32_t mux_id)
+    {
+        // The TLS handshake is done already, the stream is ready as soon as it is accepted
+        if (const auto it = channels_.find(mux_id); it != channels_.end()) {
+            net::post(executor(), [stream{it->second.stream}]() {
+                stream->manager()->on_server_ready(stream);
+            });
+        }
+    }
+
+    void MuxConnection::close_stream(std::uint32_t mux_id)
+    {
+        const auto it = channels_.find(mux_id);
+        if (it == channels_.end())
+            return;
+
+        auto& channel = it->second;
+        if (channel.reset) {
+            channels_.erase(it);
+            return;
+        }
+
+        // The fin goes out after the data still waiting to be framed
+        channel.closing = true;
+        channel.reading = false;
+        schedule(mux_id, channel);
+    }
+
+    void MuxConnection::read_stream(std::uint32_t mux_id)
+    {
+        const auto it = channels_.find(mux_id);
+        if (it == channels_.end())
+            return;
+
+        auto& channel = it->second;
+        if (channel.reset) {
+            net::post(executor(), [stream{channel.stream}]() {
+                stream->manager()->on_error(net::error::connection_reset, stream);
+            });
+            return;
+        }
+
+        if (!channel.inbound.empty() || channel.remote_closed)
+            deliver(mux_id, channel);
+        else
+            channel.reading = true;
+    }
+
+    bool MuxConnection::has_data_ready(std::uint32_t mux_id) const
+    {
+        const auto it = channels_.find(mux_id);
+        return it != channels_.end() && !it->second.inbound.empty();
+    }
+
+    void MuxConnection::write_stream(std::uint32_t mux_id, IoBuffer event)
+    {
+        const auto it = channels_.find(mux_id);
+        if (it == channels_.end())
+            return;
+
+        auto& channel = it->second;
+        if (channel.reset || channel.closing)
+            return;
+
+        channel.outbound.insert(channel.outbound.end(), event.begin(), event.end());
+        schedule(mux_id, channel);
+
+        // The stream manager may relay the next chunk while less than the high watermark waits to be framed
+        if (channel.budget.queue(event.size()))
+            net::post(executor(), [stream{channel.stream}]() { stream->manager()->on_write(stream); });
+    }
+
+    void MuxConnection::deliver(std::uint32_t mux_id, Channel& channel)
+    {
+        channel.reading = false;
+
+        // A stream half closed by the client ends like a plain connection closed by the client
+        if (channel.inbound.empty()) {
+            net::post(executor(), [stream{channel.stream}]() { stream->manager()->on_error({}, stream); });
+            return;
+        }
+
+        IoBuffer event;
+        event.swap(channel.inbound);
+        credit(mux_id, channel, event.size());
+
+        net::post(executor(), [stream{channel.stream}, event{std::move(event)}]() mutable {
+            stream->manager()->on_read(std::move(event), stream);
+        });
+    }
+
+    void MuxConnection::credit(std::uint32_t mux_id, Channel& channel, std::size_t size)
+    {
+        // Data is handed over only when the stream manager asks for more, that is after the previous
+        // chunk was relayed, so the window moves at the pace of the target
+        channel.consumed += static_cast<std::uint32_t>(size);
+        if (channel.remote_closed || channel.consumed < options_.stream_window / 2)
+            return;
+
+        send_control(MuxFrameType::kWindowUpdate, 0, mux_id, channel.consumed);
+        channel.recv_window += channel.consumed;
+        channel.consumed = 0;
+    }
+
+    void MuxConnection::send_control(MuxFrameType type, std::uint16_t flags, std::uint32_t mux_id, std::uint32_t length)
+    {
+        encode_mux_header({type, flags, mux_id, length}, control_);
+        request_flush();
+    }
+
+    void MuxConnection::schedule(std::uint32_t mux_id, Channel& channel)
+    {
+        if (!channel.scheduled && (channel.closing || channel.send_window > 0)) {
+            channel.scheduled = true;
+            ready_.push_back(mux_id);
+        }
+        request_flush();
+    }
+
+    void MuxConnection::request_flush()
+    {
+        // Deferred, so that everything queued while processing one read goes out in one write
+        if (writing_ || flush_posted_ || closed_)
+            return;
+
+        flush_posted_ = true;
+        net::post(executor(), [this, self{shared_from_this()}]() {
+            flush_posted_ = false;
+            flush();
+        });
+    }
+
+    void MuxConnection::flush()
+    {
+        if (writing_ || closed_)
+            return;
+
+        tx_.clear();
+        tx_.swap(control_);
+
+        while (!ready_.empty() && tx_.size() < kMaxBatchSize) {
+            const auto mux_id = ready_.front();
+            ready_.pop_front();
+
+            const auto it = channels_.find(mux_id);
+            if (it == channels_.end())
+                continue;
+
+            auto& channel = it->second;
+            channel.scheduled = false;
+
+            const auto size = std::min({channel.outbound.size(), std::size_t{channel.send_window}, kQuantum});
+            if (size > 0) {
+                encode_mux_header({MuxFrameType::kData, 0, mux_id, static_cast<std::uint32_t>(size)}, tx_);
+                const auto end = channel.outbound.begin() + static_cast<std::ptrdiff_t>(size);
+                tx_.insert(tx_.end(), channel.outbound.begin(), end);
+                channel.outbound.erase(channel.outbound.begin(), end);
+                channel.send_window -= static_cast<std::uint32_t>(size);
+            }
+
+            if (channel.budget.drain(size))
+                net::post(executor(), [stream{channel.stream}]() { stream->manager()->on_write(stream); });
+
+            if (channel.closing && channel.outbound.empty()) {
+                encode_mux_header({MuxFrameType::kWindowUpdate, kMuxFin, mux_id, 0}, tx_);
+                channels_.erase(it);
+                continue;
+            }
+
+            if (!channel.outbound.empty() && channel.send_window > 0) {
+                channel.scheduled = true;
+                ready_.push_back(mux_id);
+            }
+        }
+
+        if (tx_.empty())
+            return;
+
+        writing_ = true;
+        net::async_write(
+            socket_, net::buffer(tx_),
+            [this, self{shared_from_this()}](const net::error_code& ec, std::size_t) {
+                writing_ = false;
+                if (closed_)
+                    return;
+
+                if (ec) {
+                    close(ec);
+                    return;
+                }
+
+                if (going_away_ && control_.empty()) {
+                    close(net::error::connection_aborted);
+                    return;
+                }
+
+                flush();
+            });
+    }
+
+    void MuxConnection::protocol_error(const std::string& reason)
+    {
+        logger_.warn(std::format("[{}] protocol error from [{}]: {}", id_, remote_address_, reason));
+
+        // Nothing more is read, the connection closes once the go away frame is sent
+        going_away_ = true;
+        send_control(MuxFrameType::kGoAway, 0, 0, static_cast<std::uint32_t>(MuxGoAway::kProtocolError));
+    }
+
+    void MuxConnection::close(const net::error_code& ec)
+    {
+        if (closed_)
+            return;
+        closed_ = true;
+
+        if (ec)
+            logger_.debug(std::format("[{}] multiplexed connection error: {}", id_, ec.message()));
+
+        net::error_code ignored_ec;
+        socket_.lowest_layer().close(ignored_ec);
+
+        // Open streams end the way a plain connection would end: cleanly if the client closed the
+        // connection, with the error otherwise
+        auto channels = std::move(channels_);
+        channels_.clear();
+        ready_.clear();
+        for (auto& [_, channel] : channels) {
+            net::post(executor(), [stream{std::move(channel.stream)}, ec]() {
+                stream->manager()->on_error(ec, stream);
+            });
+        }
+    }
+}
@@ -0,0 +1,141 @@
+#ifndef MTLS_MPROXY_TRANSPORT_MUX_MUX_CONNECTION_H
+#define MTLS_MPROXY_TRANSPORT_MUX_MUX_CONNECTION_H
+
+#include "transport/stream_manager.h"
+#include "transport/tls/tls_session_stats.h"
+#include "mux_frame.h"
+
+#include <asynclog/logger_factory.h>
+#include <asynclog/scoped_logger.h>
+
+#include <asio/ip/tcp.hpp>
+#include <asio/ssl.hpp>
+
+#include <array>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+
+namespace mtls_mproxy
+{
+    namespace net = asio;
+    using ssl_socket = net::ssl::stream<net::ip::tcp::socket>;
+
+    class MuxServerStream;
+
+    // One mTLS connection carrying many logical streams. The client opens, feeds and closes streams with
+    // frames, every stream is handed to the stream manager as a regular ServerStream. Each stream has a
+    // send and a receive window, so a stream whose target is slow stops its sender without stalling the
+    // others. Streams with data to send are served round-robin, at most one quantum per turn, and the
+    // frames of one turn go out in a single TLS write.
+    class MuxConnection final : public std::enable_shared_from_this<MuxConnection>
+    {
+    public:
+        struct Options {
+            // Concurrent logical streams per connection, 0 disables multiplexing
+            std::size_t max_streams{0};
+            // Receive window of every stream in bytes, not less than the protocol's initial window
+            std::uint32_t stream_window{kMuxInitialWindow};
+        };
+
+        // Session ids of the listener, shared with the plain TLS streams
+        using IdGenerator = std::function<int()>;
+
+        MuxConnection(ssl_socket&& socket,
+                      int id,
+                      StreamManagerPtr stream_manager,
+                      IdGenerator next_id,
+                      Options options,
+                      TlsSessionStatsPtr stats,
+                      const asynclog::LoggerFactory& log_factory,
+                      IoBuffer early_data = {});
+        ~MuxConnection();
+
+        MuxConnection(const MuxConnection& other) = delete;
+        MuxConnection& operator=(const MuxConnection& other) = delete;
+
+        void start();
+
+        net::any_io_executor executor();
+        const std::string& remote_address() const { return remote_address_; }
+        const std::string& client_identity() const { return client_identity_; }
+        // Keeps the connection counted by the per peer limits until it is destroyed
+        void hold(ConnectionLease lease) { lease_ = std::move(lease); }
+
+        // Logical stream interface, the stream is identified by its id on the wire
+        void start_stream(std::uint32_t mux_id);
+        void close_stream(std::uint32_t mux_id);
+        void read_stream(std::uint32_t mux_id);
+        // Data of the stream is received and waits for a read
+        bool has_data_ready(std::uint32_t mux_id) const;
+        void write_stream(std::uint32_t mux_id, IoBuffer event);
+
+    private:
+        struct Channel {
+            std::shared_ptr<MuxServerStream> stream;
+            // Received and not yet handed to the stream manager
+            IoBuffer inbound;
+            // Written by the stream manager and not yet framed
+            IoBuffer outbound;
+            WriteBudget budget;
+            std::uint32_t send_window{kMuxInitialWindow};
+            std::uint32_t recv_window{0};
+            // Bytes handed to the stream manager since the last window update
+            std::uint32_t consumed{0};
+            bool reading{false};
+            bool scheduled{false};
+            bool remote_closed{false};
+            bool reset{false};
+            bool closing{false};
+        };
+
+        void do_read();
+        bool process_frames();
+        bool handle_frame(const MuxFrameHeader& header, std::span<const std::uint8_t> payload);
+        bool open_channel(const MuxFrameHeader& header);
+
+        void deliver(std::uint32_t mux_id, Channel& channel);
+        void credit(std::uint32_t mux_id, Channel& channel, std::size_t size);
+
+        void send_control(MuxFrameType type, std::uint16_t flags, std::uint32_t mux_id, std::uint32_t length);
+        void schedule(std::uint32_t mux_id, Channel& channel);
+        void request_flush();
+        void flush();
+
+        void protocol_error(const std::string& reason);
+        void close(const net::error_code& ec);
+
+        ssl_socket socket_;
+        StreamManagerPtr stream_manager_;
+        IdGenerator next_id_;
+        Options options_;
+        TlsSessionStatsPtr stats_;
+        asynclog::LoggerFactory logger_factory_;
+        asynclog::ScopedLogger logger_;
+        int id_;
+        std::string remote_address_;
+        std::string client_identity_;
+        ConnectionLease lease_;
+
+        std::unordered_map<std::uint32_t, Channel> channels_;
+        // Streams with data to send and send window left, in round-robin order
+        std::deque<std::uint32_t> ready_;
+
+        std::array<std::uint8_t, max_buffer_size> read_buffer_;
+        // Received bytes not forming a complete frame yet
+        IoBuffer rx_;
+        // Window updates, acknowledgements, pings and resets, sent ahead of stream data
+        IoBuffer control_;
+        IoBuffer tx_;
+        bool writing_{false};
+        bool flush_posted_{false};
+        // A go away frame was queued, the connection closes once it is sent
+        bool going_away_{false};
+        bool closed_{false};
+    };
+
+    using MuxConnectionPtr = std::shared_ptr<MuxConnection>;
+}
+
+#endif // MTLS_MPROXY_TRANSPORT_MUX_MUX_CONNECTION_H
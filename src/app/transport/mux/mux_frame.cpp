@@ -0,0 +1,55 @@
+#include "mux_frame.h"
+
+namespace
+{
+    void put_u16(std::uint16_t value, mtls_mproxy::IoBuffer& out)
+    {
+        out.push_back(static_cast<std::uint8_t>(value >> 8));
+        out.push_back(static_cast<std::uint8_t>(value));
+    }
+
+    void put_u32(std::uint32_t value, mtls_mproxy::IoBuffer& out)
+    {
+        put_u16(static_cast<std::uint16_t>(value >> 16), out);
+        put_u16(static_cast<std::uint16_t>(value), out);
+    }
+
+    std::uint16_t get_u16(const std::uint8_t* data)
+    {
+        return static_cast<std::uint16_t>((data[0] << 8) | data[1]);
+    }
+
+    std::uint32_t get_u32(const std::uint8_t* data)
+    {
+        return (static_cast<std::uint32_t>(get_u16(data)) << 16) | get_u16(data + 2);
+    }
+}
+
+namespace mtls_mproxy
+{
+    void encode_mux_header(const MuxFrameHeader& header, IoBuffer& out)
+    {
+        out.push_back(kMuxVersion);
+        out.push_back(static_cast<std::uint8_t>(header.type));
+        put_u16(header.flags, out);
+        put_u32(header.stream_id, out);
+        put_u32(header.length, out);
+    }
+
+    std::optional<MuxFrameHeader> decode_mux_header(std::span<const std::uint8_t> data)
+    {
+        if (data.size() < kMuxHeaderSize || data[0] != kMuxVersion)
+            return std::nullopt;
+
+        if (data[1] > static_cast<std::uint8_t>(MuxFrameType::kGoAway))
+            return std::nullopt;
+
+        MuxFrameHeader header;
+        header.type = static_cast<MuxFrameType>(data[1]);
+        header.flags = get_u16(data.data() + 2);
+        header.stream_id = get_u32(data.data() + 4);
+        header.length = get_u32(data.data() + 8);
+
+        return header;
+    }
+}
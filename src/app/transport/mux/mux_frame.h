@@ -0,0 +1,64 @@
+#ifndef MTLS_MPROXY_TRANSPORT_MUX_MUX_FRAME_H
+#define MTLS_MPROXY_TRANSPORT_MUX_MUX_FRAME_H
+
+#include "transport/io_buffer.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+
+namespace mtls_mproxy
+{
+    // Frame layout of the yamux protocol (github.com/hashicorp/yamux, spec.md): a 12 byte header of
+    // version, type, flags, stream id and length, all big endian, followed by the payload of data frames.
+    // Existing yamux client libraries can open streams over the mTLS connection as they are.
+
+    enum class MuxFrameType : std::uint8_t
+    {
+        kData = 0,
+        kWindowUpdate = 1,
+        kPing = 2,
+        kGoAway = 3
+    };
+
+    enum MuxFlags : std::uint16_t
+    {
+        kMuxSyn = 0x1,
+        kMuxAck = 0x2,
+        kMuxFin = 0x4,
+        kMuxRst = 0x8
+    };
+
+    enum class MuxGoAway : std::uint32_t
+    {
+        kNormal = 0,
+        kProtocolError = 1,
+        kInternalError = 2
+    };
+
+    struct MuxFrameHeader {
+        MuxFrameType type{MuxFrameType::kData};
+        std::uint16_t flags{0};
+        std::uint32_t stream_id{0};
+        // Payload size of data frames, window delta, ping value or go away code for the other types
+        std::uint32_t length{0};
+    };
+
+    constexpr std::size_t kMuxHeaderSize = 12;
+    constexpr std::uint8_t kMuxVersion = 0;
+    // Receive window every stream starts with, a larger one is announced by a window update
+    constexpr std::uint32_t kMuxInitialWindow = 256 * 1024;
+
+    // ALPN protocol id a client offers to speak the multiplexed protocol on the mTLS connection
+    constexpr std::string_view kMuxAlpnProtocol{"mproxy-mux"};
+
+    // Appends the encoded header to the buffer
+    void encode_mux_header(const MuxFrameHeader& header, IoBuffer& out);
+    // Decodes the header at the start of the data (at least kMuxHeaderSize bytes), nullopt if the
+    // version or the type is unknown
+    std::optional<MuxFrameHeader> decode_mux_header(std::span<const std::uint8_t> data);
+}
+
+#endif // MTLS_MPROXY_TRANSPORT_MUX_MUX_FRAME_H
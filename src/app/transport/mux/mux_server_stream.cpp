@@ -0,0 +1,57 @@
+#include "mux_server_stream.h"
+#include "mux_connection.h"
+
+namespace mtls_mproxy
+{
+    MuxServerStream::MuxServerStream(const StreamManagerPtr& ptr,
+                                     int id,
+                                     std::shared_ptr<MuxConnection> connection,
+                                     std::uint32_t mux_id)
+        : ServerStream{ptr, id}
+        , connection_{std::move(connection)}
+        , mux_id_{mux_id}
+    {
+    }
+
+    net::any_io_executor MuxServerStream::executor() { return connection_->executor(); }
+
+    void MuxServerStream::start()
+    {
+        connection_->start_stream(mux_id_);
+    }
+
+    void MuxServerStream::stop()
+    {
+        connection_->close_stream(mux_id_);
+    }
+
+    void MuxServerStream::read()
+    {
+        connection_->read_stream(mux_id_);
+    }
+
+    void MuxServerStream::write(IoBuffer event)
+    {
+        connection_->write_stream(mux_id_, std::move(event));
+    }
+
+    std::vector<std::uint8_t> MuxServerStream::udp_associate()
+    {
+        return {};
+    }
+
+    std::string MuxServerStream::remote_address()
+    {
+        return connection_->remote_address();
+    }
+
+    std::string MuxServerStream::client_identity()
+    {
+        return connection_->client_identity();
+    }
+
+    bool MuxServerStream::has_data_ready()
+    {
+        return connection_->has_data_ready(mux_id_);
+    }
+}
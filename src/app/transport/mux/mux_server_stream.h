@@ -0,0 +1,46 @@
+#ifndef MTLS_MPROXY_TRANSPORT_MUX_MUX_SERVER_STREAM_H
+#define MTLS_MPROXY_TRANSPORT_MUX_MUX_SERVER_STREAM_H
+
+#include "transport/server_stream.h"
+
+#include <cstdint>
+#include <memory>
+
+namespace mtls_mproxy
+{
+    class MuxConnection;
+
+    // Logical stream of a multiplexed mTLS connection. It is a handle only, buffers, flow control
+    // windows and scheduling belong to the connection.
+    class MuxServerStream final
+        : public ServerStream
+        , public std::enable_shared_from_this<MuxServerStream>
+    {
+    public:
+        MuxServerStream(const StreamManagerPtr& ptr,
+                        int id,
+                        std::shared_ptr<MuxConnection> connection,
+                        std::uint32_t mux_id);
+        ~MuxServerStream() override = default;
+
+        net::any_io_executor executor() override;
+
+        void start() override;
+        void stop() override;
+        void read() override;
+        void write(IoBuffer event) override;
+        std::vector<std::uint8_t> udp_associate() override;
+        std::string remote_address() override;
+        std::string client_identity() override;
+        bool has_data_ready() override;
+
+        // Stream id on the wire, the id() is unique among all sessions of the listener
+        [[nodiscard]] std::uint32_t mux_id() const { return mux_id_; }
+
+    private:
+        std::shared_ptr<MuxConnection> connection_;
+        std::uint32_t mux_id_;
+    };
+}
+
+#endif // MTLS_MPROXY_TRANSPORT_MUX_MUX_SERVER_STREAM_H
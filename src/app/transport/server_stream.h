@@ -1,11 +1,13 @@
 #ifndef MTLS_MPROXY_TRANSPORT_SERVER_STREAM_H
 #define MTLS_MPROXY_TRANSPORT_SERVER_STREAM_H
 
+#include "transport/connection_limiter.h"
 #include "transport/io_buffer.h"
 
 #include <asio/any_io_executor.hpp>
 
 #include <memory>
+#include <string>
 
 namespace mtls_mproxy
 {
@@ -31,12 +33,23 @@ namespace mtls_mproxy
         virtual void write(IoBuffer event) = 0;
         virtual std::vector<std::uint8_t> udp_associate() = 0;
 
+        // Address of the connected peer without port
+        virtual std::string remote_address() = 0;
+        // Authenticated peer identity (client certificate subject), empty for plain connections
+        virtual std::string client_identity() = 0;
+        // Client data is already received, the next read completes without waiting for the client
+        virtual bool has_data_ready() = 0;
+
         [[nodiscard]] int id() const { return id_; }
         StreamManagerPtr manager() { return stream_manager_; }
 
+        // Keeps the connection counted by the per peer limits until the stream is destroyed
+        void hold(ConnectionLease lease) { lease_ = std::move(lease); }
+
     private:
         StreamManagerPtr stream_manager_;
         int id_;
+        ConnectionLease lease_;
     };
 
     using ServerStreamPtr = std::shared_ptr<ServerStream>;
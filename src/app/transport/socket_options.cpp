@@ -0,0 +1,352 @@
+#include "socket_options.h"
+
+#include <asio/io_context.hpp>
+
+#include <cctype>
+#include <charconv>
+#include <format>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+#if defined(__linux__)
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
+
+namespace
+{
+    namespace net = asio;
+    using tcp = asio::ip::tcp;
+    using mtls_mproxy::SocketOptions;
+
+    std::optional<int> parse_int(std::string_view str)
+    {
+        int value{0};
+        const auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+        if (str.empty() || ec != std::errc{} || ptr != str.data() + str.size() || value < 0)
+            return std::nullopt;
+
+        return value;
+    }
+
+    // Byte counts take a K or M suffix
+    std::optional<int> parse_bytes(std::string_view str)
+    {
+        long long multiplier{1};
+        if (!str.empty()) {
+            switch (std::toupper(static_cast<unsigned char>(str.back()))) {
+            case 'K': multiplier = 1024; break;
+            case 'M': multiplier = 1024 * 1024; break;
+            default: break;
+            }
+            if (multiplier != 1)
+                str.remove_suffix(1);
+        }
+
+        const auto value = parse_int(str);
+        if (!value.has_value() || *value * multiplier > std::numeric_limits<int>::max())
+            return std::nullopt;
+
+        return static_cast<int>(*value * multiplier);
+    }
+
+    // 'on' or '<idle>/<interval>/<probes>' with the times in seconds
+    std::optional<SocketOptions::Keepalive> parse_keepalive(std::string_view str)
+    {
+        if (str == "on")
+            return SocketOptions::Keepalive{};
+
+        const auto first = str.find('/');
+        const auto second = first == std::string_view::npos ? first : str.find('/', first + 1);
+        if (second == std::string_view::npos)
+            return std::nullopt;
+
+        const auto idle = parse_int(str.substr(0, first));
+        const auto interval = parse_int(str.substr(first + 1, second - first - 1));
+        const auto probes = parse_int(str.substr(second + 1));
+        if (!idle.has_value() || !interval.has_value() || !probes.has_value())
+            return std::nullopt;
+
+        return SocketOptions::Keepalive{std::chrono::seconds{*idle}, std::chrono::seconds{*interval}, *probes};
+    }
+
+    bool parse_option(SocketOptions& options, std::string_view item)
+    {
+        const auto key_sep = item.find('=');
+        if (key_sep == std::string_view::npos)
+            return false;
+
+        const auto key = item.substr(0, key_sep);
+        const auto value = item.substr(key_sep + 1);
+        if (key == "nodelay" && (value == "on" || value == "off")) {
+            options.nodelay = value == "on";
+        } else if (key == "sndbuf" || key == "rcvbuf" || key == "notsent-lowat") {
+            const auto bytes = parse_bytes(value);
+            if (!bytes.has_value())
+                return false;
+            if (key == "sndbuf")
+                options.send_buffer = *bytes;
+            else if (key == "rcvbuf")
+                options.receive_buffer = *bytes;
+            else
+                options.notsent_lowat = *bytes;
+        } else if (key == "keepalive") {
+            options.keepalive = parse_keepalive(value);
+            return options.keepalive.has_value();
+        } else if (key == "congestion" && !value.empty()) {
+            options.congestion = value;
+        } else if (key == "user-timeout") {
+            const auto timeout = parse_int(value);
+            if (!timeout.has_value())
+                return false;
+            options.user_timeout = std::chrono::milliseconds{*timeout};
+        } else {
+            return false;
+        }
+
+        return true;
+    }
+
+    template <typename Socket>
+    void apply_buffer_sizes(Socket& socket, const SocketOptions& options, std::vector<std::string>& unsupported)
+    {
+        net::error_code ec;
+        if (options.send_buffer > 0) {
+            socket.set_option(net::socket_base::send_buffer_size{options.send_buffer}, ec);
+            if (ec)
+                unsupported.emplace_back("SO_SNDBUF");
+        }
+
+        if (options.receive_buffer > 0) {
+            socket.set_option(net::socket_base::receive_buffer_size{options.receive_buffer}, ec);
+            if (ec)
+                unsupported.emplace_back("SO_RCVBUF");
+        }
+    }
+
+    template <typename Socket>
+    std::vector<std::string> apply_tcp_options(Socket& socket, const SocketOptions& options)
+    {
+        std::vector<std::string> unsupported;
+        apply_buffer_sizes(socket, options, unsupported);
+
+        net::error_code ec;
+        if (options.nodelay.has_value()) {
+            socket.set_option(tcp::no_delay{*options.nodelay}, ec);
+            if (ec)
+                unsupported.emplace_back("TCP_NODELAY");
+        }
+
+        if (options.keepalive.has_value()) {
+            socket.set_option(net::socket_base::keep_alive{true}, ec);
+            if (ec)
+                unsupported.emplace_back("SO_KEEPALIVE");
+        }
+
+#if defined(__linux__)
+        const auto fd = socket.native_handle();
+        const auto set = [fd, &unsupported](int name, int value, const char* label) {
+            if (::setsockopt(fd, IPPROTO_TCP, name, &value, sizeof(value)) != 0)
+                unsupported.emplace_back(label);
+        };
+
+        if (options.keepalive.has_value()) {
+            const auto& keepalive = *options.keepalive;
+            if (keepalive.idle.count() > 0)
+                set(TCP_KEEPIDLE, static_cast<int>(keepalive.idle.count()), "TCP_KEEPIDLE");
+            if (keepalive.interval.count() > 0)
+                set(TCP_KEEPINTVL, static_cast<int>(keepalive.interval.count()), "TCP_KEEPINTVL");
+            if (keepalive.probes > 0)
+                set(TCP_KEEPCNT, keepalive.probes, "TCP_KEEPCNT");
+        }
+
+        if (options.notsent_lowat > 0)
+            set(TCP_NOTSENT_LOWAT, options.notsent_lowat, "TCP_NOTSENT_LOWAT");
+        if (options.user_timeout.count() > 0)
+            set(TCP_USER_TIMEOUT, static_cast<int>(options.user_timeout.count()), "TCP_USER_TIMEOUT");
+
+        // Fails for algorithms the kernel has not loaded or does not allow unprivileged processes
+        if (!options.congestion.empty() &&
+            ::setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, options.congestion.data(),
+                         static_cast<socklen_t>(options.congestion.size())) != 0)
+            unsupported.emplace_back("TCP_CONGESTION " + options.congestion);
+#else
+        if (options.keepalive.has_value() &&
+            (options.keepalive->idle.count() > 0 || options.keepalive->interval.count() > 0 || options.keepalive->probes > 0))
+            unsupported.emplace_back("keepalive timing");
+        if (options.notsent_lowat > 0)
+            unsupported.emplace_back("TCP_NOTSENT_LOWAT");
+        if (options.user_timeout.count() > 0)
+            unsupported.emplace_back("TCP_USER_TIMEOUT");
+        if (!options.congestion.empty())
+            unsupported.emplace_back("TCP_CONGESTION " + options.congestion);
+#endif
+
+        return unsupported;
+    }
+
+    void connect_from(tcp::socket& socket,
+                      tcp::resolver::results_type endpoints,
+                      tcp::resolver::results_type::const_iterator endpoint,
+                      SocketOptions options,
+                      net::error_code last_error,
+                      mtls_mproxy::ConnectHandler handler)
+    {
+        for (; endpoint != endpoints.end(); ++endpoint) {
+            net::error_code ec;
+            socket.close(ec);
+            socket.open(endpoint->endpoint().protocol(), ec);
+            if (ec) {
+                last_error = ec;
+                continue;
+            }
+
+            mtls_mproxy::apply_socket_options(socket, options);
+            socket.async_connect(
+                endpoint->endpoint(),
+                [&socket, endpoints, endpoint, options{std::move(options)}, handler{std::move(handler)}](const net::error_code& ec) mutable {
+                    if (!ec || ec == net::error::operation_aborted || !socket.is_open()) {
+                        handler(ec && !socket.is_open() ? net::error::operation_aborted : ec, endpoint->endpoint());
+                        return;
+                    }
+
+                    const auto next = std::next(endpoint);
+                    connect_from(socket, std::move(endpoints), next, std::move(options), ec, std::move(handler));
+                });
+            return;
+        }
+
+        handler(last_error ? last_error : net::error_code{net::error::not_found}, tcp::endpoint{});
+    }
+}
+
+namespace mtls_mproxy
+{
+    bool SocketOptions::empty() const
+    {
+        return !nodelay.has_value() && send_buffer == 0 && receive_buffer == 0 && notsent_lowat == 0 &&
+               !keepalive.has_value() && congestion.empty() && user_timeout.count() == 0;
+    }
+
+    std::vector<std::string> apply_socket_options(tcp::socket& socket, const SocketOptions& options)
+    {
+        if (options.empty())
+            return {};
+
+        return apply_tcp_options(socket, options);
+    }
+
+    std::vector<std::string> apply_socket_options(tcp::acceptor& acceptor, const SocketOptions& options)
+    {
+        if (options.empty())
+            return {};
+
+        return apply_tcp_options(acceptor, options);
+    }
+
+    std::vector<std::string> apply_socket_options(udp::socket& socket, const SocketOptions& options)
+    {
+        std::vector<std::string> unsupported;
+        apply_buffer_sizes(socket, options, unsupported);
+        return unsupported;
+    }
+
+    std::vector<std::string> probe_socket_options(const SocketOptions& options)
+    {
+        net::io_context ctx;
+        tcp::socket socket{ctx};
+        net::error_code ec;
+        socket.open(tcp::v4(), ec);
+        if (ec)
+            return {};
+
+        return apply_socket_options(socket, options);
+    }
+
+    void connect_with_options(tcp::socket& socket,
+                              tcp::resolver::results_type endpoints,
+                              SocketOptions options,
+                              ConnectHandler handler)
+    {
+        const auto begin = endpoints.begin();
+        connect_from(socket, std::move(endpoints), begin, std::move(options), {}, std::move(handler));
+    }
+
+    SocketProfiles read_socket_profiles(const std::filesystem::path& path,
+                                        std::string_view mode,
+                                        std::string_view port)
+    {
+        std::ifstream file{path};
+        if (!file)
+            throw std::runtime_error{"can't open socket profiles file: " + path.string()};
+
+        struct Selection {
+            std::string profile;
+            std::size_t line_no{0};
+            // 0 - any listener, 1 - the mode, 2 - the listen port
+            int rank{-1};
+        };
+
+        std::map<std::string, SocketOptions, std::less<>> profiles;
+        Selection downstream;
+        Selection upstream;
+
+        std::string line;
+        for (std::size_t line_no = 1; std::getline(file, line); ++line_no) {
+            if (const auto comment = line.find('#'); comment != std::string::npos)
+                line.erase(comment);
+
+            std::istringstream fields{line};
+            std::string kind, name;
+            if (!(fields >> kind))
+                continue;
+
+            if (kind == "profile" && fields >> name) {
+                SocketOptions options;
+                std::string item;
+                bool valid{true};
+                while (valid && fields >> item)
+                    valid = parse_option(options, item);
+
+                if (valid) {
+                    profiles[name] = std::move(options);
+                    continue;
+                }
+            } else if ((kind == "downstream" || kind == "upstream") && fields >> name) {
+                std::string scope, extra;
+                fields >> scope >> extra;
+                if (extra.empty()) {
+                    const int rank = scope.empty() ? 0 : scope == port ? 2 : scope == mode ? 1 : -1;
+                    auto& selection = kind == "downstream" ? downstream : upstream;
+                    if (rank >= 0 && rank >= selection.rank)
+                        selection = {name, line_no, rank};
+                    continue;
+                }
+            }
+
+            throw std::runtime_error{std::format("{}:{}: expected 'profile <name> <option>=<value>...' or "
+                                                 "'<downstream|upstream> <profile> [<mode>|<port>]'",
+                                                 path.string(), line_no)};
+        }
+
+        SocketProfiles selected;
+        for (auto [selection, options] : {std::pair{&downstream, &selected.downstream},
+                                          std::pair{&upstream, &selected.upstream}}) {
+            if (selection->rank < 0)
+                continue;
+
+            const auto profile = profiles.find(selection->profile);
+            if (profile == profiles.end()) {
+                throw std::runtime_error{std::format("{}:{}: unknown socket profile '{}'",
+                                                     path.string(), selection->line_no, selection->profile)};
+            }
+            *options = profile->second;
+        }
+
+        return selected;
+    }
+}
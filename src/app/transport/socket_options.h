@@ -0,0 +1,84 @@
+#ifndef MTLS_MPROXY_TRANSPORT_SOCKET_OPTIONS_H
+#define MTLS_MPROXY_TRANSPORT_SOCKET_OPTIONS_H
+
+#include <asio/ip/tcp.hpp>
+#include <asio/ip/udp.hpp>
+
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace mtls_mproxy
+{
+    namespace net = asio;
+    using tcp = asio::ip::tcp;
+    using udp = asio::ip::udp;
+
+    // Socket option profile, unset options keep the system defaults
+    struct SocketOptions {
+        // Keepalive probing of an idle connection, zero values keep the system defaults
+        struct Keepalive {
+            std::chrono::seconds idle{0};
+            std::chrono::seconds interval{0};
+            int probes{0};
+        };
+
+        std::optional<bool> nodelay;
+        // SO_SNDBUF and SO_RCVBUF in bytes, 0 - kernel autotuning
+        int send_buffer{0};
+        int receive_buffer{0};
+        // Unsent bytes queued in the kernel before the socket stops being writable (TCP_NOTSENT_LOWAT),
+        // 0 - unlimited. Keeps relayed data in the proxy buffers where flow control sees it.
+        int notsent_lowat{0};
+        std::optional<Keepalive> keepalive;
+        // Congestion control algorithm (TCP_CONGESTION), e.g. bbr or cubic
+        std::string congestion;
+        // Unacknowledged data older than this fails the connection (TCP_USER_TIMEOUT), 0 - disabled
+        std::chrono::milliseconds user_timeout{0};
+
+        [[nodiscard]] bool empty() const;
+    };
+
+    // Sets the options on a socket. Options the system rejects are skipped, their names are returned for
+    // a warning. A UDP socket only takes the buffer sizes. Options set on a listener before it listens
+    // also shape the connections it accepts, the window scale of a connection follows the receive buffer
+    // it had at the handshake.
+    std::vector<std::string> apply_socket_options(tcp::socket& socket, const SocketOptions& options);
+    std::vector<std::string> apply_socket_options(tcp::acceptor& acceptor, const SocketOptions& options);
+    std::vector<std::string> apply_socket_options(udp::socket& socket, const SocketOptions& options);
+
+    // Sets the options on a scratch socket, returns the names of those the system does not support
+    std::vector<std::string> probe_socket_options(const SocketOptions& options);
+
+    using ConnectHandler = std::function<void(const net::error_code& ec, const tcp::endpoint& endpoint)>;
+
+    // Connects to the first endpoint that accepts like net::async_connect, but sets the options on each
+    // socket before its connect. The handler gets operation_aborted if the socket is closed meanwhile.
+    void connect_with_options(tcp::socket& socket,
+                              tcp::resolver::results_type endpoints,
+                              SocketOptions options,
+                              ConnectHandler handler);
+
+    // Profiles selected for a listener
+    struct SocketProfiles {
+        // The listening socket and the connections it accepts
+        SocketOptions downstream;
+        // Connections to the targets, backends or the remote mproxy
+        SocketOptions upstream;
+    };
+
+    // Reads named profiles and selects the downstream and upstream ones of the listener, throws if the
+    // file can't be read or has errors:
+    //   profile <name> <option>=<value>...
+    //   <downstream|upstream> <profile> [<mode>|<port>]
+    // A selection for the listen port wins over one for the mode, which wins over one for any listener.
+    SocketProfiles read_socket_profiles(const std::filesystem::path& path,
+                                        std::string_view mode,
+                                        std::string_view port);
+}
+
+#endif // MTLS_MPROXY_TRANSPORT_SOCKET_OPTIONS_H
@@ -3,6 +3,8 @@
 
 #include "server_stream.h"
 #include "client_stream.h"
+#include "flow_control.h"
+#include "socket_options.h"
 
 namespace mtls_mproxy
 {
@@ -32,6 +34,19 @@ namespace mtls_mproxy
         virtual void connect(int id, std::string host, std::string service) = 0;
 
         virtual std::vector<std::uint8_t> udp_associate(int id) = 0;
+
+        // Watermarks of the data a stream buffers for its socket, taken by the streams of the manager.
+        // A stream holds back on_write above the high watermark and sends it when the buffer has drained
+        // to the low watermark, the session does not read the producing stream in between.
+        virtual FlowControl flow_control() const = 0;
+        // Socket profile of the upstream connections the streams of the manager open
+        virtual const SocketOptions& upstream_socket_options() const = 0;
+
+        // Live sessions of the manager, the listener stops admitting new ones at its session limit
+        virtual std::size_t live_sessions() const = 0;
+        // Refusal sent on a connection rejected under overload before it is closed, empty if the protocol
+        // has none and the connection is reset
+        virtual std::vector<std::uint8_t> overload_reply() const = 0;
     };
 
     using StreamManagerPtr = std::shared_ptr<StreamManager>;
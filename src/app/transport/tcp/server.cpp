@@ -1,18 +1,31 @@
 #include "server.h"
 #include "tcp_server_stream.h"
 
+#include <algorithm>
 #include <charconv>
+#include <format>
 #include <memory>
 
 namespace mtls_mproxy
 {
-    Server::Server(const std::string& port, StreamManagerPtr proxy_backend, asynclog::LoggerFactory logger_factory)
+    Server::Server(const std::string& port,
+                   StreamManagerPtr proxy_backend,
+                   asynclog::LoggerFactory logger_factory,
+                   UdpBatchOptions udp_batch,
+                   AdmissionControl::Options admission,
+                   ConnectionLimiterPtr limiter,
+                   ListenerOptions listener)
         : signals_(ctx_)
         , acceptor_(ctx_)
         , stream_manager_(proxy_backend)
         , logger_factory_{logger_factory}
         , logger_{logger_factory.create("tcp_server")}
         , stream_id_(0)
+        , udp_batch_{udp_batch}
+        , admission_{admission}
+        , accept_timer_{ctx_}
+        , limiter_{std::move(limiter)}
+        , listener_{listener}
     {
         configure_signals();
         async_wait_signals();
@@ -21,10 +34,8 @@ namespace mtls_mproxy
         std::from_chars(port.data(), port.data() + port.size(), listen_port);
 
         tcp::endpoint ep{tcp::endpoint(tcp::v4(), listen_port)};
-        acceptor_.open(ep.protocol());
-        acceptor_.set_option(tcp::acceptor::reuse_address(true));
-        acceptor_.bind(ep);
-        acceptor_.listen();
+        for (const auto& option : open_listener(acceptor_, ep, listener_))
+            logger_.warn(std::format("{} is not supported, listener starts without it", option));
 
         logger_.info("proxy server starts on port: " + port);
         start_accept();
@@ -47,6 +58,7 @@ namespace mtls_mproxy
             [this](net::error_code /*ec*/, int /*signno*/) {
             logger_.info("proxy server stopping");
             acceptor_.close();
+            accept_timer_.cancel();
             ctx_.stop();
             logger_.info("proxy server stopped");
         });
@@ -54,9 +66,68 @@ namespace mtls_mproxy
 
     void Server::start_accept()
     {
-        tcp::socket socket{ctx_.get_executor()};
+        while (!held_.empty()) {
+            const auto delay = admission_.accept_delay(stream_manager_->live_sessions());
+            if (delay > AdmissionControl::Clock::duration::zero() || !admission_.admit(stream_manager_->live_sessions())) {
+                pause_accept(delay > AdmissionControl::Clock::duration::zero() ? delay : AdmissionControl::kPauseInterval);
+                return;
+            }
+
+            auto held = std::move(held_.front());
+            held_.pop_front();
+            open_stream(std::move(held.socket), std::move(held.lease));
+        }
+
+        // Every outstanding accept has to find room for its connection
+        const auto accepts = std::min(listener_.accepts, admission_.accept_headroom(stream_manager_->live_sessions()));
+        if (accepts == 0) {
+            pause_accept(AdmissionControl::kPauseInterval);
+            return;
+        }
+
+        while (accepts_in_flight_ < accepts) {
+            const auto delay = admission_.accept_delay(stream_manager_->live_sessions());
+            if (delay > AdmissionControl::Clock::duration::zero()) {
+                pause_accept(delay);
+                return;
+            }
+
+            if (accept_paused_) {
+                accept_paused_ = false;
+                logger_.info("proxy server accepting resumed");
+            }
+
+            accept();
+        }
+    }
+
+    void Server::pause_accept(AdmissionControl::Clock::duration delay)
+    {
+        if (!accept_paused_) {
+            accept_paused_ = true;
+            logger_.warn(std::format("proxy server overloaded, accepting paused, live sessions {}",
+                                     stream_manager_->live_sessions()));
+        }
+
+        // One timer tops the outstanding accepts up again
+        if (accept_timer_armed_)
+            return;
+
+        accept_timer_armed_ = true;
+        accept_timer_.expires_after(delay);
+        accept_timer_.async_wait([this](const net::error_code& ec) {
+            accept_timer_armed_ = false;
+            if (!ec)
+                start_accept();
+        });
+    }
+
+    void Server::accept()
+    {
+        ++accepts_in_flight_;
         acceptor_.async_accept(
             [this](const net::error_code& ec, tcp::socket socket) {
+                --accepts_in_flight_;
                 if (!acceptor_.is_open()) {
                     logger_.debug("proxy server acceptor is closed");
                     if (ec)
@@ -65,19 +136,55 @@ namespace mtls_mproxy
                     return;
                 }
 
+                if (ec == net::error::no_descriptors || ec == std::errc::too_many_files_open_in_system) {
+                    logger_.warn("proxy server error: " + ec.message());
+                    admission_.on_descriptors_exhausted();
+                }
+
                 if (!ec) {
-                    auto new_stream = TcpServerStream::create(
-                        stream_manager_,
-                        ++stream_id_,
-                        std::move(socket),
-                        logger_factory_);
-                    stream_manager_->on_accept(std::move(new_stream));
+                    ConnectionLease lease;
+                    net::error_code remote_ec;
+                    const auto remote = socket.remote_endpoint(remote_ec);
+                    if (limiter_ && !remote_ec && !limiter_->admit_source(lease, remote.address())) {
+                        admission_.reject(socket, {});
+                        logger_.debug(std::format("connection from {} rejected, source over its limits ({} rejected)",
+                                                  remote.address().to_string(), limiter_->rejected()));
+                    } else {
+                        admit(std::move(socket), std::move(lease));
+                    }
                 }
 
                 start_accept();
             });
     }
 
+    void Server::admit(tcp::socket socket, ConnectionLease lease)
+    {
+        if (held_.empty() && admission_.admit(stream_manager_->live_sessions())) {
+            open_stream(std::move(socket), std::move(lease));
+        } else if (admission_.options().action == OverloadAction::pause) {
+            // Waits like the connections still in the backlog, in order
+            held_.push_back({std::move(socket), std::move(lease)});
+        } else {
+            admission_.reject(socket, stream_manager_->overload_reply());
+            logger_.debug(std::format("connection rejected, proxy server overloaded ({} rejected)",
+                                      admission_.rejected()));
+        }
+    }
+
+    void Server::open_stream(tcp::socket socket, ConnectionLease lease)
+    {
+        apply_socket_options(socket, listener_.sockets);
+        auto new_stream = TcpServerStream::create(
+            stream_manager_,
+            ++stream_id_,
+            std::move(socket),
+            logger_factory_,
+            udp_batch_);
+        new_stream->hold(std::move(lease));
+        stream_manager_->on_accept(std::move(new_stream));
+    }
+
     Server::~Server()
     {
         logger_.debug("proxy server stopped");
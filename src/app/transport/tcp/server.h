@@ -1,14 +1,20 @@
 #ifndef MTLS_MPROXY_TRANSPORT_SERVER_H
 #define MTLS_MPROXY_TRANSPORT_SERVER_H
 
+#include "transport/admission_control.h"
+#include "transport/listener.h"
 #include "transport/stream_manager.h"
+#include "transport/udp_batch.h"
 
 #include <asio/io_context.hpp>
 #include <asio/ip/tcp.hpp>
 #include <asio/signal_set.hpp>
+#include <asio/steady_timer.hpp>
 
 #include <asynclog/logger_factory.h>
 
+#include <deque>
+
 namespace mtls_mproxy
 {
     using tcp = asio::ip::tcp;
@@ -16,13 +22,22 @@ namespace mtls_mproxy
 
     class Server {
     public:
-        explicit Server(const std::string& port, StreamManagerPtr proxy_backend, asynclog::LoggerFactory logger_factory);
+        Server(const std::string& port,
+               StreamManagerPtr proxy_backend,
+               asynclog::LoggerFactory logger_factory,
+               UdpBatchOptions udp_batch = {},
+               AdmissionControl::Options admission = {},
+               ConnectionLimiterPtr limiter = nullptr,
+               ListenerOptions listener = {});
         virtual ~Server();
 
         Server(const Server& other) = delete;
         Server& operator=(const Server& other) = delete;
 
         void run();
+
+        net::any_io_executor executor() { return ctx_.get_executor(); }
+
     private:
         net::io_context ctx_;
         net::signal_set signals_;
@@ -31,11 +46,35 @@ namespace mtls_mproxy
         asynclog::LoggerFactory logger_factory_;
         asynclog::ScopedLogger logger_;
         int stream_id_;
+        // Batching of the SOCKS5 UDP associate sockets of the accepted connections
+        UdpBatchOptions udp_batch_;
+        AdmissionControl admission_;
+        // Retries a paused accept
+        net::steady_timer accept_timer_;
+        bool accept_paused_{false};
+        bool accept_timer_armed_{false};
+        // nullptr if no per peer limits are set
+        ConnectionLimiterPtr limiter_;
+        ListenerOptions listener_;
+        std::size_t accepts_in_flight_{0};
+
+        struct HeldConnection {
+            tcp::socket socket;
+            ConnectionLease lease;
+        };
+        // Connections accepted over the limits with the pause action, admitted before any new accept
+        std::deque<HeldConnection> held_;
 
         void configure_signals();
         void async_wait_signals();
 
+        // Tops the outstanding accepts up to the configured number unless the admission control pauses
         void start_accept();
+        void pause_accept(AdmissionControl::Clock::duration delay);
+        void accept();
+        // Opens the session of an accepted connection, rejects or holds it if it isn't admitted
+        void admit(tcp::socket socket, ConnectionLease lease);
+        void open_stream(tcp::socket socket, ConnectionLease lease);
     };
 }
 
@@ -5,19 +5,17 @@
 #include "transport/stream_manager.h"
 #include "auxiliary/helpers.h"
 
+#include <asio/post.hpp>
 #include <asio/write.hpp>
 
+#include <utility>
+
 namespace
 {
     namespace net = asio;
     using tcp = asio::ip::tcp;
     using udp = asio::ip::udp;
 
-    constexpr std::uint8_t ATYPE_IPv4 = 0x01;
-    constexpr std::uint8_t ATYPE_DOMAIN = 0x03;
-    constexpr std::uint8_t ATYPE_IPv6 = 0x04;
-    constexpr std::size_t SOCKS5_UDP_HEADER_SIZE = 0x04;
-
     std::string ep_to_str(const tcp::socket& sock)
     {
         if (!sock.is_open())
@@ -38,24 +36,26 @@ namespace mtls_mproxy
     TcpServerStream::TcpServerStream(const StreamManagerPtr& ptr,
                                      int id,
                                      tcp::socket&& socket,
-                                     const asynclog::LoggerFactory& log_factory)
+                                     const asynclog::LoggerFactory& log_factory,
+                                     UdpBatchOptions udp_batch)
         : ServerStream{ptr, id}
         , socket_{std::move(socket)}
         , executor_{socket_.get_executor()}
         , logger_{log_factory.create("tcp_server_stream")}
         , read_buffer_{}
-        , write_buffer_{}
-        , udp_read_buffer_{}
+        , budget_{ptr->flow_control()}
+        , udp_batch_{udp_batch}
     {
     }
 
     std::shared_ptr<TcpServerStream> TcpServerStream::create(const StreamManagerPtr& ptr,
                                                              int id,
                                                              tcp::socket&& socket,
-                                                             const asynclog::LoggerFactory& log_factory)
+                                                             const asynclog::LoggerFactory& log_factory,
+                                                             UdpBatchOptions udp_batch)
     {
         return std::shared_ptr<TcpServerStream>(
-            new TcpServerStream(ptr, id, std::move(socket), log_factory));
+            new TcpServerStream(ptr, id, std::move(socket), log_factory, udp_batch));
     }
 
     TcpServerStream::~TcpServerStream()
@@ -75,10 +75,31 @@ namespace mtls_mproxy
 
     void TcpServerStream::stop()
     {
-        net::error_code ignored_ec;
-        socket_.shutdown(tcp::socket::shutdown_both, ignored_ec);
         if (udp_socket_.has_value())
             udp_socket_.value().close();
+
+        // Relayed data still buffered goes out before the shutdown, as long as the peer reads it
+        if (wip_) {
+            if (!stopping_) {
+                stopping_ = true;
+                drain_timer_.emplace(executor_);
+                drain_timer_->expires_after(budget_.limits().drain_timeout);
+                drain_timer_->async_wait([this, self{shared_from_this()}](const net::error_code& ec) {
+                    if (!ec && stopping_) {
+                        logger_.debug(std::format("[{}] buffered data not drained in time, closing", id()));
+                        net::error_code ignored_ec;
+                        socket_.close(ignored_ec);
+                    }
+                });
+            }
+            return;
+        }
+
+        if (drain_timer_.has_value())
+            drain_timer_->cancel();
+
+        net::error_code ignored_ec;
+        socket_.shutdown(tcp::socket::shutdown_both, ignored_ec);
     }
 
     void TcpServerStream::write(IoBuffer event)
@@ -95,19 +116,8 @@ namespace mtls_mproxy
                 read();
             }
         } else {
-            IoBuffer packet{};
-
-            const auto client_addr_bytes = aux::endpoint_to_bytes(sender_ep_);
-            const auto udp_reply_hdr_size = client_addr_bytes.size() + SOCKS5_UDP_HEADER_SIZE;
-
-            packet.resize(udp_reply_hdr_size + event.size());
-            packet[0] = packet[1] = packet[2] = 0;
-            packet[3] = sender_ep_.address().is_v4() ? ATYPE_IPv4 : ATYPE_IPv6;
-
-            std::ranges::copy(client_addr_bytes, packet.data() + SOCKS5_UDP_HEADER_SIZE);
-            std::ranges::copy(event, packet.data() + udp_reply_hdr_size);
-
-            udp_write_queue_.emplace(std::move(packet));
+            // The datagram already starts with its SOCKS5 header
+            udp_write_queue_.push_back({std::move(event), sender_ep_});
 
             write_udp();
         }
@@ -117,9 +127,29 @@ namespace mtls_mproxy
     {
         udp::endpoint udp_bind_request_ep{socket_.local_endpoint().address(), 0};
         udp_socket_ = udp::socket(socket_.get_executor(), udp_bind_request_ep);
+        if (udp_batch_.offload)
+            udp_offload_ = enable_udp_offload(*udp_socket_);
         return aux::endpoint_to_bytes(udp_socket_->local_endpoint());
     }
 
+    std::string TcpServerStream::remote_address()
+    {
+        net::error_code ec;
+        const auto rep = socket_.remote_endpoint(ec);
+        return ec ? std::string{} : rep.address().to_string();
+    }
+
+    std::string TcpServerStream::client_identity()
+    {
+        return {};
+    }
+
+    bool TcpServerStream::has_data_ready()
+    {
+        net::error_code ec;
+        return socket_.available(ec) > 0 && !ec;
+    }
+
     void TcpServerStream::read()
     {
         if (!is_udp_enabled()) {
@@ -141,65 +171,151 @@ namespace mtls_mproxy
     // +---- + ------ + ------ + ---------- + -------- + ---------- +
     void TcpServerStream::write_udp()
     {
-        if (udp_write_queue_.empty())
+        if (udp_write_queue_.empty() || udp_write_in_progress_)
             return;
 
-        if (udp_write_in_progress_)
-            return;
-
-        const auto& packet = udp_write_queue_.front();
+        // Deferred, so the replies to a whole received batch leave in one send call
         udp_write_in_progress_ = true;
+        net::post(executor_, [this, self{shared_from_this()}]() { flush_udp(); });
+    }
 
-        (*udp_socket_).async_send_to(
-            net::buffer(packet.data(), packet.size()), sender_ep_,
-                [this, self{shared_from_this()}](const net::error_code& ec, std::size_t bytes_sent) {
-                    if (!ec) {
-                        udp_write_queue_.pop();
-                        udp_write_in_progress_ = false;
-                        manager()->on_write(self);
-                        if (!udp_write_queue_.empty())
-                            write_udp();
-                    }
-                    else {
-                        handle_error(ec);
-                    }
-                });
+    void TcpServerStream::flush_udp()
+    {
+        while (!udp_write_queue_.empty()) {
+            net::error_code ec;
+            const auto sent = send_batch(*udp_socket_, udp_write_queue_, udp_batch_.send_batch, udp_offload_, ec);
+            if (ec == net::error::would_block) {
+                udp_socket_->async_wait(
+                    udp::socket::wait_write,
+                    [this, self{shared_from_this()}](const net::error_code& ec) {
+                        if (!ec)
+                            flush_udp();
+                        else
+                            handle_error(ec);
+                    });
+                return;
+            }
+
+            if (ec) {
+                handle_error(ec);
+                return;
+            }
+
+            for (std::size_t i = 0; i < sent; ++i)
+                recycle_datagram_buffer(std::move(udp_write_queue_[i].data));
+            udp_write_queue_.erase(udp_write_queue_.begin(), udp_write_queue_.begin() + sent);
+        }
+
+        udp_write_in_progress_ = false;
+        manager()->on_write(shared_from_this());
     }
 
     void TcpServerStream::write_tcp(IoBuffer buffer)
     {
-        if (wip_) {
-            logger_.debug(std::format("[{}] write in progress", id()));
-            return;
-        }
+        const auto size = buffer.size();
+        if (pending_.empty())
+            pending_.swap(buffer);
+        else
+            pending_.insert(pending_.end(), buffer.begin(), buffer.end());
+
+        if (!wip_)
+            flush_tcp();
+
+        if (budget_.queue(size))
+            net::post(executor_, [this, self{shared_from_this()}]() { manager()->on_write(self); });
+    }
+
+    void TcpServerStream::flush_tcp()
+    {
+        in_flight_.swap(pending_);
+        pending_.clear();
         wip_ = true;
-        std::ranges::copy(buffer, write_buffer_.begin());
+
         net::async_write(
-            socket_, net::buffer(write_buffer_, buffer.size()),
+            socket_, net::buffer(in_flight_),
             [this, self{shared_from_this()}](const net::error_code& ec, size_t) {
-                if (!ec) {
-                    wip_ = false;
-                    manager()->on_write(self);
-                } else
+                wip_ = false;
+                if (ec) {
+                    if (stopping_) {
+                        net::error_code ignored_ec;
+                        socket_.close(ignored_ec);
+                        return;
+                    }
                     handle_error(ec);
+                    return;
+                }
+
+                const auto resume = budget_.drain(in_flight_.size());
+                if (!pending_.empty())
+                    flush_tcp();
+
+                if (resume)
+                    manager()->on_write(self);
+
+                if (stopping_ && !wip_) {
+                    stopping_ = false;
+                    stop();
+                }
             });
     }
 
     void TcpServerStream::read_udp()
     {
-        (*udp_socket_).async_receive_from(
-            net::buffer(udp_read_buffer_), sender_ep_,
-            [this, self{shared_from_this()}](const net::error_code& ec, const size_t length)
-            {
-                if (!ec) {
-                    uint8_t* data = udp_read_buffer_.data();
-                    IoBuffer event(udp_read_buffer_.data(), udp_read_buffer_.data() + length);
-                    manager()->on_read(std::move(event), self);
-                }
-                else {
-                    handle_error(ec);
-                }
-            });
+        if (udp_dispatching_) {
+            udp_read_requested_ = true;
+            return;
+        }
+
+        if (udp_read_in_progress_)
+            return;
+
+        // Completions never run inside read(), the caller may not be ready for them yet
+        udp_read_in_progress_ = true;
+        net::post(executor_, [this, self{shared_from_this()}]() { receive_udp(); });
+    }
+
+    // The socket is drained before waiting, the reactor only reports new datagrams
+    void TcpServerStream::receive_udp()
+    {
+        net::error_code ec;
+        auto& batch = thread_receive_batch(udp_batch_);
+        const auto count = batch.receive(*udp_socket_, ec);
+        if (ec == net::error::would_block) {
+            udp_socket_->async_wait(
+                udp::socket::wait_read,
+                [this, self{shared_from_this()}](const net::error_code& ec) {
+                    if (!ec) {
+                        receive_udp();
+                    } else {
+                        udp_read_in_progress_ = false;
+                        handle_error(ec);
+                    }
+                });
+            return;
+        }
+
+        udp_read_in_progress_ = false;
+        if (ec) {
+            handle_error(ec);
+            return;
+        }
+
+        const auto self{shared_from_this()};
+        udp_dispatching_ = true;
+        for (std::size_t i = 0; i < count; ++i) {
+            sender_ep_ = batch.sender(i);
+            const auto data = batch.data(i);
+            auto buffer = take_datagram_buffer();
+            buffer.assign(data.begin(), data.end());
+            manager()->on_read(std::move(buffer), self);
+        }
+        udp_dispatching_ = false;
+
+        // Other sessions get their turn before the next batch
+        if (std::exchange(udp_read_requested_, false)) {
+            udp_read_in_progress_ = true;
+            net::post(executor_, [this, self]() { receive_udp(); });
+        }
     }
 
     void TcpServerStream::read_tcp()
@@ -2,13 +2,16 @@
 #define MTLS_MPROXY_TRANSPORT_TCP_SERVER_STREAM_H
 
 #include "transport/server_stream.h"
+#include "transport/flow_control.h"
+#include "transport/udp_batch.h"
 
 #include <asynclog/logger_factory.h>
 
 #include <asio/ip/tcp.hpp>
 #include <asio/ip/udp.hpp>
+#include <asio/steady_timer.hpp>
 
-#include <queue>
+#include <optional>
 
 namespace mtls_mproxy
 {
@@ -25,7 +28,8 @@ namespace mtls_mproxy
         static std::shared_ptr<TcpServerStream> create(const StreamManagerPtr& ptr,
                                                        int id,
                                                        tcp::socket&& socket,
-                                                       const asynclog::LoggerFactory& log_factory);
+                                                       const asynclog::LoggerFactory& log_factory,
+                                                       UdpBatchOptions udp_batch = {});
         ~TcpServerStream() override;
 
         void start() override;
@@ -33,6 +37,9 @@ namespace mtls_mproxy
         void read() override;
         void write(IoBuffer event) override;
         std::vector<std::uint8_t> udp_associate() override;
+        std::string remote_address() override;
+        std::string client_identity() override;
+        bool has_data_ready() override;
 
         net::any_io_executor executor() override;
 
@@ -40,16 +47,20 @@ namespace mtls_mproxy
         TcpServerStream(const StreamManagerPtr& ptr,
                         int id,
                         tcp::socket&& socket,
-                        const asynclog::LoggerFactory& log_factory);
+                        const asynclog::LoggerFactory& log_factory,
+                        UdpBatchOptions udp_batch);
 
 
         void handle_error(const net::error_code& ec);
         bool is_udp_enabled() const { return udp_socket_.has_value(); }
 
         void write_udp();
+        void flush_udp();
         void write_tcp(IoBuffer buffer);
+        void flush_tcp();
 
         void read_udp();
+        void receive_udp();
         void read_tcp();
 
         tcp::socket socket_;
@@ -61,13 +72,25 @@ namespace mtls_mproxy
         bool use_udp_{false};
 
         std::array<std::uint8_t, max_buffer_size> read_buffer_;
-        std::array<std::uint8_t, max_buffer_size> write_buffer_;
-        std::array<std::uint8_t, max_buffer_size> udp_read_buffer_;
-        std::queue<IoBuffer> udp_write_queue_;
+        // Data relayed while a write is in flight is coalesced here and goes out with the next write
+        IoBuffer pending_;
+        IoBuffer in_flight_;
+        WriteBudget budget_;
+        UdpBatchOptions udp_batch_;
+        UdpOffload udp_offload_;
+        std::deque<Datagram> udp_write_queue_;
+        // A receive is running or waits for the socket to become readable
+        bool udp_read_in_progress_{false};
+        // Set while the received datagrams are handed to the manager, their read requests are deferred
+        bool udp_dispatching_{false};
+        bool udp_read_requested_{false};
         bool udp_write_in_progress_{false};
 
         bool rip_{false};
         bool wip_{false};
+        bool stopping_{false};
+        // Closes the socket of a stopped stream whose buffered data doesn't drain in time
+        std::optional<net::steady_timer> drain_timer_;
     };
 }
 
@@ -1,14 +1,23 @@
 #include "tcp_client_stream.h"
 #include "stream_manager.h"
+#include "socket_options.h"
 
+#include <asio/post.hpp>
 #include <asio/write.hpp>
-#include <asio/connect.hpp>
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <cerrno>
+#endif
 
 namespace
 {
     namespace net = asio;
     using tcp = asio::ip::tcp;
 
+    // A fast open connect nobody writes to starts without payload after this
+    constexpr std::chrono::milliseconds kFastOpenWriteWait{200};
+
     enum : std::int32_t { eRemote, eLocal };
     std::string ep_to_str(const tcp::socket& sock, std::int32_t dir)
     {
@@ -38,7 +47,8 @@ namespace mtls_mproxy
         , socket_{ctx}
         , resolver_{ctx}
         , logger_{logger_factory.create("tcp_client")}
-        , read_buffer_{}, write_buffer_{}
+        , read_buffer_{}
+        , budget_{ptr->flow_control()}
     {
     }
 
@@ -70,6 +80,30 @@ namespace mtls_mproxy
 
     void TcpClientStream::stop()
     {
+        connect_deferred_ = false;
+        if (fast_open_timer_.has_value())
+            fast_open_timer_->cancel();
+
+        // Relayed data still buffered goes out before the shutdown, as long as the peer reads it
+        if (wip_) {
+            if (!stopping_) {
+                stopping_ = true;
+                drain_timer_.emplace(socket_.get_executor());
+                drain_timer_->expires_after(budget_.limits().drain_timeout);
+                drain_timer_->async_wait([this, self{shared_from_this()}](const net::error_code& ec) {
+                    if (!ec && stopping_) {
+                        logger_.debug(std::format("[{}] buffered data not drained in time, closing", id()));
+                        net::error_code ignored_ec;
+                        socket_.close(ignored_ec);
+                    }
+                });
+            }
+            return;
+        }
+
+        if (drain_timer_.has_value())
+            drain_timer_->cancel();
+
         net::error_code ignored_ec;
         socket_.shutdown(tcp::socket::shutdown_both, ignored_ec);
     }
@@ -80,6 +114,11 @@ namespace mtls_mproxy
             logger_.debug(std::format("[{}] read in progress", id()));
             return;
         }
+        if (connect_deferred_ || connecting_) {
+            read_deferred_ = true;
+            return;
+        }
+
         rip_ = true;
         socket_.async_read_some(
             net::buffer(read_buffer_.data(), read_buffer_.size()),
@@ -96,40 +135,200 @@ namespace mtls_mproxy
 
     void TcpClientStream::write(IoBuffer event)
     {
-        if (wip_) {
-            logger_.debug(std::format("[{}] write in progress", id()));
-            return;
+        const auto size = event.size();
+        if (pending_.empty())
+            pending_.swap(event);
+        else
+            pending_.insert(pending_.end(), event.begin(), event.end());
+
+        if (connect_deferred_) {
+            connect_deferred_ = false;
+            fast_open_timer_->cancel();
+
+            in_flight_.swap(pending_);
+            pending_.clear();
+            wip_ = true;
+            connecting_ = true;
+            fast_open_connect(endpoints_.begin());
+        } else if (!wip_ && !connecting_) {
+            flush();
         }
+
+        if (budget_.queue(size))
+            net::post(socket_.get_executor(), [this, self{shared_from_this()}]() { manager()->on_write(self); });
+    }
+
+    void TcpClientStream::flush()
+    {
+        in_flight_.swap(pending_);
+        pending_.clear();
         wip_ = true;
-        std::ranges::copy(event, write_buffer_.begin());
+        send_in_flight(0);
+    }
+
+    void TcpClientStream::send_in_flight(std::size_t offset)
+    {
         net::async_write(
-            socket_, net::buffer(write_buffer_, event.size()),
+            socket_, net::buffer(in_flight_.data() + offset, in_flight_.size() - offset),
             [this, self{shared_from_this()}](const net::error_code& ec, std::size_t) {
-                if (!ec) {
-                    wip_ = false;
-                    manager()->on_write(self);
-                } else {
+                wip_ = false;
+                if (ec) {
+                    if (stopping_) {
+                        net::error_code ignored_ec;
+                        socket_.close(ignored_ec);
+                        return;
+                    }
                     handle_error(ec);
+                    return;
+                }
+
+                const auto resume = budget_.drain(in_flight_.size());
+                if (!pending_.empty())
+                    flush();
+
+                if (resume)
+                    manager()->on_write(self);
+
+                if (stopping_ && !wip_) {
+                    stopping_ = false;
+                    stop();
                 }
             });
     }
 
     void TcpClientStream::connect(tcp::resolver::results_type&& results)
     {
-        net::async_connect(
-            socket_, results,
-            [this, self{shared_from_this()}](const net::error_code& ec, const tcp::endpoint& ep) {
+        endpoints_ = std::move(results);
+        if (!fast_open_ || endpoints_.empty()) {
+            connect_now(true);
+            return;
+        }
+
+        logger_.debug(std::format("[{}] tcp fast open to [{}], connecting with the first write", id(), host_));
+        connect_deferred_ = true;
+        fast_open_timer_.emplace(socket_.get_executor());
+        fast_open_timer_->expires_after(kFastOpenWriteWait);
+        fast_open_timer_->async_wait([this, self{shared_from_this()}](const net::error_code& ec) {
+            if (!ec && connect_deferred_) {
+                connect_deferred_ = false;
+                connect_now(false);
+            }
+        });
+
+        net::post(socket_.get_executor(), [this, self{shared_from_this()}]() {
+            manager()->on_connect(IoBuffer{}, self);
+        });
+    }
+
+    void TcpClientStream::enable_fast_open()
+    {
+#if defined(__linux__) && defined(MSG_FASTOPEN)
+        fast_open_ = true;
+#endif
+    }
+
+    void TcpClientStream::connect_now(bool notify)
+    {
+        connecting_ = true;
+        connect_with_options(
+            socket_, endpoints_, manager()->upstream_socket_options(),
+            [this, self{shared_from_this()}, notify](const net::error_code& ec, const tcp::endpoint&) {
+                connecting_ = false;
                 if (!ec) {
                     logger_.info(std::format("[{}] connected to [{}] --> [{}]", id(), host_, ep_to_str(socket_, eRemote)));
-                    logger_.debug(std::format("[{}] local address [{}]", id(), ep_to_str(socket_, eLocal)));
-                    IoBuffer event{};
-                    manager()->on_connect(std::move(event), self);
+                    on_connected(notify);
                 } else {
                     handle_error(ec);
                 }
             });
     }
 
+    void TcpClientStream::fast_open_connect(tcp::resolver::results_type::const_iterator endpoint)
+    {
+#if defined(__linux__) && defined(MSG_FASTOPEN)
+        for (; endpoint != endpoints_.end(); ++endpoint) {
+            const auto ep = endpoint->endpoint();
+            net::error_code ec;
+            socket_.close(ec);
+            socket_.open(ep.protocol(), ec);
+            if (!ec)
+                socket_.non_blocking(true, ec);
+            if (ec) {
+                connect_error_ = ec;
+                continue;
+            }
+            apply_socket_options(socket_, manager()->upstream_socket_options());
+
+            // Sent with the SYN if the kernel has a cookie for the server, otherwise the SYN asks for one
+            // and nothing is sent (EINPROGRESS)
+            const auto sent = ::sendto(socket_.native_handle(), in_flight_.data(), in_flight_.size(),
+                                       MSG_FASTOPEN | MSG_NOSIGNAL, ep.data(), static_cast<socklen_t>(ep.size()));
+            if (sent < 0 && errno != EINPROGRESS) {
+                connect_error_ = net::error_code{errno, net::error::get_system_category()};
+                continue;
+            }
+            fast_open_sent_ = sent < 0 ? 0 : static_cast<std::size_t>(sent);
+
+            socket_.async_wait(
+                tcp::socket::wait_write,
+                [this, self{shared_from_this()}, endpoint](net::error_code ec) {
+                    if (!ec) {
+                        int error{0};
+                        socklen_t length{sizeof(error)};
+                        if (::getsockopt(socket_.native_handle(), SOL_SOCKET, SO_ERROR, &error, &length) != 0)
+                            error = errno;
+                        if (error != 0)
+                            ec = net::error_code{error, net::error::get_system_category()};
+                    }
+
+                    if (ec == net::error::operation_aborted || (ec && stopping_)) {
+                        connecting_ = false;
+                        wip_ = false;
+                        return;
+                    }
+
+                    if (ec) {
+                        connect_error_ = ec;
+                        fast_open_connect(std::next(endpoint));
+                        return;
+                    }
+
+                    connecting_ = false;
+                    logger_.info(std::format("[{}] connected to [{}] --> [{}], {} bytes in the SYN",
+                                             id(), host_, ep_to_str(socket_, eRemote), fast_open_sent_));
+
+                    // The payload the SYN didn't carry is written as usual
+                    send_in_flight(fast_open_sent_);
+                    on_connected(false);
+                });
+            return;
+        }
+
+        connecting_ = false;
+        wip_ = false;
+        handle_error(connect_error_);
+#else
+        (void)endpoint;
+#endif
+    }
+
+    void TcpClientStream::on_connected(bool notify)
+    {
+        logger_.debug(std::format("[{}] local address [{}]", id(), ep_to_str(socket_, eLocal)));
+        if (notify) {
+            IoBuffer event{};
+            manager()->on_connect(std::move(event), shared_from_this());
+        }
+
+        if (!wip_ && !pending_.empty())
+            flush();
+
+        if (read_deferred_) {
+            read_deferred_ = false;
+            read();
+        }
+    }
+
     void TcpClientStream::handle_error(const net::error_code& ec)
     {
         manager()->on_error(ec, shared_from_this());
@@ -2,10 +2,14 @@
 #define MTLS_MPROXY_TRANSPORT_TCP_CLIENT_STREAM_H
 
 #include "client_stream.h"
+#include "flow_control.h"
 
 #include <asynclog/logger_factory.h>
 
 #include <asio/ip/tcp.hpp>
+#include <asio/steady_timer.hpp>
+
+#include <optional>
 
 namespace mtls_mproxy
 {
@@ -30,19 +34,32 @@ namespace mtls_mproxy
         void read() override;
         void write(IoBuffer event) override;
 
+        void set_host(std::string host) override;
+        void set_service(std::string service) override;
+
         void connect(tcp::resolver::results_type&& results);
 
+        // TCP Fast Open for a session that writes first: connect() reports the connection right away,
+        // the real connect waits for the first write and carries it in the SYN. Repeat connections to
+        // a server that issued a cookie save a round trip, without a cookie the data follows the
+        // handshake. Reads wait for the connection, a connect without any write starts after a short
+        // wait. Only available on Linux, elsewhere the stream connects as usual.
+        void enable_fast_open();
+
     private:
         TcpClientStream(const StreamManagerPtr& ptr,
                         int id,
                         net::any_io_executor ctx,
                         const asynclog::LoggerFactory& log_factory);
 
+        void flush();
+        void send_in_flight(std::size_t offset);
 
-        void handle_error(const net::error_code& ec);
+        void connect_now(bool notify);
+        void fast_open_connect(tcp::resolver::results_type::const_iterator endpoint);
+        void on_connected(bool notify);
 
-        void set_host(std::string host) override;
-        void set_service(std::string service) override;
+        void handle_error(const net::error_code& ec);
 
         tcp::socket socket_;
         tcp::resolver resolver_;
@@ -53,10 +70,27 @@ namespace mtls_mproxy
         std::string port_;
 
         std::array<std::uint8_t, max_buffer_size> read_buffer_;
-        std::array<std::uint8_t, max_buffer_size> write_buffer_;
+        // Data relayed while a write is in flight is coalesced here and goes out with the next write
+        IoBuffer pending_;
+        IoBuffer in_flight_;
+        WriteBudget budget_;
+
+        tcp::resolver::results_type endpoints_;
+        net::error_code connect_error_;
+        bool fast_open_{false};
+        // The connect waits for the first write
+        bool connect_deferred_{false};
+        bool connecting_{false};
+        bool read_deferred_{false};
+        // Payload bytes the kernel took with the SYN
+        std::size_t fast_open_sent_{0};
+        std::optional<net::steady_timer> fast_open_timer_;
+        // Closes the socket of a stopped stream whose buffered data doesn't drain in time
+        std::optional<net::steady_timer> drain_timer_;
 
         bool rip_{false};
         bool wip_{false};
+        bool stopping_{false};
     };
 }
 
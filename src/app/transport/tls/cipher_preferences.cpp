@@ -0,0 +1,74 @@
+#include "cipher_preferences.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#elif defined(__linux__) && defined(__aarch64__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+#include <stdexcept>
+
+namespace
+{
+    constexpr auto kAesFirstSuites = "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256";
+    constexpr auto kChachaFirstSuites = "TLS_CHACHA20_POLY1305_SHA256:TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384";
+
+    constexpr auto kAesFirstCiphers =
+        "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
+        "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:"
+        "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305";
+    constexpr auto kChachaFirstCiphers =
+        "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305:"
+        "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
+        "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384";
+
+    // X25519 is the default key share of OpenSSL, BoringSSL, NSS and Go clients
+    constexpr auto kDefaultGroups = "X25519:P-256:P-384";
+}
+
+namespace mtls_mproxy
+{
+    bool cpu_has_aes_acceleration()
+    {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        int regs[4]{};
+        __cpuid(regs, 1);
+        return (regs[2] & (1 << 25)) != 0;
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+        unsigned int eax{0}, ebx{0}, ecx{0}, edx{0};
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+            return false;
+        return (ecx & bit_AES) != 0;
+#elif defined(__linux__) && defined(__aarch64__)
+        return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#elif defined(__APPLE__) && defined(__aarch64__)
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    CipherPreferences default_cipher_preferences()
+    {
+        const auto aes = cpu_has_aes_acceleration();
+        return {aes ? kAesFirstSuites : kChachaFirstSuites,
+                aes ? kAesFirstCiphers : kChachaFirstCiphers,
+                kDefaultGroups};
+    }
+
+    void apply_cipher_preferences(SSL_CTX* ctx, const CipherPreferences& preferences)
+    {
+        if (!SSL_CTX_set_ciphersuites(ctx, preferences.ciphersuites.c_str()))
+            throw std::runtime_error{"invalid TLS 1.3 cipher suites: " + preferences.ciphersuites};
+        if (!SSL_CTX_set_cipher_list(ctx, preferences.ciphers.c_str()))
+            throw std::runtime_error{"invalid TLS 1.2 ciphers: " + preferences.ciphers};
+        if (!SSL_CTX_set1_groups_list(ctx, preferences.groups.c_str()))
+            throw std::runtime_error{"invalid key exchange groups: " + preferences.groups};
+
+        // Server order decides, except that clients preferring ChaCha20 (no AES hardware) get it
+        SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_PRIORITIZE_CHACHA);
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef MTLS_MPROXY_TRANSPORT_TLS_CIPHER_PREFERENCES_H
+#define MTLS_MPROXY_TRANSPORT_TLS_CIPHER_PREFERENCES_H
+
+#include <openssl/ssl.h>
+
+#include <string>
+
+namespace mtls_mproxy
+{
+    // Server side cipher and key exchange preferences in OpenSSL list syntax
+    struct CipherPreferences {
+        // TLS 1.3 cipher suites
+        std::string ciphersuites;
+        // TLS 1.2 cipher list
+        std::string ciphers;
+        // Key exchange groups, the first one should be the key share clients send by default so that
+        // the handshake doesn't need a HelloRetryRequest
+        std::string groups;
+    };
+
+    // True if the CPU has AES instructions (AES-NI, ARMv8 crypto extensions)
+    bool cpu_has_aes_acceleration();
+
+    // X25519 first and AES-GCM or ChaCha20-Poly1305 first depending on the CPU
+    CipherPreferences default_cipher_preferences();
+
+    // Applies the lists and server side preference, throws on a list OpenSSL doesn't accept
+    void apply_cipher_preferences(SSL_CTX* ctx, const CipherPreferences& preferences);
+}
+
+#endif // MTLS_MPROXY_TRANSPORT_TLS_CIPHER_PREFERENCES_H
@@ -0,0 +1,158 @@
+#include "crl_store.h"
+
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509_vfy.h>
+
+#include <stdexcept>
+#include <vector>
+
+namespace
+{
+    std::vector<X509_CRL*> read_crls(const std::filesystem::path& path)
+    {
+        BIO* bio = BIO_new_file(path.string().c_str(), "r");
+        if (!bio)
+            throw std::runtime_error{"can't open CRL file: " + path.string()};
+
+        std::vector<X509_CRL*> crls;
+        while (X509_CRL* crl = PEM_read_bio_X509_CRL(bio, nullptr, nullptr, nullptr))
+            crls.push_back(crl);
+        BIO_free(bio);
+
+        // Reading stops with a 'no start line' error at the end of the file
+        ERR_clear_error();
+
+        if (crls.empty())
+            throw std::runtime_error{"CRL file contains no PEM encoded CRLs: " + path.string()};
+
+        return crls;
+    }
+
+    // CA certificates and CRLs with CRL checks for the whole chain, nullptr if the CA file can't be loaded
+    X509_STORE* make_verify_store(const std::filesystem::path& ca_path, const std::vector<X509_CRL*>& crls)
+    {
+        X509_STORE* store = X509_STORE_new();
+        if (!store)
+            return nullptr;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        const auto loaded = X509_STORE_load_file(store, ca_path.string().c_str());
+#else
+        const auto loaded = X509_STORE_load_locations(store, ca_path.string().c_str(), nullptr);
+#endif
+        if (loaded != 1) {
+            X509_STORE_free(store);
+            ERR_clear_error();
+            return nullptr;
+        }
+
+        for (auto* crl : crls)
+            X509_STORE_add_crl(store, crl);
+
+        // Duplicate CRLs in the file are reported but harmless
+        ERR_clear_error();
+
+        X509_STORE_set_flags(store, X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
+        return store;
+    }
+
+    bool revoked_by_store(STACK_OF(X509_OBJECT)* objects, X509* cert)
+    {
+        const auto* issuer = X509_get_issuer_name(cert);
+        for (int i = 0; i < sk_X509_OBJECT_num(objects); ++i) {
+            auto* crl = X509_OBJECT_get0_X509_CRL(sk_X509_OBJECT_value(objects, i));
+            X509_REVOKED* entry{nullptr};
+            if (crl && X509_NAME_cmp(X509_CRL_get_issuer(crl), issuer) == 0 && X509_CRL_get0_by_cert(crl, &entry, cert) == 1)
+                return true;
+        }
+        return false;
+    }
+
+    // Checks the certificate and the issuers the store holds. A session keeps the client certificate
+    // but not its chain, intermediate CAs that only the client sent can't be checked.
+    bool chain_revoked(X509_STORE* store, X509* cert)
+    {
+        constexpr int kMaxDepth = 8;
+
+        X509_STORE_lock(store);
+        auto* objects = X509_STORE_get0_objects(store);
+        auto revoked = false;
+        for (int depth = 0; cert && !revoked && depth < kMaxDepth; ++depth) {
+            revoked = revoked_by_store(objects, cert);
+            if (X509_NAME_cmp(X509_get_subject_name(cert), X509_get_issuer_name(cert)) == 0)
+                break;
+
+            auto* issuer = X509_OBJECT_retrieve_by_subject(objects, X509_LU_X509, X509_get_issuer_name(cert));
+            cert = issuer ? X509_OBJECT_get0_X509(issuer) : nullptr;
+        }
+        X509_STORE_unlock(store);
+        return revoked;
+    }
+
+    // Resumed sessions skip chain verification. The ticket of a client certificate revoked since the
+    // session was established is ignored, the client goes through a full handshake and fails it.
+    SSL_TICKET_RETURN check_session_ticket(SSL* ssl,
+                                           SSL_SESSION* session,
+                                           const unsigned char* /*keyname*/,
+                                           size_t /*keyname_length*/,
+                                           SSL_TICKET_STATUS status,
+                                           void* /*arg*/)
+    {
+        switch (status) {
+        case SSL_TICKET_EMPTY:
+        case SSL_TICKET_NO_DECRYPT:
+            return SSL_TICKET_RETURN_IGNORE_RENEW;
+        case SSL_TICKET_SUCCESS:
+        case SSL_TICKET_SUCCESS_RENEW:
+            break;
+        default:
+            return SSL_TICKET_RETURN_ABORT;
+        }
+
+        // The store the handshake started with, the one of the context may be replaced meanwhile
+        X509_STORE* store{nullptr};
+        SSL_get0_verify_cert_store(ssl, &store);
+        if (auto* peer = SSL_SESSION_get0_peer(session); store && peer && chain_revoked(store, peer))
+            return SSL_TICKET_RETURN_IGNORE;
+
+        return status == SSL_TICKET_SUCCESS_RENEW ? SSL_TICKET_RETURN_USE_RENEW : SSL_TICKET_RETURN_USE;
+    }
+}
+
+namespace mtls_mproxy
+{
+    CrlStore::CrlStore(std::filesystem::path path, std::filesystem::path ca_path)
+        : path_{std::move(path)}
+        , ca_path_{std::move(ca_path)}
+    {
+    }
+
+    void CrlStore::attach(SSL_CTX* ctx)
+    {
+        ctx_ = ctx;
+        reload();
+        SSL_CTX_set_session_ticket_cb(ctx, nullptr, check_session_ticket, nullptr);
+    }
+
+    bool CrlStore::reload()
+    {
+        const auto modified = std::filesystem::last_write_time(path_);
+        if (modified == modified_)
+            return false;
+
+        const auto crls = read_crls(path_);
+        X509_STORE* store = make_verify_store(ca_path_, crls);
+        for (auto* crl : crls)
+            X509_CRL_free(crl);
+        if (!store)
+            throw std::runtime_error{"can't load CA certificates: " + ca_path_.string()};
+
+        // The context and every SSL object created from it hold their own reference to the store
+        SSL_CTX_set1_verify_cert_store(ctx_, store);
+        X509_STORE_free(store);
+
+        modified_ = modified;
+        return true;
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef MTLS_MPROXY_TRANSPORT_TLS_CRL_STORE_H
+#define MTLS_MPROXY_TRANSPORT_TLS_CRL_STORE_H
+
+#include <openssl/ssl.h>
+
+#include <filesystem>
+
+namespace mtls_mproxy
+{
+    // Certificate revocation lists for client certificate verification, read from a PEM file with one
+    // or more CRLs. Every load builds a verify store of the CA certificates and the CRLs of the file and
+    // replaces the verify store of the context, so revocations dropped from the file are dropped too.
+    // Handshakes already running keep the store they started with, the following ones use the new store.
+    // Session tickets are checked against the store when presented, so revoked clients don't resume;
+    // stateful sessions are not, the server cache has to be flushed after a reload.
+    class CrlStore
+    {
+    public:
+        CrlStore(std::filesystem::path path, std::filesystem::path ca_path);
+
+        CrlStore(const CrlStore& other) = delete;
+        CrlStore& operator=(const CrlStore& other) = delete;
+
+        // Loads the file, enables CRL checks for the whole chain and installs the session ticket check.
+        // Throws if the file can't be loaded.
+        void attach(SSL_CTX* ctx);
+
+        // Re-reads the file if it was modified, returns true if the new CRLs replaced the current ones.
+        // On failure the current CRLs stay in use and the error is thrown.
+        bool reload();
+
+        [[nodiscard]] const std::filesystem::path& path() const { return path_; }
+
+    private:
+        std::filesystem::path path_;
+        std::filesystem::path ca_path_;
+        std::filesystem::file_time_type modified_{};
+        SSL_CTX* ctx_{nullptr};
+    };
+}
+
+#endif // MTLS_MPROXY_TRANSPORT_TLS_CRL_STORE_H
@@ -0,0 +1,328 @@
+#include "handshake_pool.h"
+
+#include <asio/post.hpp>
+#include <asio/ssl/error.hpp>
+#include <asio/steady_timer.hpp>
+#ifndef _WIN32
+#include <asio/posix/stream_descriptor.hpp>
+#include <unistd.h>
+#endif
+
+#include <openssl/err.h>
+
+#include <format>
+#include <optional>
+
+namespace
+{
+    namespace net = asio;
+    using tcp = asio::ip::tcp;
+    using mtls_mproxy::HandshakePool;
+    using mtls_mproxy::IoBuffer;
+    using mtls_mproxy::SslPtr;
+
+    // Retry period while OpenSSL has no free async job to run the handshake on
+    constexpr std::chrono::milliseconds kAsyncJobRetryDelay{1};
+    constexpr std::size_t kEarlyDataChunkSize = 4096;
+
+    net::error_code handshake_error(SSL* ssl, int ret)
+    {
+        const auto err = SSL_get_error(ssl, ret);
+        if (const auto ssl_err = ERR_get_error(); ssl_err != 0)
+            return {static_cast<int>(ssl_err), net::error::get_ssl_category()};
+
+        if (err == SSL_ERROR_SYSCALL && ret < 0)
+            return net::error::connection_reset;
+
+        return net::error::eof;
+    }
+
+    class HandshakeOp final : public std::enable_shared_from_this<HandshakeOp>
+    {
+    public:
+        HandshakeOp(tcp::socket socket,
+                    SslPtr ssl,
+                    net::any_io_executor relay_executor,
+                    HandshakePool::Handler handler)
+            : socket_{std::move(socket)}
+            , ssl_{std::move(ssl)}
+            , relay_executor_{std::move(relay_executor)}
+            , handler_{std::move(handler)}
+            , deadline_{socket_.get_executor()}
+            , retry_timer_{socket_.get_executor()}
+            , read_early_data_{SSL_get_max_early_data(ssl_.get()) > 0}
+        {
+        }
+
+        void start(std::chrono::seconds timeout)
+        {
+            net::error_code ec;
+            socket_.non_blocking(true, ec);
+            if (ec) {
+                finish(ec);
+                return;
+            }
+
+            deadline_.expires_after(timeout);
+            deadline_.async_wait([self{shared_from_this()}](const net::error_code& ec) {
+                if (!ec && !self->done_) {
+                    self->timed_out_ = true;
+                    self->cancel_waits();
+                }
+            });
+
+            step();
+        }
+
+    private:
+        void step()
+        {
+            ERR_clear_error();
+            int ret{0};
+            if (read_early_data_) {
+                ret = read_early_data();
+                if (ret > 0)
+                    ret = SSL_do_handshake(ssl_.get());
+            } else {
+                ret = SSL_do_handshake(ssl_.get());
+            }
+
+            if (ret == 1) {
+                finish({});
+                return;
+            }
+
+            switch (SSL_get_error(ssl_.get(), ret)) {
+            case SSL_ERROR_WANT_READ:
+                wait(tcp::socket::wait_read);
+                break;
+            case SSL_ERROR_WANT_WRITE:
+                wait(tcp::socket::wait_write);
+                break;
+            case SSL_ERROR_WANT_ASYNC:
+                wait_async_job();
+                break;
+            case SSL_ERROR_WANT_ASYNC_JOB:
+                retry_later();
+                break;
+            default:
+                finish(handshake_error(ssl_.get(), ret));
+                break;
+            }
+        }
+
+        // Early data has to be read before the handshake completes. Returns 1 once all of it has been
+        // read (or the client sent none), otherwise the result to pass to SSL_get_error.
+        int read_early_data()
+        {
+            while (true) {
+                const auto offset = early_data_.size();
+                early_data_.resize(offset + kEarlyDataChunkSize);
+
+                std::size_t read_bytes{0};
+                const auto ret = SSL_read_early_data(ssl_.get(), early_data_.data() + offset, kEarlyDataChunkSize, &read_bytes);
+                early_data_.resize(offset + read_bytes);
+
+                if (ret == SSL_READ_EARLY_DATA_ERROR)
+                    return -1;
+
+                if (ret == SSL_READ_EARLY_DATA_FINISH) {
+                    read_early_data_ = false;
+                    return 1;
+                }
+            }
+        }
+
+        void wait(tcp::socket::wait_type type)
+        {
+            socket_.async_wait(type, [self{shared_from_this()}](const net::error_code& ec) {
+                self->on_ready(ec);
+            });
+        }
+
+        void wait_async_job()
+        {
+#ifndef _WIN32
+            std::size_t fd_count{0};
+            SSL_get_all_async_fds(ssl_.get(), nullptr, &fd_count);
+            if (fd_count > 0) {
+                std::vector<OSSL_ASYNC_FD> fds(fd_count);
+                SSL_get_all_async_fds(ssl_.get(), fds.data(), &fd_count);
+
+                // The descriptor is owned by the engine, wait on a duplicate
+                if (const auto fd = ::dup(fds.front()); fd >= 0) {
+                    async_fd_.emplace(socket_.get_executor(), fd);
+                    async_fd_->async_wait(net::posix::stream_descriptor::wait_read,
+                        [self{shared_from_this()}](const net::error_code& ec) {
+                            self->async_fd_.reset();
+                            self->on_ready(ec);
+                        });
+                    return;
+                }
+            }
+#endif
+            retry_later();
+        }
+
+        void retry_later()
+        {
+            retry_timer_.expires_after(kAsyncJobRetryDelay);
+            retry_timer_.async_wait([self{shared_from_this()}](const net::error_code& ec) {
+                self->on_ready(ec);
+            });
+        }
+
+        void on_ready(const net::error_code& ec)
+        {
+            if (timed_out_) {
+                finish(net::error::timed_out);
+                return;
+            }
+
+            if (ec) {
+                finish(ec);
+                return;
+            }
+
+            step();
+        }
+
+        void cancel_waits()
+        {
+            net::error_code ignored_ec;
+            socket_.cancel(ignored_ec);
+            retry_timer_.cancel();
+#ifndef _WIN32
+            if (async_fd_.has_value())
+                async_fd_->cancel(ignored_ec);
+#endif
+        }
+
+        void finish(net::error_code ec)
+        {
+            if (done_)
+                return;
+            done_ = true;
+            deadline_.cancel();
+
+            if (!ec) {
+                // Records are relayed by the asio engine from now on, it can't resume async jobs
+                SSL_clear_mode(ssl_.get(), SSL_MODE_ASYNC);
+
+                socket_.non_blocking(false, ec);
+                const auto protocol = socket_.local_endpoint(ec).protocol();
+                const auto native_socket = ec ? tcp::socket::native_handle_type{} : socket_.release(ec);
+
+                if (!ec) {
+                    // The SSL object travels with the handler and is freed if it never runs
+                    net::post(relay_executor_,
+                        [handler{std::move(handler_)}, relay{relay_executor_}, protocol, native_socket, ssl{std::move(ssl_)},
+                         early_data{std::move(early_data_)}]() mutable {
+                            tcp::socket socket{relay};
+                            net::error_code ec;
+                            socket.assign(protocol, native_socket, ec);
+                            if (ec) {
+                                handler(ec, std::move(socket), SslPtr{nullptr, SSL_free}, {});
+                                return;
+                            }
+                            handler({}, std::move(socket), std::move(ssl), std::move(early_data));
+                        });
+                    return;
+                }
+            }
+
+            net::post(relay_executor_, [handler{std::move(handler_)}, relay{relay_executor_}, ec]() {
+                handler(ec, tcp::socket{relay}, SslPtr{nullptr, SSL_free}, {});
+            });
+        }
+
+        tcp::socket socket_;
+        SslPtr ssl_;
+        net::any_io_executor relay_executor_;
+        HandshakePool::Handler handler_;
+        net::steady_timer deadline_;
+        net::steady_timer retry_timer_;
+#ifndef _WIN32
+        std::optional<net::posix::stream_descriptor> async_fd_;
+#endif
+        bool read_early_data_;
+        IoBuffer early_data_;
+        bool done_{false};
+        bool timed_out_{false};
+    };
+}
+
+namespace mtls_mproxy
+{
+    HandshakePool::HandshakePool(std::size_t threads,
+                                 std::chrono::seconds timeout,
+                                 const asynclog::LoggerFactory& log_factory)
+        : timeout_{timeout}
+        , logger_{log_factory.create("tls_handshake_pool")}
+    {
+        for (std::size_t i = 0; i < threads; ++i) {
+            workers_.emplace_back(std::make_unique<net::io_context>(1));
+            work_guards_.emplace_back(net::make_work_guard(*workers_.back()));
+        }
+
+        for (auto& worker : workers_)
+            threads_.emplace_back([&worker]() { worker->run(); });
+
+        logger_.info(std::format("tls handshake pool started with {} threads", threads));
+    }
+
+    HandshakePool::~HandshakePool()
+    {
+        stop();
+    }
+
+    net::any_io_executor HandshakePool::next_executor()
+    {
+        const auto idx = next_worker_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+        return workers_[idx]->get_executor();
+    }
+
+    void HandshakePool::handshake(tcp::socket socket,
+                                  SSL_CTX* ssl_ctx,
+                                  net::any_io_executor relay_executor,
+                                  Handler handler)
+    {
+        async_server_handshake(std::move(socket), ssl_ctx, timeout_, std::move(relay_executor), std::move(handler));
+    }
+
+    void HandshakePool::stop()
+    {
+        for (auto& guard : work_guards_)
+            guard.reset();
+        for (auto& worker : workers_)
+            worker->stop();
+        for (auto& thread : threads_)
+            if (thread.joinable())
+                thread.join();
+        threads_.clear();
+    }
+
+    void async_server_handshake(tcp::socket socket,
+                                SSL_CTX* ssl_ctx,
+                                std::chrono::seconds timeout,
+                                net::any_io_executor relay_executor,
+                                HandshakePool::Handler handler)
+    {
+        SslPtr ssl{SSL_new(ssl_ctx), SSL_free};
+        BIO* bio = ssl ? BIO_new_socket(static_cast<int>(socket.native_handle()), BIO_NOCLOSE) : nullptr;
+        if (!bio) {
+            const net::error_code ec{static_cast<int>(ERR_get_error()), net::error::get_ssl_category()};
+            net::post(relay_executor, [handler{std::move(handler)}, relay{relay_executor}, ec]() {
+                handler(ec, tcp::socket{relay}, SslPtr{nullptr, SSL_free}, {});
+            });
+            return;
+        }
+
+        SSL_set_bio(ssl.get(), bio, bio);
+        SSL_set_accept_state(ssl.get());
+
+        auto executor = socket.get_executor();
+        auto op = std::make_shared<HandshakeOp>(std::move(socket), std::move(ssl), std::move(relay_executor), std::move(handler));
+        net::post(executor, [op, timeout]() { op->start(timeout); });
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef MTLS_MPROXY_TRANSPORT_TLS_HANDSHAKE_POOL_H
+#define MTLS_MPROXY_TRANSPORT_TLS_HANDSHAKE_POOL_H
+
+#include "transport/io_buffer.h"
+
+#include <asynclog/logger_factory.h>
+
+#include <asio/any_io_executor.hpp>
+#include <asio/executor_work_guard.hpp>
+#include <asio/io_context.hpp>
+#include <asio/ip/tcp.hpp>
+
+#include <openssl/ssl.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace mtls_mproxy
+{
+    namespace net = asio;
+    using tcp = asio::ip::tcp;
+
+    // Owns an SSL object until it is released to a stream
+    using SslPtr = std::unique_ptr<SSL, decltype(&SSL_free)>;
+
+    // Worker threads that run server side TLS handshakes away from the relay event loop. Every worker owns
+    // an io_context; the listener accepts sockets directly onto a worker, the handshake is driven there
+    // with SSL_do_handshake on a socket BIO (so nothing past the handshake is read ahead), and the socket
+    // together with its SSL object is handed back to the relay executor once the handshake completes.
+    // With SSL_MODE_ASYNC on the context, private key operations of an async capable engine or provider
+    // yield to the worker loop instead of blocking it.
+    class HandshakePool
+    {
+    public:
+        // Invoked on the relay executor. On success the socket belongs to the relay executor and the
+        // handler owns the SSL object until a stream takes it, on failure the SSL object is empty. Early
+        // data is the TLS 1.3 0-RTT payload received during the handshake, empty unless the context
+        // accepts early data.
+        using Handler = std::function<void(const net::error_code& ec, tcp::socket socket, SslPtr ssl, IoBuffer early_data)>;
+
+        HandshakePool(std::size_t threads, std::chrono::seconds timeout, const asynclog::LoggerFactory& log_factory);
+        ~HandshakePool();
+
+        HandshakePool(const HandshakePool& other) = delete;
+        HandshakePool& operator=(const HandshakePool& other) = delete;
+
+        // Worker executor to accept the next socket on
+        net::any_io_executor next_executor();
+
+        void handshake(tcp::socket socket, SSL_CTX* ssl_ctx, net::any_io_executor relay_executor, Handler handler);
+
+        void stop();
+
+    private:
+        using WorkGuard = net::executor_work_guard<net::io_context::executor_type>;
+
+        std::vector<std::unique_ptr<net::io_context>> workers_;
+        std::vector<WorkGuard> work_guards_;
+        std::vector<std::thread> threads_;
+        std::atomic<std::size_t> next_worker_{0};
+        std::chrono::seconds timeout_;
+        asynclog::ScopedLogger logger_;
+    };
+
+    using HandshakePoolPtr = std::shared_ptr<HandshakePool>;
+
+    // Runs the same handshake driver on the executor of the socket itself, used when early data has to
+    // be read but no handshake threads are configured
+    void async_server_handshake(tcp::socket socket,
+                                SSL_CTX* ssl_ctx,
+                                std::chrono::seconds timeout,
+                                net::any_io_executor relay_executor,
+                                HandshakePool::Handler handler);
+}
+
+#endif // MTLS_MPROXY_TRANSPORT_TLS_HANDSHAKE_POOL_H
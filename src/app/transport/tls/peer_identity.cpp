@@ -0,0 +1,24 @@
+#include "peer_identity.h"
+
+namespace mtls_mproxy
+{
+    std::string peer_certificate_subject(SSL* ssl)
+    {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        X509* cert = SSL_get1_peer_certificate(ssl);
+#else
+        X509* cert = SSL_get_peer_certificate(ssl);
+#endif
+        if (!cert)
+            return {};
+
+        std::string subject;
+        if (char* name = X509_NAME_oneline(X509_get_subject_name(cert), nullptr, 0)) {
+            subject = name;
+            OPENSSL_free(name);
+        }
+        X509_free(cert);
+
+        return subject;
+    }
+}
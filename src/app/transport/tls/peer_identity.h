@@ -0,0 +1,14 @@
+#ifndef MTLS_MPROXY_TRANSPORT_TLS_PEER_IDENTITY_H
+#define MTLS_MPROXY_TRANSPORT_TLS_PEER_IDENTITY_H
+
+#include <openssl/ssl.h>
+
+#include <string>
+
+namespace mtls_mproxy
+{
+    // One line subject of the verified peer certificate, empty if the peer sent none
+    std::string peer_certificate_subject(SSL* ssl);
+}
+
+#endif // MTLS_MPROXY_TRANSPORT_TLS_PEER_IDENTITY_H
@@ -0,0 +1,175 @@
+#include "ticket_key_store.h"
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+namespace
+{
+    using mtls_mproxy::TicketKeyStore;
+
+    constexpr std::size_t kTicketKeyRecordSize = 80;
+
+    int ticket_key_store_index()
+    {
+        static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
+    }
+
+    TicketKeyStore::TicketKeys read_ticket_keys(const std::filesystem::path& path)
+    {
+        std::ifstream file{path, std::ios::binary};
+        if (!file)
+            throw std::runtime_error{"can't open session ticket key file: " + path.string()};
+
+        const std::vector<std::uint8_t> data{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+        if (data.empty() || data.size() % kTicketKeyRecordSize != 0)
+            throw std::runtime_error{"session ticket key file must contain one or more 80 byte keys: " + path.string()};
+
+        TicketKeyStore::TicketKeys keys(data.size() / kTicketKeyRecordSize);
+        const auto* record = data.data();
+        for (auto& key : keys) {
+            std::memcpy(key.name.data(), record, key.name.size());
+            std::memcpy(key.hmac_key.data(), record + 16, key.hmac_key.size());
+            std::memcpy(key.aes_key.data(), record + 48, key.aes_key.size());
+            record += kTicketKeyRecordSize;
+        }
+
+        return keys;
+    }
+
+    // Returns 1 for the current key, 2 for an older key (the ticket gets renewed), 0 for unknown name
+    int select_key(const TicketKeyStore::TicketKeys& keys,
+                   unsigned char* key_name,
+                   int enc,
+                   const TicketKeyStore::TicketKey*& key)
+    {
+        if (enc) {
+            key = &keys.front();
+            std::memcpy(key_name, key->name.data(), key->name.size());
+            return 1;
+        }
+
+        const auto it = std::ranges::find_if(keys, [key_name](const auto& k) {
+            return std::memcmp(k.name.data(), key_name, k.name.size()) == 0;
+        });
+        if (it == keys.end())
+            return 0;
+
+        key = &*it;
+        return it == keys.begin() ? 1 : 2;
+    }
+
+    int init_cipher(EVP_CIPHER_CTX* cipher_ctx, const TicketKeyStore::TicketKey& key, unsigned char* iv, int enc)
+    {
+        if (enc) {
+            if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0)
+                return -1;
+            return EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), nullptr, key.aes_key.data(), iv) ? 1 : -1;
+        }
+
+        return EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), nullptr, key.aes_key.data(), iv) ? 1 : -1;
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    int ticket_key_callback(SSL* ssl, unsigned char* key_name, unsigned char* iv,
+                            EVP_CIPHER_CTX* cipher_ctx, EVP_MAC_CTX* mac_ctx, int enc)
+    {
+        const auto* store = static_cast<const TicketKeyStore*>(
+            SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ticket_key_store_index()));
+        const auto keys = store ? store->keys() : nullptr;
+        if (!keys || keys->empty())
+            return enc ? -1 : 0;
+
+        const TicketKeyStore::TicketKey* key{nullptr};
+        const auto result = select_key(*keys, key_name, enc, key);
+        if (result == 0)
+            return 0;
+
+        static char digest[] = "SHA256";
+        OSSL_PARAM params[] = {
+            OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+                                              const_cast<std::uint8_t*>(key->hmac_key.data()),
+                                              key->hmac_key.size()),
+            OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+            OSSL_PARAM_construct_end()
+        };
+        if (!EVP_MAC_CTX_set_params(mac_ctx, params))
+            return -1;
+
+        return init_cipher(cipher_ctx, *key, iv, enc) < 0 ? -1 : result;
+    }
+#else
+    int ticket_key_callback(SSL* ssl, unsigned char* key_name, unsigned char* iv,
+                            EVP_CIPHER_CTX* cipher_ctx, HMAC_CTX* hmac_ctx, int enc)
+    {
+        const auto* store = static_cast<const TicketKeyStore*>(
+            SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ticket_key_store_index()));
+        const auto keys = store ? store->keys() : nullptr;
+        if (!keys || keys->empty())
+            return enc ? -1 : 0;
+
+        const TicketKeyStore::TicketKey* key{nullptr};
+        const auto result = select_key(*keys, key_name, enc, key);
+        if (result == 0)
+            return 0;
+
+        if (!HMAC_Init_ex(hmac_ctx, key->hmac_key.data(), static_cast<int>(key->hmac_key.size()), EVP_sha256(), nullptr))
+            return -1;
+
+        return init_cipher(cipher_ctx, *key, iv, enc) < 0 ? -1 : result;
+    }
+#endif
+}
+
+namespace mtls_mproxy
+{
+    TicketKeyStore::TicketKeyStore(std::filesystem::path path)
+        : path_{std::move(path)}
+    {
+    }
+
+    void TicketKeyStore::attach(SSL_CTX* ctx)
+    {
+        reload();
+
+        SSL_CTX_set_ex_data(ctx, ticket_key_store_index(), this);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_callback);
+#else
+        SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_callback);
+#endif
+    }
+
+    bool TicketKeyStore::reload()
+    {
+        const auto modified = std::filesystem::last_write_time(path_);
+        if (keys() && modified == modified_)
+            return false;
+
+        auto loaded = read_ticket_keys(path_);
+
+        // A rotation that replaced the whole file must not drop sessions issued under the previous
+        // encryption key, so it stays available for decryption until the next rotation
+        if (const auto current = keys()) {
+            const auto& previous = current->front();
+            const auto listed = std::ranges::any_of(loaded, [&previous](const auto& k) { return k.name == previous.name; });
+            if (!listed)
+                loaded.push_back(previous);
+        }
+
+        keys_.store(std::make_shared<const TicketKeys>(std::move(loaded)), std::memory_order_release);
+        modified_ = modified;
+        return true;
+    }
+}
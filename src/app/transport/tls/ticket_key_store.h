@@ -0,0 +1,54 @@
+#ifndef MTLS_MPROXY_TRANSPORT_TLS_TICKET_KEY_STORE_H
+#define MTLS_MPROXY_TRANSPORT_TLS_TICKET_KEY_STORE_H
+
+#include <openssl/ssl.h>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace mtls_mproxy
+{
+    // Session ticket encryption keys shared between mproxy instances through a key file. The file is a
+    // concatenation of 80 byte records: key name (16), HMAC key (32), AES-256 key (32), the same layout
+    // nginx uses. The first record encrypts new tickets, all records decrypt, so a key is rotated by
+    // prepending a new record and dropping the oldest one later; tickets issued under a retired but
+    // still listed key are accepted and renewed with the current key. The previous encryption key is
+    // kept for decryption even if a reload no longer lists it.
+    class TicketKeyStore
+    {
+    public:
+        struct TicketKey {
+            std::array<std::uint8_t, 16> name;
+            std::array<std::uint8_t, 32> hmac_key;
+            std::array<std::uint8_t, 32> aes_key;
+        };
+        using TicketKeys = std::vector<TicketKey>;
+
+        explicit TicketKeyStore(std::filesystem::path path);
+
+        TicketKeyStore(const TicketKeyStore& other) = delete;
+        TicketKeyStore& operator=(const TicketKeyStore& other) = delete;
+
+        // Installs the ticket key callback on the context, throws if the key file can't be loaded
+        void attach(SSL_CTX* ctx);
+
+        // Re-reads the key file if it was modified, returns true if a new key set was loaded.
+        // On failure the current keys stay in use and the error is thrown.
+        bool reload();
+
+        [[nodiscard]] std::shared_ptr<const TicketKeys> keys() const { return keys_.load(std::memory_order_acquire); }
+        [[nodiscard]] const std::filesystem::path& path() const { return path_; }
+
+    private:
+        std::filesystem::path path_;
+        std::filesystem::file_time_type modified_{};
+        std::atomic<std::shared_ptr<const TicketKeys>> keys_;
+    };
+}
+
+#endif // MTLS_MPROXY_TRANSPORT_TLS_TICKET_KEY_STORE_H
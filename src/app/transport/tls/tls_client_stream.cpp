@@ -0,0 +1,175 @@
+#include "tls_client_stream.h"
+#include "transport/stream_manager.h"
+
+#include "auxiliary/helpers.h"
+
+#include <asio/post.hpp>
+#include <asio/write.hpp>
+
+#include <format>
+
+namespace mtls_mproxy
+{
+    TlsClientStream::TlsClientStream(const StreamManagerPtr& ptr,
+                                     int id,
+                                     TlsConnectorPtr connector,
+                                     const asynclog::LoggerFactory& log_factory)
+        : ClientStream{ptr, id}
+        , connector_{std::move(connector)}
+        , logger_{log_factory.create("tls_client")}
+        , read_buffer_{}
+        , budget_{ptr->flow_control()}
+    {
+    }
+
+    TlsClientStream::~TlsClientStream()
+    {
+        logger_.debug(std::format("[{}] tls client stream closed ({}:{})", id(), host_, port_));
+    }
+
+    std::shared_ptr<TlsClientStream> TlsClientStream::create(const StreamManagerPtr& ptr,
+                                                             int id,
+                                                             TlsConnectorPtr connector,
+                                                             const asynclog::LoggerFactory& log_factory)
+    {
+        return std::shared_ptr<TlsClientStream>(new TlsClientStream(ptr, id, std::move(connector), log_factory));
+    }
+
+    void TlsClientStream::start()
+    {
+        connector_->acquire(
+            [this, self{shared_from_this()}](const net::error_code& ec, std::unique_ptr<ssl_socket> socket) {
+                if (stopped_)
+                    return;
+
+                if (ec) {
+                    handle_error(ec);
+                    return;
+                }
+
+                socket_ = std::move(socket);
+                net::error_code ep_ec;
+                const auto ep = socket_->lowest_layer().remote_endpoint(ep_ec);
+                logger_.info(std::format("[{}] tunnel to [{}:{}] --> [{}]{}",
+                                         id(),
+                                         host_,
+                                         port_,
+                                         ep_ec ? ep_ec.message() : aux::to_string(ep),
+                                         SSL_session_reused(socket_->native_handle()) ? ", resumed session" : ""));
+
+                IoBuffer event{};
+                manager()->on_connect(std::move(event), self);
+            });
+    }
+
+    void TlsClientStream::stop()
+    {
+        stopped_ = true;
+        if (!socket_)
+            return;
+
+        // Relayed data still buffered goes out before the shutdown, as long as the remote reads it
+        if (wip_) {
+            if (!stopping_) {
+                stopping_ = true;
+                drain_timer_.emplace(socket_->get_executor());
+                drain_timer_->expires_after(budget_.limits().drain_timeout);
+                drain_timer_->async_wait([this, self{shared_from_this()}](const net::error_code& ec) {
+                    if (!ec && stopping_) {
+                        logger_.debug(std::format("[{}] buffered data not drained in time, closing", id()));
+                        net::error_code ignored_ec;
+                        socket_->lowest_layer().close(ignored_ec);
+                    }
+                });
+            }
+            return;
+        }
+
+        if (drain_timer_.has_value())
+            drain_timer_->cancel();
+
+        // The remote treats a connection closed without close_notify like a regular close
+        net::error_code ignored_ec;
+        socket_->lowest_layer().shutdown(net::ip::tcp::socket::shutdown_both, ignored_ec);
+    }
+
+    void TlsClientStream::read()
+    {
+        if (rip_) {
+            logger_.debug(std::format("[{}] read in progress", id()));
+            return;
+        }
+        rip_ = true;
+        socket_->async_read_some(
+            net::buffer(read_buffer_.data(), read_buffer_.size()),
+            [this, self{shared_from_this()}](const net::error_code& ec, const std::size_t length) {
+                rip_ = false;
+                if (!ec && length) {
+                    IoBuffer event{read_buffer_.data(), read_buffer_.data() + length};
+                    manager()->on_read(std::move(event), self);
+                } else if (ec == net::ssl::error::stream_truncated) {
+                    handle_error(net::error::eof);
+                } else {
+                    handle_error(ec);
+                }
+            });
+    }
+
+    void TlsClientStream::write(IoBuffer event)
+    {
+        const auto size = event.size();
+        if (pending_.empty())
+            pending_.swap(event);
+        else
+            pending_.insert(pending_.end(), event.begin(), event.end());
+
+        if (!wip_)
+            flush();
+
+        if (budget_.queue(size))
+            net::post(socket_->get_executor(), [this, self{shared_from_this()}]() { manager()->on_write(self); });
+    }
+
+    void TlsClientStream::flush()
+    {
+        in_flight_.swap(pending_);
+        pending_.clear();
+        wip_ = true;
+
+        net::async_write(
+            *socket_, net::buffer(in_flight_),
+            [this, self{shared_from_this()}](const net::error_code& ec, std::size_t) {
+                wip_ = false;
+                if (ec) {
+                    if (stopping_) {
+                        net::error_code ignored_ec;
+                        socket_->lowest_layer().close(ignored_ec);
+                        return;
+                    }
+                    handle_error(ec);
+                    return;
+                }
+
+                const auto resume = budget_.drain(in_flight_.size());
+                if (!pending_.empty())
+                    flush();
+
+                if (resume)
+                    manager()->on_write(self);
+
+                if (stopping_ && !wip_) {
+                    stopping_ = false;
+                    stop();
+                }
+            });
+    }
+
+    void TlsClientStream::handle_error(const net::error_code& ec)
+    {
+        manager()->on_error(ec, shared_from_this());
+    }
+
+    void TlsClientStream::set_host(std::string host) { host_.swap(host); }
+
+    void TlsClientStream::set_service(std::string service) { port_.swap(service); }
+}
@@ -0,0 +1,72 @@
+#ifndef MTLS_MPROXY_TRANSPORT_TLS_TLS_CLIENT_STREAM_H
+#define MTLS_MPROXY_TRANSPORT_TLS_TLS_CLIENT_STREAM_H
+
+#include "transport/client_stream.h"
+#include "transport/flow_control.h"
+#include "tls_connector.h"
+
+#include <asynclog/logger_factory.h>
+
+#include <asio/steady_timer.hpp>
+
+#include <array>
+#include <optional>
+
+namespace mtls_mproxy
+{
+    // Outgoing mTLS tunnel to a remote mproxy, the connection is taken from the connector
+    class TlsClientStream final
+        : public ClientStream
+        , public std::enable_shared_from_this<TlsClientStream>
+    {
+    public:
+        ~TlsClientStream() override;
+
+        static std::shared_ptr<TlsClientStream> create(
+            const StreamManagerPtr& ptr,
+            int id,
+            TlsConnectorPtr connector,
+            const asynclog::LoggerFactory& log_factory);
+
+        void start() override;
+        void stop() override;
+        void read() override;
+        void write(IoBuffer event) override;
+
+        void set_host(std::string host) override;
+        void set_service(std::string service) override;
+
+    private:
+        TlsClientStream(const StreamManagerPtr& ptr,
+                        int id,
+                        TlsConnectorPtr connector,
+                        const asynclog::LoggerFactory& log_factory);
+
+        void flush();
+
+        void handle_error(const net::error_code& ec);
+
+        TlsConnectorPtr connector_;
+        std::unique_ptr<ssl_socket> socket_;
+
+        asynclog::ScopedLogger logger_;
+
+        std::string host_;
+        std::string port_;
+
+        std::array<std::uint8_t, max_buffer_size> read_buffer_;
+        // Data relayed while a write is in flight is coalesced here and goes out with the next write
+        IoBuffer pending_;
+        IoBuffer in_flight_;
+        WriteBudget budget_;
+
+        bool rip_{false};
+        bool wip_{false};
+        bool stopped_{false};
+        bool stopping_{false};
+        // Closes the socket of a stopped stream whose buffered data doesn't drain in time
+        std::optional<net::steady_timer> drain_timer_;
+    };
+}
+
+#endif // MTLS_MPROXY_TRANSPORT_TLS_TLS_CLIENT_STREAM_H
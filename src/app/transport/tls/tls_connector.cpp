@@ -0,0 +1,364 @@
+#include "tls_connector.h"
+
+#include <algorithm>
+#include <array>
+#include <format>
+#include <utility>
+
+namespace
+{
+    namespace net = asio;
+    using tcp = asio::ip::tcp;
+    using mtls_mproxy::ssl_socket;
+    using mtls_mproxy::TlsConnector;
+
+    // TCP connect and TLS handshake of one connection to the remote
+    constexpr std::chrono::seconds kConnectTimeout{10};
+    // Pause before refilling the pool after a connection attempt failed
+    constexpr std::chrono::seconds kRetryDelay{2};
+
+    int connector_index()
+    {
+        static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
+    }
+
+    // Processes the records received on an idle connection without blocking. Returns false if the remote
+    // closed the connection, with ec set, or sent application data nobody asked for.
+    bool read_idle(ssl_socket& socket, net::error_code& ec)
+    {
+        std::array<std::uint8_t, 1> probe{};
+        const auto size = socket.read_some(net::buffer(probe), ec);
+        if (ec == net::error::would_block) {
+            ec = {};
+            return true;
+        }
+
+        return !ec && size == 0;
+    }
+
+    class DialOp final : public std::enable_shared_from_this<DialOp>
+    {
+    public:
+        DialOp(const net::any_io_executor& executor,
+               net::ssl::context& ssl_ctx,
+               std::string host,
+               std::string port,
+               SSL_SESSION* session,
+               mtls_mproxy::SocketOptions sockets,
+               TlsConnector::Handler handler)
+            : resolver_{executor}
+            , deadline_{executor}
+            , socket_{std::make_unique<ssl_socket>(executor, ssl_ctx)}
+            , host_{std::move(host)}
+            , port_{std::move(port)}
+            , sockets_{std::move(sockets)}
+            , handler_{std::move(handler)}
+        {
+            auto* ssl = socket_->native_handle();
+
+            // The remote certificate has to match the host, SNI is only sent for names
+            net::error_code ec;
+            net::ip::make_address(host_, ec);
+            if (!ec) {
+                X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host_.c_str());
+            } else {
+                SSL_set_tlsext_host_name(ssl, host_.c_str());
+                SSL_set1_host(ssl, host_.c_str());
+            }
+
+            if (session) {
+                SSL_set_session(ssl, session);
+                SSL_SESSION_free(session);
+            }
+        }
+
+        void start(std::chrono::seconds timeout)
+        {
+            deadline_.expires_after(timeout);
+            deadline_.async_wait([self{shared_from_this()}](const net::error_code& ec) {
+                if (!ec && !self->done_) {
+                    self->timed_out_ = true;
+                    self->resolver_.cancel();
+                    net::error_code ignored_ec;
+                    self->socket_->lowest_layer().close(ignored_ec);
+                }
+            });
+
+            resolver_.async_resolve(
+                host_, port_,
+                [self{shared_from_this()}](const net::error_code& ec, tcp::resolver::results_type results) {
+                    if (ec) {
+                        self->finish(ec);
+                        return;
+                    }
+                    self->connect(std::move(results));
+                });
+        }
+
+    private:
+        void connect(tcp::resolver::results_type results)
+        {
+            mtls_mproxy::connect_with_options(
+                socket_->next_layer(), std::move(results), sockets_,
+                [self{shared_from_this()}](const net::error_code& ec, const tcp::endpoint&) {
+                    if (ec) {
+                        self->finish(ec);
+                        return;
+                    }
+                    self->handshake();
+                });
+        }
+
+        void handshake()
+        {
+            socket_->async_handshake(
+                net::ssl::stream_base::client,
+                [self{shared_from_this()}](const net::error_code& ec) { self->finish(ec); });
+        }
+
+        void finish(net::error_code ec)
+        {
+            if (done_)
+                return;
+            done_ = true;
+            deadline_.cancel();
+
+            if (timed_out_)
+                ec = net::error::timed_out;
+
+            if (ec)
+                handler_(ec, nullptr);
+            else
+                handler_(ec, std::move(socket_));
+        }
+
+        tcp::resolver resolver_;
+        net::steady_timer deadline_;
+        std::unique_ptr<ssl_socket> socket_;
+        std::string host_;
+        std::string port_;
+        mtls_mproxy::SocketOptions sockets_;
+        TlsConnector::Handler handler_;
+        bool done_{false};
+        bool timed_out_{false};
+    };
+}
+
+namespace mtls_mproxy
+{
+    TlsConnector::TlsConnector(Options options, const asynclog::LoggerFactory& log_factory)
+        : options_{std::move(options)}
+        , ssl_ctx_{net::ssl::context::tls_client}
+        , logger_{log_factory.create("tls_connector")}
+    {
+        auto ssl_options = net::ssl::context::default_workarounds |
+            net::ssl::context::no_sslv2 |
+            net::ssl::context::no_sslv3 |
+            net::ssl::context::no_tlsv1 |
+            net::ssl::context::no_tlsv1_1;
+
+        if (options_.version == "1.3")
+            ssl_options |= net::ssl::context::no_tlsv1_2;
+
+        ssl_ctx_.set_options(ssl_options);
+
+        auto* ctx = ssl_ctx_.native_handle();
+        SSL_CTX_set_min_proto_version(ctx, options_.version == "1.3" ? TLS1_3_VERSION : TLS1_2_VERSION);
+
+        auto preferences = default_cipher_preferences();
+        if (!options_.ciphers.ciphersuites.empty())
+            preferences.ciphersuites = options_.ciphers.ciphersuites;
+        if (!options_.ciphers.ciphers.empty())
+            preferences.ciphers = options_.ciphers.ciphers;
+        if (!options_.ciphers.groups.empty())
+            preferences.groups = options_.ciphers.groups;
+        apply_cipher_preferences(ctx, preferences);
+
+        ssl_ctx_.use_certificate_chain_file(options_.client_cert);
+        ssl_ctx_.use_private_key_file(options_.private_key, net::ssl::context::pem);
+        ssl_ctx_.load_verify_file(options_.ca_cert);
+        ssl_ctx_.set_verify_mode(net::ssl::verify_peer);
+
+        // Sessions are kept by the connector, not by the context cache
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_set_ex_data(ctx, connector_index(), this);
+        SSL_CTX_sess_set_new_cb(ctx, store_session);
+    }
+
+    TlsConnector::~TlsConnector()
+    {
+        if (session_)
+            SSL_SESSION_free(session_);
+
+        logger_.debug(std::format("tls connector to [{}:{}] stopped: ready hits {}, misses {}, handshakes {}, resumed {}",
+                                  options_.host,
+                                  options_.port,
+                                  ready_hits_,
+                                  ready_misses_,
+                                  full_handshakes_ + resumed_handshakes_,
+                                  resumed_handshakes_));
+    }
+
+    void TlsConnector::start(net::any_io_executor executor)
+    {
+        executor_ = std::move(executor);
+        retry_timer_.emplace(executor_);
+
+        logger_.info(std::format("mtls tunnel to [{}:{}], {} ready connections",
+                                 options_.host, options_.port, options_.warm_connections));
+        fill();
+    }
+
+    void TlsConnector::acquire(Handler handler)
+    {
+        if (!ready_.empty()) {
+            auto connection = std::move(ready_.front());
+            ready_.pop_front();
+            ++ready_hits_;
+
+            // The socket changes hands in the completion of the outstanding wait
+            connection->handover = std::move(handler);
+            net::error_code ignored_ec;
+            connection->socket->lowest_layer().cancel(ignored_ec);
+        } else {
+            ++ready_misses_;
+            dial(std::move(handler));
+        }
+
+        fill();
+    }
+
+    int TlsConnector::store_session(SSL* ssl, SSL_SESSION* session)
+    {
+        auto* connector = static_cast<TlsConnector*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), connector_index()));
+        if (!connector || !SSL_SESSION_is_resumable(session))
+            return 0;
+
+        if (connector->session_)
+            SSL_SESSION_free(connector->session_);
+        connector->session_ = session;
+
+        // The reference passed in is kept
+        return 1;
+    }
+
+    SSL_SESSION* TlsConnector::take_session()
+    {
+        // TLS 1.3 tickets are meant for a single use (RFC 8446 appendix C.4), every connection receives
+        // fresh ones
+        return std::exchange(session_, nullptr);
+    }
+
+    void TlsConnector::fill()
+    {
+        if (!retry_timer_.has_value() || retry_pending_)
+            return;
+
+        while (ready_.size() + filling_ < options_.warm_connections) {
+            ++filling_;
+            dial([this, self{shared_from_this()}](const net::error_code& ec, std::unique_ptr<ssl_socket> socket) {
+                --filling_;
+                if (!ec) {
+                    park(std::move(socket));
+                    return;
+                }
+
+                logger_.warn(std::format("mtls connection to [{}:{}] failed: {}", options_.host, options_.port, ec.message()));
+                if (retry_pending_)
+                    return;
+
+                retry_pending_ = true;
+                retry_timer_->expires_after(kRetryDelay);
+                retry_timer_->async_wait([this, self](const net::error_code& ec) {
+                    retry_pending_ = false;
+                    if (!ec)
+                        fill();
+                });
+            });
+        }
+    }
+
+    void TlsConnector::dial(Handler handler)
+    {
+        auto op = std::make_shared<DialOp>(
+            executor_,
+            ssl_ctx_,
+            options_.host,
+            options_.port,
+            take_session(),
+            options_.sockets,
+            [this, self{shared_from_this()}, handler{std::move(handler)}](const net::error_code& ec, std::unique_ptr<ssl_socket> socket) {
+                if (!ec) {
+                    if (SSL_session_reused(socket->native_handle()))
+                        ++resumed_handshakes_;
+                    else
+                        ++full_handshakes_;
+                }
+                handler(ec, std::move(socket));
+            });
+        op->start(kConnectTimeout);
+    }
+
+    void TlsConnector::park(std::unique_ptr<ssl_socket> socket)
+    {
+        auto connection = std::make_shared<ReadyConnection>();
+        connection->socket = std::move(socket);
+        ready_.push_back(connection);
+
+        // Records the handshake read ahead are processed right away
+        net::error_code ec;
+        connection->socket->lowest_layer().non_blocking(true, ec);
+        if (ec || !read_idle(*connection->socket, ec)) {
+            drop(connection, ec);
+            return;
+        }
+
+        wait_readable(connection);
+    }
+
+    // Only a wait is outstanding on a ready connection. Unlike a TLS read, which starts another TCP read
+    // for every record it processes, the wait completes exactly once after a cancel.
+    void TlsConnector::wait_readable(const ReadyConnectionPtr& connection)
+    {
+        connection->socket->lowest_layer().async_wait(
+            tcp::socket::wait_read,
+            [this, self{shared_from_this()}, connection](const net::error_code& ec) {
+                if (connection->handover) {
+                    hand_over(connection);
+                    return;
+                }
+
+                net::error_code read_ec{ec};
+                if (ec || !read_idle(*connection->socket, read_ec)) {
+                    drop(connection, read_ec);
+                    return;
+                }
+
+                wait_readable(connection);
+            });
+    }
+
+    void TlsConnector::hand_over(const ReadyConnectionPtr& connection)
+    {
+        auto handler = std::exchange(connection->handover, nullptr);
+
+        net::error_code ec;
+        if (!read_idle(*connection->socket, ec)) {
+            dial(std::move(handler)); // closed by the remote just before it was taken
+            return;
+        }
+
+        connection->socket->lowest_layer().non_blocking(false, ec);
+        handler({}, std::move(connection->socket));
+    }
+
+    void TlsConnector::drop(const ReadyConnectionPtr& connection, const net::error_code& ec)
+    {
+        // The remote closed the connection or sent data nobody asked for
+        std::erase(ready_, connection);
+        logger_.debug(std::format("ready mtls connection to [{}:{}] dropped: {}",
+                                  options_.host, options_.port, ec ? ec.message() : "unexpected data"));
+        fill();
+    }
+}
@@ -0,0 +1,109 @@
+#ifndef MTLS_MPROXY_TRANSPORT_TLS_TLS_CONNECTOR_H
+#define MTLS_MPROXY_TRANSPORT_TLS_TLS_CONNECTOR_H
+
+#include "transport/socket_options.h"
+#include "cipher_preferences.h"
+
+#include <asynclog/logger_factory.h>
+#include <asynclog/scoped_logger.h>
+
+#include <asio/any_io_executor.hpp>
+#include <asio/ip/tcp.hpp>
+#include <asio/ssl.hpp>
+#include <asio/steady_timer.hpp>
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+
+namespace mtls_mproxy
+{
+    namespace net = asio;
+    using ssl_socket = net::ssl::stream<net::ip::tcp::socket>;
+
+    // Client side of the mTLS tunnel to a remote mproxy. A number of connections are kept handshaked
+    // and ready, so a new local connection gets a tunnel without waiting for TCP and TLS handshakes.
+    // Every ready connection waits for its socket to become readable and then reads without blocking,
+    // which processes post-handshake messages (TLS 1.3 session tickets) and notices a connection the
+    // remote has closed. New connections resume a session from a previous ticket, each ticket is used once.
+    class TlsConnector final : public std::enable_shared_from_this<TlsConnector>
+    {
+    public:
+        struct Options {
+            // Remote mproxy listener
+            std::string host;
+            std::string port;
+            std::string private_key;
+            std::string client_cert;
+            std::string ca_cert;
+            std::string version;
+            // Cipher suite and group preference lists, empty entries use CPU dependent defaults
+            CipherPreferences ciphers;
+            // Handshaked connections kept ready, 0 connects on demand only
+            std::size_t warm_connections{4};
+            // Upstream socket profile of the connections to the remote
+            SocketOptions sockets;
+        };
+
+        // On success the handler owns the connected, handshaked socket
+        using Handler = std::function<void(const net::error_code& ec, std::unique_ptr<ssl_socket> socket)>;
+
+        // Throws if the certificate, key or CA files can't be loaded
+        TlsConnector(Options options, const asynclog::LoggerFactory& log_factory);
+        ~TlsConnector();
+
+        TlsConnector(const TlsConnector& other) = delete;
+        TlsConnector& operator=(const TlsConnector& other) = delete;
+
+        // Binds the connector to the relay executor and starts filling the pool of ready connections
+        void start(net::any_io_executor executor);
+
+        void acquire(Handler handler);
+
+        const std::string& host() const { return options_.host; }
+        const std::string& port() const { return options_.port; }
+        const SocketOptions& socket_options() const { return options_.sockets; }
+
+    private:
+        struct ReadyConnection {
+            std::unique_ptr<ssl_socket> socket;
+            // Set when the connection is taken, it is handed over once the outstanding wait completes
+            Handler handover;
+        };
+        using ReadyConnectionPtr = std::shared_ptr<ReadyConnection>;
+
+        static int store_session(SSL* ssl, SSL_SESSION* session);
+
+        void fill();
+        void dial(Handler handler);
+        void park(std::unique_ptr<ssl_socket> socket);
+        void wait_readable(const ReadyConnectionPtr& connection);
+        void hand_over(const ReadyConnectionPtr& connection);
+        void drop(const ReadyConnectionPtr& connection, const net::error_code& ec);
+        SSL_SESSION* take_session();
+
+        Options options_;
+        net::ssl::context ssl_ctx_;
+        net::any_io_executor executor_;
+        std::optional<net::steady_timer> retry_timer_;
+        asynclog::ScopedLogger logger_;
+
+        std::deque<ReadyConnectionPtr> ready_;
+        std::size_t filling_{0};
+        bool retry_pending_{false};
+        // Latest session received from the remote, not used yet
+        SSL_SESSION* session_{nullptr};
+
+        std::uint64_t ready_hits_{0};
+        std::uint64_t ready_misses_{0};
+        std::uint64_t full_handshakes_{0};
+        std::uint64_t resumed_handshakes_{0};
+    };
+
+    using TlsConnectorPtr = std::shared_ptr<TlsConnector>;
+}
+
+#endif // MTLS_MPROXY_TRANSPORT_TLS_TLS_CONNECTOR_H
@@ -1,15 +1,74 @@
 #include "tls_server.h"
 #include "tls_server_stream.h"
+#include "peer_identity.h"
 
+#include "auxiliary/helpers.h"
+
+#include <algorithm>
 #include <charconv>
+#include <climits>
+#include <format>
 #include <memory>
+#include <string_view>
+#include <vector>
+
+namespace
+{
+    // Session ticket key file reload and session statistics period
+    constexpr std::chrono::seconds kHousekeepingInterval{60};
+
+    constexpr unsigned char kSessionIdContext[] = "mtls-mproxy";
+
+    // Upper bound for trusting a cached client chain verification
+    constexpr std::chrono::seconds kVerifyCacheLifetime{3600};
+
+    // Clients that neither finish nor abort the handshake are dropped after this period
+    constexpr std::chrono::seconds kHandshakeTimeout{10};
+
+    // Picks the multiplexed protocol if the client offers it, clients offering nothing else or no ALPN
+    // at all get the plain tunnel
+    int select_mux_protocol(SSL* /*ssl*/,
+                            const unsigned char** out,
+                            unsigned char* outlen,
+                            const unsigned char* in,
+                            unsigned int inlen,
+                            void* /*arg*/)
+    {
+        static const auto protocols = [] {
+            std::vector<unsigned char> list{static_cast<unsigned char>(mtls_mproxy::kMuxAlpnProtocol.size())};
+            list.insert(list.end(), mtls_mproxy::kMuxAlpnProtocol.begin(), mtls_mproxy::kMuxAlpnProtocol.end());
+            return list;
+        }();
+
+        unsigned char* selected{nullptr};
+        if (SSL_select_next_proto(&selected, outlen, protocols.data(), static_cast<unsigned int>(protocols.size()),
+                                  in, inlen) != OPENSSL_NPN_NEGOTIATED)
+            return SSL_TLSEXT_ERR_NOACK;
+
+        *out = selected;
+        return SSL_TLSEXT_ERR_OK;
+    }
+
+    bool mux_negotiated(SSL* ssl)
+    {
+        const unsigned char* protocol{nullptr};
+        unsigned int size{0};
+        SSL_get0_alpn_selected(ssl, &protocol, &size);
+
+        return protocol != nullptr &&
+            std::string_view{reinterpret_cast<const char*>(protocol), size} == mtls_mproxy::kMuxAlpnProtocol;
+    }
+}
 
 namespace mtls_mproxy
 {
     TlsServer::TlsServer(const std::string& port,
                          const TlsOptions& settings,
                          StreamManagerPtr proxy_backend,
-                         asynclog::LoggerFactory log_factory)
+                         asynclog::LoggerFactory log_factory,
+                         AdmissionControl::Options admission,
+                         ConnectionLimiterPtr limiter,
+                   ListenerOptions listener)
         : ssl_ctx_{net::ssl::context::tls_server}
         , signals_(ctx_)
         , acceptor_(ctx_)
@@ -17,6 +76,12 @@ namespace mtls_mproxy
         , logger_factory_{std::move(log_factory)}
         , logger_{logger_factory_.create("tls_server")}
         , stream_id_(0)
+        , housekeeping_timer_{ctx_}
+        , session_stats_{std::make_shared<TlsSessionStats>()}
+        , admission_{admission}
+        , accept_timer_{ctx_}
+        , limiter_{std::move(limiter)}
+        , listener_{listener}
     {
         configure_signals();
         async_wait_signals();
@@ -37,23 +102,38 @@ namespace mtls_mproxy
                                       ? TLS1_3_VERSION
                                       : TLS1_2_VERSION);
 
+        configure_ciphers(settings);
+
         ssl_ctx_.use_certificate_chain_file(settings.server_cert);
         SSL_CTX_set_client_CA_list(ssl_ctx_.native_handle(), SSL_load_client_CA_file(settings.ca_cert.c_str()));
         ssl_ctx_.use_private_key_file(settings.private_key, net::ssl::context::pem);
         ssl_ctx_.load_verify_file(settings.ca_cert);
         ssl_ctx_.set_verify_mode(net::ssl::verify_peer | net::ssl::verify_fail_if_no_peer_cert);
 
+        configure_client_verification(settings);
+        configure_session_resumption(settings);
+        configure_early_data(settings);
+        configure_multiplexing(settings);
+
+        if (settings.handshake_threads > 0) {
+            if (settings.async_handshakes)
+                SSL_CTX_set_mode(ssl_ctx_.native_handle(), SSL_MODE_ASYNC);
+
+            handshake_pool_ = std::make_shared<HandshakePool>(settings.handshake_threads,
+                                                              kHandshakeTimeout,
+                                                              logger_factory_);
+        }
+
         uint16_t listen_port{0};
         std::from_chars(port.data(), port.data() + port.size(), listen_port);
 
         tcp::endpoint ep{tcp::endpoint(tcp::v4(), listen_port)};
-        acceptor_.open(ep.protocol());
-        acceptor_.set_option(tcp::acceptor::reuse_address(true));
-        acceptor_.bind(ep);
-        acceptor_.listen();
+        for (const auto& option : open_listener(acceptor_, ep, listener_))
+            logger_.warn(std::format("{} is not supported, listener starts without it", option));
 
         logger_.info("socks5-proxy tls_server starts on port: " + port);
         start_accept();
+        schedule_housekeeping();
     }
 
     void TlsServer::run()
@@ -73,36 +153,361 @@ namespace mtls_mproxy
             [this](net::error_code /*ec*/, int /*signno*/) {
                 logger_.info("socks5-proxy tls_server stopping");
                 acceptor_.close();
+                accept_timer_.cancel();
+                housekeeping_timer_.cancel();
+                if (handshake_pool_)
+                    handshake_pool_->stop();
                 ctx_.stop();
                 logger_.info("socks5-proxy tls_server stopped");
             });
     }
 
-    void TlsServer::start_accept()
+    void TlsServer::configure_ciphers(const TlsOptions& settings)
+    {
+        auto preferences = default_cipher_preferences();
+        if (!settings.ciphers.ciphersuites.empty())
+            preferences.ciphersuites = settings.ciphers.ciphersuites;
+        if (!settings.ciphers.ciphers.empty())
+            preferences.ciphers = settings.ciphers.ciphers;
+        if (!settings.ciphers.groups.empty())
+            preferences.groups = settings.ciphers.groups;
+
+        apply_cipher_preferences(ssl_ctx_.native_handle(), preferences);
+        logger_.info(std::format("tls cipher suites: {}, groups: {} (aes acceleration: {})",
+                                 preferences.ciphersuites,
+                                 preferences.groups,
+                                 cpu_has_aes_acceleration() ? "yes" : "no"));
+        logger_.debug(std::format("tls 1.2 ciphers: {}", preferences.ciphers));
+    }
+
+    void TlsServer::configure_client_verification(const TlsOptions& settings)
+    {
+        auto* ctx = ssl_ctx_.native_handle();
+
+        if (!settings.crl.empty()) {
+            crl_store_ = std::make_unique<CrlStore>(settings.crl, settings.ca_cert);
+            crl_store_->attach(ctx);
+            logger_.info(std::format("client certificate revocation lists loaded from {}", settings.crl));
+        }
+
+        if (settings.verify_cache_size > 0) {
+            verify_cache_ = std::make_unique<VerifyCache>(settings.verify_cache_size, kVerifyCacheLifetime);
+            verify_cache_->attach(ctx);
+        }
+    }
+
+    void TlsServer::configure_session_resumption(const TlsOptions& settings)
+    {
+        auto* ctx = ssl_ctx_.native_handle();
+
+        // Resumed sessions skip client certificate verification, the context binds them to this listener
+        SSL_CTX_set_session_id_context(ctx, kSessionIdContext, sizeof(kSessionIdContext) - 1);
+        SSL_CTX_set_timeout(ctx, static_cast<long>(settings.session_timeout.count()));
+
+        if (settings.session_cache_size > 0) {
+            SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+            SSL_CTX_sess_set_cache_size(ctx, settings.session_cache_size);
+        } else {
+            SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+        }
+
+        if (!settings.ticket_keys.empty()) {
+            ticket_keys_ = std::make_unique<TicketKeyStore>(settings.ticket_keys);
+            ticket_keys_->attach(ctx);
+            logger_.info(std::format("session ticket keys loaded from {} ({} keys)",
+                                     settings.ticket_keys, ticket_keys_->keys()->size()));
+        }
+    }
+
+    void TlsServer::configure_early_data(const TlsOptions& settings)
     {
-        tcp::socket socket{ctx_.get_executor()};
-        acceptor_.async_accept(
-        [this](const net::error_code& ec, tcp::socket socket) {
-                if (!acceptor_.is_open()) {
-                    logger_.debug("tls proxy server acceptor is closed");
+        if (settings.max_early_data == 0)
+            return;
 
-                    if (ec)
-                        logger_.debug("tls proxy server error: " + ec.message());
+        auto* ctx = ssl_ctx_.native_handle();
+        SSL_CTX_set_max_early_data(ctx, settings.max_early_data);
+        SSL_CTX_set_recv_max_early_data(ctx, settings.max_early_data);
 
-                    return;
+        // With anti-replay OpenSSL issues stateful single use tickets for these sessions, so early data
+        // is only accepted on the instance (and within the cache) that issued the ticket
+        if (!settings.early_data_anti_replay)
+            SSL_CTX_set_options(ctx, SSL_OP_NO_ANTI_REPLAY);
+
+        // Early data is read during the handshake, asio's async_handshake can't do that
+        early_data_enabled_ = true;
+        logger_.info(std::format("tls early data enabled, up to {} bytes, anti-replay {}",
+                                 settings.max_early_data, settings.early_data_anti_replay ? "on" : "off"));
+    }
+
+    void TlsServer::configure_multiplexing(const TlsOptions& settings)
+    {
+        if (settings.mux.max_streams == 0)
+            return;
+
+        mux_options_ = settings.mux;
+        SSL_CTX_set_alpn_select_cb(ssl_ctx_.native_handle(), select_mux_protocol, nullptr);
+        logger_.info(std::format("tls stream multiplexing enabled (alpn {}), up to {} streams per connection, "
+                                 "stream window {} bytes",
+                                 kMuxAlpnProtocol, mux_options_.max_streams, mux_options_.stream_window));
+    }
+
+    void TlsServer::schedule_housekeeping()
+    {
+        housekeeping_timer_.expires_after(kHousekeepingInterval);
+        housekeeping_timer_.async_wait([this](const net::error_code& ec) {
+            if (ec)
+                return;
+
+            if (ticket_keys_) {
+                try {
+                    if (ticket_keys_->reload())
+                        logger_.info(std::format("session ticket keys reloaded ({} keys)", ticket_keys_->keys()->size()));
+                } catch (const std::exception& ex) {
+                    logger_.warn(std::format("session ticket keys reload failed, keeping current keys: {}", ex.what()));
                 }
+            }
 
-                if (!ec) {
-                    auto new_stream = std::make_shared<TlsServerStream>(
-                        stream_manager_,
-                        ++stream_id_,
-                        ssl_socket{std::move(socket), ssl_ctx_},
-                        logger_factory_);
-                    stream_manager_->on_accept(std::move(new_stream));
+            if (crl_store_) {
+                try {
+                    if (crl_store_->reload()) {
+                        // Cached verifications and sessions predate the new revocation data, tickets are
+                        // checked against it when presented
+                        if (verify_cache_)
+                            verify_cache_->invalidate();
+                        SSL_CTX_flush_sessions(ssl_ctx_.native_handle(), LONG_MAX);
+                        logger_.info("client certificate revocation lists reloaded");
+                    }
+                } catch (const std::exception& ex) {
+                    logger_.warn(std::format("revocation lists reload failed, keeping current lists: {}", ex.what()));
                 }
+            }
+
+            report_session_stats();
+            schedule_housekeeping();
+        });
+    }
 
+    void TlsServer::report_session_stats()
+    {
+        const auto full = session_stats_->full_handshakes.load(std::memory_order_relaxed);
+        const auto resumed = session_stats_->resumed_handshakes.load(std::memory_order_relaxed);
+        const auto failed = session_stats_->failed_handshakes.load(std::memory_order_relaxed);
+
+        const auto handshakes = full + resumed;
+        if (handshakes + failed == reported_handshakes_)
+            return;
+        reported_handshakes_ = handshakes + failed;
+
+        const auto hit_rate = handshakes > 0 ? 100.0 * static_cast<double>(resumed) / static_cast<double>(handshakes) : 0.0;
+
+        auto* ctx = ssl_ctx_.native_handle();
+        logger_.info(std::format("tls sessions: handshakes {}, resumed {} (hit rate {:.1f}%), failed {}, "
+                                 "cached {}, cache timeouts {}",
+                                 handshakes,
+                                 resumed,
+                                 hit_rate,
+                                 failed,
+                                 SSL_CTX_sess_number(ctx),
+                                 SSL_CTX_sess_timeouts(ctx)));
+
+        if (verify_cache_)
+            logger_.info(std::format("client verify cache: hits {}, misses {}, entries {}",
+                                     verify_cache_->hits(), verify_cache_->misses(), verify_cache_->size()));
+    }
+
+    void TlsServer::start_accept()
+    {
+        while (!held_.empty()) {
+            const auto live = stream_manager_->live_sessions() + pending_handshakes_;
+            const auto delay = admission_.accept_delay(live);
+            if (delay > AdmissionControl::Clock::duration::zero() || !admission_.admit(live)) {
+                pause_accept(delay > AdmissionControl::Clock::duration::zero() ? delay : AdmissionControl::kPauseInterval);
+                return;
+            }
+
+            auto held = std::move(held_.front());
+            held_.pop_front();
+            open_session(std::move(held.socket), std::move(held.lease));
+        }
+
+        // Every outstanding accept has to find room for its connection
+        const auto accepts = std::min(listener_.accepts,
+                                      admission_.accept_headroom(stream_manager_->live_sessions() + pending_handshakes_));
+        if (accepts == 0) {
+            pause_accept(AdmissionControl::kPauseInterval);
+            return;
+        }
+
+        while (accepts_in_flight_ < accepts) {
+            const auto delay = admission_.accept_delay(stream_manager_->live_sessions() + pending_handshakes_);
+            if (delay > AdmissionControl::Clock::duration::zero()) {
+                pause_accept(delay);
+                return;
+            }
+
+            if (accept_paused_) {
+                accept_paused_ = false;
+                logger_.info("tls proxy server accepting resumed");
+            }
+
+            accept();
+        }
+    }
+
+    void TlsServer::pause_accept(AdmissionControl::Clock::duration delay)
+    {
+        if (!accept_paused_) {
+            accept_paused_ = true;
+            logger_.warn(std::format("tls proxy server overloaded, accepting paused, live sessions {}, handshakes {}",
+                                     stream_manager_->live_sessions(), pending_handshakes_));
+        }
+
+        // One timer tops the outstanding accepts up again
+        if (accept_timer_armed_)
+            return;
+
+        accept_timer_armed_ = true;
+        accept_timer_.expires_after(delay);
+        accept_timer_.async_wait([this](const net::error_code& ec) {
+            accept_timer_armed_ = false;
+            if (!ec)
                 start_accept();
-            });
+        });
+    }
+
+    void TlsServer::accept()
+    {
+        ++accepts_in_flight_;
+        auto on_accept = [this](const net::error_code& ec, tcp::socket socket) {
+            --accepts_in_flight_;
+            if (!acceptor_.is_open()) {
+                logger_.debug("tls proxy server acceptor is closed");
+
+                if (ec)
+                    logger_.debug("tls proxy server error: " + ec.message());
+
+                return;
+            }
+
+            if (ec == net::error::no_descriptors || ec == std::errc::too_many_files_open_in_system) {
+                logger_.warn("tls proxy server error: " + ec.message());
+                admission_.on_descriptors_exhausted();
+            }
+
+            ConnectionLease lease;
+            net::error_code remote_ec;
+            const auto remote = ec ? tcp::endpoint{} : socket.remote_endpoint(remote_ec);
+
+            // A refusal would need a handshake first, connections over the limits are reset
+            if (!ec && limiter_ && !remote_ec && !limiter_->admit_source(lease, remote.address())) {
+                admission_.reject(socket, {});
+                logger_.debug(std::format("connection from {} rejected, source over its limits ({} rejected)",
+                                          remote.address().to_string(), limiter_->rejected()));
+            } else if (!ec) {
+                admit(std::move(socket), std::move(lease));
+            }
+
+            start_accept();
+        };
+
+        // Sockets that go through the handshake pool are accepted straight onto a worker loop
+        if (handshake_pool_)
+            acceptor_.async_accept(handshake_pool_->next_executor(), std::move(on_accept));
+        else
+            acceptor_.async_accept(std::move(on_accept));
+    }
+
+    void TlsServer::admit(tcp::socket socket, ConnectionLease lease)
+    {
+        if (held_.empty() && admission_.admit(stream_manager_->live_sessions() + pending_handshakes_)) {
+            open_session(std::move(socket), std::move(lease));
+        } else if (admission_.options().action == OverloadAction::pause) {
+            // Waits like the connections still in the backlog, in order
+            held_.push_back({std::move(socket), std::move(lease)});
+        } else {
+            admission_.reject(socket, {});
+            logger_.debug(std::format("connection rejected, tls proxy server overloaded ({} rejected)",
+                                      admission_.rejected()));
+        }
+    }
+
+    void TlsServer::open_session(tcp::socket socket, ConnectionLease lease)
+    {
+        apply_socket_options(socket, listener_.sockets);
+
+        // The protocol is known once the handshake is done, multiplexed connections need it
+        // before a stream is handed to the stream manager, and so does the identity check
+        if (handshake_pool_ || early_data_enabled_ || mux_options_.max_streams > 0 ||
+            (limiter_ && limiter_->identity_limited())) {
+            offload_handshake(std::move(socket), std::move(lease));
+            return;
+        }
+
+        auto new_stream = std::make_shared<TlsServerStream>(
+            stream_manager_,
+            ++stream_id_,
+            ssl_socket{std::move(socket), ssl_ctx_},
+            session_stats_,
+            logger_factory_);
+        new_stream->hold(std::move(lease));
+        stream_manager_->on_accept(std::move(new_stream));
+    }
+
+    void TlsServer::offload_handshake(tcp::socket socket, ConnectionLease lease)
+    {
+        const auto id = ++stream_id_;
+        net::error_code ec;
+        const auto endpoint = socket.remote_endpoint(ec);
+        const auto remote = ec ? std::string{"unknown"} : aux::to_string(endpoint);
+
+        ++pending_handshakes_;
+        // The handler is copyable, the lease is moved to the stream once the handshake is done
+        auto held = std::make_shared<ConnectionLease>(std::move(lease));
+        auto on_handshake = [this, id, remote, held](const net::error_code& ec, tcp::socket socket, SslPtr ssl, IoBuffer early_data) {
+            --pending_handshakes_;
+            if (ec) {
+                session_stats_->failed_handshakes.fetch_add(1, std::memory_order_relaxed);
+                logger_.warn(std::format("[{}] mtls auth error [{}]: {}", id, remote, ec.message()));
+                return;
+            }
+
+            if (limiter_ && !limiter_->admit_identity(*held, peer_certificate_subject(ssl.get()))) {
+                logger_.warn(std::format("[{}] connection from [{}] rejected, client identity over its limits ({} rejected)",
+                                         id, remote, limiter_->rejected()));
+                return;
+            }
+
+            if (mux_options_.max_streams > 0 && mux_negotiated(ssl.get())) {
+                auto connection = std::make_shared<MuxConnection>(
+                    ssl_socket{std::move(socket), ssl.release()},
+                    id,
+                    stream_manager_,
+                    [this]() { return ++stream_id_; },
+                    mux_options_,
+                    session_stats_,
+                    logger_factory_,
+                    std::move(early_data));
+                connection->hold(std::move(*held));
+                connection->start();
+                return;
+            }
+
+            auto new_stream = std::make_shared<TlsServerStream>(
+                stream_manager_,
+                id,
+                ssl_socket{std::move(socket), ssl.release()},
+                session_stats_,
+                logger_factory_,
+                true,
+                std::move(early_data));
+            new_stream->hold(std::move(*held));
+            stream_manager_->on_accept(std::move(new_stream));
+        };
+
+        if (handshake_pool_)
+            handshake_pool_->handshake(std::move(socket), ssl_ctx_.native_handle(), ctx_.get_executor(), std::move(on_handshake));
+        else
+            async_server_handshake(std::move(socket), ssl_ctx_.native_handle(), kHandshakeTimeout, ctx_.get_executor(), std::move(on_handshake));
     }
 
     TlsServer::~TlsServer()
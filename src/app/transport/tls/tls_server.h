@@ -1,7 +1,16 @@
 #ifndef MTLS_MPROXY_TRANSPORT_TLS_SERVER_H
 #define MTLS_MPROXY_TRANSPORT_TLS_SERVER_H
 
+#include "transport/admission_control.h"
+#include "transport/listener.h"
 #include "transport/stream_manager.h"
+#include "transport/mux/mux_connection.h"
+#include "cipher_preferences.h"
+#include "crl_store.h"
+#include "handshake_pool.h"
+#include "ticket_key_store.h"
+#include "tls_session_stats.h"
+#include "verify_cache.h"
 
 #include <asynclog/logger_factory.h>
 
@@ -9,8 +18,12 @@
 #include <asio/ip/tcp.hpp>
 #include <asio/ssl.hpp>
 #include <asio/signal_set.hpp>
+#include <asio/steady_timer.hpp>
 
+#include <chrono>
+#include <deque>
 #include <filesystem>
+#include <memory>
 
 namespace mtls_mproxy
 {
@@ -26,12 +39,36 @@ namespace mtls_mproxy
             std::string server_cert;
             std::string ca_cert;
             std::string version;
+            // Cipher suite and group preference lists, empty entries use CPU dependent defaults
+            CipherPreferences ciphers;
+            // Stateful server session cache size, 0 disables the cache (tickets still work)
+            long session_cache_size{20480};
+            std::chrono::seconds session_timeout{7200};
+            // Shared session ticket key file, per process random keys are used if empty
+            std::string ticket_keys;
+            // Handshake worker threads, 0 runs handshakes on the relay event loop
+            std::size_t handshake_threads{0};
+            // SSL_MODE_ASYNC for async capable key engines/providers, requires handshake threads
+            bool async_handshakes{false};
+            // Cached successful client chain verifications, 0 disables the cache
+            std::size_t verify_cache_size{1024};
+            // PEM file with client certificate revocation lists, reloaded when modified
+            std::string crl;
+            // TLS 1.3 0-RTT data accepted from resumed clients in bytes, 0 disables early data
+            std::uint32_t max_early_data{0};
+            // Single use tickets for sessions that allow early data, off accepts replayed early data
+            bool early_data_anti_replay{true};
+            // Multiplexed connections for clients negotiating the mux ALPN protocol, off by default
+            MuxConnection::Options mux;
         };
 
         explicit TlsServer(const std::string& port,
                            const TlsOptions& settings,
                            StreamManagerPtr proxy_backend,
-                           asynclog::LoggerFactory log_factory);
+                           asynclog::LoggerFactory log_factory,
+                           AdmissionControl::Options admission = {},
+                           ConnectionLimiterPtr limiter = nullptr,
+                           ListenerOptions listener = {});
         virtual ~TlsServer();
 
         TlsServer(const TlsServer& other) = delete;
@@ -47,11 +84,53 @@ namespace mtls_mproxy
         asynclog::LoggerFactory logger_factory_;
         asynclog::ScopedLogger logger_;
         int stream_id_;
+        std::unique_ptr<TicketKeyStore> ticket_keys_;
+        net::steady_timer housekeeping_timer_;
+        TlsSessionStatsPtr session_stats_;
+        std::uint64_t reported_handshakes_{0};
+        HandshakePoolPtr handshake_pool_;
+        bool early_data_enabled_{false};
+        std::unique_ptr<CrlStore> crl_store_;
+        std::unique_ptr<VerifyCache> verify_cache_;
+        MuxConnection::Options mux_options_;
+        AdmissionControl admission_;
+        // Retries a paused accept
+        net::steady_timer accept_timer_;
+        bool accept_paused_{false};
+        bool accept_timer_armed_{false};
+        // Accepted connections still in the handshake, they count against the session limit
+        std::size_t pending_handshakes_{0};
+        // nullptr if no per peer limits are set
+        ConnectionLimiterPtr limiter_;
+        ListenerOptions listener_;
+        std::size_t accepts_in_flight_{0};
+
+        struct HeldConnection {
+            tcp::socket socket;
+            ConnectionLease lease;
+        };
+        // Connections accepted over the limits with the pause action, admitted before any new accept
+        std::deque<HeldConnection> held_;
 
         void configure_signals();
         void async_wait_signals();
 
+        void configure_ciphers(const TlsOptions& settings);
+        void configure_client_verification(const TlsOptions& settings);
+        void configure_session_resumption(const TlsOptions& settings);
+        void configure_early_data(const TlsOptions& settings);
+        void configure_multiplexing(const TlsOptions& settings);
+        void schedule_housekeeping();
+        void report_session_stats();
+
+        // Tops the outstanding accepts up to the configured number unless the admission control pauses
         void start_accept();
+        void pause_accept(AdmissionControl::Clock::duration delay);
+        void accept();
+        // Opens the session of an accepted connection, rejects or holds it if it isn't admitted
+        void admit(tcp::socket socket, ConnectionLease lease);
+        void open_session(tcp::socket socket, ConnectionLease lease);
+        void offload_handshake(tcp::socket socket, ConnectionLease lease);
     };
 }
 
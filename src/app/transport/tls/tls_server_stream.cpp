@@ -1,15 +1,35 @@
 #include "tls_server_stream.h"
+#include "peer_identity.h"
 #include "transport/stream_manager.h"
+#include "transport/udp_batch.h"
 
 #include "auxiliary/helpers.h"
 
+#include <asio/post.hpp>
 #include <asio/write.hpp>
 
+#include <utility>
+
 namespace
 {
     namespace net = asio;
     using ssl_socket = net::ssl::stream<net::ip::tcp::socket>;
 
+    // Record payload that fits one TCP segment with the TLS record overhead, so the peer can decrypt
+    // it as soon as the segment arrives
+    constexpr std::size_t kSmallRecordSize = 1400;
+    constexpr std::size_t kLargeRecordSize = 16384;
+    // Bytes sent in small records before switching to full size records
+    constexpr std::size_t kRampUpBytes = 64 * 1024;
+    // Idle period after which a stream starts over with small records
+    constexpr std::chrono::seconds kRecordIdleTimeout{1};
+
+    // Length prefix of a UDP associate frame, big-endian
+    constexpr std::size_t kFrameHeaderSize = 2;
+    constexpr std::size_t kMaxFrameSize = 0xffff;
+    // Framed datagrams waiting for TLS, newer datagrams are dropped instead of delaying the older ones
+    constexpr std::size_t kMaxQueuedDatagramBytes = 256 * 1024;
+
     std::string ep_to_str(const ssl_socket& sock)
     {
         if (!sock.lowest_layer().is_open())
@@ -29,13 +49,21 @@ namespace mtls_mproxy
     TlsServerStream::TlsServerStream(const StreamManagerPtr& ptr,
                                      int id,
                                      ssl_socket&& socket,
-                                     const asynclog::LoggerFactory& log_factory)
+                                     TlsSessionStatsPtr stats,
+                                     const asynclog::LoggerFactory& log_factory,
+                                     bool handshake_completed,
+                                     IoBuffer early_data)
         : ServerStream{ptr, id}
         , socket_{std::move(socket)}
+        , stats_{std::move(stats)}
         , logger_{log_factory.create("tls_server_stream")}
+        , handshake_completed_{handshake_completed}
+        , early_data_{std::move(early_data)}
         , read_buffer_{}
-        , write_buffer_{}
+        , budget_{ptr->flow_control()}
     {
+        pending_.reserve(kLargeRecordSize);
+        in_flight_.reserve(kLargeRecordSize);
     }
 
     TlsServerStream::~TlsServerStream()
@@ -48,7 +76,12 @@ namespace mtls_mproxy
     void TlsServerStream::start()
     {
         logger_.debug(std::format("[{}] incoming connection from client: [{}]", id(), ep_to_str(socket_)));
-        do_handshake();
+        if (!handshake_completed_) {
+            do_handshake();
+            return;
+        }
+
+        net::post(socket_.get_executor(), [this, self{shared_from_this()}]() { on_handshake_completed(); });
     }
 
     void TlsServerStream::stop()
@@ -56,11 +89,37 @@ namespace mtls_mproxy
         if (!socket_.lowest_layer().is_open())
             return;
 
+        // A client that stops reading would keep the drain and the TLS shutdown waiting forever
+        if (!drain_timer_.has_value()) {
+            drain_timer_.emplace(socket_.get_executor());
+            drain_timer_->expires_after(budget_.limits().drain_timeout);
+            drain_timer_->async_wait([this, self{shared_from_this()}](const net::error_code& ec) {
+                if (!ec && socket_.lowest_layer().is_open()) {
+                    logger_.debug(std::format("[{}] buffered data not drained in time, closing", id()));
+                    net::error_code ignored_ec;
+                    socket_.lowest_layer().close(ignored_ec);
+                }
+            });
+        }
+
+        // Relayed data still buffered goes out before close_notify
+        if (writing_ || !pending_.empty()) {
+            stopping_ = true;
+            return;
+        }
+
+        do_shutdown();
+    }
+
+    void TlsServerStream::do_shutdown()
+    {
         socket_.async_shutdown(
             [this, self{shared_from_this()}](const net::error_code& ec) {
                 if (ec && ec != net::error::eof && ec != net::ssl::error::stream_truncated)
                     handle_error(ec);
-                socket_.lowest_layer().close();
+                net::error_code ignored_ec;
+                socket_.lowest_layer().close(ignored_ec);
+                drain_timer_->cancel();
             });
 
         net::async_write(
@@ -68,7 +127,9 @@ namespace mtls_mproxy
             [this, self{shared_from_this()}](const net::error_code& ec, std::size_t trans_bytes) {
                 if (ec)
                     handle_error(ec);
-                socket_.lowest_layer().close();
+                net::error_code ignored_ec;
+                socket_.lowest_layer().close(ignored_ec);
+                drain_timer_->cancel();
             });
     }
 
@@ -78,35 +139,189 @@ namespace mtls_mproxy
             net::ssl::stream_base::server,
             [this, self{shared_from_this()}](const net::error_code& ec) {
                 if (!ec) {
-                    manager()->on_server_ready(self);
+                    on_handshake_completed();
                 } else {
+                    stats_->failed_handshakes.fetch_add(1, std::memory_order_relaxed);
                     logger_.warn(std::format("[{}] mtls auth error [{}]", id(), ep_to_str(socket_)));
                     handle_error(ec);
                 }
             });
     }
 
+    void TlsServerStream::on_handshake_completed()
+    {
+        if (SSL_session_reused(socket_.native_handle()))
+            stats_->resumed_handshakes.fetch_add(1, std::memory_order_relaxed);
+        else
+            stats_->full_handshakes.fetch_add(1, std::memory_order_relaxed);
+
+        client_identity_ = peer_certificate_subject(socket_.native_handle());
+        manager()->on_server_ready(shared_from_this());
+    }
+
     void TlsServerStream::write(IoBuffer event)
     {
-        std::ranges::copy(event, write_buffer_.begin());
+        if (udp_framing_) {
+            write_datagram(std::move(event));
+            return;
+        }
+        // The UDP associate reply is the last write without framing
+        udp_framing_ = udp_associated_;
+
+        const auto size = event.size();
+        pending_.insert(pending_.end(), event.begin(), event.end());
+        if (!writing_)
+            flush();
+
+        // The manager may relay the next chunk while this one is being written, as long as the
+        // buffered data stays below the high watermark
+        if (budget_.queue(size))
+            net::post(socket_.get_executor(), [this, self{shared_from_this()}]() { manager()->on_write(self); });
+    }
+
+    std::size_t TlsServerStream::next_record_size()
+    {
+        const auto now = std::chrono::steady_clock::now();
+        if (now - last_write_ > kRecordIdleTimeout)
+            ramp_up_bytes_ = 0;
+        last_write_ = now;
+
+        return ramp_up_bytes_ < kRampUpBytes ? kSmallRecordSize : kLargeRecordSize;
+    }
+
+    void TlsServerStream::flush()
+    {
+        if (const auto record_size = next_record_size(); record_size != record_size_) {
+            SSL_set_max_send_fragment(socket_.native_handle(), static_cast<long>(record_size));
+            record_size_ = record_size;
+        }
+
+        in_flight_.swap(pending_);
+        pending_.clear();
+        ramp_up_bytes_ += in_flight_.size();
+        writing_ = true;
+
         net::async_write(
-            socket_, net::buffer(write_buffer_, event.size()),
+            socket_, net::buffer(in_flight_),
                 [this, self{shared_from_this()}](const net::error_code& ec, size_t) {
-                if (!ec) {
-                    manager()->on_write(self);
-                } else {
+                writing_ = false;
+                last_write_ = std::chrono::steady_clock::now();
+
+                if (ec) {
+                    if (stopping_) {
+                        net::error_code ignored_ec;
+                        socket_.lowest_layer().close(ignored_ec);
+                        return;
+                    }
                     handle_error(ec);
+                    return;
+                }
+
+                const auto resume = budget_.drain(in_flight_.size());
+                if (!pending_.empty())
+                    flush();
+
+                if (resume)
+                    manager()->on_write(self);
+
+                if (stopping_ && !writing_ && socket_.lowest_layer().is_open()) {
+                    stopping_ = false;
+                    do_shutdown();
                 }
             });
     }
 
+    // Datagrams of a burst are framed into one write, the flush runs after the burst was relayed
+    void TlsServerStream::post_flush()
+    {
+        if (writing_ || udp_flush_posted_)
+            return;
+
+        udp_flush_posted_ = true;
+        net::post(socket_.get_executor(), [this, self{shared_from_this()}]() {
+            udp_flush_posted_ = false;
+            if (!writing_ && !pending_.empty() && socket_.lowest_layer().is_open())
+                flush();
+        });
+    }
+
+    // +------------------ + -------------------------------------------- +
+    // | LENGTH (2 bytes)  |  RSV | FRAG | ATYP | ADDR | PORT | DATA       |
+    // +------------------ + -------------------------------------------- +
+    void TlsServerStream::write_datagram(IoBuffer datagram)
+    {
+        const auto size = datagram.size();
+        if (size > kMaxFrameSize || pending_.size() + kFrameHeaderSize + size > kMaxQueuedDatagramBytes) {
+            if (udp_dropped_++ == 0)
+                logger_.warn(std::format("[{}] udp over tls write queue is full, dropping datagrams", id()));
+            recycle_datagram_buffer(std::move(datagram));
+            return;
+        }
+
+        if (udp_dropped_ > 0) {
+            logger_.info(std::format("[{}] {} datagrams dropped on the udp over tls write queue",
+                                     id(), std::exchange(udp_dropped_, 0)));
+        }
+
+        pending_.push_back(static_cast<std::uint8_t>(size >> 8));
+        pending_.push_back(static_cast<std::uint8_t>(size & 0xff));
+        pending_.insert(pending_.end(), datagram.begin(), datagram.end());
+        recycle_datagram_buffer(std::move(datagram));
+
+        post_flush();
+    }
+
+    // The association is served by this stream, the bound address is the one the client connected to
     std::vector<std::uint8_t> TlsServerStream::udp_associate()
     {
-        return {};
+        net::error_code ec;
+        const auto ep = socket_.lowest_layer().local_endpoint(ec);
+        if (ec)
+            return {};
+
+        udp_associated_ = true;
+        return aux::endpoint_to_bytes(ep);
+    }
+
+    std::string TlsServerStream::remote_address()
+    {
+        net::error_code ec;
+        const auto rep = socket_.lowest_layer().remote_endpoint(ec);
+        return ec ? std::string{} : rep.address().to_string();
+    }
+
+    std::string TlsServerStream::client_identity()
+    {
+        return client_identity_;
+    }
+
+    // Records received past the handshake are application data as a rule, post-handshake messages from
+    // the client are rare
+    bool TlsServerStream::has_data_ready()
+    {
+        if (!early_data_.empty() || SSL_pending(socket_.native_handle()) > 0)
+            return true;
+
+        net::error_code ec;
+        return socket_.lowest_layer().available(ec) > 0 && !ec;
     }
 
     void TlsServerStream::read()
     {
+        if (udp_framing_) {
+            read_datagrams();
+            return;
+        }
+
+        if (!early_data_.empty()) {
+            logger_.debug(std::format("[{}] relaying {} bytes of early data", id(), early_data_.size()));
+            net::post(socket_.get_executor(), [this, self{shared_from_this()}, event{std::move(early_data_)}]() mutable {
+                manager()->on_read(std::move(event), self);
+            });
+            early_data_.clear();
+            return;
+        }
+
         socket_.async_read_some(
             net::buffer(read_buffer_),
             [this, self{shared_from_this()}](const net::error_code& ec, const size_t length) {
@@ -124,6 +339,63 @@ namespace mtls_mproxy
             });
     }
 
+    void TlsServerStream::read_datagrams()
+    {
+        if (udp_dispatching_) {
+            udp_read_requested_ = true;
+            return;
+        }
+
+        if (udp_read_in_progress_)
+            return;
+
+        udp_read_in_progress_ = true;
+        socket_.async_read_some(
+            net::buffer(read_buffer_),
+            [this, self{shared_from_this()}](const net::error_code& ec, const size_t length) {
+                udp_read_in_progress_ = false;
+                if (!ec) {
+                    udp_frames_.insert(udp_frames_.end(), read_buffer_.data(), read_buffer_.data() + length);
+                    dispatch_datagrams();
+                } else {
+                    if (ec == net::error::eof || ec == net::ssl::error::stream_truncated) {
+                        socket_.lowest_layer().close();
+                        handle_error({});
+                    } else {
+                        handle_error(ec);
+                    }
+                }
+            });
+    }
+
+    void TlsServerStream::dispatch_datagrams()
+    {
+        const auto self{shared_from_this()};
+        std::size_t pos{0};
+        std::size_t delivered{0};
+
+        udp_dispatching_ = true;
+        while (udp_frames_.size() - pos >= kFrameHeaderSize) {
+            const std::size_t size = (udp_frames_[pos] << 8) | udp_frames_[pos + 1];
+            if (udp_frames_.size() - pos - kFrameHeaderSize < size)
+                break;
+
+            const auto first = udp_frames_.begin() + static_cast<std::ptrdiff_t>(pos + kFrameHeaderSize);
+            auto datagram = take_datagram_buffer();
+            datagram.assign(first, first + static_cast<std::ptrdiff_t>(size));
+            pos += kFrameHeaderSize + size;
+            ++delivered;
+            manager()->on_read(std::move(datagram), self);
+        }
+        udp_dispatching_ = false;
+
+        udp_frames_.erase(udp_frames_.begin(), udp_frames_.begin() + static_cast<std::ptrdiff_t>(pos));
+
+        // An incomplete frame keeps the pending read request open
+        if (std::exchange(udp_read_requested_, false) || delivered == 0)
+            read_datagrams();
+    }
+
     void TlsServerStream::handle_error(const net::error_code& ec)
     {
         manager()->on_error(ec, shared_from_this());
@@ -2,19 +2,23 @@
 #define MTLS_MPROXY_TRANSPORT_TLS_SERVER_STREAM_H
 
 #include "transport/server_stream.h"
+#include "transport/flow_control.h"
+#include "tls_session_stats.h"
 
 #include <asio/ip/tcp.hpp>
-#include <asio/ip/udp.hpp>
 #include <asio/ssl.hpp>
+#include <asio/steady_timer.hpp>
 
 #include <asynclog/logger_factory.h>
 #include <asynclog/scoped_logger.h>
 
+#include <chrono>
+#include <optional>
+
 namespace mtls_mproxy
 {
     namespace net = asio;
     using tcp = asio::ip::tcp;
-    using udp = asio::ip::tcp;
     using ssl_socket = net::ssl::stream<net::ip::tcp::socket>;
 
     class TlsServerStream final
@@ -25,7 +29,10 @@ namespace mtls_mproxy
         TlsServerStream(const StreamManagerPtr& ptr,
                         int id,
                         ssl_socket&& socket,
-                        const asynclog::LoggerFactory& log_factory);
+                        TlsSessionStatsPtr stats,
+                        const asynclog::LoggerFactory& log_factory,
+                        bool handshake_completed = false,
+                        IoBuffer early_data = {});
         ~TlsServerStream() override;
 
         net::any_io_executor executor() override;
@@ -35,18 +42,63 @@ namespace mtls_mproxy
         void read() override;
         void write(IoBuffer event) override;
         std::vector<std::uint8_t> udp_associate() override;
+        std::string remote_address() override;
+        std::string client_identity() override;
+        bool has_data_ready() override;
 
     private:
         void do_handshake();
+        void on_handshake_completed();
+
+        void flush();
+        void post_flush();
+        std::size_t next_record_size();
+        void do_shutdown();
+
+        void write_datagram(IoBuffer datagram);
+        void read_datagrams();
+        void dispatch_datagrams();
 
         void handle_error(const net::error_code& ec);
 
         ssl_socket socket_;
-        std::optional<udp::socket> udp_socket_;
+        TlsSessionStatsPtr stats_;
         asynclog::ScopedLogger logger_;
+        std::string client_identity_;
+        // Set when the handshake already ran on the handshake pool
+        bool handshake_completed_;
+        // 0-RTT data received during the handshake, delivered by the first read
+        IoBuffer early_data_;
 
         std::array<std::uint8_t, max_buffer_size> read_buffer_;
-        std::array<std::uint8_t, max_buffer_size> write_buffer_;
+
+        // Data not handed to TLS yet, adjacent chunks relayed while a write is in flight are coalesced
+        // here and go out together in the next records
+        IoBuffer pending_;
+        IoBuffer in_flight_;
+        WriteBudget budget_;
+        bool writing_{false};
+        bool stopping_{false};
+        // Closes the socket of a stopped stream whose buffered data and close_notify don't go out in time
+        std::optional<net::steady_timer> drain_timer_;
+
+        // SOCKS5 UDP associate: after the reply every datagram travels in a frame with a 2 byte length
+        // prefix in both directions
+        bool udp_associated_{false};
+        bool udp_framing_{false};
+        // Received bytes of frames not delivered yet, at most one incomplete frame after a dispatch
+        IoBuffer udp_frames_;
+        bool udp_read_in_progress_{false};
+        // Set while the received datagrams are handed to the manager, their read requests are deferred
+        bool udp_dispatching_{false};
+        bool udp_read_requested_{false};
+        bool udp_flush_posted_{false};
+        // Datagrams dropped since the write queue was last below its limit
+        std::size_t udp_dropped_{0};
+
+        std::size_t record_size_{0};
+        std::size_t ramp_up_bytes_{0};
+        std::chrono::steady_clock::time_point last_write_{};
     };
 }
 #endif // MTLS_MPROXY_TRANSPORT_TLS_SERVER_STREAM_H
@@ -0,0 +1,20 @@
+#ifndef MTLS_MPROXY_TRANSPORT_TLS_SESSION_STATS_H
+#define MTLS_MPROXY_TRANSPORT_TLS_SESSION_STATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace mtls_mproxy
+{
+    // Handshake counters of a TLS listener, updated by its streams once a handshake completes
+    struct TlsSessionStats {
+        std::atomic<std::uint64_t> full_handshakes{0};
+        std::atomic<std::uint64_t> resumed_handshakes{0};
+        std::atomic<std::uint64_t> failed_handshakes{0};
+    };
+
+    using TlsSessionStatsPtr = std::shared_ptr<TlsSessionStats>;
+}
+
+#endif // MTLS_MPROXY_TRANSPORT_TLS_SESSION_STATS_H
@@ -0,0 +1,160 @@
+#include "verify_cache.h"
+
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include <algorithm>
+#include <array>
+
+namespace
+{
+    constexpr std::size_t kDigestSize = 32;
+
+    using Digest = std::array<unsigned char, kDigestSize>;
+
+    bool cert_digest(X509* cert, Digest& digest)
+    {
+        unsigned int length{0};
+        return X509_digest(cert, EVP_sha256(), digest.data(), &length) == 1 && length == kDigestSize;
+    }
+
+    // Leaf fingerprint followed by the hash over the fingerprints of every presented certificate
+    std::string make_key(X509_STORE_CTX* store_ctx)
+    {
+        X509* leaf = X509_STORE_CTX_get0_cert(store_ctx);
+        Digest leaf_digest{};
+        if (!leaf || !cert_digest(leaf, leaf_digest))
+            return {};
+
+        EVP_MD_CTX* md_ctx = EVP_MD_CTX_new();
+        if (!md_ctx)
+            return {};
+
+        Digest chain_digest{};
+        unsigned int length{0};
+        bool ok = EVP_DigestInit_ex(md_ctx, EVP_sha256(), nullptr) == 1;
+        if (STACK_OF(X509)* chain = X509_STORE_CTX_get0_untrusted(store_ctx)) {
+            for (int i = 0; ok && i < sk_X509_num(chain); ++i) {
+                Digest digest{};
+                ok = cert_digest(sk_X509_value(chain, i), digest) &&
+                    EVP_DigestUpdate(md_ctx, digest.data(), digest.size()) == 1;
+            }
+        }
+        ok = ok && EVP_DigestFinal_ex(md_ctx, chain_digest.data(), &length) == 1;
+        EVP_MD_CTX_free(md_ctx);
+        if (!ok)
+            return {};
+
+        std::string key(2 * kDigestSize, '\0');
+        std::ranges::copy(leaf_digest, key.begin());
+        std::ranges::copy(chain_digest, key.begin() + kDigestSize);
+        return key;
+    }
+
+    // Time left until the first certificate of the verified chain expires
+    std::chrono::seconds chain_validity(X509_STORE_CTX* store_ctx, std::chrono::seconds limit)
+    {
+        STACK_OF(X509)* chain = X509_STORE_CTX_get0_chain(store_ctx);
+        if (!chain)
+            return std::chrono::seconds{0};
+
+        for (int i = 0; i < sk_X509_num(chain); ++i) {
+            int days{0};
+            int seconds{0};
+            if (!ASN1_TIME_diff(&days, &seconds, nullptr, X509_get0_notAfter(sk_X509_value(chain, i))))
+                return std::chrono::seconds{0};
+
+            limit = std::min(limit, std::chrono::seconds{std::int64_t{days} * 86400 + seconds});
+        }
+
+        return limit;
+    }
+}
+
+namespace mtls_mproxy
+{
+    VerifyCache::VerifyCache(std::size_t capacity, std::chrono::seconds lifetime)
+        : capacity_{capacity}
+        , lifetime_{lifetime}
+    {
+        index_.reserve(capacity_);
+    }
+
+    void VerifyCache::attach(SSL_CTX* ctx)
+    {
+        SSL_CTX_set_cert_verify_callback(ctx, &VerifyCache::verify_callback, this);
+    }
+
+    void VerifyCache::invalidate()
+    {
+        std::lock_guard lock{mutex_};
+        entries_.clear();
+        index_.clear();
+    }
+
+    std::size_t VerifyCache::size() const
+    {
+        std::lock_guard lock{mutex_};
+        return entries_.size();
+    }
+
+    int VerifyCache::verify_callback(X509_STORE_CTX* store_ctx, void* arg)
+    {
+        return static_cast<VerifyCache*>(arg)->verify(store_ctx);
+    }
+
+    int VerifyCache::verify(X509_STORE_CTX* store_ctx)
+    {
+        auto key = make_key(store_ctx);
+        if (!key.empty() && lookup(key)) {
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            X509_STORE_CTX_set_error(store_ctx, X509_V_OK);
+            return 1;
+        }
+
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        const auto result = X509_verify_cert(store_ctx);
+        if (result == 1 && !key.empty() && X509_STORE_CTX_get_error(store_ctx) == X509_V_OK) {
+            const auto validity = chain_validity(store_ctx, lifetime_);
+            if (validity.count() > 0)
+                insert(std::move(key), Clock::now() + validity);
+        }
+
+        return result;
+    }
+
+    bool VerifyCache::lookup(const std::string& key)
+    {
+        std::lock_guard lock{mutex_};
+        const auto it = index_.find(key);
+        if (it == index_.end())
+            return false;
+
+        if (it->second->expires <= Clock::now()) {
+            entries_.erase(it->second);
+            index_.erase(it);
+            return false;
+        }
+
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return true;
+    }
+
+    void VerifyCache::insert(std::string key, Clock::time_point expires)
+    {
+        std::lock_guard lock{mutex_};
+        if (const auto it = index_.find(key); it != index_.end()) {
+            it->second->expires = expires;
+            entries_.splice(entries_.begin(), entries_, it->second);
+            return;
+        }
+
+        if (entries_.size() >= capacity_) {
+            index_.erase(entries_.back().key);
+            entries_.pop_back();
+        }
+
+        entries_.push_front({key, expires});
+        index_.emplace(std::move(key), entries_.begin());
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef MTLS_MPROXY_TRANSPORT_TLS_VERIFY_CACHE_H
+#define MTLS_MPROXY_TRANSPORT_TLS_VERIFY_CACHE_H
+
+#include <openssl/ssl.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace mtls_mproxy
+{
+    // Bounded LRU of successful client certificate chain verifications. The key is the SHA-256 of the
+    // leaf certificate together with a hash of the whole presented chain, so a different intermediate
+    // never matches a cached entry. An entry expires with the earliest notAfter of the verified chain
+    // or after the configured lifetime, whichever comes first. Failed verifications are never cached.
+    // Revocation data changes must call invalidate(). Safe to use from several handshake threads.
+    class VerifyCache
+    {
+    public:
+        VerifyCache(std::size_t capacity, std::chrono::seconds lifetime);
+
+        VerifyCache(const VerifyCache& other) = delete;
+        VerifyCache& operator=(const VerifyCache& other) = delete;
+
+        // Replaces the chain verification of the context, uncached chains go through X509_verify_cert
+        void attach(SSL_CTX* ctx);
+
+        void invalidate();
+
+        [[nodiscard]] std::uint64_t hits() const { return hits_.load(std::memory_order_relaxed); }
+        [[nodiscard]] std::uint64_t misses() const { return misses_.load(std::memory_order_relaxed); }
+        [[nodiscard]] std::size_t size() const;
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        struct Entry {
+            std::string key;
+            Clock::time_point expires;
+        };
+
+        static int verify_callback(X509_STORE_CTX* store_ctx, void* arg);
+        int verify(X509_STORE_CTX* store_ctx);
+
+        bool lookup(const std::string& key);
+        void insert(std::string key, Clock::time_point expires);
+
+        const std::size_t capacity_;
+        const std::chrono::seconds lifetime_;
+
+        mutable std::mutex mutex_;
+        std::list<Entry> entries_;
+        std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+
+        std::atomic<std::uint64_t> hits_{0};
+        std::atomic<std::uint64_t> misses_{0};
+    };
+}
+
+#endif // MTLS_MPROXY_TRANSPORT_TLS_VERIFY_CACHE_H
@@ -0,0 +1,301 @@
+#include "traffic_shaper.h"
+#include "io_buffer.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <format>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string_view>
+
+namespace
+{
+    using mtls_mproxy::ShapingLimit;
+    using mtls_mproxy::TrafficShaper;
+
+    // Modification check period of the limits file
+    constexpr std::chrono::seconds kReloadInterval{5};
+    // Smallest default burst, a bucket must hold at least one full read
+    constexpr double kMinBurst = mtls_mproxy::max_buffer_size;
+
+    std::optional<std::uint64_t> parse_size(std::string_view str)
+    {
+        std::uint64_t multiplier{1};
+        if (!str.empty()) {
+            switch (std::toupper(static_cast<unsigned char>(str.back()))) {
+            case 'K': multiplier = 1024; break;
+            case 'M': multiplier = 1024 * 1024; break;
+            case 'G': multiplier = 1024 * 1024 * 1024; break;
+            default: break;
+            }
+            if (multiplier != 1)
+                str.remove_suffix(1);
+        }
+
+        std::uint64_t value{0};
+        const auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+        if (str.empty() || ec != std::errc{} || ptr != str.data() + str.size())
+            return std::nullopt;
+
+        return value * multiplier;
+    }
+
+    TrafficShaper::Limits read_limits(const std::filesystem::path& path)
+    {
+        std::ifstream file{path};
+        if (!file)
+            throw std::runtime_error{"can't open traffic shaping file: " + path.string()};
+
+        TrafficShaper::Limits limits;
+        std::string line;
+        for (std::size_t line_no = 1; std::getline(file, line); ++line_no) {
+            if (const auto comment = line.find('#'); comment != std::string::npos)
+                line.erase(comment);
+
+            std::istringstream fields{line};
+            std::string level, rate, burst, extra;
+            if (!(fields >> level))
+                continue;
+            fields >> rate >> burst >> extra;
+
+            ShapingLimit* limit{nullptr};
+            if (level == "session")
+                limit = &limits.session;
+            else if (level == "identity")
+                limit = &limits.identity;
+            else if (level == "mode")
+                limit = &limits.mode;
+            else if (level == "global")
+                limit = &limits.global;
+
+            const auto rate_value = parse_size(rate);
+            const auto burst_value = burst.empty() ? std::optional<std::uint64_t>{0} : parse_size(burst);
+            if (!limit || !rate_value.has_value() || !burst_value.has_value() || !extra.empty()) {
+                throw std::runtime_error{std::format("{}:{}: expected '<session|identity|mode|global> <rate> [<burst>]'",
+                                                     path.string(), line_no)};
+            }
+
+            *limit = {*rate_value, *burst_value};
+        }
+
+        return limits;
+    }
+}
+
+namespace mtls_mproxy
+{
+    void TokenBucket::configure(ShapingLimit limit, Clock::time_point now)
+    {
+        refill(now);
+
+        // A bucket that starts limiting starts full
+        if (unlimited())
+            tokens_ = std::numeric_limits<double>::max();
+
+        rate_ = static_cast<double>(limit.rate);
+        burst_ = limit.burst > 0 ? static_cast<double>(limit.burst) : std::max(rate_ / 10, kMinBurst);
+        tokens_ = std::min(tokens_, burst_);
+    }
+
+    void TokenBucket::consume(std::size_t bytes, Clock::time_point now)
+    {
+        if (unlimited())
+            return;
+
+        refill(now);
+        tokens_ -= static_cast<double>(bytes);
+    }
+
+    TokenBucket::Clock::duration TokenBucket::wait_time(Clock::time_point now, std::size_t tokens)
+    {
+        if (unlimited())
+            return Clock::duration::zero();
+
+        refill(now);
+        const auto missing = static_cast<double>(tokens) - tokens_;
+        if (missing <= 0)
+            return Clock::duration::zero();
+
+        return std::chrono::ceil<Clock::duration>(std::chrono::duration<double>{missing / rate_});
+    }
+
+    void TokenBucket::refill(Clock::time_point now)
+    {
+        if (!unlimited() && now > updated_) {
+            const std::chrono::duration<double> elapsed = now - updated_;
+            tokens_ = std::min(burst_, tokens_ + elapsed.count() * rate_);
+        }
+        updated_ = now;
+    }
+
+    TrafficShaper::TrafficShaper(std::filesystem::path path, const asynclog::LoggerFactory& log_factory)
+        : path_{std::move(path)}
+        , global_{std::make_shared<TokenBucket>()}
+        , logger_{log_factory.create("traffic_shaper")}
+    {
+        reload();
+    }
+
+    ShapingGatePtr TrafficShaper::open(const net::any_io_executor& executor,
+                                       const std::string& mode,
+                                       const std::string& identity)
+    {
+        if (!reload_timer_.has_value()) {
+            reload_timer_.emplace(executor);
+            schedule_reload();
+        }
+
+        const auto now = TokenBucket::Clock::now();
+        auto& mode_bucket = modes_[mode];
+        if (!mode_bucket) {
+            mode_bucket = std::make_shared<TokenBucket>();
+            mode_bucket->configure(limits_.mode, now);
+        }
+
+        TokenBucketPtr identity_bucket;
+        if (!identity.empty()) {
+            auto& shared = identities_[identity];
+            identity_bucket = shared.lock();
+            if (!identity_bucket) {
+                identity_bucket = std::make_shared<TokenBucket>();
+                identity_bucket->configure(limits_.identity, now);
+                shared = identity_bucket;
+            }
+        }
+
+        return std::make_shared<ShapingGate>(shared_from_this(), executor, std::move(identity_bucket), mode_bucket, global_);
+    }
+
+    bool TrafficShaper::reload()
+    {
+        const auto modified = std::filesystem::last_write_time(path_);
+        if (modified == modified_)
+            return false;
+
+        limits_ = read_limits(path_);
+        modified_ = modified;
+        ++generation_;
+
+        const auto now = TokenBucket::Clock::now();
+        global_->configure(limits_.global, now);
+        for (auto& [_, bucket] : modes_)
+            bucket->configure(limits_.mode, now);
+        for (auto& [_, shared] : identities_) {
+            if (const auto bucket = shared.lock())
+                bucket->configure(limits_.identity, now);
+        }
+
+        return true;
+    }
+
+    void TrafficShaper::schedule_reload()
+    {
+        reload_timer_->expires_after(kReloadInterval);
+        reload_timer_->async_wait([this, self{shared_from_this()}](const net::error_code& ec) {
+            if (ec)
+                return;
+
+            try {
+                if (reload())
+                    logger_.info(std::format("traffic shaping limits reloaded from {}", path_.string()));
+            } catch (const std::exception& ex) {
+                logger_.warn(std::format("traffic shaping limits reload failed, keeping current limits: {}", ex.what()));
+            }
+
+            std::erase_if(identities_, [](const auto& item) { return item.second.expired(); });
+            schedule_reload();
+        });
+    }
+
+    ShapingGate::ShapingGate(TrafficShaperPtr shaper,
+                             const net::any_io_executor& executor,
+                             TokenBucketPtr identity,
+                             TokenBucketPtr mode,
+                             TokenBucketPtr global)
+        : shaper_{std::move(shaper)}
+        , timer_{executor}
+        , generation_{shaper_->generation()}
+        , identity_{std::move(identity)}
+        , mode_{std::move(mode)}
+        , global_{std::move(global)}
+    {
+        session_.configure(shaper_->limits().session, TokenBucket::Clock::now());
+    }
+
+    void ShapingGate::consume(std::size_t bytes)
+    {
+        const auto now = TokenBucket::Clock::now();
+        if (generation_ != shaper_->generation()) {
+            session_.configure(shaper_->limits().session, now);
+            generation_ = shaper_->generation();
+        }
+
+        session_.consume(bytes, now);
+        if (identity_)
+            identity_->consume(bytes, now);
+        mode_->consume(bytes, now);
+        global_->consume(bytes, now);
+    }
+
+    void ShapingGate::read(std::function<void()> read)
+    {
+        // Reads parked before keep their order
+        if (!parked_.empty()) {
+            parked_.push_back(std::move(read));
+            return;
+        }
+
+        const auto wait = wait_time();
+        if (wait == TokenBucket::Clock::duration::zero()) {
+            read();
+            return;
+        }
+
+        parked_.push_back(std::move(read));
+        timer_.expires_after(wait);
+        timer_.async_wait([self{shared_from_this()}](const net::error_code& ec) {
+            if (!ec)
+                self->resume();
+        });
+    }
+
+    void ShapingGate::close()
+    {
+        parked_.clear();
+        timer_.cancel();
+    }
+
+    TokenBucket::Clock::duration ShapingGate::wait_time()
+    {
+        const auto now = TokenBucket::Clock::now();
+        auto wait = std::max({session_.wait_time(now), mode_->wait_time(now), global_->wait_time(now)});
+        if (identity_)
+            wait = std::max(wait, identity_->wait_time(now));
+
+        return wait;
+    }
+
+    // Other sessions may have drawn from the shared buckets meanwhile, the wait is checked again
+    void ShapingGate::resume()
+    {
+        if (parked_.empty())
+            return;
+
+        if (const auto wait = wait_time(); wait > TokenBucket::Clock::duration::zero()) {
+            timer_.expires_after(wait);
+            timer_.async_wait([self{shared_from_this()}](const net::error_code& ec) {
+                if (!ec)
+                    self->resume();
+            });
+            return;
+        }
+
+        auto reads = std::move(parked_);
+        parked_.clear();
+        for (auto& read : reads)
+            read();
+    }
+}
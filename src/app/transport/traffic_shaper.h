@@ -0,0 +1,152 @@
+#ifndef MTLS_MPROXY_TRANSPORT_TRAFFIC_SHAPER_H
+#define MTLS_MPROXY_TRANSPORT_TRAFFIC_SHAPER_H
+
+#include <asynclog/logger_factory.h>
+#include <asynclog/scoped_logger.h>
+
+#include <asio/any_io_executor.hpp>
+#include <asio/steady_timer.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace mtls_mproxy
+{
+    namespace net = asio;
+
+    // Rate of one shaping level, 0 - unlimited
+    struct ShapingLimit {
+        // Bytes per second
+        std::uint64_t rate{0};
+        // Bytes a bucket holds, 0 - 100 ms of the rate but at least one full read
+        std::uint64_t burst{0};
+    };
+
+    // Bytes earned at a fixed rate up to the burst size. Bytes are taken after they were read, so the
+    // bucket may go into debt, and the next read of the session waits until the debt is paid back.
+    class TokenBucket
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        void configure(ShapingLimit limit, Clock::time_point now);
+        void consume(std::size_t bytes, Clock::time_point now);
+        // Time until the bucket holds the tokens, by default until it is out of debt. Zero if it holds
+        // them already.
+        [[nodiscard]] Clock::duration wait_time(Clock::time_point now, std::size_t tokens = 0);
+
+        [[nodiscard]] bool unlimited() const { return rate_ == 0; }
+
+    private:
+        void refill(Clock::time_point now);
+
+        double rate_{0};
+        double burst_{0};
+        double tokens_{0};
+        Clock::time_point updated_{};
+    };
+
+    using TokenBucketPtr = std::shared_ptr<TokenBucket>;
+
+    class ShapingGate;
+    using ShapingGatePtr = std::shared_ptr<ShapingGate>;
+
+    // Token bucket shaping on four levels: every session has its own bucket and draws from the bucket of
+    // its mTLS client identity, from the bucket of its proxy mode and from the global bucket. Bytes read
+    // from either side of a session are taken from all of them, and the next read of the session waits
+    // on a timer until none of them is in debt, so one bulk session can't starve the others.
+    //
+    // The limits are read from a file with one '<level> <rate> [<burst>]' line per limited level, level is
+    // one of session, identity, mode, global, sizes take K, M and G suffixes. The file is checked for
+    // changes every few seconds and reloaded limits apply to the buckets already in use.
+    class TrafficShaper final : public std::enable_shared_from_this<TrafficShaper>
+    {
+    public:
+        struct Limits {
+            ShapingLimit session;
+            ShapingLimit identity;
+            ShapingLimit mode;
+            ShapingLimit global;
+        };
+
+        // Throws std::runtime_error if the file can't be read or has errors
+        TrafficShaper(std::filesystem::path path, const asynclog::LoggerFactory& log_factory);
+
+        TrafficShaper(const TrafficShaper& other) = delete;
+        TrafficShaper& operator=(const TrafficShaper& other) = delete;
+
+        // Buckets of a new session, the reload timer starts on the executor of the first session
+        ShapingGatePtr open(const net::any_io_executor& executor, const std::string& mode, const std::string& identity);
+
+        // Re-reads the file if it was modified, returns true if new limits were loaded.
+        // On failure the current limits stay in use and the error is thrown.
+        bool reload();
+
+        [[nodiscard]] const Limits& limits() const { return limits_; }
+        // Changes with every reload, sessions reconfigure their own bucket when it differs
+        [[nodiscard]] std::uint64_t generation() const { return generation_; }
+
+    private:
+        void schedule_reload();
+
+        std::filesystem::path path_;
+        std::filesystem::file_time_type modified_{};
+        Limits limits_;
+        std::uint64_t generation_{0};
+
+        TokenBucketPtr global_;
+        std::unordered_map<std::string, TokenBucketPtr> modes_;
+        // Shared by the live sessions of an identity, dropped with the last of them
+        std::unordered_map<std::string, std::weak_ptr<TokenBucket>> identities_;
+
+        std::optional<net::steady_timer> reload_timer_;
+        asynclog::ScopedLogger logger_;
+    };
+
+    using TrafficShaperPtr = std::shared_ptr<TrafficShaper>;
+
+    // Buckets of one session. Reads of both sides go through the gate: they run right away while no
+    // bucket is in debt and are parked otherwise, one timer per session resumes them.
+    class ShapingGate final : public std::enable_shared_from_this<ShapingGate>
+    {
+    public:
+        ShapingGate(TrafficShaperPtr shaper,
+                    const net::any_io_executor& executor,
+                    TokenBucketPtr identity,
+                    TokenBucketPtr mode,
+                    TokenBucketPtr global);
+
+        ShapingGate(const ShapingGate& other) = delete;
+        ShapingGate& operator=(const ShapingGate& other) = delete;
+
+        // Takes bytes read from either side of the session
+        void consume(std::size_t bytes);
+        // Runs the read now or once the buckets are out of debt
+        void read(std::function<void()> read);
+        // Drops the parked reads, the session is closing
+        void close();
+
+    private:
+        TokenBucket::Clock::duration wait_time();
+        void resume();
+
+        TrafficShaperPtr shaper_;
+        net::steady_timer timer_;
+        TokenBucket session_;
+        std::uint64_t generation_;
+        // Buckets of the upper levels, no identity bucket for plain connections
+        TokenBucketPtr identity_;
+        TokenBucketPtr mode_;
+        TokenBucketPtr global_;
+        std::vector<std::function<void()>> parked_;
+    };
+}
+
+#endif // MTLS_MPROXY_TRANSPORT_TRAFFIC_SHAPER_H
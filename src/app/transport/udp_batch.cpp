@@ -0,0 +1,315 @@
+#include "udp_batch.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+
+#if defined(__linux__)
+#include <netinet/udp.h>
+#endif
+
+namespace
+{
+    namespace net = asio;
+    using udp = asio::ip::udp;
+
+    // Upper bound of one send call, the message headers live on the stack
+    constexpr std::size_t kMaxSendBatch = 64;
+
+    // Buffers kept by the pool of one thread, larger buffers are released instead of recycled
+    constexpr std::size_t kMaxPooledBuffers = 1024;
+    constexpr std::size_t kMaxPooledCapacity = 4096;
+
+    std::vector<mtls_mproxy::IoBuffer>& buffer_pool()
+    {
+        thread_local std::vector<mtls_mproxy::IoBuffer> pool;
+        return pool;
+    }
+
+#if defined(__linux__)
+    // Datagrams in one segmented message, the limit of older kernels (UDP_MAX_SEGMENTS)
+    constexpr std::size_t kMaxSegments = 64;
+    // Datagrams of one send call with segmentation offload
+    constexpr std::size_t kMaxSendDatagrams = 256;
+    // Payload of one segmented message, stays below the 16 bit IP length with room for the headers
+    constexpr std::size_t kMaxSegmentedSize = 65000;
+    // Larger datagrams are never segmented: the kernel rejects segments above the route MTU, and a
+    // 1500 byte MTU carries 1452 bytes of UDP payload over IPv6
+    constexpr std::size_t kMaxSegmentSize = 1452;
+
+    constexpr std::size_t kReceiveControlSize = CMSG_SPACE(sizeof(int));
+    constexpr std::size_t kSendControlSize = CMSG_SPACE(sizeof(std::uint16_t));
+
+    net::error_code last_error()
+    {
+        return {errno, net::error::get_system_category()};
+    }
+
+    // Errors of a segmented send that the same datagrams sent one by one do not hit
+    bool is_offload_error(int error)
+    {
+        return error == EIO || error == EINVAL || error == EOPNOTSUPP || error == ENOPROTOOPT;
+    }
+#endif
+}
+
+namespace mtls_mproxy
+{
+    UdpOffload enable_udp_offload(udp::socket& socket)
+    {
+        UdpOffload offload;
+#if defined(__linux__)
+        const int on{1};
+        offload.gro = ::setsockopt(socket.native_handle(), SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+
+        // Kernels without segmentation offload do not know the option
+        int segment_size{0};
+        socklen_t length{sizeof(segment_size)};
+        offload.gso = ::getsockopt(socket.native_handle(), SOL_UDP, UDP_SEGMENT, &segment_size, &length) == 0;
+#else
+        (void)socket;
+#endif
+        return offload;
+    }
+
+    UdpReceiveBatch::UdpReceiveBatch(std::size_t capacity, std::size_t buffer_size)
+        : buffer_size_{buffer_size}
+        , storage_(std::max<std::size_t>(capacity, 1) * buffer_size)
+        , lengths_(std::max<std::size_t>(capacity, 1))
+        , senders_(std::max<std::size_t>(capacity, 1))
+    {
+        datagrams_.reserve(lengths_.size());
+#if defined(__linux__)
+        headers_.resize(lengths_.size());
+        iovecs_.resize(lengths_.size());
+        addresses_.resize(lengths_.size());
+        controls_.resize(lengths_.size() * kReceiveControlSize);
+#endif
+    }
+
+    std::span<const std::uint8_t> UdpReceiveBatch::data(std::size_t idx) const
+    {
+        const auto& datagram = datagrams_[idx];
+        return {storage_.data() + datagram.offset, datagram.size};
+    }
+
+    void UdpReceiveBatch::split(std::size_t message, std::size_t length, std::size_t segment_size)
+    {
+        const auto offset = message * buffer_size_;
+        if (segment_size == 0 || length <= segment_size) {
+            datagrams_.push_back({offset, length, message});
+            return;
+        }
+
+        // Every datagram of a coalesced message has the segment size except the last one
+        for (std::size_t pos = 0; pos < length; pos += segment_size)
+            datagrams_.push_back({offset + pos, std::min(segment_size, length - pos), message});
+    }
+
+    std::size_t UdpReceiveBatch::receive(udp::socket& socket, net::error_code& ec)
+    {
+        ec.clear();
+        datagrams_.clear();
+
+#if defined(__linux__)
+        // The headers are reset on every call, the kernel overwrites the lengths
+        for (std::size_t i = 0; i < headers_.size(); ++i) {
+            iovecs_[i].iov_base = storage_.data() + i * buffer_size_;
+            iovecs_[i].iov_len = buffer_size_;
+            auto& hdr = headers_[i].msg_hdr;
+            hdr = {};
+            hdr.msg_name = &addresses_[i];
+            hdr.msg_namelen = sizeof(sockaddr_storage);
+            hdr.msg_iov = &iovecs_[i];
+            hdr.msg_iovlen = 1;
+            hdr.msg_control = controls_.data() + i * kReceiveControlSize;
+            hdr.msg_controllen = kReceiveControlSize;
+        }
+
+        int count;
+        do {
+            count = ::recvmmsg(socket.native_handle(),
+                               headers_.data(),
+                               static_cast<unsigned int>(headers_.size()),
+                               MSG_DONTWAIT,
+                               nullptr);
+        } while (count < 0 && errno == EINTR);
+
+        if (count < 0) {
+            ec = last_error();
+            return 0;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            auto& hdr = headers_[i].msg_hdr;
+            auto& sender = senders_[i];
+            const auto size = std::min<std::size_t>(hdr.msg_namelen, sender.capacity());
+            std::memcpy(sender.data(), &addresses_[i], size);
+            sender.resize(size);
+
+            int segment_size{0};
+            for (auto* cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+                if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+                    std::memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+            }
+            lengths_[i] = headers_[i].msg_len;
+            split(static_cast<std::size_t>(i), lengths_[i], static_cast<std::size_t>(std::max(segment_size, 0)));
+        }
+#else
+        if (!socket.non_blocking())
+            socket.non_blocking(true, ec);
+
+        for (std::size_t i = 0; !ec && i < lengths_.size(); ++i) {
+            const auto length = socket.receive_from(
+                net::buffer(storage_.data() + i * buffer_size_, buffer_size_), senders_[i], 0, ec);
+            if (!ec) {
+                lengths_[i] = length;
+                split(i, length, 0);
+            }
+        }
+
+        // Datagrams received before the socket ran dry are a success
+        if (!datagrams_.empty())
+            ec.clear();
+#endif
+        return datagrams_.size();
+    }
+
+    IoBuffer take_datagram_buffer()
+    {
+        auto& pool = buffer_pool();
+        if (pool.empty())
+            return {};
+
+        auto buffer = std::move(pool.back());
+        pool.pop_back();
+        buffer.clear();
+        return buffer;
+    }
+
+    void recycle_datagram_buffer(IoBuffer buffer)
+    {
+        auto& pool = buffer_pool();
+        if (pool.size() < kMaxPooledBuffers && buffer.capacity() > 0 && buffer.capacity() <= kMaxPooledCapacity)
+            pool.push_back(std::move(buffer));
+    }
+
+    UdpReceiveBatch& thread_receive_batch(const UdpBatchOptions& options)
+    {
+        thread_local std::unique_ptr<UdpReceiveBatch> batch;
+
+        const auto capacity = std::max<std::size_t>(options.receive_batch, 1);
+        if (!batch || batch->capacity() != capacity)
+            batch = std::make_unique<UdpReceiveBatch>(capacity);
+
+        return *batch;
+    }
+
+    std::size_t send_batch(udp::socket& socket,
+                           const std::deque<Datagram>& queue,
+                           std::size_t max_count,
+                           UdpOffload& offload,
+                           net::error_code& ec)
+    {
+        ec.clear();
+        const auto count = std::min({queue.size(), std::max<std::size_t>(max_count, 1), kMaxSendBatch});
+
+#if defined(__linux__)
+        std::array<mmsghdr, kMaxSendBatch> headers{};
+        std::array<iovec, kMaxSendDatagrams> iovecs{};
+        std::array<std::size_t, kMaxSendBatch> segments{};
+        alignas(cmsghdr) std::array<std::uint8_t, kMaxSendBatch * kSendControlSize> controls{};
+
+        std::size_t messages{0};
+        std::size_t taken{0};
+        bool segmented{false};
+        while (messages < count && taken < queue.size() && taken < kMaxSendDatagrams) {
+            const auto& first = queue[taken];
+            const auto segment_size = first.payload().size();
+
+            // A run holds datagrams to one endpoint, all of the first one's size except a shorter last one
+            std::size_t run{1};
+            std::size_t total{segment_size};
+            if (offload.gso && segment_size > 0 && segment_size <= kMaxSegmentSize) {
+                while (run < kMaxSegments && taken + run < queue.size() && taken + run < kMaxSendDatagrams) {
+                    const auto& next = queue[taken + run];
+                    const auto size = next.payload().size();
+                    if (size == 0 || size > segment_size || total + size > kMaxSegmentedSize ||
+                        next.endpoint != first.endpoint)
+                        break;
+                    total += size;
+                    ++run;
+                    if (size < segment_size)
+                        break;
+                }
+            }
+
+            for (std::size_t i = 0; i < run; ++i) {
+                const auto payload = queue[taken + i].payload();
+                iovecs[taken + i].iov_base = const_cast<std::uint8_t*>(payload.data());
+                iovecs[taken + i].iov_len = payload.size();
+            }
+
+            auto& hdr = headers[messages].msg_hdr;
+            hdr.msg_name = const_cast<sockaddr*>(first.endpoint.data());
+            hdr.msg_namelen = static_cast<socklen_t>(first.endpoint.size());
+            hdr.msg_iov = &iovecs[taken];
+            hdr.msg_iovlen = run;
+            if (run > 1) {
+                hdr.msg_control = controls.data() + messages * kSendControlSize;
+                hdr.msg_controllen = kSendControlSize;
+                auto* cmsg = CMSG_FIRSTHDR(&hdr);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(std::uint16_t));
+                const auto gso_size = static_cast<std::uint16_t>(segment_size);
+                std::memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+                segmented = true;
+            }
+
+            segments[messages++] = run;
+            taken += run;
+        }
+
+        int sent;
+        do {
+            sent = ::sendmmsg(socket.native_handle(), headers.data(), static_cast<unsigned int>(messages), MSG_DONTWAIT);
+        } while (sent < 0 && errno == EINTR);
+
+        if (sent < 0) {
+            // The route cannot take segmented messages, the socket falls back to one datagram per message
+            if (segmented && is_offload_error(errno)) {
+                offload.gso = false;
+                return send_batch(socket, queue, max_count, offload, ec);
+            }
+            ec = last_error();
+            return 0;
+        }
+
+        std::size_t datagrams{0};
+        for (int i = 0; i < sent; ++i)
+            datagrams += segments[i];
+
+        return datagrams;
+#else
+        (void)offload;
+        if (!socket.non_blocking())
+            socket.non_blocking(true, ec);
+
+        std::size_t sent{0};
+        while (!ec && sent < count) {
+            const auto payload = queue[sent].payload();
+            socket.send_to(net::buffer(payload.data(), payload.size()), queue[sent].endpoint, 0, ec);
+            if (!ec)
+                ++sent;
+        }
+
+        if (sent > 0)
+            ec.clear();
+
+        return sent;
+#endif
+    }
+}
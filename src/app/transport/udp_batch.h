@@ -0,0 +1,114 @@
+#ifndef MTLS_MPROXY_TRANSPORT_UDP_BATCH_H
+#define MTLS_MPROXY_TRANSPORT_UDP_BATCH_H
+
+#include "io_buffer.h"
+
+#include <asio/ip/udp.hpp>
+
+#include <cstddef>
+#include <deque>
+#include <span>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#endif
+
+namespace mtls_mproxy
+{
+    namespace net = asio;
+    using udp = asio::ip::udp;
+
+    // Largest UDP payload, a receive buffer of this size never truncates a datagram
+    constexpr std::size_t kMaxDatagramSize = 65536;
+
+    struct UdpBatchOptions {
+        // Datagrams taken from a socket by one receive call (recvmmsg on Linux)
+        std::size_t receive_batch{32};
+        // Datagrams handed to the kernel by one send call (sendmmsg on Linux)
+        std::size_t send_batch{32};
+        // Segmentation offload (UDP_SEGMENT) and receive coalescing (UDP_GRO) where the kernel has them
+        bool offload{true};
+    };
+
+    // Offloads in effect on one socket. Segmentation is switched off for good if the kernel rejects a
+    // segmented send, e.g. for a route whose device has no checksum offload.
+    struct UdpOffload {
+        bool gso{false};
+        bool gro{false};
+    };
+
+    // Enables the offloads the kernel supports, none on other platforms
+    UdpOffload enable_udp_offload(udp::socket& socket);
+
+    struct Datagram {
+        IoBuffer data;
+        udp::endpoint endpoint;
+        // Bytes in front of the payload, the SOCKS5 header of a datagram relayed in its received buffer
+        std::size_t offset{0};
+
+        std::span<const std::uint8_t> payload() const { return std::span{data}.subspan(offset); }
+    };
+
+    // Datagram buffers recycled on the calling thread, a relay running warm allocates none per datagram.
+    // A taken buffer is empty, recycled buffers keep their capacity.
+    IoBuffer take_datagram_buffer();
+    void recycle_datagram_buffer(IoBuffer buffer);
+
+    // Fixed set of receive buffers, allocated once and reused by every receive. One call drains up to
+    // the batch size of messages already queued on the socket, a message coalesced by UDP_GRO is split
+    // back into its datagrams. Other platforms receive the datagrams one by one.
+    class UdpReceiveBatch
+    {
+    public:
+        explicit UdpReceiveBatch(std::size_t capacity, std::size_t buffer_size = kMaxDatagramSize);
+
+        UdpReceiveBatch(const UdpReceiveBatch& other) = delete;
+        UdpReceiveBatch& operator=(const UdpReceiveBatch& other) = delete;
+
+        // Never blocks, fails with would_block if no datagram is queued. Returns the number of
+        // datagrams, the datagrams of the previous receive are overwritten.
+        std::size_t receive(udp::socket& socket, net::error_code& ec);
+
+        std::size_t capacity() const { return lengths_.size(); }
+        std::size_t size() const { return datagrams_.size(); }
+        std::span<const std::uint8_t> data(std::size_t idx) const;
+        const udp::endpoint& sender(std::size_t idx) const { return senders_[datagrams_[idx].message]; }
+
+    private:
+        struct Slice {
+            std::size_t offset;
+            std::size_t size;
+            std::size_t message;
+        };
+
+        void split(std::size_t message, std::size_t length, std::size_t segment_size);
+
+        std::size_t buffer_size_;
+        std::vector<std::uint8_t> storage_;
+        std::vector<std::size_t> lengths_;
+        std::vector<udp::endpoint> senders_;
+        std::vector<Slice> datagrams_;
+#if defined(__linux__)
+        std::vector<mmsghdr> headers_;
+        std::vector<iovec> iovecs_;
+        std::vector<sockaddr_storage> addresses_;
+        std::vector<std::uint8_t> controls_;
+#endif
+    };
+
+    // Receive buffers shared by the UDP sockets of the calling thread. A receive hands its datagrams to
+    // the stream manager before the thread runs the next one, so no socket needs buffers of its own.
+    UdpReceiveBatch& thread_receive_batch(const UdpBatchOptions& options);
+
+    // Sends datagrams from the front of the queue without blocking, at most max_count messages. With
+    // segmentation offload a run of datagrams of one size to one endpoint is a single message. Returns
+    // how many datagrams were sent, fails with would_block if the socket buffer is full.
+    std::size_t send_batch(udp::socket& socket,
+                           const std::deque<Datagram>& queue,
+                           std::size_t max_count,
+                           UdpOffload& offload,
+                           net::error_code& ec);
+}
+
+#endif // MTLS_MPROXY_TRANSPORT_UDP_BATCH_H
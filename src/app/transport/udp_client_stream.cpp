@@ -2,9 +2,9 @@
 #include "stream_manager.h"
 #include "auxiliary/helpers.h"
 
-#include <asio/write.hpp>
-#include <asio/connect.hpp>
-#include <socks/socks.h>
+#include <algorithm>
+#include <string>
+#include <utility>
 
 namespace
 {
@@ -21,26 +21,37 @@ namespace
     // +---- + ------ + ------ + ---------- + -------- + ---------- +
     // |  2  |    1   |   1    |  Variable  |    2     |  Variable  |
     // +---- + ------ + ------ + ---------- + -------- + ---------- +
-    std::size_t determine_udp_data_offset(mtls_mproxy::IoBuffer buffer)
+    std::size_t determine_udp_data_offset(const mtls_mproxy::IoBuffer& buffer)
     {
-        if (buffer.size() < 10)
+        if (buffer.size() < 5)
             return 0;
 
-        if (buffer[3] == ATYPE_IPv4)
-            return 10ull;
-
-        if (buffer[3] == ATYPE_IPv6)
-            return 22ull;
-
         std::size_t offset = 4;
-        offset += buffer[4]; // domain length
-        offset++;            // domain length field length
-        offset += 2;         // port length
+        switch (buffer[3]) {
+        case ATYPE_IPv4:
+            offset += 4;
+            break;
+        case ATYPE_IPv6:
+            offset += 16;
+            break;
+        case ATYPE_DOMAIN:
+            if (buffer[4] == 0)
+                return 0;
+            offset += buffer[4]; // domain length
+            offset++;            // domain length field length
+            break;
+        default:
+            return 0;
+        }
+        offset += 2;             // port length
 
-        if (offset < buffer.size())
-            return offset;
+        return (offset <= buffer.size()) ? offset : 0;
+    }
 
-        return 0;
+    // ATYP, DST.ADDR and DST.PORT of a datagram, the key of its destination
+    std::span<const std::uint8_t> destination_address(const mtls_mproxy::Datagram& datagram)
+    {
+        return std::span{datagram.data}.subspan(3, datagram.offset - 3);
     }
 
     enum : std::int32_t { eRemote, eLocal };
@@ -66,87 +77,58 @@ namespace mtls_mproxy
 {
     UdpClientStream::UdpClientStream(const StreamManagerPtr& ptr,
                                      int id, const net::any_io_executor& ctx,
-                                     const asynclog::LoggerFactory& log_factory)
+                                     const asynclog::LoggerFactory& log_factory,
+                                     UdpSocketPoolPtr pool)
         : ClientStream{ptr, id}
-        , socket_{ctx, udp::v4()}
+        , pool_{std::move(pool)}
         , resolver_{ctx}
         , logger_{log_factory.create("udp_client")}
-        , read_buffer_{}
     {}
 
     UdpClientStream::~UdpClientStream()
     {
+        if (attached_)
+            pool_->detach(id());
         logger_.debug(std::format("[{}] udp client stream closed", id()));
     }
 
     void UdpClientStream::start()
     {
-        socket_.bind(udp::endpoint{udp::v4(), 0});
-        read();
+        pool_->attach(id(), this);
+        attached_ = true;
     }
 
     void UdpClientStream::stop()
     {
-        net::error_code ignored_ec;
-        socket_.shutdown(udp::socket::shutdown_both, ignored_ec);
+        if (std::exchange(attached_, false))
+            pool_->detach(id());
+        resolver_.cancel();
     }
 
+    // The datagram is queued in its received buffer, the payload follows the SOCKS5 header
     void UdpClientStream::write(IoBuffer event)
     {
-        std::size_t data_offset = determine_udp_data_offset(event);
-
-        std::string addr, port;
-        if (!Socks::get_remote_address_info(event.data(), event.size(), addr, port) || data_offset == 0) {
+        const auto data_offset = determine_udp_data_offset(event);
+        if (data_offset == 0) {
             logger_.warn(std::format("[{}] invalid address requested", id()));
             return;
         }
 
-        std::size_t bytes_to_send = event.size() - data_offset;
-
-        Packet packet;
-        packet.data.resize(bytes_to_send);
-        std::copy(event.begin() + data_offset, event.end(), packet.data.begin());
-        packet.addr = addr;
-        packet.port = port;
-
-        if ((event[3] == ATYPE_IPv4 || event[3] == ATYPE_IPv6)) {
-            write_queue_.emplace(std::move(packet));
-            write_packet();
+        Datagram datagram{std::move(event), {}, data_offset};
+        const auto address = destination_address(datagram);
+        if (const auto* endpoint = destinations_.find(address)) {
+            datagram.endpoint = *endpoint;
+        } else if (const auto literal = UdpDestinationCache::parse_literal(address)) {
+            logger_.debug(std::format("[{}] requested ip address [{}]", id(), aux::to_string(*literal)));
+            destinations_.insert(address, *literal);
+            datagram.endpoint = *literal;
         } else {
-            dns_queue_.emplace(std::move(packet));
+            dns_queue_.push_back(std::move(datagram));
             make_dns_resolve();
-        }
-    }
-
-    void UdpClientStream::write_packet()
-    {
-        if (write_queue_.empty())
             return;
+        }
 
-        if (write_in_progress_)
-            return;
-
-        const auto& packet = write_queue_.front();
-        write_in_progress_ = true;
-
-        logger_.info(std::format("[{}] requested ip address [{}:{}]", id(), packet.addr, packet.port));
-
-        const udp::endpoint target_endpoint(asio::ip::make_address(packet.addr), std::stoi(packet.port));
-
-        socket_.async_send_to(
-            net::buffer(packet.data, packet.data.size()),
-            target_endpoint,
-            [this, self{shared_from_this()}](const net::error_code& ec, std::size_t bytes_sent) {
-                write_in_progress_ = false;
-                if (!ec) {
-                    write_queue_.pop();
-                    manager()->on_write(shared_from_this());
-                    if (!write_queue_.empty())
-                        write_packet();
-                } else {
-                    handle_error(ec);
-                }
-            });
+        pool_->send(id(), std::move(datagram));
     }
 
     void UdpClientStream::make_dns_resolve()
@@ -157,45 +139,72 @@ namespace mtls_mproxy
         if (resolve_in_progress_)
             return;
 
-        const auto& packet = dns_queue_.front();
+        // ATYP | name length | name | port
+        const auto address = destination_address(dns_queue_.front());
+        std::string host(address.begin() + 2, address.end() - 2);
+        std::string port = std::to_string((address[address.size() - 2] << 8) | address.back());
         resolve_in_progress_ = true;
 
-        logger_.info(std::format("[{}] requested domain address [{}:{}]", id(), packet.addr, packet.port));
+        logger_.info(std::format("[{}] requested domain address [{}:{}]", id(), host, port));
         resolver_.async_resolve(
-            packet.addr, packet.port,
-            [this, self{shared_from_this()}](const net::error_code& ec, const udp::resolver::results_type &results) {
+            host, port,
+            [this, self{shared_from_this()}, host, port](const net::error_code& ec,
+                                                         const udp::resolver::results_type& results) {
                 resolve_in_progress_ = false;
-                if (!ec) {
-                    auto packet = dns_queue_.front();
-                    udp::endpoint ep{results.begin()->endpoint().address(),
-                        static_cast<std::uint16_t>(std::stoi(packet.port))};
-
-                    logger_.info(std::format("[{}] resolved domain address [{}:{}] -> [{}]", id(),
-                                             packet.addr, packet.port, aux::to_string(ep)));
-
-                    packet.addr = ep.address().to_string();
-                    write_queue_.emplace(std::move(packet));
-                    dns_queue_.pop();
-                    if (!dns_queue_.empty())
-                        make_dns_resolve();
-                } else {
+                if (ec) {
                     handle_error(ec);
+                    return;
                 }
+
+                // IPv4 is preferred, a host without IPv6 connectivity fails every datagram to an IPv6 address
+                const auto v4 = std::ranges::find_if(results, [](const auto& entry) {
+                    return entry.endpoint().address().is_v4();
+                });
+                const auto ep = (v4 != results.end()) ? v4->endpoint() : results.begin()->endpoint();
+                logger_.info(std::format("[{}] resolved domain address [{}:{}] -> [{}]", id(),
+                                         host, port, aux::to_string(ep)));
+                destinations_.insert(destination_address(dns_queue_.front()), ep);
+
+                // Every waiting datagram to a known destination leaves, the others wait for their resolve
+                for (auto it = dns_queue_.begin(); it != dns_queue_.end();) {
+                    if (const auto* endpoint = destinations_.find(destination_address(*it))) {
+                        it->endpoint = *endpoint;
+                        pool_->send(id(), std::move(*it));
+                        it = dns_queue_.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+
+                make_dns_resolve();
             });
     }
 
-    void UdpClientStream::read()
+    // Datagrams are handed over by the socket pool as they arrive
+    void UdpClientStream::read() {}
+
+    // The reply carries the address of the remote sender in its SOCKS5 header
+    void UdpClientStream::on_datagram(std::span<const std::uint8_t> data, const udp::endpoint& sender)
     {
-        socket_.async_receive_from(
-            net::buffer(read_buffer_), sender_ep_,
-            [this, self{shared_from_this()}](const net::error_code& ec, const size_t length) {
-                if (!ec) {
-                    IoBuffer event(read_buffer_.data(), read_buffer_.data() + length);
-                    manager()->on_read(std::move(event), self);
-                } else {
-                    handle_error(ec);
-                }
-            });
+        // The header only changes with the sender, it is built once per sender
+        if (reply_header_.empty() || reply_header_ep_ != sender) {
+            const auto sender_addr_bytes = aux::endpoint_to_bytes(sender);
+            reply_header_.assign(SOCKS5_UDP_HEADER_SIZE, 0);
+            reply_header_[3] = sender.address().is_v4() ? ATYPE_IPv4 : ATYPE_IPv6;
+            reply_header_.insert(reply_header_.end(), sender_addr_bytes.begin(), sender_addr_bytes.end());
+            reply_header_ep_ = sender;
+        }
+
+        auto buffer = take_datagram_buffer();
+        buffer.reserve(reply_header_.size() + data.size());
+        buffer.assign(reply_header_.begin(), reply_header_.end());
+        buffer.insert(buffer.end(), data.begin(), data.end());
+        manager()->on_read(std::move(buffer), shared_from_this());
+    }
+
+    void UdpClientStream::on_datagram_error(const net::error_code& ec)
+    {
+        handle_error(ec);
     }
 
     void UdpClientStream::handle_error(const net::error_code& ec)
@@ -206,4 +215,4 @@ namespace mtls_mproxy
     void UdpClientStream::set_host(std::string host) {}
 
     void UdpClientStream::set_service(std::string service) {}
-}
\ No newline at end of file
+}
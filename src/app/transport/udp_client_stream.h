@@ -2,32 +2,32 @@
 #define MTLS_MPROXY_TRANSPORT_UDP_CLIENT_STREAM_H
 
 #include "client_stream.h"
+#include "udp_batch.h"
+#include "udp_destination_cache.h"
+#include "udp_socket_pool.h"
 
 #include <asynclog/logger_factory.h>
 
 #include <asio/ip/udp.hpp>
-#include <queue>
+#include <deque>
 
 namespace mtls_mproxy
 {
     namespace net = asio;
     using udp = asio::ip::udp;
 
-    struct Packet {
-        IoBuffer data;
-        std::string addr;
-        std::string port;
-    };
-
+    // Outgoing side of a SOCKS5 UDP association, the datagrams leave and arrive through a socket pool
     class UdpClientStream final
         : public ClientStream
+        , public UdpAssociation
         , public std::enable_shared_from_this<UdpClientStream>
     {
     public:
         UdpClientStream(const StreamManagerPtr& ptr,
                         int id,
                         const net::any_io_executor &ctx,
-                        const asynclog::LoggerFactory& log_factory);
+                        const asynclog::LoggerFactory& log_factory,
+                        UdpSocketPoolPtr pool);
         ~UdpClientStream() override;
 
         void start() override;
@@ -38,24 +38,28 @@ namespace mtls_mproxy
         void set_host(std::string host) override;
         void set_service(std::string service) override;
 
+        void on_datagram(std::span<const std::uint8_t> data, const udp::endpoint& sender) override;
+        void on_datagram_error(const net::error_code& ec) override;
+
     private:
-        void write_packet();
         void make_dns_resolve();
         void handle_error(const net::error_code& ec);
 
-        udp::socket socket_;
+        UdpSocketPoolPtr pool_;
         udp::resolver resolver_;
 
         asynclog::ScopedLogger logger_;
 
-        udp::endpoint sender_ep_;
+        UdpDestinationCache destinations_;
 
-        std::array<std::uint8_t, max_buffer_size> read_buffer_;
+        // SOCKS5 header of the replies from the last sender
+        IoBuffer reply_header_;
+        udp::endpoint reply_header_ep_;
 
-        std::queue<Packet> write_queue_;
-        std::queue<Packet> dns_queue_;
+        // Datagrams to domain names that are not resolved yet, in arrival order
+        std::deque<Datagram> dns_queue_;
 
-        bool write_in_progress_{false};
+        bool attached_{false};
         bool resolve_in_progress_{false};
     };
 }
@@ -0,0 +1,90 @@
+#include "udp_destination_cache.h"
+
+#include <algorithm>
+
+namespace
+{
+    constexpr std::uint8_t ATYPE_IPv4 = 0x01;
+    constexpr std::uint8_t ATYPE_IPv6 = 0x04;
+
+    template <typename Bytes>
+    Bytes copy_bytes(std::span<const std::uint8_t> data)
+    {
+        Bytes bytes{};
+        std::copy_n(data.begin(), bytes.size(), bytes.begin());
+        return bytes;
+    }
+}
+
+namespace mtls_mproxy
+{
+    UdpDestinationCache::UdpDestinationCache(std::size_t capacity, std::chrono::seconds ttl)
+        : capacity_{std::max<std::size_t>(capacity, 1)}
+        , ttl_{ttl}
+    {
+        entries_.reserve(capacity_);
+    }
+
+    const udp::endpoint* UdpDestinationCache::find(std::span<const std::uint8_t> address)
+    {
+        // An association mostly sends to the destination of its previous datagram
+        auto match = [&address](const Entry& entry) { return std::ranges::equal(entry.address, address); };
+        auto it = (last_hit_ < entries_.size() && match(entries_[last_hit_]))
+            ? entries_.begin() + static_cast<std::ptrdiff_t>(last_hit_)
+            : std::ranges::find_if(entries_, match);
+        if (it == entries_.end())
+            return nullptr;
+
+        if (it->expires_at.has_value() && *it->expires_at <= Clock::now()) {
+            entries_.erase(it);
+            last_hit_ = 0;
+            return nullptr;
+        }
+
+        it->last_used = ++use_counter_;
+        last_hit_ = static_cast<std::size_t>(it - entries_.begin());
+        return &it->endpoint;
+    }
+
+    void UdpDestinationCache::insert(std::span<const std::uint8_t> address, const udp::endpoint& endpoint)
+    {
+        const auto expires_at = (address.empty() || address[0] == ATYPE_IPv4 || address[0] == ATYPE_IPv6)
+            ? std::nullopt
+            : std::optional{Clock::now() + ttl_};
+
+        auto it = std::ranges::find_if(entries_, [&address](const Entry& entry) {
+            return std::ranges::equal(entry.address, address);
+        });
+        if (it == entries_.end()) {
+            if (entries_.size() < capacity_) {
+                entries_.emplace_back();
+                it = entries_.end() - 1;
+            } else {
+                it = std::ranges::min_element(entries_, {}, &Entry::last_used);
+            }
+            it->address.assign(address.begin(), address.end());
+        }
+
+        it->endpoint = endpoint;
+        it->expires_at = expires_at;
+        it->last_used = ++use_counter_;
+    }
+
+    // ATYP | DST.ADDR (4 or 16 bytes) | DST.PORT (2 bytes, network order)
+    std::optional<udp::endpoint> UdpDestinationCache::parse_literal(std::span<const std::uint8_t> address)
+    {
+        if (address.empty())
+            return std::nullopt;
+
+        const auto type = address[0];
+        const std::size_t addr_size = (type == ATYPE_IPv4) ? 4 : (type == ATYPE_IPv6) ? 16 : 0;
+        if (addr_size == 0 || address.size() != 1 + addr_size + 2)
+            return std::nullopt;
+
+        const auto port = static_cast<std::uint16_t>((address[1 + addr_size] << 8) | address[2 + addr_size]);
+        if (type == ATYPE_IPv4)
+            return udp::endpoint{asio::ip::address_v4{copy_bytes<asio::ip::address_v4::bytes_type>(address.subspan(1))}, port};
+
+        return udp::endpoint{asio::ip::address_v6{copy_bytes<asio::ip::address_v6::bytes_type>(address.subspan(1))}, port};
+    }
+}
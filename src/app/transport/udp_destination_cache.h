@@ -0,0 +1,51 @@
+#ifndef MTLS_MPROXY_TRANSPORT_UDP_DESTINATION_CACHE_H
+#define MTLS_MPROXY_TRANSPORT_UDP_DESTINATION_CACHE_H
+
+#include "io_buffer.h"
+
+#include <asio/ip/udp.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace mtls_mproxy
+{
+    using udp = asio::ip::udp;
+
+    // Destinations of one UDP association keyed by the raw SOCKS5 address bytes (ATYP, DST.ADDR and
+    // DST.PORT), so a datagram to a known destination is sent without parsing or resolving its address
+    // again. Resolved domain names expire, when the cache is full the least recently used entry goes.
+    class UdpDestinationCache
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        explicit UdpDestinationCache(std::size_t capacity = 16, std::chrono::seconds ttl = std::chrono::seconds{60});
+
+        const udp::endpoint* find(std::span<const std::uint8_t> address);
+        void insert(std::span<const std::uint8_t> address, const udp::endpoint& endpoint);
+
+        // Endpoint of an IPv4 or IPv6 address, nullopt for a domain name
+        static std::optional<udp::endpoint> parse_literal(std::span<const std::uint8_t> address);
+
+    private:
+        struct Entry {
+            IoBuffer address;
+            udp::endpoint endpoint;
+            std::optional<Clock::time_point> expires_at;
+            std::uint64_t last_used;
+        };
+
+        std::size_t capacity_;
+        std::chrono::seconds ttl_;
+        std::vector<Entry> entries_;
+        std::size_t last_hit_{0};
+        std::uint64_t use_counter_{0};
+    };
+}
+
+#endif // MTLS_MPROXY_TRANSPORT_UDP_DESTINATION_CACHE_H
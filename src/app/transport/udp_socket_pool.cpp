@@ -0,0 +1,392 @@
+#include "udp_socket_pool.h"
+#include "auxiliary/helpers.h"
+
+#include <asio/post.hpp>
+
+#include <algorithm>
+#include <functional>
+#include <string_view>
+#include <utility>
+
+namespace
+{
+    constexpr auto kWheelTick = std::chrono::seconds{1};
+
+    std::size_t combine(std::size_t seed, std::size_t value)
+    {
+        return seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+    }
+
+    std::size_t hash_endpoint(const asio::ip::udp::endpoint& ep)
+    {
+        const auto& addr = ep.address();
+        std::size_t seed = std::hash<std::uint16_t>{}(ep.port());
+        if (addr.is_v4())
+            return combine(seed, std::hash<std::uint32_t>{}(addr.to_v4().to_uint()));
+
+        const auto bytes = addr.to_v6().to_bytes();
+        const std::string_view view{reinterpret_cast<const char*>(bytes.data()), bytes.size()};
+        return combine(seed, std::hash<std::string_view>{}(view));
+    }
+}
+
+namespace mtls_mproxy
+{
+    std::size_t UdpSocketPool::RouteHash::operator()(const Route& route) const
+    {
+        return combine(hash_endpoint(route.remote), std::hash<int>{}(route.association));
+    }
+
+    std::size_t UdpSocketPool::MappingHash::operator()(const Mapping& mapping) const
+    {
+        return combine(hash_endpoint(mapping.remote), std::hash<const void*>{}(mapping.socket));
+    }
+
+    UdpSocketPoolPtr UdpSocketPool::create(const net::any_io_executor& executor,
+                                           Options options,
+                                           const asynclog::LoggerFactory& log_factory)
+    {
+        return std::shared_ptr<UdpSocketPool>(new UdpSocketPool(executor, options, log_factory));
+    }
+
+    UdpSocketPool::UdpSocketPool(const net::any_io_executor& executor,
+                                 Options options,
+                                 const asynclog::LoggerFactory& log_factory)
+        : executor_{executor}
+        , options_{options}
+        , logger_{log_factory.create("udp_socket_pool")}
+        , wheel_timer_{executor}
+    {
+        // The first slots of a family are its pooled sockets, opened on first use
+        const auto pooled = is_shared() ? options_.shared_sockets : 1;
+        sockets_v4_.resize(pooled);
+        sockets_v6_.resize(pooled);
+
+        // A slot per second of the timeout and one for the current tick
+        if (is_shared())
+            wheel_.resize(static_cast<std::size_t>(std::max<std::chrono::seconds::rep>(options_.nat_timeout.count(), 1)) + 1);
+    }
+
+    void UdpSocketPool::attach(int association, UdpAssociation* receiver)
+    {
+        if (is_shared())
+            associations_[association] = Association{receiver, {}};
+        else
+            receiver_ = receiver;
+    }
+
+    void UdpSocketPool::detach(int association)
+    {
+        if (!is_shared()) {
+            receiver_ = nullptr;
+            for (auto* sockets : {&sockets_v4_, &sockets_v6_}) {
+                for (auto& socket : *sockets) {
+                    net::error_code ignored_ec;
+                    if (socket)
+                        socket->socket.close(ignored_ec);
+                    socket.reset();
+                }
+            }
+            return;
+        }
+
+        const auto it = associations_.find(association);
+        if (it == associations_.end())
+            return;
+
+        const auto remotes = std::move(it->second.remotes);
+        associations_.erase(it);
+        for (const auto& remote : remotes) {
+            if (const auto route = routes_.find(Route{association, remote}); route != routes_.end())
+                remove_route(route);
+        }
+    }
+
+    void UdpSocketPool::send(int association, Datagram datagram)
+    {
+        const auto socket = is_shared() ? route_socket(association, datagram.endpoint)
+                                        : private_socket(datagram.endpoint.protocol());
+        if (!socket) {
+            recycle_datagram_buffer(std::move(datagram.data));
+            return;
+        }
+
+        socket->write_queue.push_back(std::move(datagram));
+        if (socket->writing)
+            return;
+
+        // Deferred, so the datagrams of a whole received batch leave in one send call
+        socket->writing = true;
+        net::post(executor_, [self{shared_from_this()}, socket]() { self->flush(socket); });
+    }
+
+    std::vector<UdpSocketPool::PooledSocketPtr>& UdpSocketPool::family(const udp& protocol)
+    {
+        return (protocol == udp::v6()) ? sockets_v6_ : sockets_v4_;
+    }
+
+    UdpSocketPool::PooledSocketPtr UdpSocketPool::open_socket(const udp& protocol, bool pooled)
+    {
+        net::error_code ec;
+        udp::socket socket{executor_};
+        socket.open(protocol, ec);
+        if (!ec && protocol == udp::v6())
+            socket.set_option(net::ip::v6_only{true}, ec);
+        if (!ec)
+            socket.bind(udp::endpoint{protocol, 0}, ec);
+        if (ec) {
+            logger_.warn(std::format("failed to open an outgoing {} udp socket: {}",
+                                     protocol == udp::v6() ? "IPv6" : "IPv4", ec.message()));
+            return nullptr;
+        }
+
+        apply_socket_options(socket, options_.sockets);
+        auto pooled_socket = std::make_shared<PooledSocket>(std::move(socket));
+        pooled_socket->pooled = pooled;
+        if (options_.batch.offload)
+            pooled_socket->offload = enable_udp_offload(pooled_socket->socket);
+
+        if (is_shared()) {
+            logger_.info(std::format("opened {} udp socket [{}]", pooled ? "shared" : "extra",
+                                     aux::to_string(pooled_socket->socket.local_endpoint(ec))));
+        }
+
+        net::post(executor_, [self{shared_from_this()}, pooled_socket]() { self->receive(pooled_socket); });
+        return pooled_socket;
+    }
+
+    UdpSocketPool::PooledSocketPtr UdpSocketPool::private_socket(const udp& protocol)
+    {
+        auto& socket = family(protocol).front();
+        if (!socket && receiver_ != nullptr)
+            socket = open_socket(protocol, true);
+
+        return socket;
+    }
+
+    UdpSocketPool::PooledSocketPtr UdpSocketPool::route_socket(int association, const udp::endpoint& remote)
+    {
+        const auto now = Clock::now();
+        if (const auto it = routes_.find(Route{association, remote}); it != routes_.end()) {
+            it->second.last_used = now;
+            return it->second.socket;
+        }
+
+        const auto assoc = associations_.find(association);
+        if (assoc == associations_.end())
+            return nullptr;
+
+        // Associations start at different pooled sockets to spread the mappings, the extra sockets follow
+        auto& sockets = family(remote.protocol());
+        const auto pooled = options_.shared_sockets;
+        PooledSocketPtr socket;
+        for (std::size_t i = 0; i < sockets.size() && !socket; ++i) {
+            auto& candidate = sockets[(i < pooled) ? (static_cast<std::size_t>(association) + i) % pooled : i];
+            if (!candidate) {
+                candidate = open_socket(remote.protocol(), true);
+                if (!candidate)
+                    return nullptr;
+            }
+            if (!mappings_.contains(Mapping{candidate.get(), remote}))
+                socket = candidate;
+        }
+
+        if (!socket) {
+            socket = open_socket(remote.protocol(), false);
+            if (!socket)
+                return nullptr;
+            sockets.push_back(socket);
+        }
+
+        const auto serial = ++route_serial_;
+        routes_.emplace(Route{association, remote}, RouteState{socket, now, serial});
+        mappings_.emplace(Mapping{socket.get(), remote}, association);
+        ++socket->mappings;
+        assoc->second.remotes.push_back(remote);
+        schedule(Route{association, remote}, serial, options_.nat_timeout);
+
+        net::error_code ignored_ec;
+        logger_.debug(std::format("[{}] mapped [{}] to [{}], {} mappings", association, aux::to_string(remote),
+                                  aux::to_string(socket->socket.local_endpoint(ignored_ec)), routes_.size()));
+        return socket;
+    }
+
+    void UdpSocketPool::remove_route(std::unordered_map<Route, RouteState, RouteHash>::iterator it)
+    {
+        const auto route = it->first;
+        const auto socket = it->second.socket;
+        routes_.erase(it);
+        mappings_.erase(Mapping{socket.get(), route.remote});
+        --socket->mappings;
+
+        if (const auto assoc = associations_.find(route.association); assoc != associations_.end())
+            std::erase(assoc->second.remotes, route.remote);
+
+        retire_socket(socket);
+    }
+
+    void UdpSocketPool::retire_socket(const PooledSocketPtr& socket)
+    {
+        if (socket->pooled || socket->mappings > 0 || socket->writing)
+            return;
+
+        net::error_code ignored_ec;
+        socket->socket.close(ignored_ec);
+        std::erase(sockets_v4_, socket);
+        std::erase(sockets_v6_, socket);
+    }
+
+    // The socket is drained before waiting, the reactor only reports new datagrams
+    void UdpSocketPool::receive(const PooledSocketPtr& socket)
+    {
+        if (!socket->socket.is_open())
+            return;
+
+        net::error_code ec;
+        auto& batch = thread_receive_batch(options_.batch);
+        const auto count = batch.receive(socket->socket, ec);
+        if (ec && ec != net::error::would_block) {
+            if (!is_shared()) {
+                if (receiver_ != nullptr)
+                    receiver_->on_datagram_error(ec);
+                return;
+            }
+
+            // A shared socket keeps serving the other associations
+            logger_.warn(std::format("shared udp socket receive failed: {}", ec.message()));
+        }
+
+        if (ec) {
+            socket->socket.async_wait(
+                udp::socket::wait_read,
+                [self{shared_from_this()}, socket](const net::error_code& ec) {
+                    if (!ec)
+                        self->receive(socket);
+                });
+            return;
+        }
+
+        for (std::size_t i = 0; i < count; ++i)
+            dispatch(*socket, batch.data(i), batch.sender(i));
+
+        // Other sockets get their turn before the next batch
+        net::post(executor_, [self{shared_from_this()}, socket]() { self->receive(socket); });
+    }
+
+    void UdpSocketPool::dispatch(const PooledSocket& socket,
+                                 std::span<const std::uint8_t> data,
+                                 const udp::endpoint& sender)
+    {
+        if (!is_shared()) {
+            if (receiver_ != nullptr)
+                receiver_->on_datagram(data, sender);
+            return;
+        }
+
+        const auto mapping = mappings_.find(Mapping{&socket, sender});
+        if (mapping == mappings_.end())
+            return;
+
+        if (const auto assoc = associations_.find(mapping->second); assoc != associations_.end())
+            assoc->second.receiver->on_datagram(data, sender);
+    }
+
+    void UdpSocketPool::flush(const PooledSocketPtr& socket)
+    {
+        auto& queue = socket->write_queue;
+        while (!queue.empty()) {
+            net::error_code ec;
+            const auto sent = send_batch(socket->socket, queue, options_.batch.send_batch, socket->offload, ec);
+            if (ec == net::error::would_block) {
+                socket->socket.async_wait(
+                    udp::socket::wait_write,
+                    [self{shared_from_this()}, socket](const net::error_code& ec) {
+                        if (!ec)
+                            self->flush(socket);
+                    });
+                return;
+            }
+
+            if (ec) {
+                if (!is_shared()) {
+                    if (receiver_ != nullptr)
+                        receiver_->on_datagram_error(ec);
+                    return;
+                }
+
+                // An unreachable destination must not hold up the other associations of the socket
+                logger_.debug(std::format("datagram to [{}] dropped: {}", aux::to_string(queue.front().endpoint),
+                                          ec.message()));
+                recycle_datagram_buffer(std::move(queue.front().data));
+                queue.pop_front();
+                continue;
+            }
+
+            for (std::size_t i = 0; i < sent; ++i)
+                recycle_datagram_buffer(std::move(queue[i].data));
+            queue.erase(queue.begin(), queue.begin() + sent);
+        }
+
+        socket->writing = false;
+        retire_socket(socket);
+    }
+
+    void UdpSocketPool::schedule(const Route& route, std::uint64_t serial, Clock::duration delay)
+    {
+        const auto ticks = std::clamp<std::size_t>(
+            static_cast<std::size_t>(std::max<std::chrono::seconds::rep>(std::chrono::ceil<std::chrono::seconds>(delay).count(), 1)),
+            1, wheel_.size() - 1);
+        wheel_[(wheel_cursor_ + ticks) % wheel_.size()].push_back(WheelEntry{route, serial});
+
+        if (wheel_running_)
+            return;
+
+        wheel_running_ = true;
+        wheel_timer_.expires_after(kWheelTick);
+        wheel_timer_.async_wait([self{shared_from_this()}](const net::error_code& ec) {
+            if (!ec)
+                self->tick();
+        });
+    }
+
+    // Only the entries of the current slot are looked at, a route used since it was scheduled moves on
+    // to the slot of its new expiry
+    void UdpSocketPool::tick()
+    {
+        wheel_cursor_ = (wheel_cursor_ + 1) % wheel_.size();
+        auto due = std::move(wheel_[wheel_cursor_]);
+        wheel_[wheel_cursor_].clear();
+
+        const auto now = Clock::now();
+        for (const auto& entry : due) {
+            const auto it = routes_.find(entry.route);
+            if (it == routes_.end() || it->second.serial != entry.serial)
+                continue;
+
+            const auto idle = now - it->second.last_used;
+            if (idle < options_.nat_timeout) {
+                schedule(entry.route, entry.serial, options_.nat_timeout - idle);
+                continue;
+            }
+
+            logger_.debug(std::format("[{}] mapping to [{}] expired", entry.route.association,
+                                      aux::to_string(entry.route.remote)));
+            remove_route(it);
+        }
+
+        // The slot keeps its capacity for the next round
+        due.clear();
+        wheel_[wheel_cursor_] = std::move(due);
+
+        if (routes_.empty()) {
+            wheel_running_ = false;
+            return;
+        }
+
+        wheel_timer_.expires_at(wheel_timer_.expiry() + kWheelTick);
+        wheel_timer_.async_wait([self{shared_from_this()}](const net::error_code& ec) {
+            if (!ec)
+                self->tick();
+        });
+    }
+}
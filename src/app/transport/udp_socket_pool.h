@@ -0,0 +1,172 @@
+#ifndef MTLS_MPROXY_TRANSPORT_UDP_SOCKET_POOL_H
+#define MTLS_MPROXY_TRANSPORT_UDP_SOCKET_POOL_H
+
+#include "udp_batch.h"
+#include "socket_options.h"
+
+#include <asynclog/logger_factory.h>
+
+#include <asio/any_io_executor.hpp>
+#include <asio/ip/udp.hpp>
+#include <asio/steady_timer.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+namespace mtls_mproxy
+{
+    namespace net = asio;
+    using udp = asio::ip::udp;
+
+    // Receives the datagrams that a socket pool demultiplexes to one association
+    class UdpAssociation
+    {
+    public:
+        virtual ~UdpAssociation() = default;
+
+        virtual void on_datagram(std::span<const std::uint8_t> data, const udp::endpoint& sender) = 0;
+        virtual void on_datagram_error(const net::error_code& ec) = 0;
+    };
+
+    class UdpSocketPool;
+    using UdpSocketPoolPtr = std::shared_ptr<UdpSocketPool>;
+
+    // Outgoing UDP sockets of SOCKS5 UDP associations.
+    //
+    // A private pool serves one association with a socket per address family, opened on first use.
+    //
+    // A shared pool serves every association of a stream manager with a few sockets per family and a NAT
+    // table. The first datagram of an association to a remote endpoint maps the pair to a socket that no
+    // other association uses for that endpoint, so a reply from the endpoint on that socket belongs to
+    // exactly one association, replies without a mapping are dropped. A socket beyond the pool size is
+    // only opened when every pooled one is taken for the endpoint and closed with its last mapping.
+    // Mappings idle for the NAT timeout expire on a timer wheel with one second ticks.
+    class UdpSocketPool final : public std::enable_shared_from_this<UdpSocketPool>
+    {
+    public:
+        struct Options {
+            // Sockets per address family shared by all associations, 0 - a private pool per association
+            std::size_t shared_sockets{0};
+            // Idle time after which a mapping of a shared pool is dropped
+            std::chrono::seconds nat_timeout{60};
+            UdpBatchOptions batch;
+            // Upstream socket profile, only the buffer sizes apply to UDP
+            SocketOptions sockets;
+        };
+
+        static UdpSocketPoolPtr create(const net::any_io_executor& executor,
+                                       Options options,
+                                       const asynclog::LoggerFactory& log_factory);
+
+        UdpSocketPool(const UdpSocketPool& other) = delete;
+        UdpSocketPool& operator=(const UdpSocketPool& other) = delete;
+
+        // The receiver must stay alive until detached
+        void attach(int association, UdpAssociation* receiver);
+        // Drops the mappings of the association, a private pool closes its sockets
+        void detach(int association);
+        // Datagrams of an unsupported address family or without a free socket are dropped
+        void send(int association, Datagram datagram);
+
+        bool is_shared() const { return options_.shared_sockets > 0; }
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        struct PooledSocket {
+            explicit PooledSocket(udp::socket socket)
+                : socket{std::move(socket)}
+            {}
+
+            udp::socket socket;
+            UdpOffload offload;
+            std::deque<Datagram> write_queue;
+            std::size_t mappings{0};
+            bool writing{false};
+            // One of the pool size sockets of its family, the others are closed with their last mapping
+            bool pooled{true};
+        };
+        using PooledSocketPtr = std::shared_ptr<PooledSocket>;
+
+        struct Route {
+            int association;
+            udp::endpoint remote;
+            bool operator==(const Route& other) const = default;
+        };
+
+        struct Mapping {
+            const PooledSocket* socket;
+            udp::endpoint remote;
+            bool operator==(const Mapping& other) const = default;
+        };
+
+        struct RouteHash {
+            std::size_t operator()(const Route& route) const;
+        };
+
+        struct MappingHash {
+            std::size_t operator()(const Mapping& mapping) const;
+        };
+
+        struct RouteState {
+            PooledSocketPtr socket;
+            Clock::time_point last_used;
+            // Identifies the wheel slot entry of this route, entries of a removed route are skipped
+            std::uint64_t serial;
+        };
+
+        struct Association {
+            UdpAssociation* receiver;
+            std::vector<udp::endpoint> remotes;
+        };
+
+        struct WheelEntry {
+            Route route;
+            std::uint64_t serial;
+        };
+
+        UdpSocketPool(const net::any_io_executor& executor, Options options, const asynclog::LoggerFactory& log_factory);
+
+        std::vector<PooledSocketPtr>& family(const udp& protocol);
+        PooledSocketPtr open_socket(const udp& protocol, bool pooled);
+        PooledSocketPtr private_socket(const udp& protocol);
+        PooledSocketPtr route_socket(int association, const udp::endpoint& remote);
+        void remove_route(std::unordered_map<Route, RouteState, RouteHash>::iterator it);
+        void retire_socket(const PooledSocketPtr& socket);
+
+        void receive(const PooledSocketPtr& socket);
+        void dispatch(const PooledSocket& socket, std::span<const std::uint8_t> data, const udp::endpoint& sender);
+        void flush(const PooledSocketPtr& socket);
+
+        void schedule(const Route& route, std::uint64_t serial, Clock::duration delay);
+        void tick();
+
+        net::any_io_executor executor_;
+        Options options_;
+        asynclog::ScopedLogger logger_;
+
+        std::vector<PooledSocketPtr> sockets_v4_;
+        std::vector<PooledSocketPtr> sockets_v6_;
+
+        // Private pool
+        UdpAssociation* receiver_{nullptr};
+
+        // Shared pool
+        std::unordered_map<int, Association> associations_;
+        std::unordered_map<Route, RouteState, RouteHash> routes_;
+        std::unordered_map<Mapping, int, MappingHash> mappings_;
+
+        net::steady_timer wheel_timer_;
+        std::vector<std::vector<WheelEntry>> wheel_;
+        std::size_t wheel_cursor_{0};
+        std::uint64_t route_serial_{0};
+        bool wheel_running_{false};
+    };
+}
+
+#endif // MTLS_MPROXY_TRANSPORT_UDP_SOCKET_POOL_H
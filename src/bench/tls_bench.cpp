@@ -0,0 +1,372 @@
+// Measures mutual TLS 1.3 handshakes per second (full and resumed) for every key exchange group and bulk
+// encryption throughput for every cipher suite, using the test certificates from config/. Client and
+// server run in one thread over an in-memory BIO pair, so the numbers are the CPU cost of both sides.
+
+#include "transport/tls/cipher_preferences.h"
+
+#include <cliap/cliap.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    constexpr std::size_t kBioBufferSize = 64 * 1024;
+    constexpr std::size_t kRecordSize = 16384;
+    constexpr int kMaxHandshakeRounds = 64;
+
+    constexpr std::array kCipherSuites = {
+        "TLS_AES_128_GCM_SHA256",
+        "TLS_AES_256_GCM_SHA384",
+        "TLS_CHACHA20_POLY1305_SHA256",
+    };
+
+    constexpr unsigned char kSessionIdContext[] = "mtls-mproxy-bench";
+
+    struct SslCtxDeleter { void operator()(SSL_CTX* ctx) const { SSL_CTX_free(ctx); } };
+    struct SslDeleter { void operator()(SSL* ssl) const { SSL_free(ssl); } };
+    struct SessionDeleter { void operator()(SSL_SESSION* session) const { SSL_SESSION_free(session); } };
+
+    using SslCtxPtr = std::unique_ptr<SSL_CTX, SslCtxDeleter>;
+    using SslPtr = std::unique_ptr<SSL, SslDeleter>;
+    using SessionPtr = std::unique_ptr<SSL_SESSION, SessionDeleter>;
+
+    struct BenchConf
+    {
+        std::filesystem::path ca_cert;
+        std::filesystem::path cert;
+        std::filesystem::path private_key;
+        std::chrono::milliseconds duration;
+        std::vector<std::string> groups;
+    };
+
+    std::string ssl_errors()
+    {
+        std::string errors;
+        while (const auto err = ERR_get_error()) {
+            std::array<char, 256> buffer{};
+            ERR_error_string_n(err, buffer.data(), buffer.size());
+            if (!errors.empty())
+                errors += "; ";
+            errors += buffer.data();
+        }
+
+        return errors;
+    }
+
+    // config/ has no client certificate, the server certificate doubles as one. Its extended key usage
+    // is serverAuth only, so the server side check accepts any purpose, the chain is still verified.
+    SslCtxPtr make_context(const BenchConf& conf, bool server, std::string_view suite, std::string_view group)
+    {
+        SslCtxPtr ctx{SSL_CTX_new(server ? TLS_server_method() : TLS_client_method())};
+        if (!ctx)
+            throw std::runtime_error{"SSL_CTX_new failed: " + ssl_errors()};
+
+        SSL_CTX_set_min_proto_version(ctx.get(), TLS1_3_VERSION);
+        if (!SSL_CTX_set_ciphersuites(ctx.get(), std::string{suite}.c_str()) ||
+            !SSL_CTX_set1_groups_list(ctx.get(), std::string{group}.c_str()) ||
+            !SSL_CTX_use_certificate_chain_file(ctx.get(), conf.cert.string().c_str()) ||
+            !SSL_CTX_use_PrivateKey_file(ctx.get(), conf.private_key.string().c_str(), SSL_FILETYPE_PEM) ||
+            !SSL_CTX_load_verify_locations(ctx.get(), conf.ca_cert.string().c_str(), nullptr))
+            throw std::runtime_error{std::format("can't configure {} context for {}/{}: {}",
+                                                 server ? "server" : "client", suite, group, ssl_errors())};
+
+        if (server) {
+            SSL_CTX_set_verify(ctx.get(), SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, nullptr);
+            SSL_CTX_set_purpose(ctx.get(), X509_PURPOSE_ANY);
+            SSL_CTX_set_session_id_context(ctx.get(), kSessionIdContext, sizeof(kSessionIdContext) - 1);
+            SSL_CTX_set_options(ctx.get(), SSL_OP_CIPHER_SERVER_PREFERENCE);
+        } else {
+            SSL_CTX_set_verify(ctx.get(), SSL_VERIFY_PEER, nullptr);
+            SSL_CTX_set_session_cache_mode(ctx.get(), SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        }
+
+        return ctx;
+    }
+
+    bool in_progress(SSL* ssl, int ret)
+    {
+        const auto err = SSL_get_error(ssl, ret);
+        return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE;
+    }
+
+    class Connection
+    {
+    public:
+        Connection(SSL_CTX* client_ctx, SSL_CTX* server_ctx, SSL_SESSION* session = nullptr)
+            : client_{SSL_new(client_ctx)}
+            , server_{SSL_new(server_ctx)}
+        {
+            BIO* client_bio{nullptr};
+            BIO* server_bio{nullptr};
+            BIO_new_bio_pair(&client_bio, kBioBufferSize, &server_bio, kBioBufferSize);
+            SSL_set_bio(client_.get(), client_bio, client_bio);
+            SSL_set_bio(server_.get(), server_bio, server_bio);
+
+            SSL_set_connect_state(client_.get());
+            SSL_set_accept_state(server_.get());
+            if (session)
+                SSL_set_session(client_.get(), session);
+        }
+
+        // OpenSSL marks the session of a connection freed without close_notify as not resumable
+        ~Connection()
+        {
+            SSL_shutdown(client_.get());
+            SSL_shutdown(server_.get());
+        }
+
+        bool handshake()
+        {
+            bool client_done{false};
+            bool server_done{false};
+            for (int round = 0; round < kMaxHandshakeRounds; ++round) {
+                if (!client_done) {
+                    const auto ret = SSL_do_handshake(client_.get());
+                    client_done = ret == 1;
+                    if (!client_done && !in_progress(client_.get(), ret))
+                        return false;
+                }
+
+                if (!server_done) {
+                    const auto ret = SSL_do_handshake(server_.get());
+                    server_done = ret == 1;
+                    if (!server_done && !in_progress(server_.get(), ret))
+                        return false;
+                }
+
+                if (client_done && server_done)
+                    return true;
+            }
+
+            return false;
+        }
+
+        // TLS 1.3 tickets arrive after the handshake, the client picks them up on its first read
+        SessionPtr session()
+        {
+            std::array<std::uint8_t, 1> byte{0x2a};
+            if (SSL_write(server_.get(), byte.data(), 1) != 1 || SSL_read(client_.get(), byte.data(), 1) != 1)
+                return nullptr;
+
+            return SessionPtr{SSL_get1_session(client_.get())};
+        }
+
+        bool resumed() const { return SSL_session_reused(client_.get()) == 1; }
+
+        // Encrypts one record on the client and decrypts it on the server
+        bool transfer(const std::vector<std::uint8_t>& data, std::vector<std::uint8_t>& received)
+        {
+            if (SSL_write(client_.get(), data.data(), static_cast<int>(data.size())) != static_cast<int>(data.size()))
+                return false;
+
+            std::size_t total{0};
+            while (total < data.size()) {
+                const auto ret = SSL_read(server_.get(), received.data() + total, static_cast<int>(received.size() - total));
+                if (ret <= 0)
+                    return false;
+                total += static_cast<std::size_t>(ret);
+            }
+
+            return true;
+        }
+
+    private:
+        SslPtr client_;
+        SslPtr server_;
+    };
+
+    double per_second(std::uint64_t count, Clock::duration elapsed)
+    {
+        return static_cast<double>(count) / std::chrono::duration<double>(elapsed).count();
+    }
+
+    // With a session every connection resumes the ticket the previous one received, like a reconnecting client
+    std::optional<double> handshakes_per_second(SSL_CTX* client_ctx, SSL_CTX* server_ctx, SessionPtr session,
+                                                std::chrono::milliseconds duration)
+    {
+        const bool resume{session != nullptr};
+        std::uint64_t count{0};
+        const auto start = Clock::now();
+        auto elapsed = Clock::duration{};
+        while (elapsed < duration) {
+            Connection conn{client_ctx, server_ctx, session.get()};
+            if (!conn.handshake())
+                return std::nullopt;
+
+            if (resume) {
+                if (!conn.resumed())
+                    return std::nullopt;
+                session = conn.session();
+            }
+
+            ++count;
+            elapsed = Clock::now() - start;
+        }
+
+        return per_second(count, elapsed);
+    }
+
+    std::optional<double> bulk_gbits(SSL_CTX* client_ctx, SSL_CTX* server_ctx, std::chrono::milliseconds duration)
+    {
+        Connection conn{client_ctx, server_ctx};
+        if (!conn.handshake())
+            return std::nullopt;
+
+        const std::vector<std::uint8_t> data(kRecordSize, 0x5a);
+        std::vector<std::uint8_t> received(kRecordSize);
+
+        std::uint64_t bytes{0};
+        const auto start = Clock::now();
+        auto elapsed = Clock::duration{};
+        while (elapsed < duration) {
+            for (int i = 0; i < 64; ++i) {
+                if (!conn.transfer(data, received))
+                    return std::nullopt;
+                bytes += data.size();
+            }
+            elapsed = Clock::now() - start;
+        }
+
+        return per_second(bytes * 8, elapsed) / 1e9;
+    }
+
+    std::string format_result(const std::optional<double>& value, std::string_view unit)
+    {
+        return value.has_value() ? std::format("{:.2f} {}", *value, unit) : std::string{"failed"};
+    }
+
+    void run_handshake_bench(const BenchConf& conf)
+    {
+        std::cout << std::format("{:<32}{:>20}{:>20}\n", "group (TLS_AES_128_GCM_SHA256)", "full", "resumed");
+        for (const auto& group : conf.groups) {
+            const auto suite = kCipherSuites.front();
+            const auto server_ctx = make_context(conf, true, suite, group);
+            const auto client_ctx = make_context(conf, false, suite, group);
+
+            const auto full = handshakes_per_second(client_ctx.get(), server_ctx.get(), nullptr, conf.duration);
+
+            std::optional<double> resumed;
+            Connection first{client_ctx.get(), server_ctx.get()};
+            if (first.handshake()) {
+                if (auto session = first.session())
+                    resumed = handshakes_per_second(client_ctx.get(), server_ctx.get(), std::move(session), conf.duration);
+            }
+
+            std::cout << std::format("{:<32}{:>20}{:>20}\n", group, format_result(full, "hs/s"), format_result(resumed, "hs/s"));
+        }
+    }
+
+    void run_bulk_bench(const BenchConf& conf)
+    {
+        std::cout << std::format("{:<32}{:>20}\n", "cipher suite (16 KiB records)", "encrypt+decrypt");
+        for (const auto* suite : kCipherSuites) {
+            const auto group = conf.groups.front();
+            const auto server_ctx = make_context(conf, true, suite, group);
+            const auto client_ctx = make_context(conf, false, suite, group);
+
+            const auto gbits = bulk_gbits(client_ctx.get(), server_ctx.get(), conf.duration);
+            std::cout << std::format("{:<32}{:>20}\n", suite, format_result(gbits, "Gbit/s"));
+        }
+    }
+
+    std::vector<std::string> split_list(std::string_view str)
+    {
+        std::vector<std::string> items;
+        while (!str.empty()) {
+            const auto end = str.find(':');
+            if (end != 0)
+                items.emplace_back(str.substr(0, end));
+            str = (end == std::string_view::npos) ? std::string_view{} : str.substr(end + 1);
+        }
+
+        return items;
+    }
+
+    std::optional<BenchConf> parse_command_line_arguments(int argc, char* argv[])
+    {
+        using cliap::Arg;
+        using cliap::ArgParser;
+
+        ArgParser argParser;
+
+        argParser
+            .add_parameter(Arg("h,help").flag().description("show help message"))
+            .add_parameter(Arg("d,config-dir").set_default(".").description("directory with test-ca.pem, test-server-cert.pem and test-server-key.pem"))
+            .add_parameter(Arg("t,duration").set_default("2000").description("duration of every measurement in milliseconds"))
+            .add_parameter(Arg("g,groups").set_default("X25519:P-256:P-384").description("key exchange groups to measure"));
+
+        const auto err_msg = argParser.parse(argc, argv);
+        if (argParser.arg("h").is_parsed()) {
+            argParser.print_help();
+            return std::nullopt;
+        }
+
+        if (err_msg.has_value()) {
+            std::cout << *err_msg << std::endl;
+            argParser.print_help();
+            return std::nullopt;
+        }
+
+        const std::filesystem::path dir{argParser.arg("d").get_value_as_str()};
+
+        BenchConf conf{dir / "test-ca.pem", dir / "test-server-cert.pem", dir / "test-server-key.pem", {}, {}};
+
+        const auto duration = argParser.arg("t").get_value_as_str();
+        int duration_ms{0};
+        const auto [ptr, ec] = std::from_chars(duration.data(), duration.data() + duration.size(), duration_ms);
+        if (ec != std::errc{} || ptr != duration.data() + duration.size() || duration_ms <= 0) {
+            std::cerr << "the <duration> parameter must be a positive number of milliseconds" << std::endl;
+            return std::nullopt;
+        }
+        conf.duration = std::chrono::milliseconds{duration_ms};
+
+        conf.groups = split_list(argParser.arg("g").get_value_as_str());
+        if (conf.groups.empty()) {
+            std::cerr << "the <groups> parameter must list at least one group" << std::endl;
+            return std::nullopt;
+        }
+
+        return conf;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    const auto conf = parse_command_line_arguments(argc, argv);
+    if (!conf.has_value())
+        return 0;
+
+    const auto defaults = mtls_mproxy::default_cipher_preferences();
+    std::cout << std::format("{}\naes acceleration: {}\ndefault cipher suites: {}\ndefault groups: {}\n\n",
+                             OpenSSL_version(OPENSSL_VERSION),
+                             mtls_mproxy::cpu_has_aes_acceleration() ? "yes" : "no",
+                             defaults.ciphersuites,
+                             defaults.groups);
+
+    try {
+        run_handshake_bench(*conf);
+        std::cout << std::endl;
+        run_bulk_bench(*conf);
+    } catch (std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
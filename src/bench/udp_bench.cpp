@@ -0,0 +1,398 @@
+// Measures the datagrams per second a UDP relay forwards on one thread: per datagram async_receive_from
+// and async_send_to (the relay before batching) against batched receive and send with several batch
+// sizes, each with and without UDP segmentation and receive offload. Every round a generator fills the
+// relay socket receive buffer, then the relay forwards the queued datagrams to a sink socket. Only the
+// relay is timed. The per datagram relay stops on an empty socket (FIONREAD) before each receive, the
+// batched relay on a receive that finds nothing. Loopback has no receive offload of its own, with offload
+// the generator sends segmented messages so that the relay socket gets them coalesced as from a NIC.
+
+#include "transport/udp_batch.h"
+
+#include <cliap/cliap.h>
+
+#include <asio/io_context.hpp>
+#include <asio/ip/udp.hpp>
+#include <asio/post.hpp>
+
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <deque>
+#include <format>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace
+{
+    namespace net = asio;
+    using udp = asio::ip::udp;
+    using Clock = std::chrono::steady_clock;
+    using mtls_mproxy::Datagram;
+    using mtls_mproxy::IoBuffer;
+    using mtls_mproxy::UdpOffload;
+
+    // Requested socket buffer size, the kernel caps it at net.core.rmem_max
+    constexpr int kSocketBufferSize = 4 * 1024 * 1024;
+
+    struct BenchConf
+    {
+        std::chrono::milliseconds duration;
+        std::size_t datagram_size;
+        std::size_t round_size;
+        std::vector<std::size_t> batches;
+    };
+
+    struct Sockets
+    {
+        Sockets(net::io_context& ctx, bool offload)
+            : generator{ctx, udp::endpoint{net::ip::address_v4::loopback(), 0}}
+            , relay_in{ctx, udp::endpoint{net::ip::address_v4::loopback(), 0}}
+            , relay_out{ctx, udp::endpoint{net::ip::address_v4::loopback(), 0}}
+            , sink{ctx, udp::endpoint{net::ip::address_v4::loopback(), 0}}
+        {
+            relay_in.set_option(net::socket_base::receive_buffer_size{kSocketBufferSize});
+            relay_out.set_option(net::socket_base::send_buffer_size{kSocketBufferSize});
+            sink.set_option(net::socket_base::receive_buffer_size{kSocketBufferSize});
+            relay_in.non_blocking(true);
+            relay_out.non_blocking(true);
+            sink.non_blocking(true);
+            if (offload) {
+                generator_offload = mtls_mproxy::enable_udp_offload(generator);
+                mtls_mproxy::enable_udp_offload(relay_in);
+                relay_offload = mtls_mproxy::enable_udp_offload(relay_out);
+            }
+        }
+
+        udp::socket generator;
+        udp::socket relay_in;
+        udp::socket relay_out;
+        udp::socket sink;
+        UdpOffload generator_offload;
+        UdpOffload relay_offload;
+    };
+
+    // The relay before batching: one receive and one send per datagram, every datagram copied once
+    class PerDatagramRelay
+    {
+    public:
+        PerDatagramRelay(udp::socket& in, udp::socket& out, udp::endpoint target)
+            : in_{in}
+            , out_{out}
+            , target_{target}
+        {
+        }
+
+        void start() { read(); }
+        std::size_t forwarded() const { return forwarded_; }
+
+    private:
+        void read()
+        {
+            if (in_.available() == 0)
+                return;
+
+            in_.async_receive_from(
+                net::buffer(buffer_), sender_,
+                [this](const net::error_code& ec, std::size_t length) {
+                    if (ec)
+                        return;
+                    queue_.emplace_back(buffer_.data(), buffer_.data() + length);
+                    write();
+                    read();
+                });
+        }
+
+        void write()
+        {
+            if (writing_ || queue_.empty())
+                return;
+
+            writing_ = true;
+            out_.async_send_to(
+                net::buffer(queue_.front()), target_,
+                [this](const net::error_code& ec, std::size_t) {
+                    writing_ = false;
+                    if (ec)
+                        return;
+                    queue_.pop_front();
+                    ++forwarded_;
+                    write();
+                });
+        }
+
+        udp::socket& in_;
+        udp::socket& out_;
+        udp::endpoint target_;
+        udp::endpoint sender_;
+        std::array<std::uint8_t, mtls_mproxy::max_buffer_size> buffer_{};
+        std::deque<IoBuffer> queue_;
+        std::size_t forwarded_{0};
+        bool writing_{false};
+    };
+
+    // Same structure as the UDP streams: drain a batch, copy it into the write queue, flush the queue in
+    // a posted handler with as few send calls as the batch size allows
+    class BatchRelay
+    {
+    public:
+        BatchRelay(udp::socket& in, udp::socket& out, UdpOffload offload, udp::endpoint target, std::size_t batch)
+            : in_{in}
+            , out_{out}
+            , offload_{offload}
+            , target_{target}
+            , batch_{batch}
+            , rx_{batch}
+        {
+        }
+
+        void start() { receive(); }
+        std::size_t forwarded() const { return forwarded_; }
+
+    private:
+        void receive()
+        {
+            net::error_code ec;
+            const auto count = rx_.receive(in_, ec);
+            if (ec)
+                return;
+
+            for (std::size_t i = 0; i < count; ++i) {
+                const auto data = rx_.data(i);
+                queue_.push_back({IoBuffer(data.begin(), data.end()), target_});
+            }
+
+            if (!flushing_) {
+                flushing_ = true;
+                net::post(in_.get_executor(), [this] { flush(); });
+            }
+            net::post(in_.get_executor(), [this] { receive(); });
+        }
+
+        void flush()
+        {
+            while (!queue_.empty()) {
+                net::error_code ec;
+                const auto sent = mtls_mproxy::send_batch(out_, queue_, batch_, offload_, ec);
+                if (ec == net::error::would_block) {
+                    out_.async_wait(udp::socket::wait_write, [this](const net::error_code& ec) {
+                        if (!ec)
+                            flush();
+                    });
+                    return;
+                }
+                if (ec)
+                    return;
+
+                queue_.erase(queue_.begin(), queue_.begin() + sent);
+                forwarded_ += sent;
+            }
+            flushing_ = false;
+        }
+
+        udp::socket& in_;
+        udp::socket& out_;
+        UdpOffload offload_;
+        udp::endpoint target_;
+        std::size_t batch_;
+        mtls_mproxy::UdpReceiveBatch rx_;
+        std::deque<Datagram> queue_;
+        std::size_t forwarded_{0};
+        bool flushing_{false};
+    };
+
+    void generate(Sockets& sockets, const BenchConf& conf)
+    {
+        std::deque<Datagram> queue;
+        const auto target = sockets.relay_in.local_endpoint();
+        for (std::size_t i = 0; i < conf.round_size; ++i)
+            queue.push_back({IoBuffer(conf.datagram_size, static_cast<std::uint8_t>(i)), target});
+
+        while (!queue.empty()) {
+            net::error_code ec;
+            const auto sent = mtls_mproxy::send_batch(sockets.generator, queue, 64, sockets.generator_offload, ec);
+            if (ec == net::error::would_block) {
+                sockets.generator.wait(udp::socket::wait_write);
+                continue;
+            }
+            if (ec)
+                throw std::runtime_error{"generator send failed: " + ec.message()};
+            queue.erase(queue.begin(), queue.begin() + sent);
+        }
+    }
+
+    std::size_t drain(udp::socket& socket)
+    {
+        mtls_mproxy::UdpReceiveBatch batch{64};
+        std::size_t count{0};
+        net::error_code ec;
+        while (!ec)
+            count += batch.receive(socket, ec);
+
+        return count;
+    }
+
+    struct Result
+    {
+        double pps;
+        std::size_t delivered_percent;
+    };
+
+    // make_relay(sockets) returns a relay with start() and forwarded()
+    template <typename MakeRelay>
+    Result measure(const BenchConf& conf, bool offload, MakeRelay make_relay)
+    {
+        net::io_context ctx;
+        Sockets sockets{ctx, offload};
+
+        std::size_t forwarded{0};
+        std::size_t generated{0};
+        std::size_t delivered{0};
+        auto relay_time = Clock::duration{};
+        const auto start = Clock::now();
+        while (Clock::now() - start < conf.duration) {
+            generate(sockets, conf);
+            generated += conf.round_size;
+
+            auto relay = make_relay(sockets);
+            const auto round_start = Clock::now();
+            relay.start();
+            ctx.run();
+            relay_time += Clock::now() - round_start;
+            ctx.restart();
+
+            forwarded += relay.forwarded();
+            delivered += drain(sockets.sink);
+        }
+
+        const auto seconds = std::chrono::duration<double>(relay_time).count();
+        return {seconds > 0 ? static_cast<double>(forwarded) / seconds : 0.0,
+                generated ? delivered * 100 / generated : 0};
+    }
+
+    void run_bench(const BenchConf& conf)
+    {
+        std::cout << std::format("{:<36}{:>16}{:>12}\n", std::format("relay ({} byte datagrams)", conf.datagram_size),
+                                 "datagrams/s", "delivered");
+
+        const auto per_datagram = measure(conf, false, [](Sockets& s) {
+            return PerDatagramRelay{s.relay_in, s.relay_out, s.sink.local_endpoint()};
+        });
+        std::cout << std::format("{:<36}{:>16.0f}{:>11}%\n", "per datagram async", per_datagram.pps,
+                                 per_datagram.delivered_percent);
+
+        for (const auto offload : {false, true}) {
+            for (const auto batch : conf.batches) {
+                const auto batched = measure(conf, offload, [batch](Sockets& s) {
+                    return BatchRelay{s.relay_in, s.relay_out, s.relay_offload, s.sink.local_endpoint(), batch};
+                });
+                const auto name = std::format("batch {}{}", batch, offload ? " + offload" : "");
+                std::cout << std::format("{:<36}{:>16.0f}{:>11}%   x{:.2f}\n", name, batched.pps,
+                                         batched.delivered_percent,
+                                         per_datagram.pps > 0 ? batched.pps / per_datagram.pps : 0.0);
+            }
+        }
+    }
+
+    std::optional<int> to_int(std::string_view str)
+    {
+        int value{0};
+        const auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+        if (ec != std::errc{} || ptr != str.data() + str.size())
+            return std::nullopt;
+
+        return value;
+    }
+
+    std::optional<std::vector<std::size_t>> parse_batches(std::string_view str)
+    {
+        std::vector<std::size_t> batches;
+        while (!str.empty()) {
+            const auto end = str.find(',');
+            const auto value = to_int(str.substr(0, end));
+            if (!value.has_value() || *value < 1 || *value > 64)
+                return std::nullopt;
+            batches.push_back(static_cast<std::size_t>(*value));
+            str = (end == std::string_view::npos) ? std::string_view{} : str.substr(end + 1);
+        }
+
+        return batches;
+    }
+
+    std::optional<BenchConf> parse_command_line_arguments(int argc, char* argv[])
+    {
+        using cliap::Arg;
+        using cliap::ArgParser;
+
+        ArgParser argParser;
+
+        argParser
+            .add_parameter(Arg("h,help").flag().description("show help message"))
+            .add_parameter(Arg("t,duration").set_default("2000").description("duration of every measurement in milliseconds"))
+            .add_parameter(Arg("s,size").set_default("64").description("datagram payload size in bytes"))
+            .add_parameter(Arg("r,round").set_default("256").description("datagrams queued for the relay per round, must fit the socket receive buffer"))
+            .add_parameter(Arg("b,batches").set_default("1,8,32,64").description("comma separated batch sizes to measure [1..64]"));
+
+        const auto err_msg = argParser.parse(argc, argv);
+        if (argParser.arg("h").is_parsed()) {
+            argParser.print_help();
+            return std::nullopt;
+        }
+
+        if (err_msg.has_value()) {
+            std::cout << *err_msg << std::endl;
+            argParser.print_help();
+            return std::nullopt;
+        }
+
+        BenchConf conf{};
+
+        const auto duration = to_int(argParser.arg("t").get_value_as_str());
+        if (!duration.has_value() || *duration <= 0) {
+            std::cerr << "the <duration> parameter must be a positive number of milliseconds" << std::endl;
+            return std::nullopt;
+        }
+        conf.duration = std::chrono::milliseconds{*duration};
+
+        const auto size = to_int(argParser.arg("s").get_value_as_str());
+        if (!size.has_value() || *size < 1 || *size > mtls_mproxy::max_buffer_size) {
+            std::cerr << std::format("the <size> parameter must be a number of bytes from 1 to {}", +mtls_mproxy::max_buffer_size) << std::endl;
+            return std::nullopt;
+        }
+        conf.datagram_size = static_cast<std::size_t>(*size);
+
+        const auto round = to_int(argParser.arg("r").get_value_as_str());
+        if (!round.has_value() || *round < 1) {
+            std::cerr << "the <round> parameter must be a positive number of datagrams" << std::endl;
+            return std::nullopt;
+        }
+        conf.round_size = static_cast<std::size_t>(*round);
+
+        const auto batches = parse_batches(argParser.arg("b").get_value_as_str());
+        if (!batches.has_value() || batches->empty()) {
+            std::cerr << "the <batches> parameter must list batch sizes from 1 to 64" << std::endl;
+            return std::nullopt;
+        }
+        conf.batches = *batches;
+
+        return conf;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    const auto conf = parse_command_line_arguments(argc, argv);
+    if (!conf.has_value())
+        return 0;
+
+    try {
+        run_bench(*conf);
+    } catch (std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -3,6 +3,7 @@
 #include "socks/socks_stream_manager.h"
 #include "http/http_stream_manager.h"
 #include "fwd/fwd_stream_manager.h"
+#include "fwd/entry_stream_manager.h"
 
 #include <asynclog/log_manager.h>
 #include <asynclog/scoped_logger.h>
@@ -10,7 +11,11 @@
 
 #include <cliap/cliap.h>
 
+#include <charconv>
+#include <chrono>
 #include <optional>
+#include <string_view>
+#include <vector>
 
 namespace
 {
@@ -22,7 +27,19 @@ namespace
         std::string target_host;
         std::string target_port;
         int log_level;
+        mtls_mproxy::BackendPool::Options backends;
         mtls_mproxy::TlsServer::TlsOptions tls_options;
+        mtls_mproxy::UpstreamPool::Options http_pool;
+        mtls_mproxy::ResponseCache::Options http_cache;
+        mtls_mproxy::TlsConnector::Options entry;
+        mtls_mproxy::UdpBatchOptions udp_batch;
+        mtls_mproxy::UdpSocketPool::Options udp_sockets;
+        mtls_mproxy::FlowControl flow_control;
+        std::string shaping_file;
+        mtls_mproxy::AdmissionControl::Options admission;
+        mtls_mproxy::ConnectionLimiter::Options peer_limits;
+        mtls_mproxy::ListenerOptions listener;
+        mtls_mproxy::SocketOptions upstream_sockets;
 
         bool tls_enabled() const {
             return
@@ -32,6 +49,105 @@ namespace
         }
     };
 
+    std::optional<int> to_int(const std::string& str)
+    {
+        int value{0};
+        const auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+        if (ec != std::errc{} || ptr != str.data() + str.size())
+            return std::nullopt;
+
+        return value;
+    }
+
+    // Parses a comma separated list of 'host:port' items, IPv6 literals are written as '[addr]:port'
+    std::optional<std::vector<mtls_mproxy::BackendPool::Target>> parse_backends(std::string_view str)
+    {
+        std::vector<mtls_mproxy::BackendPool::Target> targets;
+        while (!str.empty()) {
+            const auto end = str.find(',');
+            auto item = str.substr(0, end);
+            str = (end == std::string_view::npos) ? std::string_view{} : str.substr(end + 1);
+
+            const auto port_sep = item.rfind(':');
+            if (port_sep == std::string_view::npos || port_sep == 0 || port_sep + 1 == item.size())
+                return std::nullopt;
+
+            auto host = item.substr(0, port_sep);
+            if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+                host = host.substr(1, host.size() - 2);
+
+            targets.push_back({std::string{host}, std::string{item.substr(port_sep + 1)}});
+        }
+
+        return targets;
+    }
+
+    // Parses 'source=<connections>[/<rate>],identity=<connections>[/<rate>]', both items are optional
+    std::optional<mtls_mproxy::ConnectionLimiter::Options> parse_peer_limits(std::string_view str)
+    {
+        mtls_mproxy::ConnectionLimiter::Options options;
+        while (!str.empty()) {
+            const auto end = str.find(',');
+            const auto item = str.substr(0, end);
+            str = (end == std::string_view::npos) ? std::string_view{} : str.substr(end + 1);
+
+            const auto key_sep = item.find('=');
+            if (key_sep == std::string_view::npos)
+                return std::nullopt;
+
+            const auto key = item.substr(0, key_sep);
+            const auto value = item.substr(key_sep + 1);
+            const auto rate_sep = value.find('/');
+            const auto connections = to_int(std::string{value.substr(0, rate_sep)});
+            const auto rate = rate_sep == std::string_view::npos ? std::optional<int>{0} : to_int(std::string{value.substr(rate_sep + 1)});
+            if (!connections.has_value() || *connections < 0 || !rate.has_value() || *rate < 0)
+                return std::nullopt;
+
+            const mtls_mproxy::PeerLimits limits{static_cast<std::size_t>(*connections), static_cast<std::uint64_t>(*rate)};
+            if (key == "source")
+                options.per_source = limits;
+            else if (key == "identity")
+                options.per_identity = limits;
+            else
+                return std::nullopt;
+        }
+
+        return options;
+    }
+
+    // Parses 'backlog=<n>,accepts=<n>,defer-accept=<seconds>,fast-open=<queue>', every item is optional
+    std::optional<mtls_mproxy::ListenerOptions> parse_listener_options(std::string_view str)
+    {
+        mtls_mproxy::ListenerOptions options;
+        while (!str.empty()) {
+            const auto end = str.find(',');
+            const auto item = str.substr(0, end);
+            str = (end == std::string_view::npos) ? std::string_view{} : str.substr(end + 1);
+
+            const auto key_sep = item.find('=');
+            if (key_sep == std::string_view::npos)
+                return std::nullopt;
+
+            const auto key = item.substr(0, key_sep);
+            const auto value = to_int(std::string{item.substr(key_sep + 1)});
+            if (!value.has_value() || *value < 0)
+                return std::nullopt;
+
+            if (key == "backlog")
+                options.backlog = *value;
+            else if (key == "accepts" && *value > 0)
+                options.accepts = static_cast<std::size_t>(*value);
+            else if (key == "defer-accept")
+                options.defer_accept = std::chrono::seconds{*value};
+            else if (key == "fast-open")
+                options.fast_open = *value;
+            else
+                return std::nullopt;
+        }
+
+        return options;
+    }
+
     std::optional<ServerConf> parse_command_line_arguments(int argc, char* argv[])
     {
         using cliap::Arg;
@@ -44,16 +160,56 @@ namespace
         argParser
             .add_parameter(Arg("h,help").flag().description("show help message"))
             .add_parameter(Arg("p,port").required().set_default("8443").description("proxy server listen port number"))
-            .add_parameter(Arg("m,mode").required().set_default("http").description("proxy mode [http|socks5|tun]"))
+            .add_parameter(Arg("m,mode").required().set_default("http").description("proxy mode [http|socks5|tun|client], client relays local connections to a remote mproxy over mTLS"))
             .add_parameter(Arg("v,log_level").set_default("info").description("verbosity level of log messages [debug|trace|info|warning|error|fatal]"))
             .add_parameter(Arg("l,log_file").set_default("trace.log").description("log file path"))
             .add_parameter(Arg("t,tls").flag().description("use tls tunnel mode"))
             .add_parameter(Arg("k,private-key").description("private key file path"))
-            .add_parameter(Arg("s,server-cert").description("server certificate file path"))
+            .add_parameter(Arg("s,server-cert").description("server certificate file path, the client certificate in client mode"))
             .add_parameter(Arg("c,ca-cert").description("CA certificate file path"))
-            .add_parameter(Arg("n,target-host").description("tunnel target host"))
-            .add_parameter(Arg("o,target-port").description("tunnel target port"))
-            .add_parameter(Arg("V,tls-version").set_default("1.3").description("TLS min protocol version [1.2 or 1.3]"));
+            .add_parameter(Arg("n,target-host").description("tunnel target host, the remote mproxy in client mode"))
+            .add_parameter(Arg("o,target-port").description("tunnel target port, the remote mproxy port in client mode"))
+            .add_parameter(Arg("b,backends").description("comma separated list of tunnel backends host:port, used together with <target-host>"))
+            .add_parameter(Arg("B,balance").set_default("round-robin").description("tunnel backend balancing policy [round-robin|least-sessions|p2c|hash-address|hash-identity]"))
+            .add_parameter(Arg("H,health-check-interval").set_default("5").description("tunnel backend TCP health check interval in seconds, 0 - disabled"))
+            .add_parameter(Arg("O,relay-high-watermark").set_default("256").description("relayed data in KiB buffered per direction of a session before the sending side is no longer read"))
+            .add_parameter(Arg("J,relay-low-watermark").set_default("64").description("buffered data in KiB at which reading of a paused sending side resumes, below <relay-high-watermark>"))
+            .add_parameter(Arg("a,shaping").description("traffic shaping limits file, '<session|identity|mode|global> <rate> [<burst>]' per line, reloaded when modified"))
+            .add_parameter(Arg("e,max-sessions").set_default("0").description("live sessions admitted by the listener, 0 - unlimited"))
+            .add_parameter(Arg("f,accept-rate").set_default("0").description("connections accepted per second, 0 - unlimited"))
+            .add_parameter(Arg("g,fd-headroom").set_default("64").description("free file descriptors below which accepting pauses, 0 - disabled"))
+            .add_parameter(Arg("overload-action").set_default("pause").description("connections over <max-sessions> or <accept-rate> [pause|reset|reply], pause leaves them in the listen backlog, reply sends a SOCKS5 failure or HTTP 503 (reset behind TLS)"))
+            .add_parameter(Arg("peer-limits").description("per peer limits 'source=<connections>[/<rate>],identity=<connections>[/<rate>]', concurrent connections and new connections per second of a source address (IPv6 /64) or mTLS client identity, 0 - unlimited, a multiplexed mTLS connection counts once"))
+            .add_parameter(Arg("listener").description("listener tuning 'backlog=<n>,accepts=<n>,defer-accept=<seconds>,fast-open=<queue>', listen backlog (0 - system maximum), outstanding accepts (default 4), TCP_DEFER_ACCEPT timeout and TCP Fast Open queue (0 - disabled)"))
+            .add_parameter(Arg("socket-profiles").description("socket option profiles file, 'profile <name> <option>=<value>...' and '<downstream|upstream> <profile> [<mode>|<port>]' per line, options: nodelay=on|off, sndbuf=<bytes>, rcvbuf=<bytes>, notsent-lowat=<bytes>, keepalive=on|<idle>/<interval>/<count>, congestion=<algorithm>, user-timeout=<ms>"))
+            .add_parameter(Arg("fast-open-connect").set_default("off").description("TCP Fast Open on upstream connects that have data to send first: plain requests in http mode, tunnels with client data in tun mode [on|off]"))
+            .add_parameter(Arg("r,target-resolve-interval").set_default("30").description("tunnel target DNS refresh interval in seconds, 0 - resolve once at startup"))
+            .add_parameter(Arg("V,tls-version").set_default("1.3").description("TLS min protocol version [1.2 or 1.3]"))
+            .add_parameter(Arg("S,session-cache").set_default("20480").description("TLS server session cache size, 0 - disabled"))
+            .add_parameter(Arg("T,session-timeout").set_default("7200").description("TLS session and ticket lifetime in seconds"))
+            .add_parameter(Arg("K,ticket-keys").description("shared TLS session ticket key file (80 byte keys, the first one encrypts)"))
+            .add_parameter(Arg("w,handshake-threads").set_default("0").description("TLS handshake worker threads, 0 - handshakes run on the relay thread"))
+            .add_parameter(Arg("A,tls-async").flag().description("enable async TLS key operations for async capable engines/providers, requires <handshake-threads>"))
+            .add_parameter(Arg("C,verify-cache").set_default("1024").description("cached client certificate chain verifications, 0 - disabled"))
+            .add_parameter(Arg("R,crl").description("client certificate revocation lists file (PEM), checked for changes every minute; after a reload revoked clients can't resume sessions, but open connections stay and a revoked intermediate CA missing from <ca-cert> only takes effect as its sessions expire (<session-timeout>)"))
+            .add_parameter(Arg("E,early-data").set_default("0").description("TLS 1.3 0-RTT data accepted from resumed clients in bytes (tun mode only), 0 - disabled"))
+            .add_parameter(Arg("Y,early-data-anti-replay").set_default("on").description("single use tickets for 0-RTT sessions [on|off], off accepts replayed early data"))
+            .add_parameter(Arg("Q,ciphersuites").description("TLS 1.3 cipher suites in preference order, default depends on AES hardware support"))
+            .add_parameter(Arg("q,ciphers").description("TLS 1.2 ciphers in preference order, default depends on AES hardware support"))
+            .add_parameter(Arg("G,groups").description("key exchange groups in preference order, default X25519:P-256:P-384"))
+            .add_parameter(Arg("x,mux-streams").set_default("0").description("logical streams per multiplexed mTLS connection (yamux framing, ALPN 'mproxy-mux'), 0 - multiplexing disabled"))
+            .add_parameter(Arg("X,mux-window").set_default("256").description("receive window of a multiplexed stream in KiB, at least 256"))
+            .add_parameter(Arg("W,warm-connections").set_default("4").description("handshaked mTLS connections kept ready in client mode, 0 - connect on demand"))
+            .add_parameter(Arg("u,udp-batch").set_default("32").description("datagrams received or sent by one system call on SOCKS5 UDP associations [1..64]"))
+            .add_parameter(Arg("N,udp-shared-sockets").set_default("0").description("outgoing UDP sockets per address family shared by all SOCKS5 UDP associations, 0 - a socket per association"))
+            .add_parameter(Arg("L,udp-nat-timeout").set_default("60").description("idle time in seconds after which a mapping of a shared outgoing UDP socket expires"))
+            .add_parameter(Arg("U,udp-offload").set_default("on").description("UDP segmentation and receive offload on SOCKS5 UDP associations where the kernel supports it [on|off]"))
+            .add_parameter(Arg("i,http-idle-per-host").set_default("8").description("idle keep-alive connections kept per origin server in http mode, 0 - no reuse"))
+            .add_parameter(Arg("P,http-idle-max").set_default("256").description("idle keep-alive connections kept in total in http mode"))
+            .add_parameter(Arg("I,http-idle-timeout").set_default("30").description("idle keep-alive connection lifetime in seconds in http mode"))
+            .add_parameter(Arg("M,http-cache-memory").set_default("0").description("in-memory HTTP response cache size in MiB in http mode, 0 - disabled"))
+            .add_parameter(Arg("D,http-cache-disk").set_default("0").description("memory mapped on-disk HTTP response cache size in MiB in http mode, 0 - disabled"))
+            .add_parameter(Arg("F,http-cache-file").set_default("http_cache.bin").description("on-disk HTTP response cache file, recreated on start"));
 
         const auto err_msg = argParser.parse(argc, argv);
         if (argParser.arg("h").is_parsed()) {
@@ -73,8 +229,192 @@ namespace
         srv_conf.log_file_path = argParser.arg("l").get_value_as_str();
         srv_conf.target_host = argParser.arg("n").get_value_as_str();
         srv_conf.target_port = argParser.arg("o").get_value_as_str();
+        const auto resolve_interval = to_int(argParser.arg("r").get_value_as_str());
+        if (!resolve_interval.has_value() || *resolve_interval < 0) {
+            std::cerr << "the <target-resolve-interval> parameter must be a non-negative number of seconds" << std::endl;
+            return std::nullopt;
+        }
+        srv_conf.backends.resolve_interval = std::chrono::seconds{*resolve_interval};
+
+        const auto high_watermark = to_int(argParser.arg("O").get_value_as_str());
+        if (!high_watermark.has_value() || *high_watermark <= 0) {
+            std::cerr << "the <relay-high-watermark> parameter must be a positive number of KiB" << std::endl;
+            return std::nullopt;
+        }
+        const auto low_watermark = to_int(argParser.arg("J").get_value_as_str());
+        if (!low_watermark.has_value() || *low_watermark < 0 || *low_watermark >= *high_watermark) {
+            std::cerr << "the <relay-low-watermark> parameter must be a non-negative number of KiB below <relay-high-watermark>" << std::endl;
+            return std::nullopt;
+        }
+        srv_conf.flow_control.high_watermark = static_cast<std::size_t>(*high_watermark) * 1024;
+        srv_conf.flow_control.low_watermark = static_cast<std::size_t>(*low_watermark) * 1024;
+        srv_conf.shaping_file = argParser.arg("a").get_value_as_str();
+
+        const auto max_sessions = to_int(argParser.arg("e").get_value_as_str());
+        if (!max_sessions.has_value() || *max_sessions < 0) {
+            std::cerr << "the <max-sessions> parameter must be a non-negative number" << std::endl;
+            return std::nullopt;
+        }
+        srv_conf.admission.max_sessions = static_cast<std::size_t>(*max_sessions);
+
+        const auto accept_rate = to_int(argParser.arg("f").get_value_as_str());
+        if (!accept_rate.has_value() || *accept_rate < 0) {
+            std::cerr << "the <accept-rate> parameter must be a non-negative number of connections per second" << std::endl;
+            return std::nullopt;
+        }
+        srv_conf.admission.max_accept_rate = static_cast<std::uint64_t>(*accept_rate);
+
+        const auto fd_headroom = to_int(argParser.arg("g").get_value_as_str());
+        if (!fd_headroom.has_value() || *fd_headroom < 0) {
+            std::cerr << "the <fd-headroom> parameter must be a non-negative number of descriptors" << std::endl;
+            return std::nullopt;
+        }
+        srv_conf.admission.fd_headroom = static_cast<std::size_t>(*fd_headroom);
+
+        const auto overload_action = mtls_mproxy::parse_overload_action(argParser.arg("overload-action").get_value_as_str());
+        if (!overload_action.has_value()) {
+            std::cerr << "the <overload-action> parameter must be one of [pause|reset|reply]" << std::endl;
+            return std::nullopt;
+        }
+        srv_conf.admission.action = *overload_action;
+
+        const auto peer_limits = parse_peer_limits(argParser.arg("peer-limits").get_value_as_str());
+        if (!peer_limits.has_value()) {
+            std::cerr << "the <peer-limits> parameter must look like 'source=<connections>[/<rate>],identity=<connections>[/<rate>]'" << std::endl;
+            return std::nullopt;
+        }
+        srv_conf.peer_limits = *peer_limits;
+
+        const auto listener = parse_listener_options(argParser.arg("listener").get_value_as_str());
+        if (!listener.has_value()) {
+            std::cerr << "the <listener> parameter must look like 'backlog=<n>,accepts=<n>,defer-accept=<seconds>,fast-open=<queue>' with accepts above 0" << std::endl;
+            return std::nullopt;
+        }
+        srv_conf.listener = *listener;
+
+        const auto fast_open_connect = argParser.arg("fast-open-connect").get_value_as_str();
+        if (fast_open_connect != "on" && fast_open_connect != "off") {
+            std::cerr << "the <fast-open-connect> parameter must be one of [on|off]" << std::endl;
+            return std::nullopt;
+        }
+        srv_conf.http_pool.fast_open = fast_open_connect == "on";
+        srv_conf.backends.fast_open = fast_open_connect == "on";
+
+        if (const auto profiles_file = argParser.arg("socket-profiles").get_value_as_str(); !profiles_file.empty()) {
+            try {
+                const auto profiles = mtls_mproxy::read_socket_profiles(profiles_file, srv_conf.mode, srv_conf.listen_port);
+                srv_conf.listener.sockets = profiles.downstream;
+                srv_conf.upstream_sockets = profiles.upstream;
+                srv_conf.udp_sockets.sockets = profiles.upstream;
+                srv_conf.entry.sockets = profiles.upstream;
+            } catch (const std::exception& ex) {
+                std::cerr << "the <socket-profiles> file can't be used: " << ex.what() << std::endl;
+                return std::nullopt;
+            }
+        }
         // srv_conf.log_level = parse_log_level(argParser.arg("v").get_value_as_str());
 
+        if (srv_conf.mode == "socks5") {
+            const auto udp_batch = to_int(argParser.arg("u").get_value_as_str());
+            if (!udp_batch.has_value() || *udp_batch < 1 || *udp_batch > 64) {
+                std::cerr << "the <udp-batch> parameter must be a number of datagrams from 1 to 64" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.udp_batch.receive_batch = static_cast<std::size_t>(*udp_batch);
+            srv_conf.udp_batch.send_batch = static_cast<std::size_t>(*udp_batch);
+
+            const auto udp_offload = argParser.arg("U").get_value_as_str();
+            if (udp_offload != "on" && udp_offload != "off") {
+                std::cerr << "the <udp-offload> parameter must be one of [on|off]" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.udp_batch.offload = udp_offload == "on";
+
+            const auto shared_sockets = to_int(argParser.arg("N").get_value_as_str());
+            if (!shared_sockets.has_value() || *shared_sockets < 0) {
+                std::cerr << "the <udp-shared-sockets> parameter must be a non-negative number of sockets" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.udp_sockets.shared_sockets = static_cast<std::size_t>(*shared_sockets);
+
+            const auto nat_timeout = to_int(argParser.arg("L").get_value_as_str());
+            if (!nat_timeout.has_value() || *nat_timeout <= 0) {
+                std::cerr << "the <udp-nat-timeout> parameter must be a positive number of seconds" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.udp_sockets.nat_timeout = std::chrono::seconds{*nat_timeout};
+            srv_conf.udp_sockets.batch = srv_conf.udp_batch;
+        }
+
+        if (srv_conf.mode == "http") {
+            const auto idle_per_host = to_int(argParser.arg("i").get_value_as_str());
+            if (!idle_per_host.has_value() || *idle_per_host < 0) {
+                std::cerr << "the <http-idle-per-host> parameter must be a non-negative number" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.http_pool.max_idle_per_host = static_cast<std::size_t>(*idle_per_host);
+
+            const auto idle_max = to_int(argParser.arg("P").get_value_as_str());
+            if (!idle_max.has_value() || *idle_max < 0) {
+                std::cerr << "the <http-idle-max> parameter must be a non-negative number" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.http_pool.max_idle = static_cast<std::size_t>(*idle_max);
+
+            const auto idle_timeout = to_int(argParser.arg("I").get_value_as_str());
+            if (!idle_timeout.has_value() || *idle_timeout <= 0) {
+                std::cerr << "the <http-idle-timeout> parameter must be a positive number of seconds" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.http_pool.idle_timeout = std::chrono::seconds{*idle_timeout};
+
+            constexpr std::size_t kMiB = 1024 * 1024;
+            const auto cache_memory = to_int(argParser.arg("M").get_value_as_str());
+            if (!cache_memory.has_value() || *cache_memory < 0) {
+                std::cerr << "the <http-cache-memory> parameter must be a non-negative number of MiB" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.http_cache.memory_size = static_cast<std::size_t>(*cache_memory) * kMiB;
+
+            const auto cache_disk = to_int(argParser.arg("D").get_value_as_str());
+            if (!cache_disk.has_value() || *cache_disk < 0) {
+                std::cerr << "the <http-cache-disk> parameter must be a non-negative number of MiB" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.http_cache.disk_size = static_cast<std::size_t>(*cache_disk) * kMiB;
+            srv_conf.http_cache.disk_file = argParser.arg("F").get_value_as_str();
+        }
+
+        if (srv_conf.mode == "client") {
+            std::string err_msg{"When setting \'mode=client\' "};
+            srv_conf.entry.host = srv_conf.target_host;
+            srv_conf.entry.port = srv_conf.target_port;
+            if (srv_conf.entry.host.empty() || srv_conf.entry.port.empty()) {
+                std::cerr << err_msg << "the <target-host> and <target-port> parameters must be specified" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.entry.private_key = argParser.arg("k").get_value_as_str();
+            srv_conf.entry.client_cert = argParser.arg("s").get_value_as_str();
+            srv_conf.entry.ca_cert = argParser.arg("c").get_value_as_str();
+            if (srv_conf.entry.private_key.empty() || srv_conf.entry.client_cert.empty() || srv_conf.entry.ca_cert.empty()) {
+                std::cerr << err_msg << "the <private-key>, <server-cert> and <ca-cert> parameters must be specified" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.entry.version = argParser.arg("V").get_value_as_str();
+            srv_conf.entry.ciphers.ciphersuites = argParser.arg("Q").get_value_as_str();
+            srv_conf.entry.ciphers.ciphers = argParser.arg("q").get_value_as_str();
+            srv_conf.entry.ciphers.groups = argParser.arg("G").get_value_as_str();
+
+            const auto warm_connections = to_int(argParser.arg("W").get_value_as_str());
+            if (!warm_connections.has_value() || *warm_connections < 0) {
+                std::cerr << err_msg << "the <warm-connections> parameter must be a non-negative number" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.entry.warm_connections = static_cast<std::size_t>(*warm_connections);
+
+            return srv_conf;
+        }
+
         if (argParser.arg("t").is_parsed() || argParser.arg("m").get_value_as_str() == "tun") {
             std::string err_msg{"When setting \'tls\' parameters or when \'mode=tun\' "};
             srv_conf.tls_options.private_key = argParser.arg("k").get_value_as_str();
@@ -93,14 +433,116 @@ namespace
                 return std::nullopt;
             }
             srv_conf.tls_options.version = argParser.arg("V").get_value_as_str();
+            srv_conf.tls_options.ciphers.ciphersuites = argParser.arg("Q").get_value_as_str();
+            srv_conf.tls_options.ciphers.ciphers = argParser.arg("q").get_value_as_str();
+            srv_conf.tls_options.ciphers.groups = argParser.arg("G").get_value_as_str();
+
+            const auto session_cache = to_int(argParser.arg("S").get_value_as_str());
+            if (!session_cache.has_value() || *session_cache < 0) {
+                std::cerr << err_msg << "the <session-cache> parameter must be a non-negative number" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.tls_options.session_cache_size = *session_cache;
+
+            const auto session_timeout = to_int(argParser.arg("T").get_value_as_str());
+            if (!session_timeout.has_value() || *session_timeout <= 0) {
+                std::cerr << err_msg << "the <session-timeout> parameter must be a positive number of seconds" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.tls_options.session_timeout = std::chrono::seconds{*session_timeout};
+            srv_conf.tls_options.ticket_keys = argParser.arg("K").get_value_as_str();
+
+            const auto handshake_threads = to_int(argParser.arg("w").get_value_as_str());
+            if (!handshake_threads.has_value() || *handshake_threads < 0) {
+                std::cerr << err_msg << "the <handshake-threads> parameter must be a non-negative number" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.tls_options.handshake_threads = static_cast<std::size_t>(*handshake_threads);
+
+            srv_conf.tls_options.async_handshakes = argParser.arg("A").is_parsed();
+            if (srv_conf.tls_options.async_handshakes && srv_conf.tls_options.handshake_threads == 0) {
+                std::cerr << err_msg << "the <tls-async> parameter requires <handshake-threads> to be set" << std::endl;
+                return std::nullopt;
+            }
+
+            const auto verify_cache = to_int(argParser.arg("C").get_value_as_str());
+            if (!verify_cache.has_value() || *verify_cache < 0) {
+                std::cerr << err_msg << "the <verify-cache> parameter must be a non-negative number" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.tls_options.verify_cache_size = static_cast<std::size_t>(*verify_cache);
+            srv_conf.tls_options.crl = argParser.arg("R").get_value_as_str();
+
+            const auto early_data = to_int(argParser.arg("E").get_value_as_str());
+            if (!early_data.has_value() || *early_data < 0) {
+                std::cerr << err_msg << "the <early-data> parameter must be a non-negative number of bytes" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.tls_options.max_early_data = static_cast<std::uint32_t>(*early_data);
+
+            const auto anti_replay = argParser.arg("Y").get_value_as_str();
+            if (anti_replay != "on" && anti_replay != "off") {
+                std::cerr << err_msg << "the <early-data-anti-replay> parameter must be one of [on|off]" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.tls_options.early_data_anti_replay = anti_replay == "on";
+
+            const auto mux_streams = to_int(argParser.arg("x").get_value_as_str());
+            if (!mux_streams.has_value() || *mux_streams < 0) {
+                std::cerr << err_msg << "the <mux-streams> parameter must be a non-negative number" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.tls_options.mux.max_streams = static_cast<std::size_t>(*mux_streams);
+
+            const auto mux_window = to_int(argParser.arg("X").get_value_as_str());
+            if (!mux_window.has_value() || *mux_window < 256 || *mux_window > 1024 * 1024) {
+                std::cerr << err_msg << "the <mux-window> parameter must be a number of KiB between 256 and 1048576" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.tls_options.mux.stream_window = static_cast<std::uint32_t>(*mux_window) * 1024;
+
+            if (srv_conf.tls_options.max_early_data > 0) {
+                if (srv_conf.mode != "tun" || srv_conf.tls_options.version != "1.3") {
+                    std::cerr << err_msg << "the <early-data> parameter requires 'mode=tun' and 'tls-version=1.3'" << std::endl;
+                    return std::nullopt;
+                }
+                if (srv_conf.tls_options.early_data_anti_replay && srv_conf.tls_options.session_cache_size == 0) {
+                    std::cerr << err_msg << "the <early-data> parameter with anti-replay requires a non-zero <session-cache>" << std::endl;
+                    return std::nullopt;
+                }
+            }
         }
 
         if (argParser.arg("m").get_value_as_str() == "tun") {
-            if (srv_conf.target_host.empty() || srv_conf.target_port.empty()) {
-                std::string err_msg{"When setting \'mode=tun\' "};
-                std::cerr << err_msg << "the <target-host> and <target-port> parameters must be specified" << std::endl;
+            std::string err_msg{"When setting \'mode=tun\' "};
+            if (!srv_conf.target_host.empty() && !srv_conf.target_port.empty())
+                srv_conf.backends.targets.push_back({srv_conf.target_host, srv_conf.target_port});
+
+            const auto backends = parse_backends(argParser.arg("b").get_value_as_str());
+            if (!backends.has_value()) {
+                std::cerr << err_msg << "the <backends> parameter must be a list of host:port items" << std::endl;
                 return std::nullopt;
             }
+            std::ranges::copy(*backends, std::back_inserter(srv_conf.backends.targets));
+
+            if (srv_conf.backends.targets.empty()) {
+                std::cerr << err_msg << "the <target-host> and <target-port> or <backends> parameters must be specified" << std::endl;
+                return std::nullopt;
+            }
+
+            const auto policy = mtls_mproxy::parse_balance_policy(argParser.arg("B").get_value_as_str());
+            if (!policy.has_value()) {
+                std::cerr << err_msg << "the <balance> parameter must be one of [round-robin|least-sessions|p2c|hash-address|hash-identity]" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.backends.policy = *policy;
+
+            const auto health_check_interval = to_int(argParser.arg("H").get_value_as_str());
+            if (!health_check_interval.has_value() || *health_check_interval < 0) {
+                std::cerr << err_msg << "the <health-check-interval> parameter must be a non-negative number of seconds" << std::endl;
+                return std::nullopt;
+            }
+            srv_conf.backends.health_check_interval = std::chrono::seconds{*health_check_interval};
         }
 
         return srv_conf;
@@ -130,26 +572,52 @@ int main(int argc, char* argv[])
     using namespace mtls_mproxy;
 
     try {
+        TrafficShaperPtr shaper;
+        if (!conf.shaping_file.empty()) {
+            shaper = std::make_shared<TrafficShaper>(conf.shaping_file, log_factory);
+            logger.info(std::format("Traffic shaping limits loaded from {}", conf.shaping_file));
+        }
+
+        for (const auto& option : probe_socket_options(conf.upstream_sockets))
+            logger.warn(std::format("{} is not supported, upstream connections open without it", option));
+
+        ConnectionLimiterPtr limiter;
+        if (conf.peer_limits.per_source.limited() || conf.peer_limits.per_identity.limited())
+            limiter = std::make_shared<ConnectionLimiter>(conf.peer_limits);
+
         StreamManagerPtr proxy_backend;
         if (conf.mode == "http") {
             logger.info("Proxy-mode: http/s");
-            proxy_backend = std::make_shared<HttpStreamManager>(log_factory);
+            proxy_backend = std::make_shared<HttpStreamManager>(log_factory, conf.http_pool, conf.http_cache, conf.flow_control, shaper,
+                                                                 conf.upstream_sockets);
         } else if (conf.mode == "socks5") {
             logger.info("Proxy-mode: socks5/s");
-            bool support_udp_associate = !conf.tls_enabled();
-            proxy_backend = std::make_shared<SocksStreamManager>(log_factory, support_udp_associate);
+            // Behind the mTLS listener the datagrams of an association are framed inside its TLS stream
+            proxy_backend = std::make_shared<SocksStreamManager>(log_factory, true, conf.udp_sockets, conf.flow_control, shaper,
+                                                                  conf.upstream_sockets);
+        } else if (conf.mode == "client") {
+            logger.info("Proxy-mode: client");
+            const auto connector = std::make_shared<TlsConnector>(conf.entry, log_factory);
+            logger.info(std::format("Start listening on port: {}, relaying to [{}:{}] over mtls",
+                                    conf.listen_port, conf.entry.host, conf.entry.port));
+            Server srv(conf.listen_port, std::make_shared<EntryStreamManager>(log_factory, connector, conf.flow_control, shaper), log_factory,
+                       {}, conf.admission, limiter, conf.listener);
+            connector->start(srv.executor());
+            srv.run();
+            return 0;
         } else {
             logger.info("Proxy-mode: tun");
-            proxy_backend = std::make_shared<FwdStreamManager>(log_factory, conf.target_host, conf.target_port);
+            proxy_backend = std::make_shared<FwdStreamManager>(log_factory, conf.backends, conf.flow_control, shaper,
+                                                                conf.upstream_sockets);
         }
 
         if (!conf.tls_options.private_key.empty()) {
             logger.info(std::format("Start listening on port: {}, tls tunnel mode enabled", conf.listen_port));
-            TlsServer srv(conf.listen_port, conf.tls_options, std::move(proxy_backend), log_factory);
+            TlsServer srv(conf.listen_port, conf.tls_options, std::move(proxy_backend), log_factory, conf.admission, limiter, conf.listener);
             srv.run();
         } else {
             logger.info(std::format("Start listening on port: {}, tls tunnel mode disabled", conf.listen_port));
-            Server srv(conf.listen_port, std::move(proxy_backend), log_factory);
+            Server srv(conf.listen_port, std::move(proxy_backend), log_factory, conf.udp_batch, conf.admission, limiter, conf.listener);
             srv.run();
         }
     } catch (std::exception& ex) {
@@ -0,0 +1,123 @@
+#include "check.h"
+
+#include "transport/admission_control.h"
+
+#include <limits>
+
+namespace
+{
+    using namespace std::chrono_literals;
+    using namespace mtls_mproxy;
+
+    void test_token_bucket()
+    {
+        const auto start = TokenBucket::Clock::now();
+        TokenBucket bucket;
+        CHECK(bucket.unlimited());
+        bucket.consume(1000000, start);
+        CHECK(bucket.wait_time(start) == TokenBucket::Clock::duration::zero());
+
+        // Starts full, a burst worth of tokens is available right away
+        bucket.configure({10, 5}, start);
+        CHECK(!bucket.unlimited());
+        bucket.consume(5, start);
+        CHECK(bucket.wait_time(start) == TokenBucket::Clock::duration::zero());
+
+        // Debt is paid back at the rate
+        bucket.consume(2, start);
+        CHECK(bucket.wait_time(start) == 200ms);
+        CHECK(bucket.wait_time(start + 100ms) == 100ms);
+        CHECK(bucket.wait_time(start + 200ms) == TokenBucket::Clock::duration::zero());
+
+        // Refills up to the burst size only
+        const auto later = start + 10s;
+        bucket.consume(5, later);
+        CHECK(bucket.wait_time(later) == TokenBucket::Clock::duration::zero());
+        bucket.consume(1, later);
+        CHECK(bucket.wait_time(later) == 100ms);
+
+        // Without a burst size it holds a tenth of a second of the rate
+        TokenBucket fast;
+        fast.configure({1000000, 0}, start);
+        fast.consume(100000, start);
+        CHECK(fast.wait_time(start) == TokenBucket::Clock::duration::zero());
+        fast.consume(1, start);
+        CHECK(fast.wait_time(start) > TokenBucket::Clock::duration::zero());
+    }
+
+    void test_accept_rate()
+    {
+        AdmissionControl admission{{.max_sessions = 0, .max_accept_rate = 2, .fd_headroom = 0, .action = OverloadAction::pause}};
+
+        // A second worth of accepts may come at once
+        CHECK(admission.accept_delay(0) == AdmissionControl::Clock::duration::zero());
+        CHECK(admission.admit(0));
+        CHECK(admission.admit(0));
+        CHECK(!admission.admit(0));
+        CHECK(admission.accept_delay(0) > AdmissionControl::Clock::duration::zero());
+        CHECK(admission.accept_delay(0) <= 500ms);
+
+        // A paused listener holds the connections over the rate, they aren't rejected
+        CHECK(admission.rejected() == 0);
+    }
+
+    void test_rejection()
+    {
+        AdmissionControl admission{{.max_sessions = 0, .max_accept_rate = 1, .fd_headroom = 0, .action = OverloadAction::reset}};
+        CHECK(admission.admit(0));
+        CHECK(!admission.admit(0));
+        CHECK(admission.rejected() == 1);
+
+        // Fast rejection keeps accepting, connections over the limits are refused by admit()
+        CHECK(admission.accept_delay(0) == AdmissionControl::Clock::duration::zero());
+    }
+
+    void test_session_limit()
+    {
+        AdmissionControl paused{{.max_sessions = 3, .max_accept_rate = 0, .fd_headroom = 0, .action = OverloadAction::pause}};
+        CHECK(paused.admit(2));
+        CHECK(!paused.admit(3));
+        CHECK(paused.accept_delay(2) == AdmissionControl::Clock::duration::zero());
+        CHECK(paused.accept_delay(3) == AdmissionControl::kPauseInterval);
+        CHECK(paused.accept_headroom(1) == 2);
+        CHECK(paused.accept_headroom(3) == 0);
+        CHECK(paused.accept_headroom(4) == 0);
+        CHECK(paused.rejected() == 0);
+
+        // Only a paused listener limits its outstanding accepts
+        AdmissionControl replying{{.max_sessions = 3, .max_accept_rate = 0, .fd_headroom = 0, .action = OverloadAction::reply}};
+        CHECK(replying.accept_headroom(3) == std::numeric_limits<std::size_t>::max());
+        CHECK(!replying.admit(3));
+        CHECK(replying.rejected() == 1);
+
+        AdmissionControl unlimited{{.max_sessions = 0, .max_accept_rate = 0, .fd_headroom = 0, .action = OverloadAction::pause}};
+        CHECK(unlimited.accept_headroom(1000) == std::numeric_limits<std::size_t>::max());
+        CHECK(unlimited.admit(1000));
+    }
+
+    void test_descriptors_exhausted()
+    {
+        AdmissionControl admission{{.max_sessions = 0, .max_accept_rate = 0, .fd_headroom = 0, .action = OverloadAction::reset}};
+        admission.on_descriptors_exhausted();
+        CHECK(admission.accept_delay(0) == AdmissionControl::kPauseInterval);
+    }
+
+    void test_parse_overload_action()
+    {
+        CHECK(parse_overload_action("pause") == OverloadAction::pause);
+        CHECK(parse_overload_action("reset") == OverloadAction::reset);
+        CHECK(parse_overload_action("reply") == OverloadAction::reply);
+        CHECK(!parse_overload_action("drop").has_value());
+    }
+}
+
+int main()
+{
+    test_token_bucket();
+    test_accept_rate();
+    test_rejection();
+    test_session_limit();
+    test_descriptors_exhausted();
+    test_parse_overload_action();
+    return mtls_mproxy::test::result();
+}
@@ -0,0 +1,35 @@
+#ifndef MTLS_MPROXY_TESTS_CHECK_H
+#define MTLS_MPROXY_TESTS_CHECK_H
+
+#include <iostream>
+
+namespace mtls_mproxy::test
+{
+    inline int& failures()
+    {
+        static int count{0};
+        return count;
+    }
+
+    inline void check(bool passed, const char* expression, const char* file, int line)
+    {
+        if (passed)
+            return;
+
+        ++failures();
+        std::cerr << file << ":" << line << ": check failed: " << expression << std::endl;
+    }
+
+    // Exit code of a test executable
+    inline int result()
+    {
+        if (failures() > 0)
+            std::cerr << failures() << " checks failed" << std::endl;
+        return failures() > 0 ? 1 : 0;
+    }
+}
+
+// Records a failure and carries on, so one run reports every broken expectation
+#define CHECK(expression) ::mtls_mproxy::test::check(static_cast<bool>(expression), #expression, __FILE__, __LINE__)
+
+#endif // MTLS_MPROXY_TESTS_CHECK_H
@@ -0,0 +1,130 @@
+#include "check.h"
+
+#include "transport/connection_limiter.h"
+
+#include <memory>
+
+namespace
+{
+    using namespace std::chrono_literals;
+    using namespace mtls_mproxy;
+
+    const auto kStart = TokenBucket::Clock::now();
+
+    void test_connection_limit()
+    {
+        PeerTable table{{.max_connections = 2, .max_rate = 0}, 8};
+        const auto first = table.acquire(1, kStart);
+        const auto second = table.acquire(1, kStart);
+        CHECK(first.has_value());
+        CHECK(second.has_value());
+        CHECK(!table.acquire(1, kStart).has_value());
+
+        // Other peers are counted apart
+        CHECK(table.acquire(2, kStart).has_value());
+
+        table.release(*first);
+        CHECK(table.acquire(1, kStart).has_value());
+    }
+
+    void test_rate_limit()
+    {
+        PeerTable table{{.max_connections = 0, .max_rate = 2}, 8};
+
+        // A second worth of connections at once, then one every half second
+        CHECK(table.acquire(1, kStart).has_value());
+        CHECK(table.acquire(1, kStart).has_value());
+        CHECK(!table.acquire(1, kStart).has_value());
+        CHECK(!table.acquire(1, kStart + 400ms).has_value());
+        CHECK(table.acquire(1, kStart + 500ms).has_value());
+    }
+
+    void test_peers_with_connections_stay()
+    {
+        PeerTable table{{.max_connections = 1, .max_rate = 0}, 2};
+        const auto first = table.acquire(1, kStart);
+        const auto second = table.acquire(2, kStart);
+        CHECK(first.has_value() && second.has_value());
+
+        // Every entry has a connection, a new peer can't push a counted one out
+        CHECK(!table.acquire(3, kStart).has_value());
+        CHECK(!table.acquire(1, kStart).has_value());
+
+        // An idle peer can be evicted
+        table.release(*second);
+        const auto third = table.acquire(3, kStart);
+        CHECK(third.has_value());
+        CHECK(!table.acquire(1, kStart).has_value());
+        CHECK(!table.acquire(4, kStart).has_value());
+
+        // The slot of the evicted peer no longer counts for the entry's new peer
+        table.release(*second);
+        CHECK(!table.acquire(3, kStart).has_value());
+    }
+
+    void test_least_recently_seen_evicted()
+    {
+        PeerTable table{{.max_connections = 0, .max_rate = 2}, 2};
+        for (const std::uint64_t key : {1, 2, 1}) {
+            const auto slot = table.acquire(key, kStart);
+            CHECK(slot.has_value());
+            if (slot)
+                table.release(*slot);
+        }
+
+        // Peer 2 is the least recently seen one and makes room, peer 1 keeps its rate history
+        const auto third = table.acquire(3, kStart);
+        CHECK(third.has_value());
+        if (third)
+            table.release(*third);
+        CHECK(!table.acquire(1, kStart).has_value());
+
+        // Peer 3 is evicted now, peer 2 comes back with a fresh history
+        CHECK(table.acquire(2, kStart).has_value());
+        CHECK(!table.acquire(1, kStart).has_value());
+    }
+
+    void test_limiter_leases()
+    {
+        const auto limiter = std::make_shared<ConnectionLimiter>(ConnectionLimiter::Options{
+            .per_source = {.max_connections = 1, .max_rate = 0},
+            .per_identity = {.max_connections = 2, .max_rate = 0},
+            .tracked_peers = 16});
+
+        auto lease = std::make_unique<ConnectionLease>();
+        CHECK(limiter->admit_source(*lease, net::ip::make_address("192.0.2.1")));
+        ConnectionLease other;
+        CHECK(!limiter->admit_source(other, net::ip::make_address("192.0.2.1")));
+        CHECK(limiter->admit_source(other, net::ip::make_address("192.0.2.2")));
+        CHECK(limiter->rejected() == 1);
+
+        // IPv6 sources are counted per /64
+        ConnectionLease v6;
+        ConnectionLease same_prefix;
+        CHECK(limiter->admit_source(v6, net::ip::make_address("2001:db8::1")));
+        CHECK(!limiter->admit_source(same_prefix, net::ip::make_address("2001:db8::2")));
+        CHECK(limiter->admit_source(same_prefix, net::ip::make_address("2001:db8:0:1::2")));
+
+        CHECK(limiter->identity_limited());
+        CHECK(limiter->admit_identity(*lease, "CN=client"));
+        CHECK(limiter->admit_identity(other, "CN=client"));
+        ConnectionLease third;
+        CHECK(!limiter->admit_identity(third, "CN=client"));
+        CHECK(limiter->admit_identity(third, ""));
+
+        // A destroyed lease releases its source and its identity
+        lease.reset();
+        CHECK(limiter->admit_source(third, net::ip::make_address("192.0.2.1")));
+        CHECK(limiter->admit_identity(third, "CN=client"));
+    }
+}
+
+int main()
+{
+    test_connection_limit();
+    test_rate_limit();
+    test_peers_with_connections_stay();
+    test_least_recently_seen_evicted();
+    test_limiter_leases();
+    return mtls_mproxy::test::result();
+}
@@ -0,0 +1,165 @@
+#include "check.h"
+
+#include "http/cache_policy.h"
+#include "http/response_cache.h"
+
+#include <string>
+#include <string_view>
+
+namespace
+{
+    using namespace std::chrono_literals;
+    using mtls_mproxy::make_cached_response;
+    using mtls_mproxy::make_revalidated_response;
+
+    constexpr std::string_view kDate = "Sun, 06 Nov 1994 08:49:37 GMT";
+
+    template <typename Parser>
+    Parser parse(std::string_view head)
+    {
+        Parser parser;
+        const auto result = parser.parse({reinterpret_cast<const std::uint8_t*>(head.data()), head.size()});
+        CHECK(result == http::parse_result::kComplete);
+        return parser;
+    }
+
+    http::request_parser request(std::string_view fields = {})
+    {
+        return parse<http::request_parser>(std::string{"GET http://Example.com/a?b#frag HTTP/1.1\r\nHost: example.com\r\n"}
+                                           .append(fields)
+                                           .append("\r\n"));
+    }
+
+    http::response_parser response(int status, std::string_view fields)
+    {
+        return parse<http::response_parser>(std::string{"HTTP/1.1 "}
+                                            .append(std::to_string(status))
+                                            .append(" Reason\r\nDate: ")
+                                            .append(kDate)
+                                            .append("\r\n")
+                                            .append(fields)
+                                            .append("\r\n"));
+    }
+
+    http::cache_clock::time_point date()
+    {
+        return *http::parse_http_date(kDate);
+    }
+
+    void test_explicit_freshness()
+    {
+        auto freshness = http::evaluate_response(response(200, "Cache-Control: max-age=60\r\n"), date());
+        CHECK(freshness.storable);
+        CHECK(freshness.lifetime == 60s);
+        CHECK(freshness.initial_age == 0s);
+
+        freshness = http::evaluate_response(response(200, "Cache-Control: max-age=60, s-maxage=30\r\n"), date());
+        CHECK(freshness.lifetime == 30s);
+
+        freshness = http::evaluate_response(response(200, "Expires: Sun, 06 Nov 1994 08:50:37 GMT\r\n"), date());
+        CHECK(freshness.storable);
+        CHECK(freshness.lifetime == 60s);
+
+        // Age of the response and its time in transit, whichever is larger
+        freshness = http::evaluate_response(response(200, "Cache-Control: max-age=60\r\nAge: 5\r\n"), date() + 10s);
+        CHECK(freshness.initial_age == 10s);
+    }
+
+    void test_heuristic_freshness()
+    {
+        const auto freshness = http::evaluate_response(
+            response(200, "Last-Modified: Sun, 06 Nov 1994 06:49:37 GMT\r\n"), date());
+        CHECK(freshness.storable);
+        CHECK(freshness.lifetime == 720s);
+
+        // Without freshness or validators there is nothing to reuse
+        CHECK(!http::evaluate_response(response(200, ""), date()).storable);
+
+        // Validators alone keep it for revalidation
+        const auto validated = http::evaluate_response(response(200, "ETag: \"v1\"\r\n"), date());
+        CHECK(validated.storable);
+        CHECK(validated.lifetime == 0s);
+    }
+
+    void test_not_storable()
+    {
+        CHECK(!http::evaluate_response(response(200, "Cache-Control: no-store, max-age=60\r\n"), date()).storable);
+        CHECK(!http::evaluate_response(response(200, "Cache-Control: private, max-age=60\r\n"), date()).storable);
+        CHECK(!http::evaluate_response(response(200, "Cache-Control: max-age=60\r\nVary: *\r\n"), date()).storable);
+        CHECK(!http::evaluate_response(response(200, "Cache-Control: max-age=60\r\nSet-Cookie: a=b\r\n"), date()).storable);
+        CHECK(!http::evaluate_response(response(206, "Cache-Control: max-age=60\r\n"), date()).storable);
+        CHECK(!http::evaluate_response(response(500, "Cache-Control: max-age=60\r\n"), date()).storable);
+
+        const auto no_cache = http::evaluate_response(response(200, "Cache-Control: no-cache, max-age=60\r\nETag: \"v1\"\r\n"), date());
+        CHECK(no_cache.storable);
+        CHECK(no_cache.lifetime == 0s);
+    }
+
+    void test_partial_and_not_modified_entries()
+    {
+        // A 304 refreshes a stored response but is never stored itself, neither is a 206
+        const auto not_modified = response(304, "Cache-Control: max-age=60\r\nETag: \"v1\"\r\n");
+        CHECK(http::evaluate_response(not_modified, date()).storable);
+        CHECK(!http::is_storable_status(304));
+        CHECK(!http::is_storable_status(206));
+        CHECK(http::is_storable_status(200));
+        CHECK(make_cached_response(request(), not_modified, {}, date()) == nullptr);
+        CHECK(make_cached_response(request(), response(206, "Cache-Control: max-age=60\r\n"), {1, 2}, date()) == nullptr);
+        CHECK(make_cached_response(request(), response(200, "Cache-Control: no-store\r\n"), {1, 2}, date()) == nullptr);
+    }
+
+    void test_cached_entry()
+    {
+        const auto entry = make_cached_response(request("Accept-Encoding: gzip\r\n"),
+                                                response(200, "Cache-Control: max-age=60\r\nETag: \"v1\"\r\nVary: Accept-Encoding\r\n"),
+                                                {1, 2, 3},
+                                                date());
+        CHECK(entry != nullptr);
+        if (!entry)
+            return;
+
+        CHECK(entry->body->size() == 3);
+        CHECK(entry->etag == "\"v1\"");
+        CHECK(entry->lifetime == 60s);
+        CHECK(entry->vary.size() == 1);
+        CHECK(entry->matches(request("Accept-Encoding: gzip\r\n")));
+        CHECK(!entry->matches(request("Accept-Encoding: br\r\n")));
+        CHECK(!entry->matches(request()));
+
+        CHECK(entry->fresh(date() + 59s, {}));
+        CHECK(!entry->fresh(date() + 60s, {}));
+        CHECK(!entry->fresh(date(), http::request_directives{.no_cache = true}));
+        CHECK(!entry->fresh(date() + 20s, http::request_directives{.max_age = 10s}));
+        CHECK(entry->age(date() + 20s) == 20s);
+
+        const auto revalidated = make_revalidated_response(
+            *entry, response(304, "Cache-Control: max-age=120\r\nETag: \"v2\"\r\n"), date() + 100s);
+        CHECK(revalidated->lifetime == 120s);
+        CHECK(revalidated->etag == "\"v2\"");
+        CHECK(revalidated->body == entry->body);
+        // The 304 is dated like the original response, it arrives 100s old
+        CHECK(revalidated->fresh(date() + 110s, {}));
+        CHECK(!entry->fresh(date() + 110s, {}));
+    }
+
+    void test_requests()
+    {
+        CHECK(http::is_cacheable_request(request()));
+        CHECK(!http::is_cacheable_request(request("Authorization: Basic eA==\r\n")));
+        CHECK(!http::is_cacheable_request(request("Cache-Control: no-store\r\n")));
+        CHECK(!http::is_cacheable_request(parse<http::request_parser>("POST / HTTP/1.1\r\nHost: example.com\r\n\r\n")));
+        CHECK(http::parse_request_directives(request("Pragma: no-cache\r\n")).no_cache);
+        CHECK(http::cache_key(request()) == "example.com:80/a?b");
+    }
+}
+
+int main()
+{
+    test_explicit_freshness();
+    test_heuristic_freshness();
+    test_not_storable();
+    test_partial_and_not_modified_entries();
+    test_cached_entry();
+    test_requests();
+    return mtls_mproxy::test::result();
+}
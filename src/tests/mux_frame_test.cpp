@@ -0,0 +1,75 @@
+#include "check.h"
+
+#include "transport/mux/mux_frame.h"
+
+namespace
+{
+    using namespace mtls_mproxy;
+
+    void test_encoding()
+    {
+        IoBuffer out;
+        encode_mux_header({MuxFrameType::kWindowUpdate, kMuxSyn | kMuxAck, 0x01020304, 0x0a0b0c0d}, out);
+
+        // Big endian as in the yamux specification
+        const IoBuffer expected{0x00, 0x01, 0x00, 0x03, 0x01, 0x02, 0x03, 0x04, 0x0a, 0x0b, 0x0c, 0x0d};
+        CHECK(out.size() == kMuxHeaderSize);
+        CHECK(out == expected);
+    }
+
+    void test_round_trip()
+    {
+        for (const auto type : {MuxFrameType::kData, MuxFrameType::kWindowUpdate, MuxFrameType::kPing, MuxFrameType::kGoAway}) {
+            IoBuffer out;
+            encode_mux_header({type, kMuxFin | kMuxRst, 0xffffffff, 7}, out);
+
+            const auto header = decode_mux_header(out);
+            CHECK(header.has_value());
+            if (!header)
+                continue;
+
+            CHECK(header->type == type);
+            CHECK(header->flags == (kMuxFin | kMuxRst));
+            CHECK(header->stream_id == 0xffffffff);
+            CHECK(header->length == 7);
+        }
+    }
+
+    void test_payload_follows_header()
+    {
+        IoBuffer out;
+        encode_mux_header({MuxFrameType::kData, 0, 3, 2}, out);
+        out.push_back(0xaa);
+        out.push_back(0xbb);
+
+        // Only the header is decoded, the payload is left to the caller
+        const auto header = decode_mux_header(out);
+        CHECK(header.has_value() && header->length == 2);
+    }
+
+    void test_invalid_headers()
+    {
+        IoBuffer out;
+        encode_mux_header({MuxFrameType::kPing, kMuxSyn, 0, 1}, out);
+
+        CHECK(!decode_mux_header(std::span{out}.first(kMuxHeaderSize - 1)).has_value());
+        CHECK(!decode_mux_header({}).has_value());
+
+        auto unknown_version = out;
+        unknown_version[0] = 1;
+        CHECK(!decode_mux_header(unknown_version).has_value());
+
+        auto unknown_type = out;
+        unknown_type[1] = static_cast<std::uint8_t>(MuxFrameType::kGoAway) + 1;
+        CHECK(!decode_mux_header(unknown_type).has_value());
+    }
+}
+
+int main()
+{
+    test_encoding();
+    test_round_trip();
+    test_payload_follows_header();
+    test_invalid_headers();
+    return mtls_mproxy::test::result();
+}
@@ -0,0 +1,183 @@
+#include "check.h"
+
+#include "transport/udp_socket_pool.h"
+
+#include <asynclog/log_manager.h>
+
+#include <asio/io_context.hpp>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace
+{
+    using namespace std::chrono_literals;
+    using namespace mtls_mproxy;
+
+    class Receiver final : public UdpAssociation
+    {
+    public:
+        void on_datagram(std::span<const std::uint8_t> data, const udp::endpoint& sender) override
+        {
+            datagrams.emplace_back(std::string{data.begin(), data.end()}, sender);
+        }
+
+        void on_datagram_error(const net::error_code& /*ec*/) override
+        {
+            ++errors;
+        }
+
+        std::vector<std::pair<std::string, udp::endpoint>> datagrams;
+        int errors{0};
+    };
+
+    // Stands for a remote host the associations talk to
+    class Remote
+    {
+    public:
+        explicit Remote(net::io_context& ctx)
+            : ctx_{ctx}
+            , socket_{ctx, udp::endpoint{net::ip::address_v4::loopback(), 0}}
+        {
+        }
+
+        udp::endpoint endpoint() const { return socket_.local_endpoint(); }
+
+        // Text and sender of the next datagram, empty if none arrives in time
+        std::pair<std::string, udp::endpoint> receive()
+        {
+            for (int i = 0; i < 100 && socket_.available() == 0; ++i)
+                ctx_.run_for(10ms);
+            if (socket_.available() == 0)
+                return {};
+
+            std::string data(64, '\0');
+            udp::endpoint sender;
+            data.resize(socket_.receive_from(net::buffer(data), sender));
+            return {data, sender};
+        }
+
+        void send(std::string_view data, const udp::endpoint& to)
+        {
+            socket_.send_to(net::buffer(data), to);
+        }
+
+    private:
+        net::io_context& ctx_;
+        udp::socket socket_;
+    };
+
+    Datagram datagram(std::string_view data, const udp::endpoint& to)
+    {
+        return Datagram{IoBuffer{data.begin(), data.end()}, to};
+    }
+
+    UdpSocketPoolPtr shared_pool(net::io_context& ctx, std::chrono::seconds nat_timeout)
+    {
+        static const asynclog::LoggerFactory log_factory{std::make_shared<asynclog::LogManager>()};
+
+        UdpSocketPool::Options options;
+        options.shared_sockets = 1;
+        options.nat_timeout = nat_timeout;
+        return UdpSocketPool::create(ctx.get_executor(), options, log_factory);
+    }
+
+    void test_nat_mapping()
+    {
+        net::io_context ctx;
+        const auto pool = shared_pool(ctx, 60s);
+        Remote remote_a{ctx};
+        Remote remote_b{ctx};
+        Remote stranger{ctx};
+        Receiver first;
+        Receiver second;
+        pool->attach(1, &first);
+        pool->attach(2, &second);
+
+        pool->send(1, datagram("1a", remote_a.endpoint()));
+        const auto [data_1a, pooled] = remote_a.receive();
+        CHECK(data_1a == "1a");
+
+        // The pooled socket is taken for remote a, the second association gets an extra socket for it
+        pool->send(2, datagram("2a", remote_a.endpoint()));
+        const auto [data_2a, extra] = remote_a.receive();
+        CHECK(data_2a == "2a");
+        CHECK(extra.port() != pooled.port());
+
+        // but shares the pooled socket for another remote
+        pool->send(2, datagram("2b", remote_b.endpoint()));
+        const auto [data_2b, shared] = remote_b.receive();
+        CHECK(data_2b == "2b");
+        CHECK(shared.port() == pooled.port());
+
+        // Replies go to the association the socket is mapped to for the sender, the others are dropped
+        remote_a.send("to 1", pooled);
+        remote_a.send("to 2", extra);
+        remote_b.send("to 2 via pooled", pooled);
+        stranger.send("unmapped", pooled);
+        ctx.run_for(100ms);
+
+        CHECK(first.datagrams.size() == 1);
+        CHECK(!first.datagrams.empty() && first.datagrams.front().first == "to 1");
+        CHECK(!first.datagrams.empty() && first.datagrams.front().second == remote_a.endpoint());
+        CHECK(second.datagrams.size() == 2);
+        for (const auto& [data, sender] : second.datagrams)
+            CHECK(data == "to 2" || data == "to 2 via pooled");
+
+        // Detaching drops the mappings of the association
+        pool->detach(2);
+        remote_b.send("after detach", pooled);
+        ctx.run_for(100ms);
+        CHECK(second.datagrams.size() == 2);
+        CHECK(first.datagrams.size() == 1);
+
+        // The extra socket is closed with its last mapping, the remote is free for the pooled one again
+        pool->attach(3, &second);
+        pool->send(3, datagram("3b", remote_b.endpoint()));
+        const auto [data_3b, reused] = remote_b.receive();
+        CHECK(data_3b == "3b");
+        CHECK(reused.port() == pooled.port());
+        pool->detach(1);
+        pool->detach(3);
+    }
+
+    void test_mapping_expiry()
+    {
+        net::io_context ctx;
+        const auto pool = shared_pool(ctx, 1s);
+        Remote remote{ctx};
+        Receiver receiver;
+        pool->attach(1, &receiver);
+
+        pool->send(1, datagram("out", remote.endpoint()));
+        const auto [data, pooled] = remote.receive();
+        CHECK(data == "out");
+
+        remote.send("in time", pooled);
+        ctx.run_for(100ms);
+        CHECK(receiver.datagrams.size() == 1);
+
+        // Idle for the timeout and a tick of the wheel
+        ctx.run_for(2500ms);
+        remote.send("too late", pooled);
+        ctx.run_for(100ms);
+        CHECK(receiver.datagrams.size() == 1);
+
+        // A new datagram maps the remote again
+        pool->send(1, datagram("again", remote.endpoint()));
+        CHECK(remote.receive().first == "again");
+        remote.send("in time again", pooled);
+        ctx.run_for(100ms);
+        CHECK(receiver.datagrams.size() == 2);
+        CHECK(receiver.errors == 0);
+        pool->detach(1);
+    }
+}
+
+int main()
+{
+    test_nat_mapping();
+    test_mapping_expiry();
+    return mtls_mproxy::test::result();
+}